@@ -310,6 +310,7 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
     bool seen_s = false;
     bool seen_mf = false;
     bool seen_md = false;
+    bool seen_mt = false;
     bool seen_split_dwarf = false;
     bool seen_target = false;
     bool wunused_macros = false;
@@ -359,6 +360,7 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
             } else if (!strcmp(a, "-MT") || !strcmp(a, "-MQ") ||
                        str_startswith("-Wp,-MT", a) ||
                        str_startswith("-Wp,-MQ", a)) {
+                seen_mt = true;
                 args.append(a, Arg_Local);
                 args.append(argv[++i], Arg_Local);
                 /* as above but with extra argument */
@@ -843,6 +845,14 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
                 args.append("-MF", Arg_Local);
                 args.append(dfile, Arg_Local);
             }
+
+            /* The preprocessor doesn't get -o, so the rule would be for the
+               basename of the input in the current directory, not for the
+               output (Bazel puts it into bazel-out/). */
+            if (!always_local && seen_md && !seen_mt) {
+                args.append("-MQ", Arg_Local);
+                args.append(ofile, Arg_Local);
+            }
         }
 
     } else { // always_local
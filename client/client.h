@@ -48,7 +48,7 @@ extern bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun,
                          std::list<std::string> *extrafiles);
 
 /* In cpp.cpp.  */
-extern pid_t call_cpp(CompileJob &job, int fdwrite, int fdread = -1);
+extern pid_t call_cpp(CompileJob &job, int fdwrite, int fdread = -1, int fderr = -1);
 
 /* In local.cpp.  */
 extern int build_local(CompileJob &job, MsgChannel *daemon, struct rusage *usage = 0);
@@ -60,6 +60,9 @@ extern std::string clang_get_default_target(const CompileJob &job);
 
 /* In remote.cpp - permill is the probability it will be compiled three times */
 extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill);
+/* In remote.cpp - runs a command from icerun with its declared input and output files
+   on a compile server that has envs */
+extern int run_remote_command(CompileJob &job, MsgChannel *scheduler, const Environments &envs);
 
 /* safeguard.cpp */
 // We allow several recursions if icerun is involved, just in case icerun is e.g. used to invoke a script
@@ -67,8 +67,10 @@ bool dcc_is_preprocessed(const string &sfile)
  * wait for @p cpp_fid to exit before the output is complete.  This
  * allows us to overlap opening the TCP socket, which probably doesn't
  * use many cycles, with running the preprocessor.
+ *
+ * If @p fderr is given, the preprocessor's stderr goes there.
  **/
-pid_t call_cpp(CompileJob &job, int fdwrite, int fdread)
+pid_t call_cpp(CompileJob &job, int fdwrite, int fdread, int fderr)
 {
     flush_debug();
     pid_t pid = fork();
@@ -202,6 +204,11 @@ pid_t call_cpp(CompileJob &job, int fdwrite, int fdread)
         close(fdwrite);
     }
 
+    if (fderr > -1) {
+        dup2(fderr, STDERR_FILENO);
+        close(fderr);
+    }
+
     dcc_increment_safeguard(SafeguardStepCompiler);
     execv(argv[0], argv);
     int exitcode = ( errno == ENOENT ? 127 : 126 );
@@ -90,6 +90,10 @@ static void dcc_show_usage(void)
         "                              compiled on multiple hosts to ensure that they're\n"
         "                              producing the same output.  The default is 0.\n"
         "   ICECC_PREFERRED_HOST       overrides scheduler decisions if set.\n"
+        "   ICECC_BUILD_SESSION        identifies the build for sharing the hosts between builds\n"
+        "                              (default: the process group).\n"
+        "   ICECC_PRIORITY             jobs with a higher number are scheduled first within the build;\n"
+        "                              \"ninja\" uses the previous duration of the job from .ninja_log.\n"
         "   ICECC_CC                   set C compiler name (default gcc).\n"
         "   ICECC_CXX                  set C++ compiler name (default g++).\n"
         "   ICECC_REMOTE_CPP           set to 1 or 0 to override remote preprocessing\n"
@@ -108,11 +112,16 @@ static void icerun_show_usage(void)
     printf(
         "Usage:\n"
         "   icerun [command]\n"
+        "   icerun [--input <file>]... --output <file> [--output <file>]... [command]\n"
         "   icerun --help\n"
         "\n"
         "Options:\n"
         "   --help                     explain usage and exit\n"
         "   --version                  show version and exit\n"
+        "   --input <file>             the command reads the file, relative to the current directory\n"
+        "   --output <file>            the command creates the file, relative to the current directory;\n"
+        "                              a command that only reads its inputs and writes its outputs\n"
+        "                              may be run on a compile server\n"
         "Environment Variables:\n"
         "   ICECC                      if set to \"no\", just exec the real command\n"
         "   ICECC_DEBUG                [info | warning | debug]\n"
@@ -227,6 +236,83 @@ static MsgChannel* get_local_daemon()
     return local_daemon;
 }
 
+// asks the local daemon for the native environment of compiler with extrafiles added,
+// and the same compiler for other platforms if with_cross, returns nothing if there is none
+static Environments get_native_environments(MsgChannel *local_daemon, const string &target,
+                                            const string &compiler, const list<string> &extrafiles,
+                                            bool with_cross)
+{
+    Environments envs;
+    Msg *umsg = NULL;
+    string env_compression; // empty = default
+    if( const char* icecc_env_compression = getenv( "ICECC_ENV_COMPRESSION" ))
+        env_compression = icecc_env_compression;
+    trace() << "asking for native environment for " << compiler << endl;
+    if (!local_daemon->send_msg(GetNativeEnvMsg(compiler, extrafiles,
+        env_compression))) {
+        log_warning() << "failed to write get native environment" << endl;
+    } else {
+        // the timeout is high because it creates the native version
+        umsg = local_daemon->get_msg(4 * 60);
+    }
+
+    string native;
+    Environments cross;
+
+    if (umsg && umsg->type == M_NATIVE_ENV) {
+        native = static_cast<UseNativeEnvMsg*>(umsg)->nativeVersion;
+        cross = static_cast<UseNativeEnvMsg*>(umsg)->cross;
+    }
+
+    if (native.empty() || ::access(native.c_str(), R_OK) < 0) {
+        log_warning() << "daemon can't determine native environment. "
+                      "Set $ICECC_VERSION to an icecc environment.\n";
+    } else {
+        envs.push_back(make_pair(target, native));
+        log_info() << "native " << native << endl;
+
+        // the same compiler for other platforms, so that their compile servers can help
+        for (Environments::const_iterator it = cross.begin(); it != cross.end(); ++it) {
+            if (with_cross && it->first != target && ::access(it->second.c_str(), R_OK) == 0) {
+                envs.push_back(*it);
+            }
+        }
+    }
+
+    delete umsg;
+    return envs;
+}
+
+// A command run by icerun can be sent to a compile server if it declares the files it
+// creates, and all files it uses are below the current directory, where they can be
+// recreated in the server's temporary directory.
+static bool remote_command_possible(const list<string> &inputs, const list<string> &outputs)
+{
+    if (outputs.empty()) {
+        return false;
+    }
+
+    for (list<string>::const_iterator it = inputs.begin(); it != inputs.end(); ++it) {
+        struct stat st;
+
+        if (!is_contained_path(*it) || stat(it->c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            log_warning() << "command input " << *it << " is not a file below the current directory, "
+                          "running locally" << endl;
+            return false;
+        }
+    }
+
+    for (list<string>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        if (!is_contained_path(*it)) {
+            log_warning() << "command output " << *it << " is not below the current directory, "
+                          "running locally" << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static void debug_arguments(int argc, char** argv, bool original)
 {
     string argstxt = argv[ 0 ];
@@ -317,6 +403,7 @@ int main(int argc, char **argv)
 
     CompileJob job;
     bool icerun = false;
+    list<string> command_inputs, command_outputs;
 
     string compiler_name = argv[0];
     dcc_client_catch_signals();
@@ -364,6 +451,27 @@ int main(int argc, char **argv)
                 return 0;
             }
 
+            int shift = 0;
+
+            while (argv[shift + 1] && argv[shift + 2]
+                   && (!strcmp(argv[shift + 1], "--input") || !strcmp(argv[shift + 1], "--output"))) {
+                if (!strcmp(argv[shift + 1], "--input")) {
+                    command_inputs.push_back(argv[shift + 2]);
+                } else {
+                    command_outputs.push_back(argv[shift + 2]);
+                }
+
+                shift += 2;
+            }
+
+            // the command follows the options
+            if (shift > 0) {
+                argv[shift] = argv[0];
+                argv += shift;
+                argc -= shift;
+                arg = argc > 1 ? argv[1] : "";
+            }
+
             if (arg.size() > 0) {
                 job.setCompilerName(arg);
                 job.setCompilerPathname(arg);
@@ -403,7 +511,14 @@ int main(int argc, char **argv)
     }
 
     list<string> extrafiles;
-    local |= analyse_argv(argv, job, icerun, &extrafiles);
+    bool always_local = analyse_argv(argv, job, icerun, &extrafiles);
+
+    if (job.language() == CompileJob::Lang_Custom && remote_command_possible(command_inputs, command_outputs)) {
+        job.setCommandInputs(command_inputs);
+        job.setCommandOutputs(command_outputs);
+    } else {
+        local |= always_local;
+    }
 
     /* If ICECC is set to disable, then run job locally, without contacting
        the daemon at all. File-based locking will still ensure that all
@@ -457,7 +572,38 @@ int main(int argc, char **argv)
 
     Environments envs;
 
-    if (!local) {
+    if (!local && job.language() == CompileJob::Lang_Custom) {
+        string command = find_compiler(job);
+
+        if (!IS_PROTOCOL_52(local_daemon)) {
+            log_info() << "local daemon is too old to run commands remotely" << endl;
+            local = true;
+        } else if (command.empty()) {
+            local = true;
+        } else {
+            // the command is run from the native environment of the system compiler,
+            // extended by the command itself
+            ArgumentsList args;
+            list<string> flags = job.localFlags();
+
+            for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+                args.append(*it, Arg_Rest);
+            }
+
+            command = get_absfilename(command);
+            job.setFlags(args);
+            job.setCompilerName(command);
+            job.setCompilerPathname(command);
+            extrafiles.push_back(command);
+            envs = get_native_environments(local_daemon, job.targetPlatform(),
+                                           get_absfilename(compiler_path_lookup("gcc")), extrafiles,
+                                           false);
+
+            if (envs.size() == 0) {
+                local = true;
+            }
+        }
+    } else if (!local) {
         if (getenv("ICECC_VERSION")) {     // if set, use it, otherwise take default
             try {
                 envs = parse_icecc_version(job.targetPlatform(), find_prefix(job.compilerName()));
@@ -470,40 +616,13 @@ int main(int argc, char **argv)
             log_warning() << "Local daemon is too old to handle extra files." << endl;
             local = true;
         } else {
-            Msg *umsg = NULL;
             string compiler;
             if( IS_PROTOCOL_41(local_daemon))
                 compiler = get_absfilename( find_compiler( job ));
             else // Older daemons understood only two hardcoded compilers.
                 compiler = compiler_is_clang(job) ? "clang" : "gcc";
-            string env_compression; // empty = default
-            if( const char* icecc_env_compression = getenv( "ICECC_ENV_COMPRESSION" ))
-                env_compression = icecc_env_compression;
-            trace() << "asking for native environment for " << compiler << endl;
-            if (!local_daemon->send_msg(GetNativeEnvMsg(compiler, extrafiles,
-                env_compression))) {
-                log_warning() << "failed to write get native environment" << endl;
-                local = true;
-            } else {
-                // the timeout is high because it creates the native version
-                umsg = local_daemon->get_msg(4 * 60);
-            }
-
-            string native;
-
-            if (umsg && umsg->type == M_NATIVE_ENV) {
-                native = static_cast<UseNativeEnvMsg*>(umsg)->nativeVersion;
-            }
-
-            if (native.empty() || ::access(native.c_str(), R_OK) < 0) {
-                log_warning() << "daemon can't determine native environment. "
-                              "Set $ICECC_VERSION to an icecc environment.\n";
-            } else {
-                envs.push_back(make_pair(job.targetPlatform(), native));
-                log_info() << "native " << native << endl;
-            }
-
-            delete umsg;
+            envs = get_native_environments(local_daemon, job.targetPlatform(), compiler, extrafiles,
+                                           extrafiles.empty());
         }
 
         // we set it to local so we tell the local daemon about it - avoiding file locking
@@ -530,7 +649,11 @@ int main(int argc, char **argv)
             const char *s = getenv("ICECC_REPEAT_RATE");
             int rate = s ? atoi(s) : 0;
 
-            ret = build_remote(job, local_daemon, envs, rate);
+            if (job.language() == CompileJob::Lang_Custom) {
+                ret = run_remote_command(job, local_daemon, envs);
+            } else {
+                ret = build_remote(job, local_daemon, envs, rate);
+            }
 
             /* We have to tell the local daemon that everything is fine and
                that the remote daemon will send the scheduler our done msg.
@@ -46,11 +46,13 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <vector>
+#include <poll.h>
 
 #include <comm.h>
 #include "client.h"
 #include "tempfile.h"
 #include "md5.h"
+#include "envtransfer.h"
 #include "util.h"
 #include "services/util.h"
 
@@ -243,6 +245,24 @@ static UseCSMsg *get_server(MsgChannel *local_daemon)
     return usecs;
 }
 
+// how often a job may be released by busy compile servers before it is built locally
+static const int max_job_releases = 3;
+// how often a job is tried on another compile server after failing on one
+static const int max_remote_retries = 2;
+
+// after the job was released by the compile server it was given first
+static UseCSMsg *ask_again_for_server(MsgChannel *local_daemon, const GetCSMsg &getcs)
+{
+    trace() << "asking again for host to use" << endl;
+
+    if (!local_daemon->send_msg(getcs)) {
+        log_warning() << "asked for CS" << endl;
+        throw client_error(24, "Error 24 - asked for CS");
+    }
+
+    return get_server(local_daemon);
+}
+
 static void check_for_failure(Msg *msg, MsgChannel *cserver)
 {
     if (msg && msg->type == M_STATUS_TEXT) {
@@ -253,10 +273,80 @@ static void check_for_failure(Msg *msg, MsgChannel *cserver)
     }
 }
 
+/* A busy compile server gives a job that is still waiting for a slot back
+   to the scheduler if another host has become idle, the client then asks
+   for a compile server again.  */
+static remote_error released_error(MsgChannel *cserver)
+{
+    log_info() << "job released by " << cserver->name << ", asking for another host" << endl;
+    return remote_error(105, "Error 105 - job released by " + cserver->name);
+}
+
+/* Whether to ask for another compile server after the job failed on the one
+   in USECS. Jobs that could not reach the server, whose environment it could
+   not take or that it ran out of memory for are tried on a different host,
+   which the scheduler keeps away from, before building locally. Compile
+   errors are not retried, they would fail the same way everywhere.  */
+static bool try_another_server(const client_error &error, const UseCSMsg *usecs,
+                               GetCSMsg &getcs, int &releases, int &retries)
+{
+    if (error.errorCode == 105) {
+        return releases++ < max_job_releases;
+    }
+
+    switch (error.errorCode) {
+    case 2:
+    case 14:
+    case 19:
+    case 24:
+    case 25:
+    case 101:
+        break;
+    default:
+        return false;
+    }
+
+    if (!getcs.preferred_host.empty() || retries++ >= max_remote_retries) {
+        return false;
+    }
+
+    log_warning() << "retrying on another host: " << error.what() << endl;
+    getcs.avoided_hosts.push_back(make_pair(usecs->hostname, usecs->port));
+    return true;
+}
+
+// checks between chunks of the source, so that a released job isn't sent in full
+static bool job_released(MsgChannel *cserver)
+{
+    if (!IS_PROTOCOL_54(cserver) || !cserver->read_a_bit() || !cserver->has_msg()) {
+        return false;
+    }
+
+    // a closed connection shows when sending the next chunk
+    Msg *msg = cserver->get_msg(0, true);
+
+    if (!msg) {
+        return false;
+    }
+
+    check_for_failure(msg, cserver);
+
+    if (msg->type == M_JOB_RELEASE) {
+        delete msg;
+        return true;
+    }
+
+    log_warning() << "got unexpected message while sending the job" << endl;
+    delete msg;
+    throw client_error(13, "Error 13 - unexpected message while sending the job");
+}
+
 static void write_fd_to_server(int fd, MsgChannel *cserver)
 {
-    unsigned char buffer[100000]; // some random but huge number
-    off_t offset = 0;
+    // the chunk size grows as the connection gets up to speed
+    size_t chunk_size = cserver->bulkChunkSize();
+    vector<unsigned char> buffer(chunk_size);
+    size_t offset = 0;
     size_t uncompressed = 0;
     size_t compressed = 0;
 
@@ -264,7 +354,7 @@ static void write_fd_to_server(int fd, MsgChannel *cserver)
         ssize_t bytes;
 
         do {
-            bytes = read(fd, buffer + offset, sizeof(buffer) - offset);
+            bytes = read(fd, &buffer[0] + offset, chunk_size - offset);
 
             if (bytes < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
                 continue;
@@ -281,9 +371,9 @@ static void write_fd_to_server(int fd, MsgChannel *cserver)
 
         offset += bytes;
 
-        if (!bytes || offset == sizeof(buffer)) {
+        if (!bytes || offset == chunk_size) {
             if (offset) {
-                FileChunkMsg fcmsg(buffer, offset);
+                FileChunkMsg fcmsg(&buffer[0], offset);
 
                 if (!cserver->send_msg(fcmsg)) {
                     Msg *m = cserver->get_msg(2);
@@ -299,6 +389,16 @@ static void write_fd_to_server(int fd, MsgChannel *cserver)
                 uncompressed += fcmsg.len;
                 compressed += fcmsg.compressed;
                 offset = 0;
+                chunk_size = cserver->bulkChunkSize();
+
+                if (job_released(cserver)) {
+                    close(fd);
+                    throw released_error(cserver);
+                }
+
+                if (chunk_size > buffer.size()) {
+                    buffer.resize(chunk_size);
+                }
             }
 
             if (!bytes) {
@@ -316,6 +416,210 @@ static void write_fd_to_server(int fd, MsgChannel *cserver)
     }
 }
 
+// How much preprocessed source is kept in memory while waiting for a compile host,
+// anything bigger goes to a temporary file.
+static const size_t max_preproc_buffer = 16 * 1024 * 1024;
+
+/* Preprocessed source collected while the scheduler is still looking
+   for a compile host. */
+class PreprocBuffer
+{
+public:
+    PreprocBuffer()
+        : spill_fd(-1) {}
+    ~PreprocBuffer() {
+        if (spill_fd >= 0) {
+            close(spill_fd);
+        }
+    }
+
+    void append(const unsigned char *buf, size_t len)
+    {
+        if (spill_fd < 0 && data.size() + len > max_preproc_buffer) {
+            char *spill_file = 0;
+
+            if (dcc_make_tmpnam("icecc", ".ix", &spill_file, 0) != 0
+                    || (spill_fd = open(spill_file, O_RDWR)) < 0) {
+                free(spill_file);
+                throw client_error(11, "Error 11 - unable to open preprocessed file");
+            }
+
+            // only needed while the fd is open
+            unlink(spill_file);
+            free(spill_file);
+
+            if (!data.empty()) {
+                write_all(&data[0], data.size());
+            }
+
+            vector<unsigned char>().swap(data);
+        }
+
+        if (spill_fd >= 0) {
+            write_all(buf, len);
+        } else {
+            data.insert(data.end(), buf, buf + len);
+        }
+    }
+
+    void write_to_server(MsgChannel *cserver)
+    {
+        if (spill_fd >= 0) {
+            // kept for sending again if the job is released
+            lseek(spill_fd, 0, SEEK_SET);
+            write_fd_to_server(dup(spill_fd), cserver);
+            return;
+        }
+
+        size_t compressed = 0;
+
+        for (size_t offset = 0; offset < data.size();) {
+            size_t len = min(cserver->bulkChunkSize(), data.size() - offset);
+            FileChunkMsg fcmsg(&data[offset], len);
+
+            if (!cserver->send_msg(fcmsg)) {
+                Msg *m = cserver->get_msg(2);
+                check_for_failure(m, cserver);
+
+                log_error() << "write of source chunk to host "
+                            << cserver->name.c_str() << endl;
+                log_perror("failed ");
+                throw client_error(15, "Error 15 - write to host failed");
+            }
+
+            compressed += fcmsg.compressed;
+            offset += len;
+
+            if (job_released(cserver)) {
+                throw released_error(cserver);
+            }
+        }
+
+        if (compressed)
+            trace() << "sent " << compressed << " bytes (" << (compressed * 100 / data.size()) <<
+                    "%)" << endl;
+    }
+
+private:
+    void write_all(const unsigned char *buf, size_t len)
+    {
+        while (len > 0) {
+            ssize_t bytes = write(spill_fd, buf, len);
+
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytes <= 0) {
+                log_perror("writing preprocessed source");
+                throw client_error(16, "Error 16 - error writing preprocessed file");
+            }
+
+            buf += bytes;
+            len -= bytes;
+        }
+    }
+
+    vector<unsigned char> data;
+    int spill_fd;
+};
+
+/* Runs the preprocessor while the local daemon waits for the scheduler to
+   assign a compile host, instead of one after the other. The local slot is
+   only needed for cpp itself, it is given back as soon as cpp exits and
+   not held while the output goes over the network. Returns the exit status
+   of cpp. usecs is set if the host was assigned while cpp was running. */
+static int preprocess_while_waiting(CompileJob &job, MsgChannel *local_daemon, PreprocBuffer &preproc,
+                                    int err_fd, UseCSMsg *&usecs)
+{
+    int sockets[2];
+
+    if (pipe(sockets) != 0) {
+        log_perror("build_remote pipe");
+        throw client_error(32, "Error 18 - (fork error?)");
+    }
+
+    pid_t cpp_pid = call_cpp(job, sockets[1], sockets[0], err_fd);
+
+    if (cpp_pid == -1) {
+        close(sockets[0]);
+        throw client_error(18, "Error 18 - (fork error?)");
+    }
+
+    try {
+        log_block b("preprocess while waiting for cs");
+        vector<unsigned char> buffer(64 * 1024);
+
+        for (;;) {
+            pollfd pfd[2];
+            pfd[0].fd = sockets[0];
+            pfd[0].events = POLLIN;
+            pfd[1].fd = local_daemon->fd;
+            pfd[1].events = POLLIN;
+
+            if (poll(pfd, usecs ? 1 : 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                log_perror("poll");
+                throw client_error(16, "Error 16 - error reading local file");
+            }
+
+            if (!usecs && pfd[1].revents) {
+                usecs = get_server(local_daemon);
+            }
+
+            if (!pfd[0].revents) {
+                continue;
+            }
+
+            ssize_t bytes = read(sockets[0], &buffer[0], buffer.size());
+
+            if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+
+            if (bytes < 0) {
+                log_perror("reading from cpp");
+                throw client_error(16, "Error 16 - error reading local file");
+            }
+
+            if (bytes == 0) {
+                break;
+            }
+
+            preproc.append(&buffer[0], bytes);
+        }
+    } catch (...) {
+        kill(cpp_pid, SIGTERM);
+        close(sockets[0]);
+        while (waitpid(cpp_pid, 0, 0) < 0 && errno == EINTR) {}
+        throw;
+    }
+
+    close(sockets[0]);
+    int status = 255;
+
+    while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
+
+    dcc_unlock();
+    return shell_exit_status(status);
+}
+
+// Passes on what cpp wrote to stderr.
+static void flush_cpp_errors(int err_fd)
+{
+    char buffer[4096];
+    ssize_t bytes;
+
+    lseek(err_fd, 0, SEEK_SET);
+
+    while ((bytes = read(err_fd, buffer, sizeof(buffer))) > 0) {
+        ignore_result(write(STDERR_FILENO, buffer, bytes));
+    }
+}
+
 static void receive_file(const string& output_file, MsgChannel* cserver)
 {
     string tmp_file = output_file + "_icetmp";
@@ -391,9 +695,190 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
     }
 }
 
-static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
+/* Leaves the upload of the environment to the local daemon, which sends it only once
+   to the compile server for all the jobs waiting for it. Returns false if the client
+   has to send it itself. */
+static bool upload_env_by_daemon(CompileJob &job, const string &hostname, unsigned int port,
+                                 MsgChannel *local_daemon, const string &version_file)
+{
+    log_block b("Wait for environment upload");
+    string file = version_file;
+
+    if (file[0] != '/') {
+        char buf[PATH_MAX];
+
+        if (!getcwd(buf, sizeof(buf))) {
+            return false;
+        }
+
+        file = string(buf) + '/' + file;
+    }
+
+    EnvUploadMsg msg(hostname, port, job.targetPlatform(), job.environmentVersion(), file);
+
+    if (!local_daemon->send_msg(msg)) {
+        return false;
+    }
+
+    // big environments over slow links take a while, tell the user why nothing happens
+    const time_t started = time(NULL);
+    Msg *answer = 0;
+
+    for (;;) {
+        const time_t asked = time(NULL);
+        answer = local_daemon->get_msg(60);
+
+        // the daemon gone returns at once, only a timeout takes the whole minute
+        if (answer || time(NULL) - asked < 60 || time(NULL) - started >= 30 * 60) {
+            break;
+        }
+
+        log_warning() << "still waiting for the local daemon to upload the environment to "
+                      << hostname << " (" << (time(NULL) - started) / 60 << " minutes)" << endl;
+    }
+
+    if (!answer || answer->type != M_ENV_UPLOAD) {
+        delete answer;
+        throw client_error(8, "Error 8 - write environment to remote failed");
+    }
+
+    unsigned int result = static_cast<EnvUploadMsg *>(answer)->result;
+    delete answer;
+
+    switch (result) {
+    case EnvUploadMsg::Ok:
+        trace() << "local daemon installed environment on " << hostname << endl;
+        return true;
+    case EnvUploadMsg::VerifyFailed: {
+        log_info() << "Host " << hostname << " did not successfully verify environment." << endl;
+        BlacklistHostEnvMsg blacklist(job.targetPlatform(), job.environmentVersion(), hostname);
+        local_daemon->send_msg(blacklist);
+        throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
+    }
+    case EnvUploadMsg::Declined:
+        trace() << "local daemon cannot upload " << file << endl;
+        return false;
+    case EnvUploadMsg::VerifyError:
+        throw client_error(25, "Error 25 - other error verifying environment on remote");
+    default:
+        throw client_error(8, "Error 8 - write environment to remote failed");
+    }
+}
+
+/* Installs the environment on the compile server over a connection of its own,
+   marked as bulk traffic so that it does not slow down the data of other jobs.
+   Compile servers that cannot verify environments would abort the installation
+   when that connection closes, so it is returned for the job instead. */
+static MsgChannel *transfer_env(CompileJob &job, const string &hostname, unsigned int port,
+                                int host_protocol, MsgChannel *local_daemon,
+                                const string &version_file)
+{
+    log_block b("Transfer Environment");
+    MsgChannel *envserver = Service::createChannel(hostname, port, 10, host_protocol);
+
+    if (!envserver) {
+        log_error() << "no server found behind given hostname " << hostname << ":"
+                    << port << endl;
+        throw client_error(2, "Error 2 - no server found at " + hostname);
+    }
+
+    envserver->setTrafficClass(MsgChannel::BulkTraffic);
+
+    try {
+        struct stat buf;
+
+        if (stat(version_file.c_str(), &buf)) {
+            log_perror("error stat'ing file") << "\t" << version_file << endl;
+            throw client_error(4, "Error 4 - unable to stat version file");
+        }
+
+        int env_fd = open(version_file.c_str(), O_RDONLY);
+
+        if (env_fd < 0) {
+            throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
+        }
+
+        // a compile server keeping partial transfers lets a new connection continue
+        // after the blocks it already has
+        for (int attempt = 0;; ++attempt) {
+            EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
+
+            if (envserver->send_msg(msg) && lseek(env_fd, 0, SEEK_SET) == 0
+                    && send_environment(envserver, env_fd) && envserver->send_msg(EndMsg())) {
+                break;
+            }
+
+            if (!IS_PROTOCOL_48(envserver) || attempt == 2) {
+                close(env_fd);
+                log_error() << "write of environment failed" << endl;
+                throw client_error(8, "Error 8 - write environment to remote failed");
+            }
+
+            log_warning() << "sending environment to " << hostname << " interrupted, retrying" << endl;
+            delete envserver;
+            sleep(1);
+            // don't trust what we heard about the remote's protocol again
+            envserver = Service::createChannel(hostname, port, 10, 0);
+
+            if (!envserver) {
+                close(env_fd);
+                throw client_error(2, "Error 2 - no server found at " + hostname);
+            }
+
+            envserver->setTrafficClass(MsgChannel::BulkTraffic);
+        }
+
+        if ((-1 == close(env_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+
+        if (IS_PROTOCOL_31(envserver)) {
+            VerifyEnvMsg verifymsg(job.targetPlatform(), job.environmentVersion());
+
+            if (!envserver->send_msg(verifymsg)) {
+                throw client_error(22, "Error 22 - error sending environment");
+            }
+
+            Msg *verify_msg = envserver->get_msg(60);
+
+            if (verify_msg && verify_msg->type == M_VERIFY_ENV_RESULT) {
+                if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
+                    // The remote can't handle the environment at all (e.g. kernel too old),
+                    // mark it as never to be used again for this environment.
+                    log_info() << "Host " << hostname
+                               << " did not successfully verify environment."
+                               << endl;
+                    BlacklistHostEnvMsg blacklist(job.targetPlatform(),
+                                                  job.environmentVersion(), hostname);
+                    local_daemon->send_msg(blacklist);
+                    delete verify_msg;
+                    throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
+                } else
+                    trace() << "Verified host " << hostname << " for environment "
+                            << job.environmentVersion() << " (" << job.targetPlatform() << ")"
+                            << endl;
+                delete verify_msg;
+            } else {
+                delete verify_msg;
+                throw client_error(25, "Error 25 - other error verifying environment on remote");
+            }
+        }
+    } catch (...) {
+        delete envserver;
+        throw;
+    }
+
+    if (!IS_PROTOCOL_31(envserver)) {
+        return envserver;
+    }
+
+    delete envserver;
+    return 0;
+}
+
+static int build_remote_job(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
                             const string &environment, const string &version_file,
-                            const char *preproc_file, bool output)
+                            const char *preproc_file, bool output, PreprocBuffer *preproc)
 {
     string hostname = usecs->hostname;
     unsigned int port = usecs->port;
@@ -412,76 +897,30 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
     MsgChannel *cserver = 0;
 
     try {
-        cserver = Service::createChannel(hostname, port, 10);
-
-        if (!cserver) {
-            log_error() << "no server found behind given hostname " << hostname << ":"
-                        << port << endl;
-            throw client_error(2, "Error 2 - no server found at " + hostname);
+        if (!got_env && IS_PROTOCOL_47(local_daemon)) {
+            got_env = upload_env_by_daemon(job, hostname, port, local_daemon, version_file);
         }
 
         if (!got_env) {
-            log_block b("Transfer Environment");
-            // transfer env
-            struct stat buf;
-
-            if (stat(version_file.c_str(), &buf)) {
-                log_perror("error stat'ing file") << "\t" << version_file << endl;
-                throw client_error(4, "Error 4 - unable to stat version file");
-            }
-
-            EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
-
-            if (!cserver->send_msg(msg)) {
-                throw client_error(6, "Error 6 - send environment to remote failed");
-            }
-
-            int env_fd = open(version_file.c_str(), O_RDONLY);
-
-            if (env_fd < 0) {
-                throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
-            }
-
-            write_fd_to_server(env_fd, cserver);
-
-            if (!cserver->send_msg(EndMsg())) {
-                log_error() << "write of environment failed" << endl;
-                throw client_error(8, "Error 8 - write environment to remote failed");
-            }
+            cserver = transfer_env(job, hostname, port, usecs->host_protocol, local_daemon,
+                                   version_file);
+        }
 
-            if (IS_PROTOCOL_31(cserver)) {
-                VerifyEnvMsg verifymsg(job.targetPlatform(), job.environmentVersion());
+        // not again if the job has to be sent once more
+        usecs->got_env = true;
 
-                if (!cserver->send_msg(verifymsg)) {
-                    throw client_error(22, "Error 22 - error sending environment");
-                }
+        if (!cserver) {
+            cserver = Service::createChannel(hostname, port, 10, usecs->host_protocol);
+        }
 
-                Msg *verify_msg = cserver->get_msg(60);
-
-                if (verify_msg && verify_msg->type == M_VERIFY_ENV_RESULT) {
-                    if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
-                        // The remote can't handle the environment at all (e.g. kernel too old),
-                        // mark it as never to be used again for this environment.
-                        log_info() << "Host " << hostname
-                                   << " did not successfully verify environment."
-                                   << endl;
-                        BlacklistHostEnvMsg blacklist(job.targetPlatform(),
-                                                      job.environmentVersion(), hostname);
-                        local_daemon->send_msg(blacklist);
-                        delete verify_msg;
-                        throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
-                    } else
-                        trace() << "Verified host " << hostname << " for environment "
-                                << job.environmentVersion() << " (" << job.targetPlatform() << ")"
-                                << endl;
-                    delete verify_msg;
-                } else {
-                    delete verify_msg;
-                    throw client_error(25, "Error 25 - other error verifying environment on remote");
-                }
-            }
+        if (!cserver) {
+            log_error() << "no server found behind given hostname " << hostname << ":"
+                        << port << endl;
+            throw client_error(2, "Error 2 - no server found at " + hostname);
         }
 
+        cserver->setTrafficClass(MsgChannel::JobTraffic);
+
         if (!IS_PROTOCOL_31(cserver) && ignore_unverified()) {
             log_warning() << "Host " << hostname << " cannot be verified." << endl;
             throw client_error(26, "Error 26 - environment on " + hostname + " cannot be verified");
@@ -504,56 +943,27 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
         }
 
-        if (!preproc_file) {
-            int sockets[2];
-
-            if (pipe(sockets) != 0) {
-                log_perror("build_remote_in pipe");
-                /* for all possible cases, this is something severe */
-                throw client_error(32, "Error 18 - (fork error?)");
-            }
-
-            if (!dcc_lock_host()) {
-                log_error() << "can't lock for local cpp" << endl;
-                return EXIT_DISTCC_FAILED;
-            }
-            HostUnlock hostUnlock; // automatic dcc_unlock()
-
-            /* This will fork, and return the pid of the child.  It will not
-               return for the child itself.  If it returns normally it will have
-               closed the write fd, i.e. sockets[1].  */
-            pid_t cpp_pid = call_cpp(job, sockets[1], sockets[0]);
+        if (job.language() == CompileJob::Lang_Custom) {
+            const list<string> inputs = job.commandInputs();
 
-            if (cpp_pid == -1) {
-                throw client_error(18, "Error 18 - (fork error?)");
-            }
-
-            try {
-                log_block bl2("write_fd_to_server from cpp");
-                write_fd_to_server(sockets[0], cserver);
-            } catch (...) {
-                kill(cpp_pid, SIGTERM);
-                throw;
-            }
+            for (list<string>::const_iterator it = inputs.begin(); it != inputs.end(); ++it) {
+                int input_fd = open(it->c_str(), O_RDONLY);
 
-            log_block wait_cpp("wait for cpp");
+                if (input_fd < 0) {
+                    throw client_error(11, "Error 11 - unable to open " + *it);
+                }
 
-            while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
+                log_block input_block("write_fd_to_server command input");
+                write_fd_to_server(input_fd, cserver);
 
-            if (shell_exit_status(status) != 0) {   // failure
-                delete cserver;
-                cserver = 0;
-                log_warning() << "call_cpp process failed with exit status " << shell_exit_status(status) << endl;
-                // GCC's -fdirectives-only has a number of cases that it doesn't handle properly,
-                // so if in such mode preparing the source fails, try again recompiling locally.
-                // This will cause double error in case it is a real error, but it'll build successfully if
-                // it was just -fdirectives-only being broken. In other cases fail directly, Clang's
-                // -frewrite-includes is much more reliable than -fdirectives-only, so is GCC's plain -E.
-                if( !compiler_is_clang(job) && compiler_only_rewrite_includes(job))
-                    throw remote_error(103, "Error 103 - local cpp invocation failed, trying to recompile locally");
-                else
-                    return shell_exit_status(status);
+                if (!cserver->send_msg(EndMsg())) {
+                    log_info() << "write of end failed" << endl;
+                    throw client_error(12, "Error 12 - failed to send file to remote");
+                }
             }
+        } else if (preproc) {
+            log_block cpp_block("write_fd_to_server preprocessed while waiting");
+            preproc->write_to_server(cserver);
         } else {
             int cpp_fd = open(preproc_file, O_RDONLY);
 
@@ -565,7 +975,7 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             write_fd_to_server(cpp_fd, cserver);
         }
 
-        if (!cserver->send_msg(EndMsg())) {
+        if (job.language() != CompileJob::Lang_Custom && !cserver->send_msg(EndMsg())) {
             log_info() << "write of end failed" << endl;
             throw client_error(12, "Error 12 - failed to send file to remote");
         }
@@ -582,6 +992,11 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
 
         check_for_failure(msg, cserver);
 
+        if (msg->type == M_JOB_RELEASE) {
+            delete msg;
+            throw released_error(cserver);
+        }
+
         if (msg->type != M_COMPILE_RESULT) {
             log_warning() << "waited for compile result, but got " << (char)msg->type << endl;
             delete msg;
@@ -599,7 +1014,10 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw remote_error(101, "Error 101 - the server ran out of memory, recompiling locally");
         }
 
-        if (output) {
+        if (output && job.language() == CompileJob::Lang_Custom) {
+            ignore_result(write(STDOUT_FILENO, crmsg->out.c_str(), crmsg->out.size()));
+            ignore_result(write(STDERR_FILENO, crmsg->err.c_str(), crmsg->err.size()));
+        } else if (output) {
             if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)) {
                 delete crmsg;
                 log_info() << "command needs stdout/stderr workaround, recompiling locally" << endl;
@@ -629,9 +1047,15 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         bool have_dwo_file = crmsg->have_dwo_file;
         delete crmsg;
 
-        assert(!job.outputFile().empty());
+        if (job.language() == CompileJob::Lang_Custom) {
+            const list<string> outputs = job.commandOutputs();
 
-        if (status == 0) {
+            for (list<string>::const_iterator it = outputs.begin();
+                 status == 0 && it != outputs.end(); ++it) {
+                receive_file(*it, cserver);
+            }
+        } else if (status == 0) {
+            assert(!job.outputFile().empty());
             receive_file(job.outputFile(), cserver);
             if (have_dwo_file) {
                 string dwo_output = job.outputFile().substr(0, job.outputFile().rfind('.')) + ".dwo";
@@ -640,6 +1064,8 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         }
 
     } catch (...) {
+        bool setup_failed = cserver && cserver->assumed_protocol_failed();
+
         // Handle pending status messages, if any.
         if(cserver) {
             while(Msg* msg = cserver->get_msg(0, true)) {
@@ -652,6 +1078,11 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             cserver = 0;
         }
 
+        if (setup_failed) {
+            throw client_error(27, "Error 27 - " + hostname + " did not agree to protocol "
+                               + toString(usecs->host_protocol));
+        }
+
         throw;
     }
 
@@ -659,6 +1090,29 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
     return status;
 }
 
+/* The protocol of the compile server from the scheduler lets the job go out
+   without waiting for the protocol setup. Should the server not agree to it,
+   the job is sent once more after the normal setup.  */
+static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
+                            const string &environment, const string &version_file,
+                            const char *preproc_file, bool output, PreprocBuffer *preproc = 0)
+{
+    try {
+        return build_remote_job(job, usecs, local_daemon, environment, version_file,
+                                preproc_file, output, preproc);
+    } catch (client_error &error) {
+        if (error.errorCode != 27) {
+            throw;
+        }
+
+        log_warning() << error.what() << ", trying the normal protocol setup" << endl;
+        usecs->host_protocol = 0;
+    }
+
+    return build_remote_job(job, usecs, local_daemon, environment, version_file,
+                            preproc_file, output, preproc);
+}
+
 static string
 md5_for_file(const string & file)
 {
@@ -774,6 +1228,10 @@ static int minimalRemoteVersion( const CompileJob& job)
         version = max(version, 35);
     }
 
+    if (job.language() == CompileJob::Lang_Custom) {
+        version = max(version, 52);
+    }
+
     return version;
 }
 
@@ -789,6 +1247,119 @@ static unsigned int requiredRemoteFeatures()
     return features;
 }
 
+/* The build the job belongs to, so that the scheduler can balance between
+   concurrent builds.  Unless set by $ICECC_BUILD_SESSION, this is the process
+   group, which an interactive shell creates for each command.  */
+static string build_session()
+{
+    if (const char *session = getenv("ICECC_BUILD_SESSION")) {
+        return session;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "pgrp:%d", (int) getpgrp());
+    return buf;
+}
+
+/* Parses the .ninja_log entry LINE, "start end mtime output command-hash" separated
+   by tabs, and sets DURATION if it is the one of OUTPUT.  */
+static bool ninja_log_entry(const char *line, size_t length, const string &output, int &duration)
+{
+    if (length == 0 || line[0] == '#') {
+        return false;
+    }
+
+    const char *end = static_cast<const char *>(memchr(line, '\t', length));
+    const char *mtime = end ? static_cast<const char *>(memchr(end + 1, '\t', line + length - end - 1)) : 0;
+    const char *path = mtime ? static_cast<const char *>(memchr(mtime + 1, '\t', line + length - mtime - 1)) : 0;
+    const char *hash = path ? static_cast<const char *>(memchr(path + 1, '\t', line + length - path - 1)) : 0;
+
+    if (!hash || output.compare(0, string::npos, path + 1, hash - path - 1) != 0) {
+        return false;
+    }
+
+    long start_ms = atol(line);
+    long end_ms = atol(end + 1);
+    duration = max(0L, min(end_ms - start_ms, 0x7fffffffL));
+    return true;
+}
+
+/* How long building OUTPUT took the last time according to the .ninja_log in
+   the current directory, where ninja runs its commands, in milliseconds. The
+   last entry counts, so the log is read from its end, where the previous build
+   of the output usually is.  */
+static int ninja_log_duration(const string &output)
+{
+    int fd = open(".ninja_log", O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    off_t pos = lseek(fd, 0, SEEK_END);
+    string lines; // the first, maybe incomplete, line of what has been read
+    char buf[65536];
+    int duration = 0;
+    bool found = false;
+
+    while (!found && pos > 0) {
+        size_t count = min(pos, off_t(sizeof(buf)));
+        pos -= count;
+
+        if (pread(fd, buf, count, pos) != ssize_t(count)) {
+            break;
+        }
+
+        lines.insert(0, buf, count);
+
+        // only the first line may continue in the previous block
+        size_t line_end = lines.size();
+
+        while (!found && line_end > 0) {
+            size_t newline = lines.rfind('\n', line_end - 1);
+
+            if (newline == string::npos) {
+                break;
+            }
+
+            found = ninja_log_entry(lines.data() + newline + 1, line_end - newline - 1, output, duration);
+            line_end = newline;
+        }
+
+        lines.erase(line_end);
+
+        if (!found && pos == 0) {
+            found = ninja_log_entry(lines.data(), lines.size(), output, duration);
+        }
+    }
+
+    close(fd);
+    return duration;
+}
+
+/* Hint for the scheduler which jobs of the build to place first: a number
+   from $ICECC_PRIORITY, or with "ninja" the duration of the last build of
+   the output, so that long compiles don't end up last.  */
+static int scheduling_priority(const CompileJob &job)
+{
+    const char *priority = getenv("ICECC_PRIORITY");
+
+    if (!priority) {
+        return 0;
+    }
+
+    if (strcmp(priority, "ninja") == 0) {
+        if (job.language() == CompileJob::Lang_Custom) {
+            list<string> outputs = job.commandOutputs();
+            return outputs.empty() ? 0 : ninja_log_duration(outputs.front());
+        }
+
+        return ninja_log_duration(job.outputFile());
+    }
+
+    return atoi(priority);
+}
+
 int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill)
 {
     srand(time(0) + getpid());
@@ -840,6 +1411,8 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
                        minimalRemoteVersion(job), requiredRemoteFeatures());
+        getcs.build_session = build_session();
+        getcs.priority = scheduling_priority(job);
 
         trace() << "asking for host to use" << endl;
         if (!local_daemon->send_msg(getcs)) {
@@ -847,20 +1420,100 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
             throw client_error(24, "Error 24 - asked for CS");
         }
 
-        UseCSMsg *usecs = get_server(local_daemon);
+        if (!dcc_lock_host()) {
+            log_error() << "can't lock for local cpp" << endl;
+            return EXIT_DISTCC_FAILED;
+        }
+        HostUnlock hostUnlock; // automatic dcc_unlock()
+
+        // cpp's messages are only shown if its output is used, a local build shows them itself
+        char *err_file = 0;
+        int err_fd = -1;
+
+        if (dcc_make_tmpnam("icecc", ".err", &err_file, 0) == 0) {
+            err_fd = open(err_file, O_RDWR);
+            unlink(err_file);
+            free(err_file);
+        }
+
+        PreprocBuffer preproc;
+        UseCSMsg *usecs = 0;
         int ret;
 
         try {
-            if (!maybe_build_local(local_daemon, usecs, job, ret))
-                ret = build_remote_int(job, usecs, local_daemon,
-                                       version_map[usecs->host_platform],
-                                       versionfile_map[usecs->host_platform],
-                                       0, true);
+            int cpp_status = preprocess_while_waiting(job, local_daemon, preproc, err_fd, usecs);
+
+            if (cpp_status != 0) {
+                /* A job already placed here is built without cpp, its errors come from
+                   that build. A host not assigned yet is not waited for, closing the
+                   connection to the local daemon cancels the request. */
+                if (usecs && maybe_build_local(local_daemon, usecs, job, ret)) {
+                    close(err_fd);
+                    delete usecs;
+                    return ret;
+                }
+
+                flush_cpp_errors(err_fd);
+                close(err_fd);
+                err_fd = -1;
+                delete usecs;
+                usecs = 0;
+                log_warning() << "call_cpp process failed with exit status " << cpp_status << endl;
+
+                // GCC's -fdirectives-only has a number of cases that it doesn't handle properly,
+                // so if in such mode preparing the source fails, try again recompiling locally.
+                // This will cause double error in case it is a real error, but it'll build successfully if
+                // it was just -fdirectives-only being broken. In other cases fail directly, Clang's
+                // -frewrite-includes is much more reliable than -fdirectives-only, so is GCC's plain -E.
+                if( !compiler_is_clang(job) && compiler_only_rewrite_includes(job))
+                    throw remote_error(103, "Error 103 - local cpp invocation failed, trying to recompile locally");
+
+                return cpp_status;
+            }
+
+            if (!usecs) {
+                usecs = get_server(local_daemon);
+            }
+
+            bool flushed = false;
+            int releases = 0;
+            int retries = 0;
+
+            for (;;) {
+                try {
+                    if (!maybe_build_local(local_daemon, usecs, job, ret)) {
+                        if (!flushed) {
+                            flush_cpp_errors(err_fd);
+                            flushed = true;
+                        }
+
+                        ret = build_remote_int(job, usecs, local_daemon,
+                                               version_map[usecs->host_platform],
+                                               versionfile_map[usecs->host_platform],
+                                               0, true, &preproc);
+                    }
+
+                    break;
+                } catch (client_error &error) {
+                    if (!try_another_server(error, usecs, getcs, releases, retries)) {
+                        throw;
+                    }
+                }
+
+                delete usecs;
+                usecs = 0;
+                usecs = ask_again_for_server(local_daemon, getcs);
+            }
         } catch(...) {
+            if (err_fd >= 0) {
+                close(err_fd);
+            }
+
             delete usecs;
             throw;
         }
 
+        close(err_fd);
         delete usecs;
         return ret;
     } else {
@@ -1093,3 +1746,70 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
 
     return 0;
 }
+
+int run_remote_command(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs)
+{
+    trace() << "preparing " << job.compilerName() << " to be run for "
+            << job.targetPlatform() << "\n";
+
+    map<string, string> versionfile_map, version_map;
+    Environments envs = rip_out_paths(_envs, version_map, versionfile_map);
+
+    if (!envs.size()) {
+        throw client_error(22, "Error 22 - no environment for running " + job.compilerName());
+    }
+
+    string fake_filename = job.compilerName();
+    list<string> args = job.restFlags();
+
+    for (list<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+        fake_filename += "/" + *it;
+    }
+
+    const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
+    GetCSMsg getcs(envs, fake_filename, job.language(), 1, job.targetPlatform(), 0,
+                   preferred_host ? preferred_host : string(),
+                   minimalRemoteVersion(job), requiredRemoteFeatures());
+    getcs.build_session = build_session();
+    getcs.priority = scheduling_priority(job);
+
+    trace() << "asking for host to use" << endl;
+    if (!local_daemon->send_msg(getcs)) {
+        log_warning() << "asked for CS" << endl;
+        throw client_error(24, "Error 24 - asked for CS");
+    }
+
+    UseCSMsg *usecs = get_server(local_daemon);
+    int ret;
+
+    int releases = 0;
+    int retries = 0;
+
+    try {
+        for (;;) {
+            try {
+                if (!maybe_build_local(local_daemon, usecs, job, ret)) {
+                    ret = build_remote_int(job, usecs, local_daemon,
+                                           version_map[usecs->host_platform],
+                                           versionfile_map[usecs->host_platform], 0, true);
+                }
+
+                break;
+            } catch (client_error &error) {
+                if (!try_another_server(error, usecs, getcs, releases, retries)) {
+                    throw;
+                }
+            }
+
+            delete usecs;
+            usecs = 0;
+            usecs = ask_again_for_server(local_daemon, getcs);
+        }
+    } catch (...) {
+        delete usecs;
+        throw;
+    }
+
+    delete usecs;
+    return ret;
+}
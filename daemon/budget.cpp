@@ -0,0 +1,99 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "budget.h"
+
+#include <algorithm>
+
+#include <job.h>
+#include "logging.h"
+
+using namespace std;
+
+// files remembered, the least recently used are forgotten first
+static const size_t max_files = 4096;
+
+static string file_key(const CompileJob &job, const string &host)
+{
+    return host + ":" + job.workingDirectory() + "/" + job.inputFile();
+}
+
+static string class_key(const CompileJob &job)
+{
+    return toString(job.language()) + "/" + toString(job.argumentFlags());
+}
+
+unsigned int MemoryBudget::predict(const CompileJob &job, const string &host) const
+{
+    map<string, Peak>::const_iterator file = files.find(file_key(job, host));
+
+    if (file != files.end()) {
+        // the file may have grown since
+        return file->second.size + file->second.size / 4 + 16;
+    }
+
+    map<string, unsigned int>::const_iterator average = classes.find(class_key(job));
+
+    if (average != classes.end()) {
+        return average->second + average->second / 2;
+    }
+
+    switch (job.language()) {
+    case CompileJob::Lang_C:
+    case CompileJob::Lang_OBJC:
+        return 256;
+    default:
+        return 768;
+    }
+}
+
+void MemoryBudget::learn(const CompileJob &job, const string &host, unsigned int peak)
+{
+    if (peak == 0) {
+        return;
+    }
+
+    string key = file_key(job, host);
+
+    if (files.size() >= max_files && files.find(key) == files.end()) {
+        map<string, Peak>::iterator oldest = files.begin();
+
+        for (map<string, Peak>::iterator it = files.begin(); it != files.end(); ++it) {
+            if (it->second.last_use < oldest->second.last_use) {
+                oldest = it;
+            }
+        }
+
+        files.erase(oldest);
+    }
+
+    Peak &entry = files[key];
+    entry.size = peak;
+    entry.last_use = ++sequence;
+
+    unsigned int &average = classes[class_key(job)];
+    average = average ? (average * 7 + peak) / 8 : peak;
+}
+
+void MemoryBudget::release(unsigned int need)
+{
+    committed -= min(committed, need);
+}
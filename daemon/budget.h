@@ -0,0 +1,81 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_BUDGET_H
+#define ICECREAM_BUDGET_H
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+class CompileJob;
+
+/* The memory available to compile jobs, and how much of it the running jobs
+   may need at their peak. The need of a job is predicted from the peak the
+   same file from the same host had the last time, or else from jobs of the
+   same language and optimization level. A job is only started while its
+   prediction fits into what is not committed to others yet. All sizes are
+   in megabytes. */
+class MemoryBudget
+{
+public:
+    MemoryBudget()
+        : budget(0)
+        , committed(0)
+        , sequence(0) {}
+
+    unsigned int predict(const CompileJob &job, const std::string &host) const;
+    void learn(const CompileJob &job, const std::string &host, unsigned int peak);
+
+    // free is the memory not used by anything, untouched the part of the
+    // running jobs' reservations they do not use yet, which free still counts
+    void set_available(unsigned int free, unsigned int untouched) {
+        budget = free + committed - std::min(untouched, free + committed);
+    }
+    // a single job is always admitted, even if it is larger than the budget
+    bool admit(unsigned int need) const {
+        return committed == 0 || budget == 0 || committed + need <= budget;
+    }
+    void grant(unsigned int need) {
+        committed += need;
+    }
+    void release(unsigned int need);
+
+    unsigned int total() const {
+        return budget;
+    }
+    unsigned int used() const {
+        return committed;
+    }
+
+private:
+    struct Peak {
+        unsigned int size;
+        unsigned long last_use;
+    };
+
+    unsigned int budget; // 0 if unknown
+    unsigned int committed;
+    std::map<std::string, Peak> files; // by host and input file
+    std::map<std::string, unsigned int> classes; // average by language and flags
+    unsigned long sequence;
+};
+
+#endif
@@ -0,0 +1,297 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "command.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <vector>
+
+#include "comm.h"
+#include "exitcode.h"
+#include "file_util.h"
+#include "logging.h"
+#include "util.h"
+#include "workit.h"
+
+using namespace std;
+
+static bool receive_input(MsgChannel *client, const string &file, unsigned int job_stat[])
+{
+    string::size_type slash = file.rfind('/');
+
+    if (slash != string::npos && !mkpath(file.substr(0, slash))) {
+        return false;
+    }
+
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        log_perror("open") << "\t" << file << endl;
+        return false;
+    }
+
+    bool ok = false;
+
+    while (Msg *msg = client->get_msg(60)) {
+        if (msg->type == M_END) {
+            delete msg;
+            ok = true;
+            break;
+        }
+
+        if (msg->type != M_FILE_CHUNK) {
+            log_error() << "protocol error while reading command input " << file << endl;
+            delete msg;
+            break;
+        }
+
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+        job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
+        job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
+
+        if (!write_all(fd, fcmsg->buffer, fcmsg->len)) {
+            log_perror("write") << "\t" << file << endl;
+            delete msg;
+            break;
+        }
+
+        delete msg;
+    }
+
+    if (close(fd) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+int run_command(CompileJob &job, unsigned int job_stat[], MsgChannel *client,
+                CompileResultMsg &rmsg, const string &dir, unsigned long int mem_limit)
+{
+    const list<string> inputs = job.commandInputs();
+    const list<string> outputs = job.commandOutputs();
+
+    if (job.compilerName().empty() || job.compilerName()[0] != '/') {
+        log_error() << "remote command " << job.compilerName() << " is not an absolute path" << endl;
+        return EXIT_DISTCC_FAILED;
+    }
+
+    for (list<string>::const_iterator it = inputs.begin(); it != inputs.end(); ++it) {
+        if (!is_contained_path(*it) || !receive_input(client, dir + "/" + *it, job_stat)) {
+            log_error() << "failed to receive command input " << *it << endl;
+            return EXIT_DISTCC_FAILED;
+        }
+    }
+
+    for (list<string>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        string::size_type slash = it->rfind('/');
+
+        if (!is_contained_path(*it) || (slash != string::npos && !mkpath(dir + "/" + it->substr(0, slash)))) {
+            log_error() << "invalid command output " << *it << endl;
+            return EXIT_DISTCC_FAILED;
+        }
+    }
+
+    list<string> args = job.nonLocalFlags();
+    vector<char *> argv;
+    string argstxt;
+    argv.push_back(strdup(job.compilerName().c_str()));
+
+    for (list<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+        argv.push_back(strdup(it->c_str()));
+        argstxt += ' ';
+        argstxt += *it;
+    }
+
+    argv.push_back(0);
+    trace() << "remote command " << job.compilerName() << argstxt << endl;
+
+    int out_pipe[2], err_pipe[2], exec_pipe[2];
+
+    if (pipe(out_pipe) || pipe(err_pipe) || pipe(exec_pipe)) {
+        return EXIT_DISTCC_FAILED;
+    }
+
+    struct timeval starttv;
+    gettimeofday(&starttv, 0);
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        return EXIT_OUT_OF_MEMORY;
+    }
+
+    if (pid == 0) {
+        setenv("PATH", "/usr/bin", 1);
+
+        if (getuid() == 0 || getgid() == 0) {
+            _exit(142);
+        }
+
+#ifdef RLIMIT_AS
+        struct rlimit rlim;
+        rlim.rlim_cur = rlim.rlim_max = rlim_t(mem_limit) * 1024 * 1024;
+
+        if (setrlimit(RLIMIT_AS, &rlim)) {
+            log_perror("setrlimit");
+        }
+#endif
+
+        if (chdir(dir.c_str()) != 0) {
+            _exit(EXIT_DISTCC_FAILED);
+        }
+
+        int null = open("/dev/null", O_RDONLY);
+
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+        }
+
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        close(exec_pipe[0]);
+        fcntl(exec_pipe[1], F_SETFD, FD_CLOEXEC);
+        close_debug();
+        execv(argv[0], &argv[0]);
+
+        // tell the parent that the command did not start, not that it failed
+        char result = 1;
+        ignore_result(write(exec_pipe[1], &result, 1));
+        _exit(EXIT_COMPILER_MISSING);
+    }
+
+    for (size_t i = 0; i < argv.size(); ++i) {
+        free(argv[i]);
+    }
+
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    close(exec_pipe[1]);
+
+    char result;
+    ssize_t n;
+
+    while ((n = read(exec_pipe[0], &result, 1)) < 0 && errno == EINTR) {}
+
+    close(exec_pipe[0]);
+
+    int fds[2] = { out_pipe[0], err_pipe[0] };
+    string *texts[2] = { &rmsg.out, &rmsg.err };
+    char buffer[4096];
+
+    while (fds[0] >= 0 || fds[1] >= 0) {
+        vector<pollfd> pollfds;
+
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i] >= 0) {
+                pollfd pfd;
+                pfd.fd = fds[i];
+                pfd.events = POLLIN;
+                pollfds.push_back(pfd);
+            }
+        }
+
+        if (poll(pollfds.data(), pollfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i] < 0 || !pollfd_is_set(pollfds, fds[i], POLLIN)) {
+                continue;
+            }
+
+            ssize_t bytes = read(fds[i], buffer, sizeof(buffer));
+
+            if (bytes > 0) {
+                texts[i]->append(buffer, bytes);
+            } else if (bytes == 0 || errno != EINTR) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    struct rusage ru;
+    int status;
+
+    while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR) {}
+
+    if (n == 1) {
+        log_error() << "remote command " << job.compilerName() << " did not start" << endl;
+        return EXIT_COMPILER_MISSING;
+    }
+
+    struct timeval endtv;
+    gettimeofday(&endtv, 0);
+    rmsg.status = shell_exit_status(status);
+    job_stat[JobStatistics::exit_code] = rmsg.status;
+    job_stat[JobStatistics::real_msec] = (endtv.tv_sec - starttv.tv_sec) * 1000
+                                         + (long(endtv.tv_usec) - long(starttv.tv_usec)) / 1000;
+    job_stat[JobStatistics::user_msec] = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
+    job_stat[JobStatistics::sys_msec] = ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000;
+    job_stat[JobStatistics::sys_pfaults] = ru.ru_majflt + ru.ru_nswap + ru.ru_minflt;
+#ifdef __APPLE__
+    job_stat[JobStatistics::peak_rss] = ru.ru_maxrss / 1024;
+#else
+    job_stat[JobStatistics::peak_rss] = ru.ru_maxrss; // kilobytes
+#endif
+
+    if (rmsg.status != 0) {
+        log_warning() << "Remote command exited with exit code " << rmsg.status << endl;
+        return 0;
+    }
+
+    for (list<string>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        struct stat st;
+
+        if (stat((dir + "/" + *it).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            rmsg.err += "icerun: " + *it + " was not created by " + job.compilerName() + "\n";
+            rmsg.status = 1;
+            break;
+        }
+
+        job_stat[JobStatistics::out_uncompressed] += st.st_size;
+    }
+
+    log_info() << "Remote command completed with exit code " << rmsg.status << endl;
+    return 0;
+}
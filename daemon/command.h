@@ -0,0 +1,38 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_COMMAND_H
+#define ICECREAM_COMMAND_H
+
+#include <job.h>
+#include <string>
+
+class MsgChannel;
+class CompileResultMsg;
+
+/* Runs a command that icerun sent instead of a compile job. The declared
+   input files are received into dir at their paths relative to the client's
+   working directory, the command is run there, and it has to create all the
+   declared outputs for the job to succeed. Must be used inside the chroot of
+   the environment, which contains the command at its absolute path. */
+extern int run_command(CompileJob &job, unsigned int job_stat[], MsgChannel *client,
+                       CompileResultMsg &rmsg, const std::string &dir, unsigned long int mem_limit);
+
+#endif
@@ -0,0 +1,665 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "driver.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utime.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "comm.h"
+#include "envtransfer.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;
+
+const char driver_cache_dir[] = "/.icecc-driver";
+const size_t driver_cache_limit = 1024 * 1024;
+
+static const char *const cache_dir = driver_cache_dir;
+
+static const char input_placeholder[] = "icecc-driver-input";
+static const char output_placeholder[] = "icecc-driver-output";
+static const char root_placeholder[] = "/icecc-driver-root";
+static const char cwd_placeholder[] = "/icecc-driver-cwd";
+static const char param_placeholder[] = "icecc-driver-param";
+
+// --param values the daemon sets per job, the driver passes them on unchanged
+static const char *const job_params[] = { "ggc-min-expand=", "ggc-min-heapsize=" };
+
+static string replace_all(string str, const string &from, const string &to)
+{
+    for (size_t pos = str.find(from); pos != string::npos; pos = str.find(from, pos + to.size())) {
+        str.replace(pos, from.size(), to);
+    }
+
+    return str;
+}
+
+static string current_dir()
+{
+    char buffer[PATH_MAX];
+
+    if (!getcwd(buffer, sizeof(buffer))) {
+        return "/";
+    }
+
+    return buffer;
+}
+
+DriverExpansion::DriverExpansion(const string &input, const string &output, const string &root)
+    : input_arg(input_placeholder)
+    , root_arg(root_placeholder)
+{
+    // keep the directory and extension, the driver derives the names of other outputs from them
+    size_t slash = output.rfind('/');
+    string dir = slash == string::npos ? string() : output.substr(0, slash + 1);
+    string base = output.substr(dir.size());
+    size_t dot = base.rfind('.');
+
+    if (dot == 0 || dot == string::npos) {
+        dot = base.size();
+    }
+
+    output_arg = dir + output_placeholder + base.substr(dot);
+
+    values.push_back(make_pair(string(input_placeholder), input));
+    values.push_back(make_pair(string(output_placeholder), base.substr(0, dot)));
+    values.push_back(make_pair(string(root_placeholder), root));
+
+    string cwd = current_dir();
+
+    if (cwd != "/") {
+        values.push_back(make_pair(string(cwd_placeholder), cwd));
+    }
+}
+
+string DriverExpansion::resolve(const string &arg) const
+{
+    string result = arg;
+
+    for (list<pair<string, string> >::const_iterator it = values.begin(); it != values.end(); ++it) {
+        result = replace_all(result, it->first, it->second);
+    }
+
+    return result;
+}
+
+// One line with each argument terminated by a NUL.
+static string serialize(const Command &command)
+{
+    string line;
+
+    for (Command::const_iterator it = command.begin(); it != command.end(); ++it) {
+        line += *it;
+        line += '\0';
+    }
+
+    return line;
+}
+
+static Command deserialize(const string &line)
+{
+    Command command;
+
+    for (size_t pos = 0, end; (end = line.find('\0', pos)) != string::npos; pos = end + 1) {
+        command.push_back(line.substr(pos, end - pos));
+    }
+
+    return command;
+}
+
+// Pairs of "<param>=<placeholder>" and "<param>=<value>" for the job_params in args.
+static list<pair<string, string> > job_param_values(const vector<string> &args)
+{
+    list<pair<string, string> > values;
+
+    for (vector<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+        size_t start = it->compare(0, 8, "--param=") == 0 ? 8 : 0;
+
+        for (size_t i = 0; i < sizeof(job_params) / sizeof(job_params[0]); ++i) {
+            size_t len = strlen(job_params[i]);
+
+            if (it->compare(start, len, job_params[i]) == 0) {
+                values.push_back(make_pair(string(job_params[i]) + param_placeholder,
+                                           it->substr(start)));
+            }
+        }
+    }
+
+    return values;
+}
+
+static string cache_file(const string &key)
+{
+    // the key is stored in the file as well
+    EnvHash hash;
+    hash.update(key);
+    return string(cache_dir) + "/" + hash.str();
+}
+
+// An entry without commands means the job has to go through the driver.
+static bool read_cache(const string &file, const string &key, vector<Command> &commands)
+{
+    ifstream in(file.c_str());
+    string line;
+
+    if (!getline(in, line) || line != key) {
+        return false;
+    }
+
+    while (getline(in, line)) {
+        commands.push_back(deserialize(line));
+    }
+
+    // the least recently used entries are evicted first
+    utime(file.c_str(), 0);
+    return true;
+}
+
+// Removes the least recently used entries until another size bytes fit into the limit.
+static void evict_cache(size_t size)
+{
+    DIR *dir = opendir(cache_dir);
+
+    if (!dir) {
+        return;
+    }
+
+    vector<pair<time_t, string> > entries;
+    size_t total = 0;
+
+    for (struct dirent *ent = readdir(dir); ent; ent = readdir(dir)) {
+        string file = string(cache_dir) + "/" + ent->d_name;
+        struct stat st;
+
+        if (ent->d_name[0] == '.' || lstat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        total += st.st_size;
+
+        // files being written by other jobs have a suffix
+        if (strchr(ent->d_name, '.') == 0) {
+            entries.push_back(make_pair(st.st_mtime, file));
+        }
+    }
+
+    closedir(dir);
+    sort(entries.begin(), entries.end());
+
+    for (vector<pair<time_t, string> >::const_iterator it = entries.begin();
+            it != entries.end() && total + size > driver_cache_limit; ++it) {
+        struct stat st;
+
+        if (lstat(it->second.c_str(), &st) == 0 && unlink(it->second.c_str()) == 0) {
+            total -= min(total, size_t(st.st_size));
+        }
+    }
+}
+
+static void write_cache(const string &file, const string &key, const vector<Command> &commands)
+{
+    if (mkdir(cache_dir, 0755) && errno != EEXIST) {
+        log_perror("mkdir driver cache") << "\t" << cache_dir << endl;
+        return;
+    }
+
+    string entry = key + '\n';
+
+    for (vector<Command>::const_iterator it = commands.begin(); it != commands.end(); ++it) {
+        entry += serialize(*it) + '\n';
+    }
+
+    if (entry.size() > driver_cache_limit) {
+        return;
+    }
+
+    evict_cache(entry.size());
+
+    // several jobs may be expanding the same arguments
+    string tmpfile = file + "." + toString(getpid());
+    ofstream out(tmpfile.c_str());
+    out << entry;
+    out.close();
+
+    if (!out || rename(tmpfile.c_str(), file.c_str()) != 0) {
+        log_perror("failed to save driver expansion") << "\t" << file << endl;
+        unlink(tmpfile.c_str());
+    }
+}
+
+static bool run_driver(const vector<string> &args, string &output)
+{
+    int fds[2];
+
+    if (pipe(fds)) {
+        return false;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        vector<char *> argv;
+
+        for (vector<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+            argv.push_back(const_cast<char *>(it->c_str()));
+        }
+
+        argv.push_back(const_cast<char *>("-###"));
+        argv.push_back(0);
+        execv(argv[0], &argv[0]);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    char buffer[4096];
+
+    for (;;) {
+        ssize_t bytes = read(fds[0], buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            break;
+        }
+
+        output.append(buffer, bytes);
+    }
+
+    close(fds[0]);
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Splits a command printed by -###. GCC quotes arguments with special characters,
+// clang quotes all of them.
+static bool split_command(const string &line, Command &command)
+{
+    string arg;
+    bool in_arg = false;
+    bool quoted = false;
+
+    for (size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+
+        if (quoted) {
+            if (c == '\\' && i + 1 < line.size()) {
+                arg += line[++i];
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                arg += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+            in_arg = true;
+        } else if (c == ' ' || c == '\t') {
+            if (in_arg) {
+                command.push_back(arg);
+            }
+
+            arg.clear();
+            in_arg = false;
+        } else {
+            arg += c;
+            in_arg = true;
+        }
+    }
+
+    if (in_arg) {
+        command.push_back(arg);
+    }
+
+    return !quoted && !command.empty();
+}
+
+static bool parse_commands(const string &output, vector<Command> &commands)
+{
+    istringstream in(output);
+    string line;
+
+    while (getline(in, line)) {
+        // everything else is version information and environment settings
+        if (line.empty() || line[0] != ' ' || line == " (in-process)") {
+            continue;
+        }
+
+        Command command;
+
+        if (!split_command(line, command)) {
+            return false;
+        }
+
+        commands.push_back(command);
+    }
+
+    return !commands.empty();
+}
+
+static string basename_of(const string &path)
+{
+    size_t slash = path.rfind('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+// Only a lone clang -cc1 or a GCC frontend followed by the assembler can be run directly,
+// the latter is changed to pass the assembly through a pipe.
+static bool make_direct(vector<Command> &commands)
+{
+    // what the driver did not find in its own directories comes from PATH, see work_it()
+    for (vector<Command>::iterator it = commands.begin(); it != commands.end(); ++it) {
+        if ((*it)[0].find('/') == string::npos) {
+            (*it)[0] = "/usr/bin/" + (*it)[0];
+        }
+    }
+
+    if (commands.size() == 1 && commands[0].size() > 1 && commands[0][1] == "-cc1") {
+        return access(commands[0][0].c_str(), X_OK) == 0;
+    }
+
+    if (commands.size() != 2 || basename_of(commands[0][0]).compare(0, 3, "cc1") != 0) {
+        return false;
+    }
+
+    Command &frontend = commands[0];
+    Command &as = commands[1];
+    string assembly;
+
+    for (size_t i = 1; i + 1 < frontend.size(); ++i) {
+        if (frontend[i] == "-o" && frontend[i + 1].size() > 2
+                && frontend[i + 1].compare(frontend[i + 1].size() - 2, 2, ".s") == 0) {
+            assembly = frontend[i + 1];
+            frontend[i + 1] = "-";
+            break;
+        }
+    }
+
+    string as_name = basename_of(as[0]);
+
+    if (assembly.empty() || (as_name != "as" && (as_name.size() < 3
+                             || as_name.compare(as_name.size() - 3, 3, "-as") != 0))) {
+        return false;
+    }
+
+    Command::iterator input = find(as.begin() + 1, as.end(), assembly);
+
+    if (input == as.end()) {
+        return false;
+    }
+
+    // other inputs, such as files given with -Wa, keep their place before or after it
+    *input = "-";
+    return access(frontend[0].c_str(), X_OK) == 0 && access(as[0].c_str(), X_OK) == 0;
+}
+
+bool DriverExpansion::expand(const vector<string> &args, vector<Command> &commands) const
+{
+    for (vector<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+        // LTO objects record the options the driver passes in the environment
+        if (it->compare(0, 5, "-flto") == 0 || it->compare(0, 11, "-save-temps") == 0) {
+            return false;
+        }
+    }
+
+    // jobs that differ only in these share the expansion
+    list<pair<string, string> > params = job_param_values(args);
+    string key = serialize(args);
+
+    for (list<pair<string, string> >::const_iterator it = params.begin(); it != params.end(); ++it) {
+        key = replace_all(key, it->second, it->first);
+    }
+
+    if (key.find('\n') != string::npos) {
+        return false;
+    }
+
+    string file = cache_file(key);
+    vector<Command> expanded;
+
+    if (!read_cache(file, key, expanded)) {
+        string output;
+
+        if (!run_driver(args, output) || !parse_commands(output, expanded)
+                || !make_direct(expanded)) {
+            trace() << "cannot bypass the compiler driver for these arguments" << endl;
+            expanded.clear();
+        }
+
+        string cwd = current_dir();
+
+        for (vector<Command>::iterator command = expanded.begin(); command != expanded.end();
+                ++command) {
+            for (Command::iterator arg = command->begin(); arg != command->end(); ++arg) {
+                if (arg->find('\n') != string::npos) {
+                    expanded.clear();
+                    break;
+                }
+
+                if (cwd != "/") {
+                    *arg = replace_all(*arg, cwd, cwd_placeholder);
+                }
+
+                for (list<pair<string, string> >::const_iterator it = params.begin();
+                        it != params.end(); ++it) {
+                    *arg = replace_all(*arg, it->second, it->first);
+                }
+            }
+
+            if (expanded.empty()) {
+                break;
+            }
+        }
+
+        write_cache(file, key, expanded);
+    }
+
+    for (vector<Command>::const_iterator command = expanded.begin(); command != expanded.end();
+            ++command) {
+        Command resolved;
+
+        for (Command::const_iterator arg = command->begin(); arg != command->end(); ++arg) {
+            string value = resolve(*arg);
+
+            for (list<pair<string, string> >::const_iterator it = params.begin();
+                    it != params.end(); ++it) {
+                value = replace_all(value, it->first, it->second);
+            }
+
+            resolved.push_back(value);
+        }
+
+        commands.push_back(resolved);
+    }
+
+    return !commands.empty();
+}
+
+static pid_t command_pids[2];
+
+static void forward_signal(int sig)
+{
+    for (int i = 0; i < 2; ++i) {
+        if (command_pids[i] > 0) {
+            kill(command_pids[i], sig);
+        }
+    }
+}
+
+static void exec_command(const Command &command)
+{
+    vector<char *> argv;
+
+    for (Command::const_iterator it = command.begin(); it != command.end(); ++it) {
+        argv.push_back(const_cast<char *>(it->c_str()));
+    }
+
+    argv.push_back(0);
+    execv(argv[0], &argv[0]);
+}
+
+static pid_t spawn_command(const Command &command, int in_fd, int out_fd, const int fds[2],
+                           int failure_fd, const sigset_t &mask)
+{
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    sigprocmask(SIG_SETMASK, &mask, 0);
+
+    if (in_fd >= 0) {
+        dup2(in_fd, STDIN_FILENO);
+    }
+
+    if (out_fd >= 0) {
+        dup2(out_fd, STDOUT_FILENO);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    exec_command(command);
+    perror("ICECC: execv");
+
+    char resultByte = 1;
+    ignore_result(write(failure_fd, &resultByte, 1));
+    _exit(-1);
+}
+
+void exec_commands(const vector<Command> &commands, int failure_fd)
+{
+    if (commands.size() == 1) {
+        exec_command(commands[0]);
+        return;
+    }
+
+    int fds[2];
+
+    if (pipe(fds)) {
+        return;
+    }
+
+    // a SIGTERM from the daemon has to reach the commands
+    sigset_t term, mask;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term, &mask);
+
+    command_pids[0] = spawn_command(commands[0], -1, fds[1], fds, failure_fd, mask);
+
+    if (command_pids[0] < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        sigprocmask(SIG_SETMASK, &mask, 0);
+        return;
+    }
+
+    command_pids[1] = spawn_command(commands[1], fds[0], -1, fds, failure_fd, mask);
+
+    if (command_pids[1] < 0) {
+        kill(command_pids[0], SIGKILL);
+        char resultByte = 1;
+        ignore_result(write(failure_fd, &resultByte, 1));
+        _exit(-1);
+    }
+
+    // The parent notices the end of the compile by the input and output going away.
+    close(fds[0]);
+    close(fds[1]);
+    close(failure_fd);
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+
+    struct sigaction act;
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = forward_signal;
+    act.sa_flags = 0;
+    sigaction(SIGTERM, &act, 0);
+    sigprocmask(SIG_SETMASK, &mask, 0);
+
+    int status[2] = { 0, 0 };
+
+    for (int running = 2; running > 0;) {
+        int st;
+        pid_t pid = waitpid(-1, &st, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            _exit(-1);
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            if (pid == command_pids[i]) {
+                status[i] = st;
+                command_pids[i] = 0;
+                --running;
+            }
+        }
+    }
+
+    // report the frontend failing rather than the assembler choking on what it left
+    int result = (WIFEXITED(status[0]) && WEXITSTATUS(status[0]) == 0) ? status[1] : status[0];
+
+    if (WIFSIGNALED(result)) {
+        signal(WTERMSIG(result), SIG_DFL);
+        raise(WTERMSIG(result));
+    }
+
+    _exit(WIFEXITED(result) ? WEXITSTATUS(result) : -1);
+}
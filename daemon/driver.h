@@ -0,0 +1,80 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_DRIVER_H
+#define ICECREAM_DRIVER_H
+
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::vector<std::string> Command;
+
+// Where the expansions are kept, relative to the root of the environment, and the most
+// they may take there. The daemon counts the limit in the size of each environment.
+extern const char driver_cache_dir[];
+extern const size_t driver_cache_limit;
+
+/* Runs the compiler driver of a remote job once with -### to find out which
+   frontend and assembler commands it would run, and remembers them in the
+   environment, so that following jobs with the same arguments can execute
+   those directly. Values that differ between jobs are passed to the driver
+   as placeholders and filled in for each job, the GC --params the daemon
+   sets from the job's memory grant are replaced the same way after the
+   driver ran. Must be used inside the
+   chroot of the environment, from the job's working directory. */
+class DriverExpansion
+{
+public:
+    DriverExpansion(const std::string &input, const std::string &output, const std::string &root);
+
+    // what to pass to the driver instead of the input and output file names and the tmp root
+    const std::string &input() const {
+        return input_arg;
+    }
+    const std::string &output() const {
+        return output_arg;
+    }
+    const std::string &root() const {
+        return root_arg;
+    }
+
+    // replaces the placeholders in arg by the values of this job
+    std::string resolve(const std::string &arg) const;
+
+    // the commands to run instead of the driver invoked with args, false if there is no
+    // way around the driver
+    bool expand(const std::vector<std::string> &args, std::vector<Command> &commands) const;
+
+private:
+    std::string input_arg;
+    std::string output_arg;
+    std::string root_arg;
+    std::list<std::pair<std::string, std::string> > values; // placeholder -> value
+};
+
+/* Replaces the current process with the expanded commands, connecting the
+   frontend to the assembler through a pipe if there are two. Returns only if
+   nothing was started, failures after that are reported by writing to
+   failure_fd and exiting. */
+extern void exec_commands(const std::vector<Command> &commands, int failure_fd);
+
+#endif
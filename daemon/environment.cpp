@@ -30,16 +30,35 @@
 #include <grp.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <signal.h>
+#ifdef HAVE_ELF_H
+#include <elf.h>
+#endif
 
 #include "comm.h"
+#include "driver.h"
 #include "exitcode.h"
 #include "util.h"
+#include "file_util.h"
+#include "md5.h"
+#include "traffic.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mount.h>
+#endif
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
 
 using namespace std;
 
@@ -79,6 +98,13 @@ size_t sumup_dir(const string &dir)
     return res;
 }
 
+// The driver cache grows while jobs run, so its limit is counted instead of what it has now.
+static size_t environment_size(const string &dirname)
+{
+    size_t size = sumup_dir(dirname);
+    return size - min(size, sumup_dir(dirname + driver_cache_dir)) + driver_cache_limit;
+}
+
 static void list_target_dirs(const string &current_target, const string &targetdir, Environments &envs)
 {
     DIR *envdir = opendir(targetdir.c_str());
@@ -125,8 +151,9 @@ static bool exec_and_wait(const char *const argv[])
     _exit(-1);
 }
 
-// Removes everything in the directory recursively, but not the directory itself.
-static bool cleanup_directory(const string &directory)
+// Removes everything in the directory recursively, but not the directory itself
+// and not the entry named keep in it.
+static bool cleanup_directory(const string &directory, const char *keep = "")
 {
     DIR *dir = opendir(directory.c_str());
 
@@ -135,7 +162,8 @@ static bool cleanup_directory(const string &directory)
     }
 
     while (dirent *f = readdir(dir)) {
-        if (strcmp(f->d_name, ".") == 0 || strcmp(f->d_name, "..") == 0) {
+        if (strcmp(f->d_name, ".") == 0 || strcmp(f->d_name, "..") == 0
+                || strcmp(f->d_name, keep) == 0) {
             continue;
         }
 
@@ -166,7 +194,8 @@ bool cleanup_cache(const string &basedir, uid_t user_uid, gid_t user_gid)
 {
     flush_debug();
 
-    if (access(basedir.c_str(), R_OK) == 0 && !cleanup_directory(basedir)) {
+    // interrupted transfers can still be continued after a restart
+    if (access(basedir.c_str(), R_OK) == 0 && !cleanup_directory(basedir, "partial")) {
         log_error() << "failed to clean up envs dir" << endl;
         return false;
     }
@@ -217,14 +246,13 @@ Environments available_environmnents(const string &basedir)
     return envs;
 }
 
-// Returns fd for icecc-create-env output
-int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
-                     const std::string &compiler, const list<string> &extrafiles,
-                     const std::string &compression)
+// Forks a child running as the user in the directory of the native environments. The child
+// writes the file name of the environment to fd when done, the parent gets the other end.
+static pid_t fork_native_env_child(const string &basedir, uid_t user_uid, gid_t user_gid, int &fd)
 {
     string nativedir = basedir + "/native/";
     if (mkdir(nativedir.c_str(), 0775) && errno != EEXIST) {
-        return 0;
+        return -1;
     }
 
     if (chown(nativedir.c_str(), user_uid, user_gid) ||
@@ -233,7 +261,7 @@ int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
         if (-1 == rmdir(nativedir.c_str())){
             log_perror("rmdir failed");
         }
-        return 0;
+        return -1;
     }
 
     flush_debug();
@@ -254,7 +282,8 @@ int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
             log_perror("close failed");
         }
         fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
-        return pipes[0];
+        fd = pipes[0];
+        return pid;
     }
     // else
 
@@ -288,12 +317,163 @@ int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
         log_perror("close failed");
     }
 
-    if (-1 == dup2(pipes[1], 5)){   // icecc-create-env will write the hash there
-        log_perror("dup2 failed");
+    fd = pipes[1];
+    return 0;
+}
+
+// the first line the compiler prints when called with option as the user
+static string compiler_output(const string &compiler, const char *option, uid_t user_uid,
+                              gid_t user_gid)
+{
+    int pipes[2];
+
+    if (pipe(pipes) < 0) {
+        log_perror("pipe");
+        return string();
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork");
+        close(pipes[0]);
+        close(pipes[1]);
+        return string();
     }
 
-    if ((-1 == close(pipes[1])) && (errno != EBADF)){
-        log_perror("close failed");
+    if (pid == 0) {
+#ifndef HAVE_LIBCAP_NG
+        if (getuid() != user_uid || geteuid() != user_uid
+                || getgid() != user_gid || getegid() != user_gid) {
+            if (setgroups(0, NULL) < 0 || setgid(user_gid) < 0
+                    || (!geteuid() && setuid(user_uid) < 0)) {
+                _exit(143);
+            }
+        }
+#endif
+        int null = open("/dev/null", O_WRONLY);
+
+        if (null >= 0) {
+            dup2(null, STDERR_FILENO);
+        }
+
+        // first, the read end may be on stdout if that was closed
+        close(pipes[0]);
+        dup2(pipes[1], STDOUT_FILENO);
+        execl(compiler.c_str(), compiler.c_str(), option, (char *) NULL);
+        _exit(1);
+    }
+
+    close(pipes[1]);
+    string output;
+    char buf[1024];
+    ssize_t bytes;
+
+    while ((bytes = read(pipes[0], buf, sizeof(buf))) != 0) {
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            break;
+        }
+
+        output.append(buf, bytes);
+    }
+
+    close(pipes[0]);
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return string();
+    }
+
+    return output.substr(0, output.find('\n'));
+}
+
+static string toolchain_identity(const string &compiler, uid_t user_uid, gid_t user_gid)
+{
+    // "gcc (Debian 12.2.0-14) 12.2.0" or "Debian clang version 14.0.6", with the vendor's
+    // package version, which tells builds of the same version apart
+    string version = compiler_output(compiler, "--version", user_uid, user_gid);
+    string target = compiler_output(compiler, "-dumpmachine", user_uid, user_gid);
+
+    if (version.empty() || target.empty()) {
+        log_warning() << "cannot determine version and target of " << compiler << endl;
+        return string();
+    }
+
+    // GCC starts with the name it was called by, which is another one for a cross compiler
+    string::size_type paren = version.find(" (");
+
+    if (version.find("clang") == string::npos && paren != string::npos) {
+        version = "gcc" + version.substr(paren);
+    }
+
+    // x86_64-pc-linux-gnu and x86_64-linux-gnu generate the same code, drop the vendor
+    vector<string> parts;
+    string::size_type start = 0;
+
+    for (string::size_type dash; (dash = target.find('-', start)) != string::npos; start = dash + 1) {
+        parts.push_back(target.substr(start, dash - start));
+    }
+
+    parts.push_back(target.substr(start));
+
+    if (parts.size() == 4) {
+        target = parts[0] + "-" + parts[2] + "-" + parts[3];
+    }
+
+    return version + " " + target;
+}
+
+// Returns fd for icecc-create-env output
+int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
+                     const std::string &compiler, const list<string> &extrafiles,
+                     const std::string &compression)
+{
+    int fd;
+    pid_t pid = fork_native_env_child(basedir, user_uid, user_gid, fd);
+
+    if (pid < 0) {
+        return 0;
+    }
+
+    if (pid) {
+        return fd;
+    }
+
+    // icecc-create-env writes the name of the tarball to fd 5, which is passed on together
+    // with the identity of the toolchain once it is done
+    int names[2];
+
+    if (fd == 5) {
+        fd = dup(fd);
+    }
+
+    if (pipe(names) == -1) {
+        log_perror("pipe");
+        _exit(1);
+    }
+
+    if (names[0] == 5) {
+        names[0] = dup(names[0]);
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(names[0], F_SETFD, FD_CLOEXEC);
+
+    if (names[1] != 5) {
+        if (-1 == dup2(names[1], 5)){
+            log_perror("dup2 failed");
+        }
+
+        if ((-1 == close(names[1])) && (errno != EBADF)){
+            log_perror("close failed");
+        }
     }
 
     if ((-1 == close(STDOUT_FILENO)) && (errno != EBADF)){ // hide output from icecc-create-env
@@ -327,198 +507,966 @@ int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
         free( (void*) argv[ i ] );
     delete[] argv;
 
-    _exit(0);
-}
-
-size_t finish_create_env(int pipe, const string &basedir, string &native_environment)
-{
-// We don't care about waitpid() , icecc-create-env prints the name of the tarball as the very last
-// action before exit, so if there's something in the pipe, just block on it until it closes.
-
-    char buf[1024];
-    buf[0] = '\0';
+    close(5);
+    char name[1024];
+    ssize_t bytes;
 
-    while (read(pipe, buf, 1023) < 0 && errno == EINTR) {}
+    while ((bytes = read(names[0], name, sizeof(name) - 1)) < 0 && errno == EINTR) {}
 
-    if (char *nl = strchr(buf, '\n')) {
-        *nl = '\0';
+    if (bytes <= 0) {
+        _exit(1);
     }
 
-    if( buf[0] == '\0') {
-        trace() << "native_environment creation failed" << endl;
-        return 0;
-    }
+    name[bytes] = '\0';
+    string result = string(name, strcspn(name, "\n")) + "\n"
+                    + toolchain_identity(compiler, user_uid, user_gid) + "\n";
+    ignore_result(write(fd, result.c_str(), result.size()));
+    _exit(0);
+}
 
-    string nativedir = basedir + "/native/";
-    native_environment = nativedir + buf;
+static string md5_hex(md5_state_t *state)
+{
+    md5_byte_t digest[16];
+    char hex[33];
+    md5_finish(state, digest);
 
-    if ((-1 == close(pipe)) && (errno != EBADF)){
-        log_perror("close failed");
+    for (int i = 0; i < 16; ++i) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
     }
-    trace() << "native_environment " << native_environment << endl;
-    struct stat st;
 
-    if (!native_environment.empty()
-        && (stat(native_environment.c_str(), &st) == 0)) {
-        return st.st_size;
-    }
+    return hex;
+}
 
-    if (-1 == rmdir(nativedir.c_str())){
-        log_perror("rmdir failed");
+/* Whether a native environment holds what its name says. icecc-create-env
+   names it by the MD5 sum of the "<md5> /<path>" lines of its files, in
+   the order they are archived. */
+static bool verify_native_env(const string &file, const string &name)
+{
+    if (name.size() < 36 || name.find_first_not_of("0123456789abcdef") != 32
+            || name.compare(32, 4, ".tar") != 0) {
+        log_error() << "native environment " << name << " is not named by its contents" << endl;
+        return false;
     }
-    return 0;
-}
 
+    struct archive *a = archive_read_new();
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
 
+    if (archive_read_open_filename(a, file.c_str(), 64 * 1024) != ARCHIVE_OK) {
+        log_error() << "cannot read " << file << ": " << archive_error_string(a) << endl;
+        archive_read_free(a);
+        return false;
+    }
 
-static int copy_data(struct archive *ar, struct archive *aw)
-{
+    map<string, string> sums; // for hard links, which are archived without data
+    string listing;
+    struct archive_entry *entry;
     int r;
-    const void *buff;
-    size_t size;
 
+    while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
+        string path = archive_entry_pathname(entry);
+        string sum;
+
+        if (archive_entry_hardlink(entry)) {
+            sum = sums[archive_entry_hardlink(entry)];
+        } else if (archive_entry_filetype(entry) == AE_IFREG) {
+            md5_state_t state;
+            const void *buffer;
+            size_t size;
 #if ARCHIVE_VERSION_NUMBER >= 3000000
-    int64_t offset;
+            int64_t offset;
 #else
-    off_t offset;
+            off_t offset;
 #endif
-    for(;;){
-        r = archive_read_data_block(ar, &buff, &size, &offset);
-        if (r == ARCHIVE_EOF){
-            return (ARCHIVE_OK);
-        }
-        r= archive_write_data_block(aw, buff, size, offset);
-        if(r != ARCHIVE_OK){
-            trace() << "copy_data(): Error after write: "<< archive_error_string(aw)<<endl;
-            return (r);
-        }
-    }
-}
+            md5_init(&state);
 
-pid_t start_install_environment(const std::string &basename, const std::string &target,
-                                const std::string &name, MsgChannel *c,
-                                int &pipe_to_child, int &pipe_from_child, FileChunkMsg *&fmsg,
-                                uid_t user_uid, gid_t user_gid, int extract_priority)
-{
-    log_info() << "start_install_environment: " << basename << " target "<<target << " Name: " << name << endl;
-    if (!name.size()) {
-        log_error() << "illegal name for environment " << name << endl;
-        return 0;
-    }
+            while ((r = archive_read_data_block(a, &buffer, &size, &offset)) == ARCHIVE_OK) {
+                md5_append(&state, static_cast<const md5_byte_t *>(buffer), size);
+            }
 
-    for (string::size_type i = 0; i < name.size(); ++i) {
-        if (isascii(name[i]) && !isspace(name[i]) && name[i] != '/' && isprint(name[i])) {
+            if (r != ARCHIVE_EOF) {
+                break;
+            }
+
+            sum = md5_hex(&state);
+        } else {
             continue;
         }
 
-        log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
-        return 0;
+        sums[path] = sum;
+        listing += sum + " /" + path + "\n";
     }
 
-    string dirname = basename + "/target=" + target;
-    Msg *msg = c->get_msg(30);
-
-    if (!msg || msg->type != M_FILE_CHUNK) {
-        trace() << "Expected first file chunk\n";
-        return 0;
+    if (r != ARCHIVE_EOF) {
+        log_error() << "cannot read " << file << ": " << archive_error_string(a) << endl;
+        archive_read_free(a);
+        return false;
     }
 
-    fmsg = dynamic_cast<FileChunkMsg*>(msg);
+    archive_read_free(a);
+    md5_state_t state;
+    md5_init(&state);
+    md5_append(&state, reinterpret_cast<const md5_byte_t *>(listing.data()), listing.size());
 
-    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
-        log_perror("mkdir target") << "\t" << dirname << endl;
-        return 0;
+    if (md5_hex(&state) != name.substr(0, 32)) {
+        log_error() << "native environment " << name << " does not match its name" << endl;
+        return false;
     }
 
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod target") << "\t" << dirname << endl;
-        return 0;
-    }
+    return true;
+}
 
-    dirname = dirname + "/" + name;
+// Returns fd for the name of the downloaded tarball, like start_create_env().
+int start_fetch_env(const string &basedir, uid_t user_uid, gid_t user_gid,
+                    const string &host, unsigned int port, int host_protocol,
+                    const string &fingerprint, const string &platform, const string &name,
+                    const string &compiler)
+{
+    int fd;
+    pid_t pid = fork_native_env_child(basedir, user_uid, user_gid, fd);
 
-    if (mkdir(dirname.c_str(), 0770)) {
-        log_perror("mkdir name") << "\t" << dirname << endl;
+    if (pid < 0) {
         return 0;
     }
 
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod name") << "\t" << dirname << endl;
-        return 0;
+    if (pid) {
+        return fd;
     }
 
-    int fds_in[2]; // for receiving data
-    int fds_out[2]; // for sending out final status
-
-    if (pipe(fds_in) == -1 || pipe(fds_out) == -1) {
-        log_perror("start_install_environment: pipe creation failed for receiving environment");
-        return 0;
-    }
+    MsgChannel *c = 0;
+    Msg *msg = 0;
 
-    flush_debug();
-    pid_t pid = fork();
+    // the normal protocol setup if the peer did not agree to the one assumed
+    for (int attempt = 0; !msg && attempt < 2; ++attempt) {
+        delete c;
+        c = Service::createChannel(host, port, 10, attempt ? 0 : host_protocol);
 
-    if (pid == -1) {
-        log_perror("start_install_environment - fork()");
-        return 0;
-    }
-    if (pid) {
-        //Runs only on parent(PID value is 0 in child and PID id on parent)
-        trace() << "Created fork for receiving environment on pid " << pid << endl;
+        if (c) {
+            c->setTrafficClass(MsgChannel::BulkTraffic);
+        }
 
-        if ((-1 == close(fds_in[0])) && (errno != EBADF)){
-            log_perror("Failed to close read end of pipe");
+        if (!c || !c->send_msg(EnvFingerprintMsg(fingerprint, platform, name))) {
+            log_error() << "cannot reach " << host << ":" << port << " for environment " << name << endl;
+            _exit(1);
         }
-        if ((-1 == close(fds_out[1])) && (errno != EBADF)){
-            log_perror("Failed to close write end of pipe");
+
+        msg = c->get_msg(60);
+
+        if (!c->assumed_protocol_failed()) {
+            break;
         }
-        pipe_to_child = fds_in[1]; //Set write end of pipe to pass to parent thread
-        pipe_from_child = fds_out[0]; //Set write end of pipe to pass to parent thread
-        fcntl(pipe_to_child, F_SETFD, FD_CLOEXEC);
-        fcntl(pipe_from_child, F_SETFD, FD_CLOEXEC);
+    }
 
-        return pid;
+    if (!msg || msg->type != M_TRANFER_ENV) {
+        log_warning() << host << " does not have environment " << name << endl;
+        _exit(1);
     }
 
-    // else
-#ifndef HAVE_LIBCAP_NG
+    delete msg;
+    string tmpfile = name + ".tmp";
+    int out = open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    if (setgroups(0, NULL) < 0) {
-        log_perror("setgroups fails");
-        _exit(143);
+    if (out < 0) {
+        log_perror("open") << "\t" << tmpfile << endl;
+        _exit(1);
     }
 
-    if (setgid(user_gid) < 0) {
-        log_perror("setgid fails");
-        _exit(143);
-    }
+    while ((msg = c->get_msg(60)) && msg->type == M_FILE_CHUNK) {
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
 
-    if (!geteuid() && setuid(user_uid) < 0) {
-        log_perror("setuid fails");
-        _exit(142);
+        if (!write_all(out, fcmsg->buffer, fcmsg->len)) {
+            log_perror("write") << "\t" << tmpfile << endl;
+            unlink(tmpfile.c_str());
+            _exit(1);
+        }
+
+        delete msg;
     }
 
-#endif
+    if (!msg || msg->type != M_END || close(out) != 0 || !verify_native_env(tmpfile, name)
+            || rename(tmpfile.c_str(), name.c_str()) != 0) {
+        log_error() << "fetching environment " << name << " from " << host << " failed" << endl;
+        unlink(tmpfile.c_str());
+        _exit(1);
+    }
 
-    // reset SIGPIPE and SIGCHILD handler so that tar
-    // isn't confused when gzip/bzip2 aborts
-    signal(SIGCHLD, SIG_DFL);
-    signal(SIGPIPE, SIG_DFL);
+    string result = name + "\n";
 
-    if ((-1 == close(fds_in[1])) && (errno != EBADF)){
-        log_perror("Failed to close write end of pipe");
-    }
-    if ((-1 == close(fds_out[0])) && (errno != EBADF)){
-        log_perror("Failed to close write end of pipe");
+    if (!compiler.empty()) {
+        result += toolchain_identity(compiler, user_uid, user_gid) + "\n";
     }
 
-    int niceval = nice(extract_priority);
+    ignore_result(write(fd, result.c_str(), result.size()));
+    _exit(0);
+}
+
+/* Closes the log and every descriptor inherited from the daemon but keep and keep2,
+   for a child that outlives the work it was forked for. It must not keep the
+   daemon's connections and listening sockets open, an upgraded or restarted
+   daemon could not take them over.  */
+static void close_daemon_fds(int keep, int keep2 = -1)
+{
+    close_debug();
+    long max_fd = sysconf(_SC_OPEN_MAX);
+
+    for (int fd = 3; fd < max_fd; ++fd) {
+        if (fd != keep && fd != keep2) {
+            close(fd);
+        }
+    }
+}
+
+pid_t start_send_env(MsgChannel *c, const string &file, const string &platform,
+                     const string &name)
+{
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    int fd = open(file.c_str(), O_RDONLY);
+    close_daemon_fds(c->fd, fd);
+
+    if (fd < 0 || !c->send_msg(EnvTransferMsg(platform, name))) {
+        _exit(1);
+    }
+
+    vector<unsigned char> buffer(c->bulkChunkSize());
+
+    for (;;) {
+        ssize_t bytes = read(fd, &buffer[0], buffer.size());
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            _exit(1);
+        }
+
+        if (bytes == 0) {
+            break;
+        }
+
+        if (!c->send_msg(FileChunkMsg(&buffer[0], bytes))) {
+            _exit(1);
+        }
+    }
+
+    c->send_msg(EndMsg());
+    _exit(0);
+}
+
+pid_t start_upload_env(const string &file, const string &target, const string &name,
+                       const string &host, unsigned int port, int host_protocol,
+                       uid_t user_uid, gid_t user_gid, unsigned int limit_kbps,
+                       Traffic *traffic, int &fd)
+{
+    flush_debug();
+    int pipes[2];
+
+    if (pipe(pipes) == -1) {
+        log_perror("pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("failed to fork");
+        close(pipes[0]);
+        close(pipes[1]);
+        return -1;
+    }
+
+    if (pid) {
+        close(pipes[1]);
+        fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+        fd = pipes[0];
+        return pid;
+    }
+
+    close(pipes[0]);
+    unsigned char result = EnvUploadMsg::TransferFailed;
+
+#ifndef HAVE_LIBCAP_NG
+    // the file was named by a client, only send it if anybody may read it
+    if (getuid() != user_uid || geteuid() != user_uid
+            || getgid() != user_gid || getegid() != user_gid) {
+        if (setgroups(0, NULL) < 0 || setgid(user_gid) < 0
+                || (!geteuid() && setuid(user_uid) < 0)) {
+            log_perror("dropping privileges failed");
+            ignore_result(write(pipes[1], &result, 1));
+            _exit(1);
+        }
+    }
+#endif
+
+    int env_fd = open(file.c_str(), O_RDONLY);
+
+    if (env_fd < 0) {
+        log_perror("open") << "\t" << file << endl;
+        result = EnvUploadMsg::Declined;
+        ignore_result(write(pipes[1], &result, 1));
+        _exit(1);
+    }
+
+    BulkBucket bucket(limit_kbps, traffic);
+
+    // a compile server keeping partial transfers lets a new connection continue
+    // after the blocks it already has
+    for (int attempt = 0;; ++attempt) {
+        // don't trust what we heard about the remote's protocol again if it failed
+        MsgChannel *c = Service::createChannel(host, port, 10, attempt ? 0 : host_protocol);
+
+        if (c && !IS_PROTOCOL_31(c)) {
+            // the installation would be aborted when this connection closes
+            result = EnvUploadMsg::Declined;
+            break;
+        }
+
+        if (c) {
+            c->setTrafficClass(MsgChannel::BulkTraffic);
+        }
+
+        if (c && c->send_msg(EnvTransferMsg(target, name))
+                && lseek(env_fd, 0, SEEK_SET) == 0
+                && send_environment(c, env_fd, &bucket) && c->send_msg(EndMsg())) {
+            Msg *msg = 0;
+            result = EnvUploadMsg::VerifyError;
+
+            if (c->send_msg(VerifyEnvMsg(target, name))) {
+                msg = c->get_msg(60);
+            }
+
+            if (msg && msg->type == M_VERIFY_ENV_RESULT) {
+                result = static_cast<VerifyEnvResultMsg *>(msg)->ok ? EnvUploadMsg::Ok
+                                                                     : EnvUploadMsg::VerifyFailed;
+            }
+
+            break;
+        }
+
+        bool resumable = c && IS_PROTOCOL_48(c);
+        delete c;
+
+        if (!resumable || attempt == 2) {
+            log_error() << "uploading " << name << " to " << host << ":" << port << " failed" << endl;
+            break;
+        }
+
+        log_warning() << "uploading " << name << " to " << host << " interrupted, retrying" << endl;
+        sleep(1);
+    }
+
+    ignore_result(write(pipes[1], &result, 1));
+    _exit(result == EnvUploadMsg::Ok ? 0 : 1);
+}
+
+#ifdef HAVE_ELF_H
+template<typename Ehdr, typename Phdr>
+static string read_build_id(int fd)
+{
+    Ehdr ehdr;
+
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != (ssize_t) sizeof(ehdr)
+            || ehdr.e_phentsize != sizeof(Phdr)) {
+        return string();
+    }
+
+    for (size_t i = 0; i < ehdr.e_phnum; ++i) {
+        Phdr phdr;
+
+        if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) != (ssize_t) sizeof(phdr)) {
+            return string();
+        }
+
+        if (phdr.p_type != PT_NOTE || phdr.p_filesz > 64 * 1024) {
+            continue;
+        }
+
+        vector<char> notes(phdr.p_filesz);
+        size_t align = phdr.p_align == 8 ? 8 : 4;
+
+        if (notes.empty()
+                || pread(fd, &notes[0], notes.size(), phdr.p_offset) != (ssize_t) notes.size()) {
+            continue;
+        }
+
+        for (size_t pos = 0; pos + sizeof(Elf32_Nhdr) <= notes.size();) {
+            // the note header is the same for 32 and 64 bits
+            Elf32_Nhdr nhdr;
+            memcpy(&nhdr, &notes[pos], sizeof(nhdr));
+            size_t name = pos + sizeof(nhdr);
+            size_t desc = name + ((nhdr.n_namesz + align - 1) & ~(align - 1));
+
+            if (desc + nhdr.n_descsz > notes.size()) {
+                break;
+            }
+
+            if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4
+                    && memcmp(&notes[name], "GNU", 4) == 0) {
+                return string(&notes[desc], nhdr.n_descsz);
+            }
+
+            pos = desc + ((nhdr.n_descsz + align - 1) & ~(align - 1));
+        }
+    }
+
+    return string();
+}
+#endif
+
+// The build-id note the linker put into an ELF binary of our byte order, empty if there is none.
+static string build_id(int fd)
+{
+#ifdef HAVE_ELF_H
+    unsigned char ident[EI_NIDENT];
+    const unsigned short one = 1;
+    const unsigned char data = *reinterpret_cast<const unsigned char *>(&one) ? ELFDATA2LSB
+                                                                             : ELFDATA2MSB;
+
+    if (pread(fd, ident, sizeof(ident), 0) != (ssize_t) sizeof(ident)
+            || memcmp(ident, ELFMAG, SELFMAG) != 0 || ident[EI_DATA] != data) {
+        return string();
+    }
+
+    if (ident[EI_CLASS] == ELFCLASS64) {
+        return read_build_id<Elf64_Ehdr, Elf64_Phdr>(fd);
+    }
+
+    if (ident[EI_CLASS] == ELFCLASS32) {
+        return read_build_id<Elf32_Ehdr, Elf32_Phdr>(fd);
+    }
+#else
+    (void)fd;
+#endif
+    return string();
+}
+
+string toolchain_fingerprint(const list<string> &files, const string &compression)
+{
+    // This runs when a client asks for the environment, so the files are not read as a whole.
+    // A binary is known by its build-id, other files by size and modification time, which
+    // stay the same wherever the package of the compiler is installed.
+    string data = compression;
+
+    for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        int fd = open(it->c_str(), O_RDONLY);
+        struct stat st;
+
+        if (fd < 0) {
+            return string();
+        }
+
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return string();
+        }
+
+        string id = build_id(fd);
+        close(fd);
+
+        data += '\0';
+        data += *it;
+        data += '\0';
+        data += toString(st.st_size);
+        data += '\0';
+        data += id.empty() ? toString(st.st_mtime) : id;
+    }
+
+    EnvHash hash;
+    hash.update(data);
+    return hash.str();
+}
+
+size_t finish_create_env(int pipe, const string &basedir, string &native_environment,
+                         string &identity)
+{
+// We don't care about waitpid() , icecc-create-env prints the name of the tarball as the very last
+// action before exit, so if there's something in the pipe, just block on it until it closes.
+
+    char buf[1024];
+    buf[0] = '\0';
+
+    while (read(pipe, buf, 1023) < 0 && errno == EINTR) {}
+
+    // the name, followed by the identity of the toolchain if it is known
+    if (char *nl = strchr(buf, '\n')) {
+        *nl = '\0';
+        identity = string(nl + 1, strcspn(nl + 1, "\n"));
+    }
+
+    if( buf[0] == '\0') {
+        trace() << "native_environment creation failed" << endl;
+        return 0;
+    }
+
+    string nativedir = basedir + "/native/";
+    native_environment = nativedir + buf;
+
+    if ((-1 == close(pipe)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+    trace() << "native_environment " << native_environment << endl;
+    struct stat st;
+
+    if (!native_environment.empty()
+        && (stat(native_environment.c_str(), &st) == 0)) {
+        return st.st_size;
+    }
+
+    if (-1 == rmdir(nativedir.c_str())){
+        log_perror("rmdir failed");
+    }
+    return 0;
+}
+
+
+
+static int copy_data(struct archive *ar, struct archive *aw)
+{
+    int r;
+    const void *buff;
+    size_t size;
+
+#if ARCHIVE_VERSION_NUMBER >= 3000000
+    int64_t offset;
+#else
+    off_t offset;
+#endif
+    for(;;){
+        r = archive_read_data_block(ar, &buff, &size, &offset);
+        if (r == ARCHIVE_EOF){
+            return (ARCHIVE_OK);
+        }
+        r= archive_write_data_block(aw, buff, size, offset);
+        if(r != ARCHIVE_OK){
+            trace() << "copy_data(): Error after write: "<< archive_error_string(aw)<<endl;
+            return (r);
+        }
+    }
+}
+
+PartialEnvironment::PartialEnvironment(const string &basedir, const string &target,
+                                       const string &name)
+    : fd(-1)
+    , verified_blocks(0)
+    , pending(0)
+    , last_block(false)
+{
+    string dir = target;
+    replace(dir.begin(), dir.end(), '/', '_');
+
+    if (name.find('/') == string::npos) {
+        path = basedir + "/partial/" + dir + "/" + name;
+    }
+}
+
+PartialEnvironment::~PartialEnvironment()
+{
+    flush();
+}
+
+bool PartialEnvironment::open(uid_t user_uid, gid_t user_gid)
+{
+    if (path.empty() || path[path.rfind('/') + 1] == '.' || path.find("/partial/.") != string::npos) {
+        log_error() << "illegal name for environment " << path << endl;
+        return false;
+    }
+
+    string targetdir = path.substr(0, path.rfind('/'));
+    string partialdir = targetdir.substr(0, targetdir.rfind('/'));
+
+    if ((mkdir(partialdir.c_str(), 0755) && errno != EEXIST)
+            || (mkdir(targetdir.c_str(), 0755) && errno != EEXIST)) {
+        log_perror("mkdir") << "\t" << targetdir << endl;
+        return false;
+    }
+
+    unsigned int blocks = 0;
+    FILE *state = fopen((path + ".blocks").c_str(), "r");
+
+    if (state) {
+        if (fscanf(state, "%u", &blocks) != 1) {
+            blocks = 0;
+        }
+
+        fclose(state);
+    }
+
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0 || st.st_size < off_t(blocks) * off_t(ENV_BLOCK_SIZE)) {
+        blocks = 0;
+    }
+
+    // the unpacking child reads it as the user
+    int file_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+
+    if (file_fd < 0 || fchown(file_fd, user_uid, user_gid) != 0
+            || ftruncate(file_fd, off_t(blocks) * off_t(ENV_BLOCK_SIZE)) != 0
+            || lseek(file_fd, 0, SEEK_END) < 0) {
+        log_perror("open partial environment") << "\t" << path << endl;
+
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+
+        return false;
+    }
+
+    verified_blocks = blocks;
+    return start_writer(file_fd);
+}
+
+/* The file is written by a child, the daemon only passes the data on over a
+   socket, so that a slow disk does not hold up everything else it does. The
+   child answers with one byte for success once the daemon closed its side
+   and everything is written. */
+bool PartialEnvironment::start_writer(int file_fd)
+{
+    int sockets[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        log_perror("socketpair");
+        close(file_fd);
+        return false;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("failed to fork");
+        close(sockets[0]);
+        close(sockets[1]);
+        close(file_fd);
+        return false;
+    }
+
+    if (pid) {
+        close(sockets[1]);
+        close(file_fd);
+        fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+        // a whole block may be on its way to the disk
+        int size = ENV_BLOCK_SIZE;
+        setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        fd = sockets[0];
+        return true;
+    }
+
+    close_daemon_fds(sockets[1], file_fd);
+    vector<unsigned char> buffer(256 * 1024);
+    unsigned char result = 0;
+
+    for (;;) {
+        ssize_t bytes = read(sockets[1], &buffer[0], buffer.size());
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            break;
+        }
+
+        if (!write_all(file_fd, &buffer[0], bytes)) {
+            result = 1;
+            break;
+        }
+    }
+
+    if (close(file_fd) != 0) {
+        result = 1;
+    }
+
+    ignore_result(write(sockets[1], &result, 1));
+    _exit(result);
+}
+
+bool PartialEnvironment::flush()
+{
+    if (fd < 0) {
+        return true;
+    }
+
+    unsigned char result = 1;
+    shutdown(fd, SHUT_WR);
+
+    while (read(fd, &result, 1) < 0 && errno == EINTR) {}
+
+    close(fd);
+    fd = -1;
+
+    if (result != 0) {
+        log_error() << "writing " << path << " failed" << endl;
+    }
+
+    return result == 0;
+}
+
+bool PartialEnvironment::add(const unsigned char *data, size_t len)
+{
+    if (last_block || complete() || pending + len > ENV_BLOCK_SIZE) {
+        log_error() << "environment data after the end of its block" << endl;
+        return false;
+    }
+
+    if (!write_all(fd, data, len)) {
+        log_perror("write") << "\t" << path << endl;
+        return false;
+    }
+
+    block_hash.update(data, len);
+    pending += len;
+    return true;
+}
+
+bool PartialEnvironment::verify(const EnvHashMsg &msg)
+{
+    if (msg.block == EnvHashMsg::ARCHIVE) {
+        if (pending) {
+            log_error() << "environment ends in an unverified block" << endl;
+            return false;
+        }
+
+        hash = msg.hash;
+        return true;
+    }
+
+    if (msg.block != verified_blocks || last_block || !pending || block_hash.str() != msg.hash) {
+        log_error() << "block " << msg.block << " of environment " << path
+                    << " is corrupt" << endl;
+        return false;
+    }
+
+    if (pending < ENV_BLOCK_SIZE) {
+        last_block = true;
+    } else {
+        ++verified_blocks;
+
+        if (!write_state()) {
+            return false;
+        }
+    }
+
+    pending = 0;
+    block_hash = EnvHash();
+    return true;
+}
+
+bool PartialEnvironment::write_state()
+{
+    string tmp = path + ".blocks.tmp";
+    FILE *state = fopen(tmp.c_str(), "w");
+
+    if (!state || fprintf(state, "%u\n", verified_blocks) < 0 || fclose(state) != 0
+            || rename(tmp.c_str(), (path + ".blocks").c_str()) != 0) {
+        log_perror("write") << "\t" << tmp << endl;
+        return false;
+    }
+
+    return true;
+}
+
+void PartialEnvironment::remove()
+{
+    flush();
+    unlink(path.c_str());
+    unlink((path + ".blocks").c_str());
+}
+
+void expire_partial_environments(const string &basedir, time_t max_age, size_t max_size,
+                                 const set<string> &receiving)
+{
+    string partialdir = basedir + "/partial";
+    DIR *dir = opendir(partialdir.c_str());
+
+    if (!dir) {
+        return;
+    }
+
+    time_t now = time(0);
+    size_t total = 0;
+    // the files that may go if they are too many, oldest first
+    multimap<time_t, pair<string, size_t> > removable;
+
+    while (struct dirent *target_ent = readdir(dir)) {
+        string targetdir = partialdir + "/" + target_ent->d_name;
+
+        if (target_ent->d_name[0] == '.') {
+            continue;
+        }
+
+        DIR *files = opendir(targetdir.c_str());
+
+        if (!files) {
+            continue;
+        }
+
+        while (struct dirent *ent = readdir(files)) {
+            string file = targetdir + "/" + ent->d_name;
+            struct stat st;
+
+            if (ent->d_name[0] == '.' || stat(file.c_str(), &st) != 0
+                    || receiving.count(file.substr(0, file.find(".blocks")))) {
+                continue;
+            }
+
+            if (now - st.st_mtime >= max_age) {
+                trace() << "removing abandoned partial environment " << file << endl;
+                unlink(file.c_str());
+                continue;
+            }
+
+            total += st.st_size;
+
+            if (file.find(".blocks") == string::npos) {
+                removable.insert(make_pair(st.st_mtime, make_pair(file, size_t(st.st_size))));
+            }
+        }
+
+        closedir(files);
+    }
+
+    closedir(dir);
+
+    for (multimap<time_t, pair<string, size_t> >::const_iterator it = removable.begin();
+            it != removable.end() && total > max_size; ++it) {
+        trace() << "removing partial environment " << it->second.first
+                << " to keep the cache size" << endl;
+        unlink(it->second.first.c_str());
+        unlink((it->second.first + ".blocks").c_str());
+        total -= it->second.second;
+    }
+}
+
+// Checks the name of an environment and creates the directory it is unpacked to.
+static bool create_environment_dir(const string &basename, const string &target,
+                                   const string &name, uid_t user_uid, gid_t user_gid,
+                                   string &dirname)
+{
+    if (!name.size()) {
+        log_error() << "illegal name for environment " << name << endl;
+        return false;
+    }
+
+    for (string::size_type i = 0; i < name.size(); ++i) {
+        if (isascii(name[i]) && !isspace(name[i]) && name[i] != '/' && isprint(name[i])) {
+            continue;
+        }
+
+        log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
+        return false;
+    }
+
+    dirname = basename + "/target=" + target;
+
+    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
+        log_perror("mkdir target") << "\t" << dirname << endl;
+        return false;
+    }
+
+    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
+        log_perror("chown,chmod target") << "\t" << dirname << endl;
+        return false;
+    }
+
+    dirname = dirname + "/" + name;
+
+    if (mkdir(dirname.c_str(), 0770)) {
+        log_perror("mkdir name") << "\t" << dirname << endl;
+        return false;
+    }
+
+    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
+        log_perror("chown,chmod name") << "\t" << dirname << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Forks the child unpacking an environment, which runs as the user. The parent gets
+// the end of a pipe the child writes 0 to on success, the child the other one. Returns
+// -1 on errors.
+static pid_t fork_install_child(uid_t user_uid, gid_t user_gid, int extract_priority,
+                                int &pipe_from_child, int &result_fd)
+{
+    int fds_out[2]; // for sending out final status
+
+    if (pipe(fds_out) == -1) {
+        log_perror("start_install_environment: pipe creation failed for receiving environment");
+        return -1;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("start_install_environment - fork()");
+        close(fds_out[0]);
+        close(fds_out[1]);
+        return -1;
+    }
+    if (pid) {
+        //Runs only on parent(PID value is 0 in child and PID id on parent)
+        trace() << "Created fork for receiving environment on pid " << pid << endl;
+
+        if ((-1 == close(fds_out[1])) && (errno != EBADF)){
+            log_perror("Failed to close write end of pipe");
+        }
+        pipe_from_child = fds_out[0]; //Set write end of pipe to pass to parent thread
+        fcntl(pipe_from_child, F_SETFD, FD_CLOEXEC);
+
+        return pid;
+    }
+
+    // else
+#ifndef HAVE_LIBCAP_NG
+
+    if (setgroups(0, NULL) < 0) {
+        log_perror("setgroups fails");
+        _exit(143);
+    }
+
+    if (setgid(user_gid) < 0) {
+        log_perror("setgid fails");
+        _exit(143);
+    }
+
+    if (!geteuid() && setuid(user_uid) < 0) {
+        log_perror("setuid fails");
+        _exit(142);
+    }
+
+#endif
+
+    // reset SIGPIPE and SIGCHILD handler so that tar
+    // isn't confused when gzip/bzip2 aborts
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    if ((-1 == close(fds_out[0])) && (errno != EBADF)){
+        log_perror("Failed to close write end of pipe");
+    }
+
+    int niceval = nice(extract_priority);
     if (-1 == niceval){
         log_warning() << "failed to set nice value: " << strerror(errno) << endl;
     }
 
+    result_fd = fds_out[1];
+    return 0;
+}
+
+// Unpacks the archive read by a to dirname, in the child.
+static void extract_environment(struct archive *a, const string &dirname, int result_fd)
+{
     /* libarchive stream reader */
-    struct archive *a;
     struct archive *ext;
     struct archive_entry *entry;
     int flags;
@@ -528,18 +1476,10 @@ pid_t start_install_environment(const std::string &basename, const std::string &
     flags |= ARCHIVE_EXTRACT_ACL;
     flags |= ARCHIVE_EXTRACT_FFLAGS;
 
-    a=archive_read_new();
-    archive_read_support_format_all(a);
-    archive_read_support_filter_all(a);
     ext = archive_write_disk_new();
     archive_write_disk_set_options(ext, flags);
     archive_write_disk_set_standard_lookup(ext);
 
-    if(archive_read_open_fd(a, fds_in[0], fmsg->len) != ARCHIVE_OK){
-        log_error() << "start_install_environment: archive_read_open_fd() failed"<< endl;
-        _exit(1);
-    }
-
     for(;;){
         int r = archive_read_next_header(a, &entry);
         if (r == ARCHIVE_EOF) {
@@ -578,14 +1518,175 @@ pid_t start_install_environment(const std::string &basename, const std::string &
 
     // Tell our parent that we have successfully finished.
     char resultByte = 0;
-    ignore_result(write(fds_out[1], &resultByte, 1));
+    ignore_result(write(result_fd, &resultByte, 1));
 
     _exit(0);
 }
 
+pid_t start_install_environment(const std::string &basename, const std::string &target,
+                                const std::string &name, MsgChannel *c,
+                                int &pipe_to_child, int &pipe_from_child, FileChunkMsg *&fmsg,
+                                uid_t user_uid, gid_t user_gid, int extract_priority)
+{
+    log_info() << "start_install_environment: " << basename << " target "<<target << " Name: " << name << endl;
+    string dirname;
+    Msg *msg = c->get_msg(30);
+
+    if (!msg || msg->type != M_FILE_CHUNK) {
+        trace() << "Expected first file chunk\n";
+        return 0;
+    }
+
+    fmsg = dynamic_cast<FileChunkMsg*>(msg);
+
+    if (!create_environment_dir(basename, target, name, user_uid, user_gid, dirname)) {
+        return 0;
+    }
+
+    int fds_in[2]; // for receiving data
+
+    if (pipe(fds_in) == -1) {
+        log_perror("start_install_environment: pipe creation failed for receiving environment");
+        return 0;
+    }
+
+    int result_fd;
+    pid_t pid = fork_install_child(user_uid, user_gid, extract_priority, pipe_from_child, result_fd);
+
+    if (pid < 0) {
+        close(fds_in[0]);
+        close(fds_in[1]);
+        return 0;
+    }
+
+    if (pid) {
+        if ((-1 == close(fds_in[0])) && (errno != EBADF)){
+            log_perror("Failed to close read end of pipe");
+        }
+        pipe_to_child = fds_in[1]; //Set write end of pipe to pass to parent thread
+        fcntl(pipe_to_child, F_SETFD, FD_CLOEXEC);
+        return pid;
+    }
+
+    if ((-1 == close(fds_in[1])) && (errno != EBADF)){
+        log_perror("Failed to close write end of pipe");
+    }
+
+    struct archive *a = archive_read_new();
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+
+    if(archive_read_open_fd(a, fds_in[0], fmsg->len) != ARCHIVE_OK){
+        log_error() << "start_install_environment: archive_read_open_fd() failed"<< endl;
+        _exit(1);
+    }
+
+    extract_environment(a, dirname, result_fd);
+    return 0; // not reached
+}
+
+pid_t start_install_environment(const string &basename, const string &target,
+                                const string &name, const PartialEnvironment &partial,
+                                int &pipe_from_child, uid_t user_uid, gid_t user_gid,
+                                int extract_priority)
+{
+    log_info() << "start_install_environment: " << basename << " target " << target << " Name: "
+               << name << " from " << partial.file() << endl;
+    string dirname;
+
+    if (!create_environment_dir(basename, target, name, user_uid, user_gid, dirname)) {
+        return 0;
+    }
+
+    int result_fd;
+    pid_t pid = fork_install_child(user_uid, user_gid, extract_priority, pipe_from_child, result_fd);
+
+    if (pid) {
+        return max(pid, 0);
+    }
+
+    // check the whole archive before unpacking any of it
+    int fd = open(partial.file().c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        log_perror("open") << "\t" << partial.file() << endl;
+        _exit(1);
+    }
+
+    EnvHash hash;
+    vector<unsigned char> buffer(256 * 1024);
+    ssize_t bytes;
+
+    while ((bytes = read(fd, &buffer[0], buffer.size())) > 0 || (bytes < 0 && errno == EINTR)) {
+        if (bytes > 0) {
+            hash.update(&buffer[0], bytes);
+        }
+    }
+
+    if (bytes < 0 || hash.str() != partial.archive_hash()) {
+        log_error() << "environment " << name << " does not match its hash" << endl;
+        _exit(1);
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    struct archive *a = archive_read_new();
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+
+    if (archive_read_open_fd(a, fd, buffer.size()) != ARCHIVE_OK) {
+        log_error() << "start_install_environment: archive_read_open_fd() failed" << endl;
+        _exit(1);
+    }
+
+    extract_environment(a, dirname, result_fd);
+    return 0; // not reached
+}
+
+static string scratch_dirname(const string &basename, const string &target)
+{
+    string name = target;
+    replace(name.begin(), name.end(), '/', '_');
+    return basename + "/scratch/" + name;
+}
+
+bool setup_scratch_dir(const string &basename, size_t size, uid_t user_uid, gid_t user_gid)
+{
+#ifdef __linux__
+    // Use a private mount namespace, the mounts then go away together with the daemon
+    // and its children and can't be left behind after a crash.
+    if (unshare(CLONE_NEWNS) != 0 || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+        log_perror("failed to set up mount namespace for the scratch dir");
+        return false;
+    }
+
+    string dirname = basename + "/scratch";
+
+    if (mkdir(dirname.c_str(), 0755) && errno != EEXIST) {
+        log_perror("mkdir in setup_scratch_dir() failed") << "\t" << dirname << endl;
+        return false;
+    }
+
+    ostringstream options;
+    options << "size=" << size << ",mode=0755,uid=" << user_uid << ",gid=" << user_gid;
+
+    if (mount("tmpfs", dirname.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, options.str().c_str()) != 0) {
+        log_perror("failed to mount tmpfs") << "\t" << dirname << endl;
+        return false;
+    }
+
+    return true;
+#else
+    (void)basename;
+    (void)size;
+    (void)user_uid;
+    (void)user_gid;
+    log_error() << "scratch dir is not supported on this platform" << endl;
+    return false;
+#endif
+}
 
 size_t finalize_install_environment(const std::string &basename, const std::string &target,
-                                    uid_t user_uid, gid_t user_gid)
+                                    uid_t user_uid, gid_t user_gid, bool use_scratch)
 {
     string dirname = basename + "/target=" + target;
     errno = 0;
@@ -597,14 +1698,200 @@ size_t finalize_install_environment(const std::string &basename, const std::stri
                     << strerror(errno) << endl;
     }
 
-    return sumup_dir(dirname);
+    size_t res = environment_size(dirname);
+
+#ifdef __linux__
+    if (use_scratch) {
+        // Compile output goes to /tmp, which gets bind-mounted from the scratch tmpfs.
+        // /var/tmp stays on disk for output that doesn't fit there anymore.
+        string spilldir = dirname + "/var/tmp";
+        string scratchdir = scratch_dirname(basename, target);
+
+        if (!mkpath(spilldir) || chown(spilldir.c_str(), user_uid, user_gid)
+                || chmod(spilldir.c_str(), 01775)) {
+            log_perror("failed to set up spill dir") << "\t" << spilldir << endl;
+        } else if ((mkdir(scratchdir.c_str(), 01775) && errno != EEXIST)
+                   || chown(scratchdir.c_str(), user_uid, user_gid)
+                   || chmod(scratchdir.c_str(), 01775)) {
+            log_perror("failed to set up scratch dir") << "\t" << scratchdir << endl;
+        } else if (mount(scratchdir.c_str(), (dirname + "/tmp").c_str(), NULL, MS_BIND, NULL) != 0) {
+            log_perror("failed to bind-mount scratch dir") << "\t" << scratchdir << endl;
+        }
+    }
+#else
+    (void)use_scratch;
+#endif
+
+    return res;
+}
+
+// Collects executables and shared libraries of an environment, i.e. the files
+// that get faulted in by the first compile in it (cc1plus, as, libLLVM.so, ...).
+static void list_toolchain_files(const string &dir, vector<pair<off_t, string> > &files)
+{
+    DIR *envdir = opendir(dir.c_str());
+
+    if (!envdir) {
+        return;
+    }
+
+    struct stat st;
+
+    string tdir = dir + "/";
+
+    for (struct dirent *ent = readdir(envdir); ent; ent = readdir(envdir)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        string path = tdir + ent->d_name;
+
+        if (lstat(path.c_str(), &st)) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            list_toolchain_files(path, files);
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0
+                   && ((st.st_mode & S_IXUSR) || strstr(ent->d_name, ".so") != NULL)) {
+            files.push_back(make_pair(st.st_size, path));
+        }
+    }
+
+    closedir(envdir);
+}
+
+size_t warm_environment(const string &basename, const string &env)
+{
+    size_t res = 0;
+#ifdef HAVE_POSIX_FADVISE
+    vector<pair<off_t, string> > files;
+    list_toolchain_files(basename + "/target=" + env, files);
+
+    for (vector<pair<off_t, string> >::const_iterator it = files.begin(); it != files.end(); ++it) {
+        int fd = open(it->second.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        // This only schedules the readahead, it does not block until the data is read.
+        if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0) {
+            res += it->first;
+        }
+
+        close(fd);
+    }
+#else
+    (void)basename;
+    (void)env;
+#endif
+    return res;
+}
+
+static size_t lock_toolchain_files(const string &basename, const string &env, size_t budget)
+{
+    size_t res = 0;
+#ifdef HAVE_MLOCK
+    vector<pair<off_t, string> > files;
+    list_toolchain_files(basename + "/target=" + env, files);
+    // The biggest files are the compiler itself and its libraries, prefer those.
+    sort(files.rbegin(), files.rend());
+
+    for (vector<pair<off_t, string> >::const_iterator it = files.begin(); it != files.end(); ++it) {
+        size_t size = it->first;
+
+        if (res + size > budget) {
+            continue;
+        }
+
+        int fd = open(it->second.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (addr == MAP_FAILED) {
+            log_perror("mmap failed") << "\t" << it->second << endl;
+            continue;
+        }
+
+        // the mapping stays until the process exits
+        if (mlock(addr, size) != 0) {
+            log_perror("mlock failed") << "\t" << it->second << endl;
+            munmap(addr, size);
+            break;
+        }
+
+        res += size;
+    }
+#else
+    (void)basename;
+    (void)env;
+    (void)budget;
+#endif
+    return res;
+}
+
+pid_t start_lock_environment(const string &basename, const string &env, size_t budget,
+                             int &lock_fd)
+{
+    int sockets[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        log_perror("socketpair()");
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("failed to fork");
+        close(sockets[0]);
+        close(sockets[1]);
+        return 0;
+    }
+
+    if (pid) {
+        close(sockets[1]);
+        // a daemon that is upgraded doesn't pass it on, the child goes away then
+        fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+        lock_fd = sockets[0];
+        return pid;
+    }
+
+    close(sockets[0]);
+    string locked = toString(lock_toolchain_files(basename, env, budget)) + "\n";
+    ignore_result(write(sockets[1], locked.c_str(), locked.size()));
+
+    close_daemon_fds(sockets[1]);
+
+    for (;;) {
+        char buf;
+        ssize_t n = read(sockets[1], &buf, 1);
+
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            _exit(0);
+        }
+    }
 }
 
 size_t remove_environment(const string &basename, const string &env)
 {
     string dirname = basename + "/target=" + env;
 
-    size_t res = sumup_dir(dirname);
+#ifdef __linux__
+    // The scratch dir is not part of the cache size, and rm must not descend into it.
+    if (umount2((dirname + "/tmp").c_str(), MNT_DETACH) == 0) {
+        rmpath(scratch_dirname(basename, env).c_str());
+    }
+#endif
+
+    size_t res = environment_size(dirname);
 
     flush_debug();
     pid_t pid = fork();
@@ -24,17 +24,89 @@
 #define ICECREAM_ENVIRONMENT_H
 
 #include <comm.h>
+#include "envtransfer.h"
 #include <list>
+#include <set>
 #include <string>
 #include <unistd.h>
 
 class MsgChannel;
+struct Traffic;
+
+/* An environment received into a file before unpacking it, so that an interrupted
+   transfer can continue where it stopped and the whole archive can be checked
+   against its hash first (protocol 48). The file and the number of verified
+   blocks in it outlive the connection. */
+class PartialEnvironment
+{
+public:
+    PartialEnvironment(const std::string &basedir, const std::string &target,
+                       const std::string &name);
+    ~PartialEnvironment();
+
+    // opens the file, keeping the blocks verified by an earlier transfer
+    bool open(uid_t user_uid, gid_t user_gid);
+    uint32_t blocks() const {
+        return verified_blocks;
+    }
+    bool add(const unsigned char *data, size_t len);
+    bool verify(const EnvHashMsg &msg);
+    // waits until all data added is in the file, false if writing it failed
+    bool flush();
+    // all data is verified and the hash of the archive known
+    bool complete() const {
+        return !hash.empty();
+    }
+    const std::string &file() const {
+        return path;
+    }
+    const std::string &archive_hash() const {
+        return hash;
+    }
+    void remove();
+
+private:
+    bool start_writer(int file_fd);
+    bool write_state();
+
+    std::string path;
+    int fd; // to the child writing the file
+    uint32_t verified_blocks;
+    size_t pending; // bytes received after the last verified block
+    EnvHash block_hash;
+    bool last_block; // a short block was verified, only the archive hash may follow
+    std::string hash;
+};
+
 extern bool cleanup_cache(const std::string &basedir, uid_t user_uid, gid_t user_gid);
 extern int start_create_env(const std::string &basedir,
                             uid_t user_uid, gid_t user_gid,
                             const std::string &compiler, const std::list<std::string> &extrafiles,
                             const std::string &compression);
-extern size_t finish_create_env(int pipe, const std::string &basedir, std::string &native_environment);
+// download a native environment from another daemon, to be finished by finish_create_env(),
+// it is dropped unless its contents match its name; compiler is the local one it is for, if any
+extern int start_fetch_env(const std::string &basedir, uid_t user_uid, gid_t user_gid,
+                           const std::string &host, unsigned int port, int host_protocol,
+                           const std::string &fingerprint, const std::string &platform,
+                           const std::string &name, const std::string &compiler);
+// serve a native environment tarball to another daemon from a child process, which
+// takes over the connection; the caller only closes its own descriptor of it
+extern pid_t start_send_env(MsgChannel *c, const std::string &file, const std::string &platform,
+                            const std::string &name);
+// install a client's environment on a compile server from a child process with the
+// privileges of user_uid, which writes an EnvUploadMsg::Result byte to fd when done
+extern pid_t start_upload_env(const std::string &file, const std::string &target,
+                              const std::string &name, const std::string &host, unsigned int port,
+                              int host_protocol, uid_t user_uid, gid_t user_gid, unsigned int limit_kbps,
+                              Traffic *traffic, int &fd);
+// identifies the toolchain made of files across machines, empty if they cannot be read
+extern std::string toolchain_fingerprint(const std::list<std::string> &files,
+                                         const std::string &compression);
+// identity is the version and target of the compiler the environment was created or fetched
+// for (like "gcc (Debian 12.2.0-14) 12.2.0 x86_64-linux-gnu"), which is the same for the
+// cross compilers for that target on other platforms, empty if it is not known
+extern size_t finish_create_env(int pipe, const std::string &basedir, std::string &native_environment,
+                                std::string &identity);
 Environments available_environmnents(const std::string &basename);
 extern pid_t start_install_environment(const std::string &basename,
                                        const std::string &target,
@@ -42,8 +114,24 @@ extern pid_t start_install_environment(const std::string &basename,
                                        MsgChannel *c, int& pipe_to_child, int& pipe_from_child,
                                        FileChunkMsg*& fmsg,
                                        uid_t user_uid, gid_t user_gid, int extract_priority);
+// unpack a completely received environment if it matches its hash
+extern pid_t start_install_environment(const std::string &basename, const std::string &target,
+                                       const std::string &name, const PartialEnvironment &partial,
+                                       int &pipe_from_child, uid_t user_uid, gid_t user_gid,
+                                       int extract_priority);
+// remove the files of transfers that were not continued for max_age seconds, and the
+// oldest ones beyond max_size bytes, except those of the files being received
+extern void expire_partial_environments(const std::string &basedir, time_t max_age,
+                                        size_t max_size, const std::set<std::string> &receiving);
+extern bool setup_scratch_dir(const std::string &basename, size_t size,
+                              uid_t user_uid, gid_t user_gid);
 extern size_t finalize_install_environment(const std::string &basename, const std::string &target,
-                                           uid_t user_uid, gid_t user_gid);
+                                           uid_t user_uid, gid_t user_gid, bool use_scratch);
+extern size_t warm_environment(const std::string &basename, const std::string &env);
+// lock up to budget bytes of the toolchain in memory in a child, which writes the locked size
+// to lock_fd and keeps them locked until it is closed
+extern pid_t start_lock_environment(const std::string &basename, const std::string &env,
+                                    size_t budget, int &lock_fd);
 extern size_t remove_environment(const std::string &basedir, const std::string &env);
 extern size_t remove_native_environment(const std::string &env);
 extern void chdir_to_environment(MsgChannel *c, const std::string &dirname, uid_t user_uid, gid_t user_gid);
@@ -201,3 +201,23 @@ bool rmpath(const char* path) {
 
     return r;
 }
+
+bool write_all(int fd, const unsigned char *buffer, size_t len)
+{
+    while (len > 0) {
+        ssize_t bytes = write(fd, buffer, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        buffer += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
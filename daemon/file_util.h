@@ -29,6 +29,7 @@ std::string get_relative_path(const std::string &to, const std::string &from);
 std::string get_canonicalized_path(const std::string &path);
 bool mkpath(const std::string &path);
 bool rmpath(const char* path);
+bool write_all(int fd, const unsigned char *buffer, size_t len);
 
 #endif
 
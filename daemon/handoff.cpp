@@ -0,0 +1,220 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBCAP_NG
+#  include <cap-ng.h>
+#endif
+#ifdef __linux__
+#  include <sys/prctl.h>
+#endif
+
+#include "logging.h"
+
+using namespace std;
+
+// changes whenever the records do, a binary that doesn't know them refuses to take over
+static const char handoff_magic[] = "icecc-handoff 1\n";
+
+HandoffRecord &HandoffRecord::operator<<(long long field)
+{
+    fields.push_back(toString(field));
+    return *this;
+}
+
+long long HandoffRecord::num(size_t i) const
+{
+    return i < fields.size() ? atoll(fields[i].c_str()) : 0;
+}
+
+int write_handoff(const list<HandoffRecord> &records)
+{
+    FILE *file = tmpfile();
+
+    if (!file) {
+        log_perror("tmpfile()");
+        return -1;
+    }
+
+    fputs(handoff_magic, file);
+
+    for (list<HandoffRecord>::const_iterator it = records.begin(); it != records.end(); ++it) {
+        fprintf(file, "%zu\n", it->fields.size());
+
+        for (size_t i = 0; i < it->fields.size(); ++i) {
+            fprintf(file, "%zu:", it->fields[i].size());
+            fwrite(it->fields[i].data(), 1, it->fields[i].size(), file);
+            fputc('\n', file);
+        }
+    }
+
+    if (fflush(file) != 0 || ferror(file)) {
+        log_perror("writing handoff state failed");
+        fclose(file);
+        return -1;
+    }
+
+    // the stream is dropped, but the descriptor stays for the next binary
+    int fd = dup(fileno(file));
+    fclose(file);
+
+    if (fd < 0) {
+        log_perror("dup()");
+        return -1;
+    }
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        log_perror("lseek()");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool read_handoff(int fd, list<HandoffRecord> &records)
+{
+    FILE *file = fdopen(fd, "r");
+
+    if (!file) {
+        log_perror("fdopen()");
+        close(fd);
+        return false;
+    }
+
+    char magic[sizeof(handoff_magic)];
+
+    if (!fgets(magic, sizeof(magic), file) || string(magic) != handoff_magic) {
+        log_error() << "handoff state has an unknown format" << endl;
+        fclose(file);
+        return false;
+    }
+
+    size_t count;
+    bool ok = true;
+
+    while (ok && fscanf(file, "%zu\n", &count) == 1) {
+        HandoffRecord record;
+        record.fields.clear();
+
+        for (size_t i = 0; ok && i < count; ++i) {
+            size_t len;
+            ok = fscanf(file, "%zu:", &len) == 1;
+
+            if (ok) {
+                string field(len, '\0');
+                ok = fread(&field[0], 1, len, file) == len && fgetc(file) == '\n';
+                record.fields.push_back(field);
+            }
+        }
+
+        if (ok && count > 0) {
+            records.push_back(record);
+        }
+    }
+
+    if (!ok || !feof(file)) {
+        log_error() << "handoff state is damaged" << endl;
+        ok = false;
+    }
+
+    fclose(file);
+    return ok;
+}
+
+bool keep_across_exec(int fd, bool keep)
+{
+    if (fd < 0) {
+        return true;
+    }
+
+    int flags = fcntl(fd, F_GETFD);
+
+    if (flags < 0) {
+        log_perror("fcntl(F_GETFD)");
+        return false;
+    }
+
+    flags = keep ? (flags & ~FD_CLOEXEC) : (flags | FD_CLOEXEC);
+
+    if (fcntl(fd, F_SETFD, flags) < 0) {
+        log_perror("fcntl(F_SETFD)");
+        return false;
+    }
+
+    return true;
+}
+
+bool keep_capabilities_across_exec()
+{
+#ifdef HAVE_LIBCAP_NG
+    static const int caps[] = { CAP_SYS_CHROOT, CAP_IPC_LOCK, CAP_SYS_ADMIN };
+
+    if (getuid() == 0) {
+        return true; // root gets them anyway
+    }
+
+    capng_get_caps_process();
+
+    for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); ++i) {
+        if (capng_have_capability(CAPNG_PERMITTED, caps[i])) {
+            capng_update(CAPNG_ADD, CAPNG_INHERITABLE, caps[i]);
+        }
+    }
+
+    if (capng_apply(CAPNG_SELECT_CAPS) != 0) {
+        log_error() << "cannot make the capabilities inheritable" << endl;
+        return false;
+    }
+
+#if defined(__linux__) && defined(PR_CAP_AMBIENT)
+
+    for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); ++i) {
+        if (capng_have_capability(CAPNG_PERMITTED, caps[i])
+                && prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, caps[i], 0, 0) < 0) {
+            log_perror("prctl(PR_CAP_AMBIENT_RAISE)");
+            return false;
+        }
+    }
+
+    return true;
+#else
+    log_error() << "capabilities cannot be kept across exec on this system" << endl;
+    return false;
+#endif
+#else
+    return true;
+#endif
+}
+
+void drop_ambient_capabilities()
+{
+#if defined(HAVE_LIBCAP_NG) && defined(__linux__) && defined(PR_CAP_AMBIENT)
+    prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_CLEAR_ALL, 0, 0, 0);
+#endif
+}
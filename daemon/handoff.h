@@ -0,0 +1,76 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_HANDOFF_H
+#define ICECREAM_HANDOFF_H
+
+#include <list>
+#include <string>
+#include <vector>
+
+/* A daemon that is upgraded executes its new binary in the same process and
+   passes on what it was doing: the sockets stay open across the exec and
+   what belongs to them is written to a file as records. A record is a kind
+   followed by fields, which are written with their length, so that any
+   string fits. */
+class HandoffRecord
+{
+public:
+    explicit HandoffRecord(const std::string &kind = std::string()) {
+        fields.push_back(kind);
+    }
+
+    HandoffRecord &operator<<(const std::string &field) {
+        fields.push_back(field);
+        return *this;
+    }
+    HandoffRecord &operator<<(long long field);
+
+    const std::string &kind() const {
+        return fields[0];
+    }
+    // fields start at 1, missing ones are empty or 0
+    std::string str(size_t i) const {
+        return i < fields.size() ? fields[i] : std::string();
+    }
+    long long num(size_t i) const;
+    size_t size() const {
+        return fields.size();
+    }
+
+    std::vector<std::string> fields;
+};
+
+// Writes the records to an unlinked temporary file, returns its descriptor or -1.
+extern int write_handoff(const std::list<HandoffRecord> &records);
+// Reads the records written by write_handoff() and closes fd, false if they are damaged.
+extern bool read_handoff(int fd, std::list<HandoffRecord> &records);
+
+// Lets the descriptor be inherited by the binary executed next, or not.
+extern bool keep_across_exec(int fd, bool keep = true);
+
+/* The daemon doesn't run as root anymore if it was started by root, so its
+   capabilities would be lost in the exec. This makes them ambient, which
+   keeps them. False if that is not possible. */
+extern bool keep_capabilities_across_exec();
+// Clears them again in the new binary, the compile jobs must not inherit them.
+extern void drop_ambient_capabilities();
+
+#endif
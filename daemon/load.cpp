@@ -431,3 +431,48 @@ void fill_stats(unsigned long &myidleload, unsigned long &myniceload, unsigned i
 
     }
 }
+
+bool process_tree_memory(pid_t pid, unsigned long &kilobytes)
+{
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", int(pid));
+    FILE *statm = fopen(path, "r");
+
+    if (!statm) {
+        return false;
+    }
+
+    unsigned long size = 0, resident = 0;
+    bool ok = fscanf(statm, "%lu %lu", &size, &resident) == 2;
+    fclose(statm);
+
+    if (!ok) {
+        return false;
+    }
+
+    kilobytes += resident * (sysconf(_SC_PAGESIZE) / 1024);
+
+    // the compiler driver runs the compiler proper and the assembler as its children
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", int(pid), int(pid));
+    FILE *children = fopen(path, "r");
+
+    if (!children) {
+        return false;
+    }
+
+    int child;
+
+    while (fscanf(children, "%d", &child) == 1) {
+        // a child may be gone by now, which is not an error
+        process_tree_memory(child, kilobytes);
+    }
+
+    fclose(children);
+    return true;
+#else
+    (void)pid;
+    (void)kilobytes;
+    return false;
+#endif
+}
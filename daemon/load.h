@@ -28,4 +28,8 @@
 // 'hint' is used to approximate the load, whenever getloadavg() is unavailable.
 void fill_stats(unsigned long &myidleload, unsigned long &myniceload, unsigned int &memory_fillgrade, StatsMsg *msg, unsigned int hint);
 
+// The resident memory of a process and all its descendants in kilobytes,
+// false where the system does not tell.
+bool process_tree_memory(pid_t pid, unsigned long &kilobytes);
+
 #endif
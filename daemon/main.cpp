@@ -34,6 +34,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <getopt.h>
 
@@ -95,12 +96,22 @@
 #include <comm.h>
 #include "load.h"
 #include "environment.h"
+#include "peers.h"
+#include "traffic.h"
+#include "topology.h"
+#include "budget.h"
+#include "slots.h"
+#include "handoff.h"
 #include "platform.h"
 #include "util.h"
 #include "getifaddrs.h"
 
 static std::string pidFilePath;
 static volatile sig_atomic_t exit_main_loop = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+// what to execute when upgrading, the daemon's own command line
+static std::string execPath;
+static char **execArgv;
 
 #ifndef __attribute_warn_unused_result__
 #define __attribute_warn_unused_result__
@@ -126,10 +137,12 @@ public:
      * CLIENTWORK: Client is busy working and we reserve the spot (job_id is set if it's a scheduler job)
      * WAITFORCHILD: Client is waiting for the compile job to finish.
      * WAITCREATEENV: We're waiting for icecc-create-env to finish.
+     * RELEASED: The job was given back to the scheduler before it started, the rest of what
+     *          the client sends is discarded until it closes the connection
      */
     enum Status { UNKNOWN, GOTNATIVE, PENDING_USE_CS, JOBDONE, LINKJOB, TOINSTALL, WAITINSTALL, TOCOMPILE,
-                  WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV,
-                  LASTSTATE = WAITCREATEENV
+                  WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV, RELEASED,
+                  LASTSTATE = RELEASED
                 } status;
     Client() {
         job_id = 0;
@@ -141,6 +154,14 @@ public:
         pipe_from_child = -1;
         pipe_to_child = -1;
         child_pid = -1;
+        cold_start = false;
+        orphaned = false;
+        peer_placed = false;
+        partial = 0;
+        core = -1;
+        mem_granted = 0;
+        overtaken = 0;
+        queued.tv_sec = queued.tv_usec = 0;
     }
 
     static string status_str(Status status) {
@@ -171,12 +192,25 @@ public:
             return "waitforchild";
         case WAITCREATEENV:
             return "waitcreateenv";
+        case RELEASED:
+            return "released";
         }
 
         assert(false);
         return string(); // shutup gcc
     }
 
+    // LASTSTATE + 1 if unknown
+    static Status status_from_str(const string &str) {
+        Status status = UNKNOWN;
+
+        while (status <= LASTSTATE && status_str(status) != str) {
+            status = Status(int(status) + 1);
+        }
+
+        return status;
+    }
+
     ~Client() {
         status = (Status) - 1;
         delete channel;
@@ -185,6 +219,8 @@ public:
         usecsmsg = 0;
         delete job;
         job = 0;
+        delete partial;
+        partial = 0;
 
         if (pipe_from_child >= 0) {
             if (-1 == close(pipe_from_child) && (errno != EBADF)){
@@ -209,10 +245,29 @@ public:
     // pipe to child process, only valid if TOINSTALL/WAITINSTALL
     int pipe_to_child;
     pid_t child_pid;
+    PartialEnvironment *partial; // only for TOINSTALL/WAITINSTALL, received into a file first
     string pending_create_env; // only for WAITCREATEENV
+    string pending_upload; // waiting for the local daemon to upload its environment
+    bool cold_start; // only for WAITFORCHILD, first job in its environment after a while
+    string target; // only for WAITFORCS
+    // the job outlived the scheduler connection it was started under (or started
+    // without one, or was placed here by a peer), so the current scheduler doesn't
+    // know its job id
+    bool orphaned;
+    bool peer_placed; // usecsmsg was picked by us from the known peers
+    int core; // only for WAITFORCHILD, where the job is pinned to, -1 if not pinned
+    unsigned int mem_granted; // only for WAITFORCHILD, MB reserved in the memory budget
+    unsigned int overtaken; // only for TOCOMPILE, younger jobs started while it didn't fit
+    struct timeval queued; // only for TOCOMPILE, since when it waits for a slot
+
+    // an orphaned job running here, counted in the login and reported as orphaned when done
+    bool reports_orphaned() const {
+        return orphaned && (status == TOCOMPILE || status == WAITFORCHILD
+                            || status == PENDING_USE_CS || status == CLIENTWORK);
+    }
 
     string dump() const {
-        string ret = status_str(status) + " " + channel->dump();
+        string ret = status_str(status) + (orphaned ? " (orphaned) " : " ") + channel->dump();
 
         switch (status) {
         case LINKJOB:
@@ -362,6 +417,7 @@ static int set_new_pgrp(void)
 }
 
 static void dcc_daemon_terminate(int);
+static void dcc_daemon_upgrade(int);
 
 /**
  * Catch all relevant termination signals.  Set up in parent and also
@@ -375,6 +431,17 @@ void dcc_daemon_catch_signals(void)
     signal(SIGTERM, &dcc_daemon_terminate);
     signal(SIGINT, &dcc_daemon_terminate);
     signal(SIGALRM, &dcc_daemon_terminate);
+    signal(SIGUSR2, &dcc_daemon_upgrade);
+}
+
+/**
+ * SIGUSR2 makes the daemon execute its binary again (after it was
+ * upgraded), without dropping the jobs and connections it has.
+ **/
+static void dcc_daemon_upgrade(int whichsig)
+{
+    signal(whichsig, dcc_daemon_upgrade);
+    upgrade_requested = 1;
 }
 
 pid_t dcc_master_pid;
@@ -422,7 +489,7 @@ void usage(const char *reason = 0)
     }
 
     cerr << "usage: iceccd [-n <netname>] [-m <max_processes>] [--no-remote] [-d|--daemonize] [-l logfile] [-s <schedulerhost[:port]>]"
-        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>] [-i|--interface <net_interface>] [-p|--port <port>]" << endl;
+        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [--env-upload-limit <KB/s>] [--auto-slots <min>:<max>] [--mlock-limit <MB>] [--scratch-size <MB>] [--cpu-pinning] [--driver-bypass] [--cross-compiler <path>] [-N <node_name>] [-i|--interface <net_interface>] [-p|--port <port>]" << endl;
     exit(1);
 }
 
@@ -439,26 +506,117 @@ unsigned int max_kids = 0;
 
 size_t cache_size_limit = 256 * 1024 * 1024;
 
+// How much of the hottest environment may be locked in memory, 0 disables it.
+size_t mlock_limit = 0;
+
+// Size of the tmpfs that compile output is written to, 0 means writing it to disk.
+size_t scratch_size_limit = 0;
+
+// Bandwidth of each environment upload done for local clients, 0 is unlimited.
+unsigned int env_upload_limit = 0;
+
+// Pin each compile job to a physical core.
+bool cpu_pinning = false;
+
+// Cross compilers to offer environments of to clients on other platforms.
+list<string> cross_compilers;
+
+// An environment not used for this long is assumed to have dropped out of the page cache.
+static const int env_cold_timeout = 10 * 60;
+// Environments not used for this long are not warmed anymore, and may drop out of the page cache.
+static const int env_hot_timeout = 60 * 60;
+// How often the hot environments get their toolchain binaries read ahead again.
+static const int env_warming_interval = 5 * 60;
+// How many of the most used environments are kept warm.
+static const unsigned int max_warm_envs = 2;
+// How often a client's toolchain is looked up for environments of other platforms.
+static const int cross_lookup_interval = 2 * 60;
+// How often a daemon without scheduler exchanges its known peers with a random one.
+static const int peer_exchange_interval = 30;
+// How many peers are sent in one list.
+static const size_t max_peer_list = 32;
+
 struct NativeEnvironment {
     string name; // the hash
     // Timestamps for files including compiler binaries, if they have changed since the time
     // the native env was built, it needs to be rebuilt.
     map<string, time_t> filetimes;
     int create_env_pipe; // if in progress of creating the environment
+    // For finding the same toolchain in the scheduler's registry instead of creating it.
+    string fingerprint;
+    bool lookup_pending; // waiting for the scheduler's answer
+    bool fetching; // create_env_pipe is a download from another daemon
+    // what to create the environment from if it has to be done locally after all
+    string compiler;
+    list<string> extrafiles;
+    string compression;
+    // compiler, version and target, see finish_create_env()
+    string identity;
+    // the platform the environment runs on, if it is fetched for another one
+    string platform;
+    time_t cross_lookup; // last time the scheduler was asked for the other platforms
     NativeEnvironment() {
         create_env_pipe = 0;
+        lookup_pending = false;
+        fetching = false;
+        cross_lookup = 0;
+    }
+};
+
+// An environment being uploaded to a compile server for local clients.
+struct EnvUpload {
+    int pipe; // from the uploading child
+    EnvUpload() {
+        pipe = -1;
     }
 };
 
+// How long the file of an interrupted environment transfer is kept for continuing it.
+static const int partial_env_max_age = 60 * 60;
+
+// How long an upgrade waits for messages in flight, before it drops the connections carrying them.
+static const int upgrade_quiet_timeout = 10;
+
 struct Daemon {
     Clients clients;
     map<string, time_t> envs_last_use;
+    // Number of jobs compiled in each installed environment, to find the hot ones.
+    map<string, unsigned int> envs_job_count;
+    string locked_env;
+    size_t locked_env_size;
+    pid_t env_lock_pid; // the child keeping locked_env in memory
+    int env_lock_fd; // it goes away when this is closed
+    bool env_lock_pending; // locked_env_size is not known yet
+    time_t next_env_warming;
+    // Jobs that were the first in their environment after installing or idling, and the rest.
+    unsigned int cold_jobs;
+    unsigned long cold_jobs_msec;
+    unsigned int warm_jobs;
+    unsigned long warm_jobs_msec;
+    // Jobs the scheduler asked back before their clients arrived, and when.
+    map<unsigned int, time_t> released_jobs;
+    // Other compile servers, to place jobs on while there is no scheduler.
+    Peers peers;
+    int peer_exchange_fd; // connecting to a random peer to exchange lists
+    struct sockaddr_in peer_exchange_addr;
+    int peer_exchange_protocol;
+    time_t next_peer_exchange;
+    unsigned int peer_placed_jobs; // since losing the scheduler
+    unsigned int reported_orphaned_jobs; // in the last login or stats
+    Traffic *traffic;
+    CpuTopology topology; // empty if unknown
+    MemoryBudget memory;
+    SlotTuner slots; // disabled unless --auto-slots
     // Map of native environments, the basic one(s) containing just the compiler
     // and possibly more containing additional files (such as compiler plugins).
     // The key is the compiler name and a concatenated list of the additional files
     // (or just the compiler name for the basic ones).
     map<string, NativeEnvironment> native_environments;
+    // Environment uploads by compile server and environment, so that concurrent
+    // clients needing the same one share it.
+    map<string, EnvUpload> env_uploads;
     string envbasedir;
+    string scratchdir; // tmpfs mounted to the /tmp of the environments, if set up
     uid_t user_uid;
     gid_t user_gid;
     int warn_icecc_user_errno;
@@ -483,6 +641,7 @@ struct Daemon {
     string netname;
     string schedname;
     int scheduler_port;
+    string scheduler_cache_file; // last scheduler found by broadcasting
     string daemon_interface;
     int daemon_port;
     unsigned int supported_features;
@@ -490,6 +649,8 @@ struct Daemon {
     int max_scheduler_pong;
     int max_scheduler_ping;
     unsigned int current_kids;
+    string logfile; // passed on when upgrading, it may have been chosen for running as root
+    time_t upgrade_started; // waiting for the connections to get quiet since then, or 0
 
     Daemon() {
         warn_icecc_user_errno = 0;
@@ -530,10 +691,31 @@ struct Daemon {
         max_scheduler_pong = MAX_SCHEDULER_PONG;
         max_scheduler_ping = MAX_SCHEDULER_PING;
         current_kids = 0;
+        locked_env_size = 0;
+        env_lock_pid = 0;
+        env_lock_fd = -1;
+        env_lock_pending = false;
+        next_env_warming = 0;
+        cold_jobs = 0;
+        cold_jobs_msec = 0;
+        warm_jobs = 0;
+        warm_jobs_msec = 0;
+        peer_exchange_fd = -1;
+        peer_exchange_protocol = 0;
+        next_peer_exchange = 0;
+        peer_placed_jobs = 0;
+        reported_orphaned_jobs = 0;
+        upgrade_started = 0;
+        traffic = Traffic::create_shared();
+
+        if (!traffic) {
+            traffic = new Traffic(); // the uploads' bytes go missing
+        }
     }
 
     ~Daemon() {
         delete discover;
+        unlock_env();
     }
 
     bool reannounce_environments() __attribute_warn_unused_result__;
@@ -543,15 +725,30 @@ struct Daemon {
     bool finish_transfer_env(Client *client, bool cancel = false);
     bool handle_get_native_env(Client *client, GetNativeEnvMsg *msg) __attribute_warn_unused_result__;
     bool finish_get_native_env(Client *client, string env_key);
+    void create_native_env(NativeEnvironment &env);
+    void register_native_env(const NativeEnvironment &env);
+    void handle_env_lookup(EnvFingerprintMsg *msg);
+    void lookup_cross_envs(NativeEnvironment &env);
+    void handle_cross_env(EnvFingerprintMsg *msg);
+    void create_cross_envs();
+    void end_env_lookups();
+    bool handle_env_request(Client *client, EnvFingerprintMsg *msg) __attribute_warn_unused_result__;
+    bool handle_env_upload(Client *client, EnvUploadMsg *msg) __attribute_warn_unused_result__;
+    void env_upload_finished(const string &key);
     void handle_old_request();
+    Client *next_compile_client();
     bool handle_compile_file(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_activity(Client *client) __attribute_warn_unused_result__;
     bool handle_file_chunk_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
+    bool handle_partial_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     void handle_end(Client *client, int exitcode);
     int scheduler_get_internals() __attribute_warn_unused_result__;
     void clear_children();
+    void orphan_clients();
     int scheduler_use_cs(UseCSMsg *msg) __attribute_warn_unused_result__;
     int scheduler_no_cs(NoCSMsg *msg) __attribute_warn_unused_result__;
+    int scheduler_job_release(JobReleaseMsg *msg) __attribute_warn_unused_result__;
+    bool release_job(Client *client);
     bool handle_get_cs(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_local_job(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_job_done(Client *cl, JobDoneMsg *m) __attribute_warn_unused_result__;
@@ -564,10 +761,24 @@ struct Daemon {
     void determine_system();
     void determine_supported_features();
     bool maybe_stats(bool force_check = false);
+    unsigned int count_orphaned_jobs() const;
+    unsigned int untouched_memory() const;
+    void maybe_warm_environments();
+    void env_locked();
+    void unlock_env();
+    void fill_peer_list(PeerListMsg &msg) const;
+    void maybe_exchange_peers();
+    void finish_peer_exchange();
+    bool handle_peer_list(Client *client, PeerListMsg *msg) __attribute_warn_unused_result__;
     bool send_scheduler(const Msg &msg) __attribute_warn_unused_result__;
     void close_scheduler();
+    bool send_login() __attribute_warn_unused_result__;
     bool reconnect();
     int working_loop();
+    bool ready_to_hand_over() const;
+    void maybe_upgrade();
+    bool hand_over();
+    void take_over(const list<HandoffRecord> &records);
     bool setup_listen_fds();
     bool setup_listen_tcp_fd( int& fd, const string& interface );
     bool setup_listen_unix_fd();
@@ -633,6 +844,13 @@ bool Daemon::setup_listen_tcp_fd( int& fd, const string& interface )
         }
     }
 
+#ifdef TCP_FASTOPEN
+    // let clients that connected before send their first message with the SYN,
+    // if the kernel allows it (net.ipv4.tcp_fastopen)
+    optval = 64;
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &optval, sizeof(optval));
+#endif
+
     if (listen(fd, 1024) < 0) {
         log_perror("Failed to set TCP socket for listening to incoming connections");
         return false;
@@ -824,12 +1042,47 @@ void Daemon::close_scheduler()
     scheduler = 0;
     delete discover;
     discover = 0;
+    orphan_clients();
+    end_env_lookups();
+    released_jobs.clear();
     next_scheduler_connect = time(0) + 20 + (rand() & 31);
     static bool fast_reconnect = getenv( "ICECC_TESTS" ) != NULL;
     if( fast_reconnect )
         next_scheduler_connect = time(0) + 3;
 }
 
+unsigned int Daemon::count_orphaned_jobs() const
+{
+    unsigned int count = 0;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->reports_orphaned()) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// The memory the running jobs have reserved in the budget, but do not use yet.
+// Where their use cannot be seen, the reservations count as used.
+unsigned int Daemon::untouched_memory() const
+{
+    unsigned int untouched = 0;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        const Client *client = it->second;
+        unsigned long used = 0;
+
+        if (client->status == Client::WAITFORCHILD && client->mem_granted
+            && process_tree_memory(client->child_pid, used)) {
+            untouched += client->mem_granted - std::min<unsigned long>(client->mem_granted, used / 1024);
+        }
+    }
+
+    return untouched;
+}
+
 bool Daemon::maybe_stats(bool force_check)
 {
     struct timeval now;
@@ -881,25 +1134,68 @@ bool Daemon::maybe_stats(bool force_check)
 
         msg.load = std::max((1000 - idle_average), memory_fillgrade);
 
+        bool retuned = false;
+
+        if (slots.enabled()) {
+            unsigned int tuned = slots.update(max_kids, diff_stat,
+                                              current_kids + clients.active_processes >= max_kids);
+
+            if (tuned != max_kids) {
+                log_info() << "tuned slots from " << max_kids << " to " << tuned << " ("
+                           << slots.throughput() << " bytes/s)" << endl;
+                max_kids = tuned;
+                retuned = true;
+            }
+
+            msg.max_kids = max_kids;
+            msg.job_speed = slots.speed();
+            msg.throughput = slots.throughput();
+            msg.queue_delay = slots.queue_delay();
+        }
+
+        msg.cold_jobs = cold_jobs;
+        msg.cold_job_msec = cold_jobs ? cold_jobs_msec / cold_jobs : 0;
+        msg.warm_jobs = warm_jobs;
+        msg.warm_job_msec = warm_jobs ? warm_jobs_msec / warm_jobs : 0;
+        msg.orphaned_jobs = count_orphaned_jobs();
+        msg.job_in = traffic->job_in / 1024;
+        msg.job_out = traffic->job_out / 1024;
+        msg.bulk_in = traffic->bulk_in / 1024;
+        msg.bulk_out = __atomic_load_n(&traffic->bulk_out, __ATOMIC_RELAXED) / 1024;
+
 #ifdef HAVE_SYS_VFS_H
         struct statfs buf;
         int ret = statfs(envbasedir.c_str(), &buf);
 
         // Require at least 25MiB of free disk space per build.
-        if (!ret && long(buf.f_bavail) < ((long(max_kids + 1 - current_kids) * 25 * 1024 * 1024) / buf.f_bsize)) {
+        long needed = long(max_kids + 1 - current_kids) * 25 * 1024 * 1024;
+
+        // Output is written to the scratch dir as long as it has space, so only
+        // the rest needs to be available on disk.
+        struct statfs scratchbuf;
+        if (!scratchdir.empty() && !statfs(scratchdir.c_str(), &scratchbuf)) {
+            needed -= std::min(needed, long(scratchbuf.f_bavail) * long(scratchbuf.f_bsize));
+        }
+
+        if (!ret && long(buf.f_bavail) < needed / long(buf.f_bsize)) {
             msg.load = 1000;
         }
 
 #endif
 
         mem_limit = std::max(int(msg.freeMem / std::min(std::max(max_kids, 1U), 4U)), min_mem_limit);
+        memory.set_available(msg.freeMem > unsigned(min_mem_limit) ? msg.freeMem - min_mem_limit : 0,
+                             untouched_memory());
 
-        if (abs(int(msg.load) - current_load) >= 100
+        if (abs(int(msg.load) - current_load) >= 100 || retuned
+            || msg.orphaned_jobs != reported_orphaned_jobs
             || (msg.load == 1000 && current_load != 1000)
             || (msg.load != 1000 && current_load == 1000)) {
             if (!send_scheduler(msg)) {
                 return false;
             }
+
+            reported_orphaned_jobs = msg.orphaned_jobs;
         }
 
         icecream_load = 0;
@@ -909,6 +1205,233 @@ bool Daemon::maybe_stats(bool force_check)
     return true;
 }
 
+void Daemon::maybe_warm_environments()
+{
+    time_t now = time(NULL);
+
+    if (now < next_env_warming) {
+        return;
+    }
+
+    next_env_warming = now + env_warming_interval;
+
+    // Environments that have not been used for a long time are allowed to drop
+    // out of the page cache, the rest is ordered by the number of jobs.
+    vector<pair<unsigned int, string> > hot_envs;
+
+    for (map<string, unsigned int>::const_iterator it = envs_job_count.begin();
+            it != envs_job_count.end(); ++it) {
+        map<string, time_t>::const_iterator last_use = envs_last_use.find(it->first);
+
+        if (last_use != envs_last_use.end() && now - last_use->second < env_hot_timeout) {
+            hot_envs.push_back(make_pair(it->second, it->first));
+        }
+    }
+
+    sort(hot_envs.rbegin(), hot_envs.rend());
+
+    for (unsigned int i = 0; i < hot_envs.size() && i < max_warm_envs; ++i) {
+        size_t warmed = warm_environment(envbasedir, hot_envs[i].second);
+        trace() << "warmed " << hot_envs[i].second << " (" << hot_envs[i].first
+                << " jobs): " << warmed << endl;
+    }
+
+    if (mlock_limit == 0) {
+        return;
+    }
+
+    string hottest = hot_envs.empty() ? string() : hot_envs.front().second;
+
+    if (hottest == locked_env) {
+        return;
+    }
+
+    unlock_env();
+
+    if (hottest.empty()) {
+        return;
+    }
+
+    // mapping and locking reads the whole toolchain, that must not hold up the clients
+    env_lock_pid = start_lock_environment(envbasedir, hottest, mlock_limit, env_lock_fd);
+
+    if (env_lock_pid) {
+        locked_env = hottest;
+        env_lock_pending = true;
+    }
+}
+
+void Daemon::env_locked()
+{
+    char buf[32];
+    ssize_t n;
+
+    while ((n = read(env_lock_fd, buf, sizeof(buf) - 1)) < 0 && errno == EINTR) {}
+
+    if (n <= 0) {
+        log_warning() << "locking " << locked_env << " in memory failed" << endl;
+        unlock_env();
+        return;
+    }
+
+    buf[n] = 0;
+    locked_env_size = strtoull(buf, NULL, 10);
+    env_lock_pending = false;
+    log_info() << "locked " << locked_env_size << " bytes of " << locked_env << " in memory" << endl;
+}
+
+void Daemon::unlock_env()
+{
+    if (env_lock_pid) {
+        close(env_lock_fd);
+        // it may still be reading the toolchain
+        kill(env_lock_pid, SIGKILL);
+
+        while (waitpid(env_lock_pid, NULL, 0) < 0 && errno == EINTR) {}
+    }
+
+    env_lock_pid = 0;
+    env_lock_fd = -1;
+    env_lock_pending = false;
+    locked_env.clear();
+    locked_env_size = 0;
+}
+
+void Daemon::fill_peer_list(PeerListMsg &msg) const
+{
+    peers.fill(msg, max_peer_list - 1);
+
+    if (noremote || max_kids == 0) {
+        return;
+    }
+
+    // the receiver knows our address from the connection
+    PeerListMsg::Peer self;
+    self.port = daemon_port;
+    self.host_platform = machine_name;
+    self.max_jobs = max_kids;
+    self.load = max(0, current_load);
+    self.protocol = PROTOCOL_VERSION;
+    self.features = supported_features;
+    self.envs = available_environmnents(envbasedir);
+    msg.peers.push_back(self);
+}
+
+/* Without a scheduler, keep the view of the other daemons fresh by
+   exchanging lists with a random one of them from time to time. */
+void Daemon::maybe_exchange_peers()
+{
+    time_t now = time(NULL);
+
+    if (scheduler || now < next_peer_exchange) {
+        return;
+    }
+
+    next_peer_exchange = now + peer_exchange_interval + (rand() % peer_exchange_interval);
+
+    if (peer_exchange_fd >= 0) {
+        trace() << "peer exchange timed out" << endl;
+        close(peer_exchange_fd);
+        peer_exchange_fd = -1;
+    }
+
+    peers.expire();
+    const Peers::Peer *peer = peers.random_peer();
+
+    // the protocol is offered without waiting for the peer, see finish_peer_exchange()
+    if (!peer || !IS_PROTOCOL_45(peer)) {
+        return;
+    }
+
+    peer_exchange_protocol = peer->protocol;
+    memset(&peer_exchange_addr, 0, sizeof(peer_exchange_addr));
+    peer_exchange_addr.sin_family = AF_INET;
+    peer_exchange_addr.sin_port = htons(peer->port);
+
+    if (!inet_aton(peer->hostname.c_str(), &peer_exchange_addr.sin_addr)) {
+        return;
+    }
+
+    if ((peer_exchange_fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        log_perror("socket()");
+        return;
+    }
+
+    fcntl(peer_exchange_fd, F_SETFL, O_NONBLOCK);
+    fcntl(peer_exchange_fd, F_SETFD, FD_CLOEXEC);
+
+    if (connect(peer_exchange_fd, (struct sockaddr *) &peer_exchange_addr, sizeof(peer_exchange_addr)) < 0
+            && errno != EINPROGRESS) {
+        trace() << "connecting to peer " << peer->hostname << " failed" << endl;
+        close(peer_exchange_fd);
+        peer_exchange_fd = -1;
+    }
+}
+
+void Daemon::finish_peer_exchange()
+{
+    int fd = peer_exchange_fd;
+    peer_exchange_fd = -1;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+        trace() << "peer " << inet_ntoa(peer_exchange_addr.sin_addr) << " not reachable" << endl;
+        close(fd);
+        return;
+    }
+
+    /* The protocol of the peer is known from the lists, so the channel is set up
+       without waiting for its answer, which would block the main loop. */
+    MsgChannel *c = Service::createChannel(fd, (struct sockaddr *) &peer_exchange_addr,
+                                           sizeof(peer_exchange_addr), peer_exchange_protocol);
+
+    if (!c) {
+        return;
+    }
+
+    PeerListMsg msg;
+    fill_peer_list(msg);
+
+    if (!c->send_msg(msg)) {
+        delete c;
+        return;
+    }
+
+    // the answer is handled like any client message
+    Client *client = new Client;
+    client->client_id = ++new_client_id;
+    client->channel = c;
+    clients[c] = client;
+    fd2chan[c->fd] = c;
+}
+
+bool Daemon::handle_peer_list(Client *client, PeerListMsg *msg)
+{
+    for (list<PeerListMsg::Peer>::iterator it = msg->peers.begin(); it != msg->peers.end(); ++it) {
+        if (it->hostname.empty()) {
+            it->hostname = client->channel->name;
+        }
+    }
+
+    peers.update(*msg, remote_name, daemon_port);
+    trace() << "got " << msg->peers.size() << " peers from " << client->channel->name
+            << ", know " << peers.size() << endl;
+
+    if (!msg->reply) {
+        PeerListMsg answer;
+        answer.reply = true;
+        fill_peer_list(answer);
+
+        if (client->channel->send_msg(answer)) {
+            return true;
+        }
+    }
+
+    handle_end(client, 0);
+    return false;
+}
+
 string Daemon::dump_internals() const
 {
     string result;
@@ -928,12 +1451,41 @@ string Daemon::dump_internals() const
         result += "  Cache Size: " + toString(cache_size) + "\n";
     }
 
+#ifdef HAVE_SYS_VFS_H
+    struct statfs scratchbuf;
+    if (!scratchdir.empty() && !statfs(scratchdir.c_str(), &scratchbuf)) {
+        result += "  Scratch dir: " + scratchdir + " (free: "
+                  + toString(long(scratchbuf.f_bavail) * long(scratchbuf.f_bsize)) + ")\n";
+    }
+#endif
+
     result += "  Architecture: " + machine_name + "\n";
 
+    if (scheduler) {
+        result += "  Placement: scheduler\n";
+    } else if (peers.size()) {
+        result += "  Placement: peers (" + toString(peers.size()) + " known, "
+                  + toString(peer_placed_jobs) + " jobs placed)\n";
+    } else {
+        result += "  Placement: local\n";
+    }
+
+    result += "  Traffic: jobs " + toString(traffic->job_in) + " in, " + toString(traffic->job_out)
+              + " out, environments " + toString(traffic->bulk_in) + " in, "
+              + toString(__atomic_load_n(&traffic->bulk_out, __ATOMIC_RELAXED)) + " out\n";
+
     for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
             it != native_environments.end(); ++it) {
         result += "  NativeEnv (" + it->first + "): " + it->second.name
-            + (it->second.create_env_pipe ? " (creating)" : "" ) + "\n";
+            + (it->second.lookup_pending ? " (looking up)" : "")
+            + (it->second.create_env_pipe ? (it->second.fetching ? " (fetching)" : " (creating)") : "")
+            + (it->second.identity.empty() ? "" : " [" + it->second.identity + "]")
+            + "\n";
+    }
+
+    for (map<string, EnvUpload>::const_iterator it = env_uploads.begin();
+            it != env_uploads.end(); ++it) {
+        result += "  EnvUpload: " + it->first + "\n";
     }
 
     if (!envs_last_use.empty()) {
@@ -945,7 +1497,30 @@ string Daemon::dump_internals() const
         result += "  envs_last_use[" + it->first  + "] = " + toString(it->second) + "\n";
     }
 
+    for (map<string, unsigned int>::const_iterator it = envs_job_count.begin();
+            it != envs_job_count.end(); ++it)  {
+        result += "  envs_job_count[" + it->first  + "] = " + toString(it->second) + "\n";
+    }
+
+    if (!locked_env.empty()) {
+        result += "  Locked env: " + locked_env + " (" + toString(locked_env_size) + " bytes)\n";
+    }
+
+    result += "  Cold starts: " + toString(cold_jobs) + " (avg "
+              + toString(cold_jobs ? cold_jobs_msec / cold_jobs : 0) + " ms), warm jobs: "
+              + toString(warm_jobs) + " (avg "
+              + toString(warm_jobs ? warm_jobs_msec / warm_jobs : 0) + " ms)\n";
+
     result += "  Current kids: " + toString(current_kids) + " (max: " + toString(max_kids) + ")\n";
+    result += slots.dump();
+    result += "  Memory: " + toString(memory.used()) + " MB committed to jobs (budget: "
+              + toString(memory.total()) + " MB)\n";
+
+    if (topology.cores()) {
+        result += "  CPU topology: " + toString(topology.cores()) + " cores, "
+                  + toString(topology.threads()) + " threads"
+                  + (cpu_pinning ? ", jobs pinned to cores\n" : "\n") + topology.dump();
+    }
 
     result += "  Supported features: " + supported_features_to_string(supported_features) + "\n";
 
@@ -989,6 +1564,9 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
         return 1;
     }
 
+    // the client asks again if its job was released by the first compile server
+    delete c->usecsmsg;
+
     if (msg->hostname == remote_name && int(msg->port) == daemon_port) {
         c->usecsmsg = new UseCSMsg(msg->host_platform, "127.0.0.1", daemon_port, msg->job_id, true, 1,
                                    msg->matched_job_id);
@@ -1024,6 +1602,7 @@ int Daemon::scheduler_no_cs(NoCSMsg *msg)
         return 1;
     }
 
+    delete c->usecsmsg;
     c->usecsmsg = new UseCSMsg(string(), "127.0.0.1", daemon_port, msg->job_id, true, 1, 0);
     c->status = Client::PENDING_USE_CS;
 
@@ -1033,6 +1612,59 @@ int Daemon::scheduler_no_cs(NoCSMsg *msg)
 
 }
 
+/* Another host has become idle while the job still waits for a slot here.
+   If its client hasn't connected yet, the job is given back once it does. */
+int Daemon::scheduler_job_release(JobReleaseMsg *msg)
+{
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client *c = it->second;
+
+        if (c->job && c->job->jobID() == msg->job_id) {
+            if (c->status == Client::TOCOMPILE && IS_PROTOCOL_54(c->channel)) {
+                release_job(c);
+                return scheduler ? 0 : 1;
+            }
+
+            trace() << "not releasing job " << msg->job_id << " " << c->dump() << endl;
+            return 0;
+        }
+    }
+
+    time_t now = time(0);
+
+    for (map<unsigned int, time_t>::iterator it = released_jobs.begin(); it != released_jobs.end();) {
+        if (now - it->second > 10 * 60) {
+            released_jobs.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    released_jobs[msg->job_id] = now;
+    return 0;
+}
+
+/* Returns false if the client is gone.  */
+bool Daemon::release_job(Client *client)
+{
+    unsigned int job_id = client->job->jobID();
+    trace() << "releasing job " << job_id << " of client " << client->client_id << endl;
+
+    // the scheduler is told the job is done instead then
+    if (!client->channel->send_msg(JobReleaseMsg(job_id))) {
+        handle_end(client, 125);
+        return false;
+    }
+
+    client->status = Client::RELEASED;
+
+    if (!send_scheduler(JobReleaseMsg(job_id))) {
+        trace() << "failed to reach scheduler for released job " << job_id << endl;
+    }
+
+    return true;
+}
+
 bool Daemon::handle_transfer_env(Client *client, EnvTransferMsg *emsg)
 {
     log_info() << "handle_transfer_env, client status " << Client::status_str(client->status) <<  endl;
@@ -1050,6 +1682,61 @@ bool Daemon::handle_transfer_env(Client *client, EnvTransferMsg *emsg)
         target =  machine_name;
     }
 
+    if (IS_PROTOCOL_48(client->channel)) {
+        string env = target + "/" + emsg->name;
+        PartialEnvironment *partial = new PartialEnvironment(envbasedir, target, emsg->name);
+        set<string> receiving;
+        receiving.insert(partial->file());
+        Client *stale = 0;
+
+        for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+            Client *other = it->second;
+
+            if (!other->partial) {
+                continue;
+            }
+
+            if (other->outfile != env) {
+                receiving.insert(other->partial->file());
+            } else if (other->status == Client::WAITINSTALL) {
+                log_warning() << "environment " << env << " is already being installed" << endl;
+                delete partial;
+                handle_end(client, 144);
+                return false;
+            } else {
+                stale = other;
+            }
+        }
+
+        if (stale) {
+            // the sender reconnected before the old connection noticed that it broke
+            log_info() << "continuing transfer of " << env << " over a new connection" << endl;
+            handle_end(stale, 144);
+        }
+
+        // what is left of the cache by the installed environments
+        expire_partial_environments(envbasedir, partial_env_max_age,
+                                    cache_size_limit - min(cache_size, cache_size_limit), receiving);
+
+        if (!partial->open(user_uid, user_gid)
+                || !client->channel->send_msg(EnvTransferStateMsg(partial->blocks()))) {
+            delete partial;
+            handle_end(client, 144);
+            return false;
+        }
+
+        if (partial->blocks()) {
+            log_info() << "continuing transfer of " << env << " after " << partial->blocks()
+                       << " blocks" << endl;
+        }
+
+        client->partial = partial;
+        client->status = Client::TOINSTALL;
+        client->outfile = env;
+        client->channel->setTrafficClass(MsgChannel::BulkTraffic);
+        return true;
+    }
+
     int pipe_from_child = -1;
     int pipe_to_child = -1;
     FileChunkMsg *fmsg = 0;
@@ -1067,6 +1754,7 @@ bool Daemon::handle_transfer_env(Client *client, EnvTransferMsg *emsg)
     client->status = Client::TOINSTALL;
     client->outfile = target + "/" + emsg->name;
     current_kids++;
+    client->channel->setTrafficClass(MsgChannel::BulkTraffic);
 
     trace() << "PID of child thread running untaring environment: " << pid << endl;
     client->pipe_to_child = pipe_to_child;
@@ -1092,6 +1780,16 @@ bool Daemon::handle_file_chunk_env(Client *client, Msg *msg)
 
     assert(client);
     assert(client->status == Client::TOINSTALL || client->status == Client::WAITINSTALL);
+
+    if (msg->type == M_FILE_CHUNK) {
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+        traffic->add(traffic->bulk_in, fcmsg->compressed ? fcmsg->compressed : fcmsg->len);
+    }
+
+    if (client->partial) {
+        return handle_partial_env(client, msg);
+    }
+
     assert(client->pipe_to_child >= 0);
 
     if (msg->type == M_FILE_CHUNK) {
@@ -1145,6 +1843,52 @@ bool Daemon::handle_file_chunk_env(Client *client, Msg *msg)
     return false;
 }
 
+bool Daemon::handle_partial_env(Client *client, Msg *msg)
+{
+    PartialEnvironment *partial = client->partial;
+    bool ok = false;
+
+    if (msg->type == M_FILE_CHUNK) {
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+        ok = partial->add(fcmsg->buffer, fcmsg->len);
+    } else if (msg->type == M_ENV_HASH) {
+        ok = partial->verify(*static_cast<EnvHashMsg *>(msg));
+    } else if (msg->type == M_END && partial->complete()) {
+        trace() << "received end of environment, unpacking it" << endl;
+
+        if (!partial->flush()) {
+            handle_end(client, 138);
+            return false;
+        }
+
+        string target = client->outfile.substr(0, client->outfile.rfind('/'));
+        string name = client->outfile.substr(client->outfile.rfind('/') + 1);
+        pid_t pid = start_install_environment(envbasedir, target, name, *partial,
+                                              client->pipe_from_child, user_uid, user_gid,
+                                              nice_level);
+
+        if (pid <= 0) {
+            partial->remove();
+            handle_end(client, 144);
+            return false;
+        }
+
+        current_kids++;
+        client->child_pid = pid;
+        client->status = Client::WAITINSTALL; // Ignore further messages until child finishes.
+        return true;
+    } else {
+        log_error() << "protocol error while receiving environment (" << msg->type << ")" << endl;
+    }
+
+    if (!ok) {
+        handle_end(client, 138);
+        return false;
+    }
+
+    return true;
+}
+
 bool Daemon::handle_env_install_child_done(Client *client)
 {
     assert(client->status == Client::TOINSTALL || client->status == Client::WAITINSTALL);
@@ -1211,10 +1955,20 @@ bool Daemon::finish_transfer_env(Client *client, bool cancel)
         current_kids--;
     }
 
+    if (client->partial) {
+        // keep what was received for the sender to continue, unless it was all there
+        if (client->partial->complete()) {
+            client->partial->remove();
+        }
+
+        delete client->partial;
+        client->partial = 0;
+    }
+
     size_t installed_size = 0;
     if( !cancel ) {
         installed_size = finalize_install_environment(envbasedir, client->outfile,
-                            user_uid, user_gid);
+                            user_uid, user_gid, !scratchdir.empty());
         log_info() << "installed_size: " << installed_size << endl;
     }
     if( installed_size == 0 )
@@ -1229,6 +1983,8 @@ bool Daemon::finish_transfer_env(Client *client, bool cancel)
         envs_last_use[current] = time(NULL);
         log_info() << "installed " << current << " size: " << installed_size
                     << " all: " << cache_size << endl;
+        // the first job will need the compiler anyway, start reading it in already
+        warm_environment(envbasedir, current);
     }
 
     check_cache_size(current);
@@ -1315,6 +2071,10 @@ void Daemon::check_cache_size(const string &new_env)
             native_environments.erase(oldest_native_env_key);
             trace() << "removing " << oldest << " " << oldest_time << " " << removed << endl;
         } else {
+            if (oldest == locked_env) {
+                unlock_env();
+            }
+
             removed = remove_environment(envbasedir, oldest);
             trace() << "removing " << envbasedir << "/" << oldest << " " << oldest_time
                     << " " << removed << endl;
@@ -1322,6 +2082,7 @@ void Daemon::check_cache_size(const string &new_env)
 
         cache_size -= min(removed, cache_size);
         envs_last_use.erase(oldest);
+        envs_job_count.erase(oldest);
     }
 }
 
@@ -1397,11 +2158,31 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
         return finish_get_native_env(client, env_key);
     } else {
         NativeEnvironment &env = native_environments[env_key]; // also inserts it
-        if (!env.create_env_pipe) { // start creating it only if not already in progress
+        // start creating it only if not already in progress
+        if (!env.create_env_pipe && !env.lookup_pending) {
             env.filetimes = filetimes;
-            trace() << "start_create_env " << env_key << endl;
-            env.create_env_pipe = start_create_env(envbasedir, user_uid, user_gid, ccompiler,
-                msg->extrafiles, msg->compression);
+            env.compiler = ccompiler;
+            env.extrafiles = msg->extrafiles;
+            env.compression = msg->compression;
+
+            if (scheduler && IS_PROTOCOL_46(scheduler)) {
+                list<string> files;
+
+                for (map<string, time_t>::const_iterator it = filetimes.begin();
+                        it != filetimes.end(); ++it) {
+                    files.push_back(it->first);
+                }
+
+                env.fingerprint = toolchain_fingerprint(files, msg->compression);
+            }
+
+            if (!env.fingerprint.empty()
+                    && send_scheduler(EnvFingerprintMsg(env.fingerprint, machine_name, ""))) {
+                trace() << "looking up " << env_key << " as " << env.fingerprint << endl;
+                env.lookup_pending = true;
+            } else {
+                create_native_env(env);
+            }
         } else {
             trace() << "waiting for already running create_env " << env_key << endl;
         }
@@ -1409,20 +2190,332 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
     return true;
 }
 
+void Daemon::create_native_env(NativeEnvironment &env)
+{
+    trace() << "start_create_env " << env.compiler << endl;
+    env.fetching = false;
+    env.create_env_pipe = start_create_env(envbasedir, user_uid, user_gid, env.compiler,
+        env.extrafiles, env.compression);
+}
+
+// Let the scheduler hand out this environment to daemons with the same toolchain,
+// and to the ones with the same compiler for another platform.
+void Daemon::register_native_env(const NativeEnvironment &env)
+{
+    if (env.name.empty() || !scheduler || !IS_PROTOCOL_46(scheduler)) {
+        return;
+    }
+
+    string file = env.name.substr(env.name.rfind('/') + 1);
+    string platform = env.platform.empty() ? machine_name : env.platform;
+
+    if (!env.fingerprint.empty()
+            && !send_scheduler(EnvFingerprintMsg(env.fingerprint, platform, file))) {
+        log_warning() << "failed to register native environment " << file << endl;
+        return;
+    }
+
+    if (!env.identity.empty() && IS_PROTOCOL_51(scheduler)
+            && !send_scheduler(EnvFingerprintMsg("toolchain:" + env.identity + "@" + platform,
+                                                 platform, file))) {
+        log_warning() << "failed to register native environment " << file << endl;
+    }
+}
+
+// The scheduler's answer whether some daemon has an environment for the toolchain.
+void Daemon::handle_env_lookup(EnvFingerprintMsg *msg)
+{
+    if (msg->fingerprint.compare(0, 10, "toolchain:") == 0) {
+        handle_cross_env(msg);
+        return;
+    }
+
+    for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        NativeEnvironment &env = it->second;
+
+        if (!env.lookup_pending || env.fingerprint != msg->fingerprint) {
+            continue;
+        }
+
+        env.lookup_pending = false;
+
+        if (msg->name.empty() || msg->name.find('/') != string::npos) {
+            create_native_env(env);
+            continue;
+        }
+
+        log_info() << "fetching native environment " << msg->name << " for " << it->first
+                   << " from " << msg->host << ":" << msg->port << endl;
+        env.fetching = true;
+        env.create_env_pipe = start_fetch_env(envbasedir, user_uid, user_gid, msg->host, msg->port,
+                                              peers.protocol(msg->host, msg->port),
+                                              msg->fingerprint, msg->platform, msg->name,
+                                              env.compiler);
+
+        if (!env.create_env_pipe) {
+            create_native_env(env);
+        }
+    }
+}
+
+// Asks the scheduler now and then whether there are compile servers on other platforms
+// with a cross compiler matching the one of a native environment.
+void Daemon::lookup_cross_envs(NativeEnvironment &env)
+{
+    time_t now = time(NULL);
+
+    if (!scheduler || !IS_PROTOCOL_51(scheduler) || !env.platform.empty() || env.compiler.empty()
+            || !env.extrafiles.empty() || now - env.cross_lookup < cross_lookup_interval) {
+        return;
+    }
+
+    env.cross_lookup = now;
+
+    // it comes with the environment, see create_env_finished()
+    if (env.identity.empty()) {
+        return;
+    }
+
+    trace() << "looking up cross environments of " << env.identity << endl;
+
+    if (!send_scheduler(EnvFingerprintMsg("toolchain:" + env.identity, machine_name, ""))) {
+        log_warning() << "failed to look up environments of " << env.identity << endl;
+    }
+}
+
+// An environment of a toolchain the local clients use, built for another platform.
+void Daemon::handle_cross_env(EnvFingerprintMsg *msg)
+{
+    string::size_type at = msg->fingerprint.rfind('@');
+
+    if (msg->name.empty() || msg->name.find('/') != string::npos || at == string::npos
+            || msg->platform.empty() || msg->platform == machine_name) {
+        return;
+    }
+
+    string identity = msg->fingerprint.substr(10, at - 10);
+    string env_key = "cross:" + msg->platform + ":" + identity;
+    map<string, NativeEnvironment>::iterator it = native_environments.find(env_key);
+
+    if (it != native_environments.end()
+            && (it->second.create_env_pipe || access(it->second.name.c_str(), R_OK) == 0)) {
+        return;
+    }
+
+    log_info() << "fetching " << msg->platform << " environment " << msg->name << " for "
+               << identity << " from " << msg->host << ":" << msg->port << endl;
+    NativeEnvironment &env = native_environments[env_key];
+    env.name.clear();
+    env.identity = identity;
+    env.platform = msg->platform;
+    env.fetching = true;
+    env.create_env_pipe = start_fetch_env(envbasedir, user_uid, user_gid, msg->host, msg->port,
+                                          peers.protocol(msg->host, msg->port),
+                                          msg->fingerprint, msg->platform, msg->name, string());
+
+    if (!env.create_env_pipe) {
+        native_environments.erase(env_key);
+    }
+}
+
+// Builds the environments of the cross compilers given on the command line, for
+// clients of other platforms that use the same compiler for our platform.
+void Daemon::create_cross_envs()
+{
+    if (!scheduler || !IS_PROTOCOL_51(scheduler)) {
+        return;
+    }
+
+    for (list<string>::const_iterator it = cross_compilers.begin(); it != cross_compilers.end(); ++it) {
+        string compiler = get_c_compiler(*it);
+        string env_key = ":" + compiler;
+        struct stat st;
+
+        if (stat(compiler.c_str(), &st) != 0) {
+            log_error() << "cross compiler " << compiler << " not found" << endl;
+            continue;
+        }
+
+        map<string, NativeEnvironment>::iterator found = native_environments.find(env_key);
+
+        if (found != native_environments.end()
+                && (found->second.create_env_pipe || found->second.lookup_pending
+                    || !found->second.name.empty())) {
+            continue;
+        }
+
+        NativeEnvironment &env = native_environments[env_key];
+        env.filetimes[compiler] = st.st_mtime;
+        env.compiler = compiler;
+
+        log_info() << "creating environment for cross compiler " << compiler << endl;
+        create_native_env(env);
+
+        if (!env.create_env_pipe) {
+            native_environments.erase(env_key);
+        }
+    }
+}
+
+// Nobody is going to answer the lookups anymore.
+void Daemon::end_env_lookups()
+{
+    for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        if (it->second.lookup_pending) {
+            it->second.lookup_pending = false;
+            create_native_env(it->second);
+        }
+    }
+}
+
+// Another daemon wants a native environment the scheduler knows we have.
+bool Daemon::handle_env_request(Client *client, EnvFingerprintMsg *msg)
+{
+    string file;
+
+    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        const string &name = it->second.name;
+
+        if (!name.empty() && !it->second.create_env_pipe
+                && name.substr(name.rfind('/') + 1) == msg->name) {
+            file = name;
+        }
+    }
+
+    if (file.empty()) {
+        log_warning() << "asked for unknown native environment " << msg->name << endl;
+        client->channel->send_msg(EndMsg());
+        handle_end(client, 123);
+        return false;
+    }
+
+    log_info() << "sending native environment " << msg->name << " to "
+               << client->channel->name << endl;
+
+    struct stat st;
+
+    if (stat(file.c_str(), &st) == 0) {
+        traffic->add(traffic->bulk_out, st.st_size);
+    }
+
+    client->channel->setTrafficClass(MsgChannel::BulkTraffic);
+
+    if (start_send_env(client->channel, file, msg->platform, msg->name) < 0) {
+        log_perror("fork");
+    }
+
+    /* The child owns the connection from now on. Nothing is sent on it here
+       anymore, handle_end() only closes our descriptor of it, which leaves the
+       connection open in the child. */
+    envs_last_use[file] = time(NULL);
+    handle_end(client, 0);
+    return false;
+}
+
+bool Daemon::handle_env_upload(Client *client, EnvUploadMsg *msg)
+{
+    // the upload runs with our network identity, only do it for clients on this machine
+    const string &from = client->channel->name;
+
+    if (from != "local unix domain socket" && from != "127.0.0.1" && from != "::1") {
+        log_error() << "environment upload requested by " << from << endl;
+        client->channel->send_msg(EndMsg());
+        handle_end(client, 124);
+        return false;
+    }
+
+    string key = msg->hostname + ":" + toString(msg->port) + "/" + msg->target + "/" + msg->name;
+    /* Finished uploads are not remembered, the compile server may have lost the
+       environment since, e.g. by restarting. Only the clients asking while one is
+       running share it. */
+    map<string, EnvUpload>::iterator it = env_uploads.find(key);
+
+    if (it == env_uploads.end()) {
+        EnvUpload upload;
+        log_info() << "uploading environment " << msg->name << " (" << msg->target << ") to "
+                   << msg->hostname << ":" << msg->port << endl;
+
+        if (start_upload_env(msg->file, msg->target, msg->name, msg->hostname, msg->port,
+                             peers.protocol(msg->hostname, msg->port), user_uid, user_gid,
+                             env_upload_limit, traffic, upload.pipe) < 0) {
+            msg->result = EnvUploadMsg::TransferFailed;
+            return client->channel->send_msg(*msg);
+        }
+
+        env_uploads[key] = upload;
+    } else {
+        trace() << "waiting for upload of environment " << key << endl;
+    }
+
+    client->pending_upload = key;
+    return true;
+}
+
+void Daemon::env_upload_finished(const string &key)
+{
+    EnvUpload &upload = env_uploads[key];
+    unsigned char result = EnvUploadMsg::TransferFailed;
+
+    if (read(upload.pipe, &result, 1) != 1) {
+        result = EnvUploadMsg::TransferFailed;
+    }
+
+    if ((-1 == close(upload.pipe)) && (errno != EBADF)) {
+        log_perror("close failed");
+    }
+
+    upload.pipe = -1;
+    trace() << "upload of environment " << key << " finished: " << int(result) << endl;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client *client = it->second;
+
+        if (client->pending_upload == key) {
+            // the client knows what it asked for, only the result matters
+            EnvUploadMsg answer;
+            answer.result = result;
+            client->pending_upload.clear();
+            client->channel->send_msg(answer);
+        }
+    }
+
+    env_uploads.erase(key);
+}
+
 bool Daemon::finish_get_native_env(Client *client, string env_key)
 {
     assert(client->status == Client::WAITCREATEENV);
     assert(client->pending_create_env == env_key);
-    UseNativeEnvMsg m(native_environments[env_key].name);
+    NativeEnvironment &env = native_environments[env_key];
+    UseNativeEnvMsg m(env.name);
+
+    // the cross environments lack the extra files, such as plugins or the command
+    // of a custom job
+    if (IS_PROTOCOL_51(client->channel) && !env.identity.empty() && env.extrafiles.empty()) {
+        for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+                it != native_environments.end(); ++it) {
+            const NativeEnvironment &cross = it->second;
+
+            if (!cross.platform.empty() && cross.identity == env.identity && !cross.name.empty()
+                    && !cross.create_env_pipe) {
+                m.cross.push_back(make_pair(cross.platform, cross.name));
+                envs_last_use[cross.name] = time(NULL);
+            }
+        }
+    }
 
     if (!client->channel->send_msg(m)) {
         handle_end(client, 138);
         return false;
     }
 
-    envs_last_use[native_environments[env_key].name] = time(NULL);
+    envs_last_use[env.name] = time(NULL);
     client->status = Client::GOTNATIVE;
     client->pending_create_env.clear();
+    lookup_cross_envs(env);
     return true;
 }
 
@@ -1433,9 +2526,30 @@ bool Daemon::create_env_finished(string env_key)
 
     trace() << "create_env_finished " << env_key << endl;
     assert(env.create_env_pipe);
-    size_t installed_size = finish_create_env(env.create_env_pipe, envbasedir, env.name);
+    int pipe = env.create_env_pipe;
+    string identity;
+    size_t installed_size = finish_create_env(pipe, envbasedir, env.name, identity);
     env.create_env_pipe = 0;
 
+    if (env.identity.empty() && !identity.empty()) {
+        env.identity = identity;
+        trace() << "toolchain of " << env.name << " is " << env.identity << endl;
+    }
+
+    if (!installed_size && !env.platform.empty()) {
+        log_warning() << "fetching " << env.platform << " environment for " << env.identity
+                      << " failed" << endl;
+        close(pipe);
+        return false;
+    }
+
+    if (!installed_size && env.fetching) {
+        log_warning() << "fetching native environment for " << env_key << " failed, creating it" << endl;
+        close(pipe);
+        create_native_env(env);
+        return env.create_env_pipe != 0;
+    }
+
     // we only clean out cache on next target install
     cache_size += installed_size;
     trace() << "cache_size = " << cache_size << endl;
@@ -1460,6 +2574,7 @@ bool Daemon::create_env_finished(string env_key)
 
     envs_last_use[env.name] = time(NULL);
     check_cache_size(env.name);
+    register_native_env(env);
 
     for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
         if (it->second->pending_create_env == env_key)
@@ -1470,6 +2585,8 @@ bool Daemon::create_env_finished(string env_key)
 
 bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
 {
+    bool orphaned_here = cl->reports_orphaned();
+
     if (cl->status == Client::CLIENTWORK) {
         clients.active_processes--;
     }
@@ -1488,6 +2605,19 @@ bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
 
     msg->client_count = clients.size();
 
+    if (orphaned_here) {
+        // compiled by the client itself, which makes this the compile server
+        if (!scheduler || !IS_PROTOCOL_44(scheduler)) {
+            return true;
+        }
+
+        msg->job_id = 0;
+        msg->flags |= JobDoneMsg::Orphaned;
+    } else if (cl->orphaned) {
+        // the compile server reports orphaned jobs itself
+        return true;
+    }
+
     return send_scheduler(*msg);
 }
 
@@ -1508,7 +2638,9 @@ void Daemon::handle_old_request()
                 clients.active_processes++;
                 trace() << "pushed local job " << client->client_id << endl;
 
-                if (!send_scheduler(JobLocalBeginMsg(client->client_id, client->outfile))) {
+                if (!scheduler) {
+                    client->orphaned = true;
+                } else if (!send_scheduler(JobLocalBeginMsg(client->client_id, client->outfile))) {
                     return;
                 }
             }
@@ -1539,7 +2671,7 @@ void Daemon::handle_old_request()
             break;
         }
 
-        client = clients.get_earliest_client(Client::TOCOMPILE);
+        client = next_compile_client();
 
         if (client) {
             CompileJob *job = client->job;
@@ -1550,17 +2682,37 @@ void Daemon::handle_old_request()
             trace() << "request for job " << job->jobID() << endl;
 
             string envforjob = job->targetPlatform() + "/" + job->environmentVersion();
+            map<string, time_t>::const_iterator last_use = envs_last_use.find(envforjob);
+            client->cold_start = envs_job_count[envforjob]++ == 0 || last_use == envs_last_use.end()
+                                 || time(NULL) - last_use->second > env_cold_timeout;
             envs_last_use[envforjob] = time(NULL);
-            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid);
+            client->core = cpu_pinning ? topology.acquire() : -1;
+
+            if (client->core >= 0) {
+                trace() << "job " << job->jobID() << " pinned to core " << client->core << endl;
+            }
+
+            client->mem_granted = memory.predict(*job, client->channel->name);
+            memory.grant(client->mem_granted);
+            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit,
+                                    client->mem_granted, user_uid, user_gid,
+                                    topology.cpus(client->core));
             trace() << "handle connection returned " << pid << endl;
 
             if (pid > 0) {
+                struct timeval now;
+                gettimeofday(&now, 0);
+                slots.job_started((now.tv_sec - client->queued.tv_sec) * 1000
+                                  + (now.tv_usec - client->queued.tv_usec) / 1000);
                 current_kids++;
                 client->status = Client::WAITFORCHILD;
                 client->pipe_from_child = sock;
                 client->child_pid = pid;
 
-                if (!send_scheduler(JobBeginMsg(job->jobID(), clients.size()))) {
+                if (!scheduler) {
+                    client->orphaned = true;
+                } else if (!client->orphaned && job->jobID()
+                           && !send_scheduler(JobBeginMsg(job->jobID(), clients.size()))) {
                     log_info() << "failed sending scheduler about " << job->jobID() << endl;
                 }
             } else {
@@ -1574,6 +2726,41 @@ void Daemon::handle_old_request()
     }
 }
 
+/* The oldest job waiting to compile, if its predicted memory fits into the
+   budget. Younger ones that fit may go first, but each job only lets as many
+   pass as there are slots, then it waits for running jobs to finish.  */
+Client *Daemon::next_compile_client()
+{
+    Client *oldest = clients.get_earliest_client(Client::TOCOMPILE);
+
+    if (!oldest || memory.admit(memory.predict(*oldest->job, oldest->channel->name))) {
+        return oldest;
+    }
+
+    if (oldest->overtaken >= max_kids) {
+        return 0;
+    }
+
+    Client *client = 0;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client *cl = it->second;
+
+        if (cl->status == Client::TOCOMPILE && (!client || cl->client_id < client->client_id)
+                && memory.admit(memory.predict(*cl->job, cl->channel->name))) {
+            client = cl;
+        }
+    }
+
+    if (client) {
+        trace() << "job of client " << oldest->client_id << " waits for memory, starting "
+                << client->client_id << " first" << endl;
+        oldest->overtaken++;
+    }
+
+    return client;
+}
+
 bool Daemon::handle_compile_done(Client *client)
 {
     assert(client->status == Client::WAITFORCHILD);
@@ -1585,18 +2772,33 @@ bool Daemon::handle_compile_done(Client *client)
     assert(current_kids > 0);
     current_kids--;
 
-    unsigned int job_stat[8];
+    unsigned int job_stat[9];
     int end_status = 151;
 
     if (read(client->pipe_from_child, job_stat, sizeof(job_stat)) == sizeof(job_stat)) {
         msg->in_uncompressed = job_stat[JobStatistics::in_uncompressed];
         msg->in_compressed = job_stat[JobStatistics::in_compressed];
+        traffic->add(traffic->job_in, job_stat[JobStatistics::in_compressed]);
+        traffic->add(traffic->job_out, job_stat[JobStatistics::out_uncompressed]);
         msg->out_compressed = msg->out_uncompressed = job_stat[JobStatistics::out_uncompressed];
         end_status = msg->exitcode = job_stat[JobStatistics::exit_code];
         msg->real_msec = job_stat[JobStatistics::real_msec];
         msg->user_msec = job_stat[JobStatistics::user_msec];
         msg->sys_msec = job_stat[JobStatistics::sys_msec];
         msg->pfaults = job_stat[JobStatistics::sys_pfaults];
+        memory.learn(*client->job, client->channel->name, job_stat[JobStatistics::peak_rss] / 1024);
+
+        if (msg->exitcode == 0) {
+            slots.job_done(msg->out_uncompressed, msg->user_msec);
+        }
+
+        if (client->cold_start) {
+            cold_jobs++;
+            cold_jobs_msec += msg->real_msec;
+        } else {
+            warm_jobs++;
+            warm_jobs_msec += msg->real_msec;
+        }
     }
 
     close(client->pipe_from_child);
@@ -1604,8 +2806,16 @@ bool Daemon::handle_compile_done(Client *client)
     string envforjob = client->job->targetPlatform() + "/" + client->job->environmentVersion();
     envs_last_use[envforjob] = time(NULL);
 
-    if(!send_scheduler(*msg))
+    if (client->orphaned) {
+        msg->job_id = 0;
+        msg->flags |= JobDoneMsg::Orphaned;
+    }
+
+    if (client->orphaned && (!scheduler || !IS_PROTOCOL_44(scheduler))) {
+        trace() << "not reporting orphaned job " << client->job->jobID() << endl;
+    } else if (!send_scheduler(*msg)) {
         log_warning() << "failed sending scheduler about compile done " << client->job->jobID() << endl;
+    }
     handle_end(client, end_status);
     delete msg;
     return false;
@@ -1618,10 +2828,17 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
     assert(job);
     client->job = job;
 
+    /* A job placed by a peer without a scheduler has no id, ours doesn't know it,
+       it is counted in the stats and reported as orphaned when done. */
+    if (!scheduler || (client->status != Client::CLIENTWORK && !job->jobID())) {
+        client->orphaned = true;
+    }
+
     if (client->status == Client::CLIENTWORK) {
         assert(job->environmentVersion() == "__client");
 
-        if (!send_scheduler(JobBeginMsg(job->jobID(), clients.size()))) {
+        if (!client->orphaned && job->jobID()
+                && !send_scheduler(JobBeginMsg(job->jobID(), clients.size()))) {
             trace() << "can't reach scheduler to tell him about compile file job "
                     << job->jobID() << endl;
             return false;
@@ -1630,6 +2847,20 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
         // no scheduler is not an error case!
     } else {
         client->status = Client::TOCOMPILE;
+        client->channel->setTrafficClass(MsgChannel::JobTraffic);
+        gettimeofday(&client->queued, 0);
+
+        map<unsigned int, time_t>::iterator released = released_jobs.find(job->jobID());
+
+        if (released != released_jobs.end()) {
+            released_jobs.erase(released);
+
+            // if it can start right away, it is better off here after all
+            if ((current_kids + clients.active_processes) >= std::max((unsigned int)1, max_kids)
+                    && IS_PROTOCOL_54(client->channel)) {
+                return release_job(client);
+            }
+        }
     }
 
     return true;
@@ -1687,6 +2918,13 @@ void Daemon::handle_end(Client *client, int exitcode)
         client->job_id = 0;
     }
 
+    if (client->peer_placed) {
+        peers.release(client->usecsmsg->hostname, client->usecsmsg->port);
+    }
+
+    topology.release(client->core);
+    memory.release(client->mem_granted);
+
     /* Delete from the clients map before send_scheduler, which causes a
        double deletion. */
     if (!clients.erase(client->channel)) {
@@ -1697,7 +2935,17 @@ void Daemon::handle_end(Client *client, int exitcode)
         assert(false);
     }
 
-    if (scheduler && client->status != Client::WAITFORCHILD) {
+    if (scheduler && client->orphaned) {
+        // handle_compile_done() reports the ones that got to WAITFORCHILD
+        if (client->reports_orphaned() && client->status != Client::WAITFORCHILD
+                && IS_PROTOCOL_44(scheduler)) {
+            JobDoneMsg msg(0, exitcode, JobDoneMsg::Orphaned, clients.size());
+
+            if (!send_scheduler(msg)) {
+                trace() << "failed to reach scheduler for orphaned job done msg!" << endl;
+            }
+        }
+    } else if (scheduler && client->status != Client::WAITFORCHILD) {
         int job_id = client->job_id;
         bool use_client_id = false;
 
@@ -1728,6 +2976,7 @@ void Daemon::handle_end(Client *client, int exitcode)
             case Client::TOINSTALL:
             case Client::WAITINSTALL:
             case Client::WAITCREATEENV:
+            case Client::RELEASED:
                 assert(false);   // should not have a job_id
                 break;
             case Client::WAITCOMPILE:
@@ -1784,14 +3033,99 @@ void Daemon::clear_children()
     trace() << "cleared children\n";
 }
 
+/* The scheduler went away. Jobs it assigned keep running and deliver their results
+   to the clients, but a new scheduler won't know their job ids, so they are counted
+   in the next login and reported as orphaned when done. */
+void Daemon::orphan_clients()
+{
+    int count = 0;
+
+    for (Clients::iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client *cl = it->second;
+
+        switch (cl->status) {
+        case Client::WAITFORCS:
+            /* the answer is lost with the scheduler, compile locally instead,
+               the same as handle_get_cs() does without a scheduler */
+            cl->usecsmsg = new UseCSMsg(cl->target, "127.0.0.1", daemon_port, cl->client_id, true, 1, 0);
+            cl->status = Client::PENDING_USE_CS;
+            cl->job_id = cl->client_id;
+            cl->orphaned = true;
+            count++;
+            break;
+        case Client::PENDING_USE_CS:
+        case Client::TOCOMPILE:
+        case Client::WAITFORCHILD:
+        case Client::WAITCOMPILE:
+        case Client::CLIENTWORK:
+            cl->orphaned = true;
+            count++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (count) {
+        log_info() << "keeping " << count << " jobs running without scheduler" << endl;
+    }
+}
+
 bool Daemon::handle_get_cs(Client *client, Msg *msg)
 {
     GetCSMsg *umsg = dynamic_cast<GetCSMsg *>(msg);
     assert(client);
+
+    // the client gave up on the compile server it got and asks for another one
+    if (client->peer_placed) {
+        peers.release(client->usecsmsg->hostname, client->usecsmsg->port);
+        client->peer_placed = false;
+    } else if (client->job_id && !client->orphaned && scheduler) {
+        trace() << "job " << client->job_id << " is retried elsewhere" << endl;
+
+        if (!send_scheduler(JobDoneMsg(client->job_id, 108, JobDoneMsg::FROM_SUBMITTER, clients.size()))) {
+            return false;
+        }
+    }
+
+    client->job_id = 0;
+    delete client->usecsmsg;
+    client->usecsmsg = 0;
     client->status = Client::WAITFORCS;
+    client->target = umsg->target;
+    client->orphaned = !scheduler;
     umsg->client_id = client->client_id;
     trace() << "handle_get_cs " << umsg->client_id << endl;
 
+    if (!scheduler && umsg->count == 1 && umsg->preferred_host.empty()) {
+        /* place the job on one of the peers we know from the last
+           scheduler, the compile server counts a job id of 0 as
+           orphaned for its scheduler */
+        string platform;
+        bool got_env;
+        const Peers::Peer *peer = peers.place(*umsg, platform, got_env);
+
+        if (peer) {
+            if (peer_placed_jobs++ == 0) {
+                log_info() << "no scheduler, placing jobs on " << peers.size() << " known peers" << endl;
+            }
+
+            trace() << "placing " << umsg->client_id << " on peer " << peer->hostname << endl;
+            client->usecsmsg = new UseCSMsg(platform, peer->hostname, peer->port, 0, got_env,
+                                            umsg->client_id, 0);
+            client->usecsmsg->host_protocol = peer->protocol;
+            client->peer_placed = true;
+
+            if (!client->channel->send_msg(*client->usecsmsg)) {
+                handle_end(client, 143);
+                return false;
+            }
+
+            client->status = Client::WAITCOMPILE;
+            return true;
+        }
+    }
+
     if (!scheduler) {
         /* now the thing is this: if there is no scheduler
            there is no point in trying to ask him. So we just
@@ -1818,6 +3152,7 @@ int Daemon::handle_cs_conf(ConfCSMsg *msg)
 bool Daemon::handle_local_job(Client *client, Msg *msg)
 {
     client->status = Client::LINKJOB;
+    client->orphaned = false;
     client->outfile = dynamic_cast<JobLocalBeginMsg *>(msg)->outfile;
     return true;
 }
@@ -1841,6 +3176,12 @@ bool Daemon::handle_activity(Client *client)
         return ret;
     }
 
+    if (client->status == Client::RELEASED) {
+        // the job has gone elsewhere, wait for the client to close
+        delete msg;
+        return true;
+    }
+
     switch (msg->type) {
     case M_GET_NATIVE_ENV:
         ret = handle_get_native_env(client, dynamic_cast<GetNativeEnvMsg *>(msg));
@@ -1870,6 +3211,15 @@ bool Daemon::handle_activity(Client *client)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(client, msg);
         break;
+    case M_PEER_LIST:
+        ret = handle_peer_list(client, static_cast<PeerListMsg *>(msg));
+        break;
+    case M_ENV_FINGERPRINT:
+        ret = handle_env_request(client, static_cast<EnvFingerprintMsg *>(msg));
+        break;
+    case M_ENV_UPLOAD:
+        ret = handle_env_upload(client, static_cast<EnvUploadMsg *>(msg));
+        break;
     default:
         log_error() << "protocol error " << msg->type << " on client "
                     << client->dump() << endl;
@@ -1907,6 +3257,9 @@ void Daemon::answer_client_requests()
         maybe_stats();
     }
 
+    maybe_warm_environments();
+    maybe_exchange_peers();
+
     vector< pollfd > pollfds;
     pollfds.reserve( fd2chan.size() + 6 );
     pollfd pfd; // tmp varible
@@ -1967,6 +3320,18 @@ void Daemon::answer_client_requests()
         pfd.fd = discover->listen_fd();
         pfd.events = POLLIN;
         pollfds.push_back(pfd);
+
+        if (discover->cache_connect_fd() >= 0) {
+            pfd.fd = discover->cache_connect_fd();
+            pfd.events = POLLOUT;
+            pollfds.push_back(pfd);
+        }
+    }
+
+    if (peer_exchange_fd >= 0) {
+        pfd.fd = peer_exchange_fd;
+        pfd.events = POLLOUT;
+        pollfds.push_back(pfd);
     }
 
     for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
@@ -1978,6 +3343,35 @@ void Daemon::answer_client_requests()
         }
     }
 
+    for (map<string, EnvUpload>::const_iterator it = env_uploads.begin();
+            it != env_uploads.end(); ++it) {
+        if (it->second.pipe >= 0) {
+            pfd.fd = it->second.pipe;
+            pfd.events = POLLIN;
+            pollfds.push_back(pfd);
+        }
+    }
+
+    if (env_lock_pending) {
+        pfd.fd = env_lock_fd;
+        pfd.events = POLLIN;
+        pollfds.push_back(pfd);
+    }
+
+    unsigned int active_jobs = 0;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        // jobs waiting for an upload are not sending anything yet
+        if ((it->second->status == Client::WAITCOMPILE && it->second->pending_upload.empty())
+                || it->second->status == Client::TOCOMPILE
+                || it->second->status == Client::WAITFORCHILD) {
+            active_jobs++;
+        }
+    }
+
+    // environment uploads slow down while jobs need the network
+    __atomic_store_n(&traffic->active_jobs, active_jobs, __ATOMIC_RELAXED);
+
     int ret = poll(pollfds.data(), pollfds.size(), max_scheduler_pong * 1000);
 
     if (ret < 0 && errno != EINTR) {
@@ -2002,7 +3396,6 @@ void Daemon::answer_client_requests()
                 if (!msg) {
                     log_warning() << "scheduler closed connection" << endl;
                     close_scheduler();
-                    clear_children();
                     return;
                 }
 
@@ -2022,12 +3415,21 @@ void Daemon::answer_client_requests()
                 case M_NO_CS:
                     ret = scheduler_no_cs(static_cast<NoCSMsg *>(msg));
                     break;
+                case M_JOB_RELEASE:
+                    ret = scheduler_job_release(static_cast<JobReleaseMsg *>(msg));
+                    break;
                 case M_GET_INTERNALS:
                     ret = scheduler_get_internals();
                     break;
                 case M_CS_CONF:
                     ret = handle_cs_conf(static_cast<ConfCSMsg *>(msg));
                     break;
+                case M_PEER_LIST:
+                    peers.update(*static_cast<PeerListMsg *>(msg), remote_name, daemon_port);
+                    break;
+                case M_ENV_FINGERPRINT:
+                    handle_env_lookup(static_cast<EnvFingerprintMsg *>(msg));
+                    break;
                 default:
                     log_error() << "unknown scheduler type " << (char)msg->type << endl;
                     ret = 1;
@@ -2042,6 +3444,10 @@ void Daemon::answer_client_requests()
             }
         }
 
+        if (peer_exchange_fd >= 0 && pollfd_is_set(pollfds, peer_exchange_fd, POLLOUT)) {
+            finish_peer_exchange();
+        }
+
         int listen_fd = -1;
 
         if (tcp_listen_fd != -1 && pollfd_is_set(pollfds, tcp_listen_fd, POLLIN)) {
@@ -2147,16 +3553,43 @@ void Daemon::answer_client_requests()
                 ++it;
             }
 
+            for (map<string, EnvUpload>::iterator it = env_uploads.begin();
+                    it != env_uploads.end();) {
+                string key = it->first;
+                int pipe = it->second.pipe;
+                ++it; // env_upload_finished() erases the entry
+
+                if (pipe >= 0 && pollfd_is_set(pollfds, pipe, POLLIN)) {
+                    env_upload_finished(key);
+                }
+            }
+
+            if (env_lock_pending && pollfd_is_set(pollfds, env_lock_fd, POLLIN)) {
+                env_locked();
+            }
         }
 
         if (had_scheduler && !scheduler) {
-            clear_children();
             return;
         }
 
     }
 }
 
+bool Daemon::send_login()
+{
+    LoginMsg lmsg(daemon_port, determine_nodename(), machine_name, supported_features);
+    lmsg.envs = available_environmnents(envbasedir);
+    lmsg.max_kids = max_kids;
+    lmsg.physical_kids = std::min(unsigned(topology.cores()), max_kids);
+    lmsg.noremote = noremote;
+
+    lmsg.orphaned_jobs = count_orphaned_jobs();
+    reported_orphaned_jobs = lmsg.orphaned_jobs;
+
+    return send_scheduler(lmsg);
+}
+
 bool Daemon::reconnect()
 {
     if (scheduler) {
@@ -2174,7 +3607,8 @@ bool Daemon::reconnect()
 
     if (!discover || (NULL == (scheduler = discover->try_get_scheduler()) && discover->timed_out())) {
         delete discover;
-        discover = new DiscoverSched(netname, max_scheduler_pong, schedname, scheduler_port);
+        discover = new DiscoverSched(netname, max_scheduler_pong, schedname, scheduler_port,
+                                     scheduler_cache_file);
     }
 
     if (!scheduler) {
@@ -2195,15 +3629,26 @@ bool Daemon::reconnect()
     }
 
     log_info() << "Connected to scheduler (I am known as " << remote_name << ")" << endl;
+
+    if (peer_placed_jobs) {
+        log_info() << "resuming central placement, " << peer_placed_jobs << " jobs were placed on peers" << endl;
+        peer_placed_jobs = 0;
+    }
     current_load = -1000;
     gettimeofday(&last_stat, 0);
     icecream_load = 0;
 
-    LoginMsg lmsg(daemon_port, determine_nodename(), machine_name, supported_features);
-    lmsg.envs = available_environmnents(envbasedir);
-    lmsg.max_kids = max_kids;
-    lmsg.noremote = noremote;
-    return send_scheduler(lmsg);
+    if (!send_login()) {
+        return false;
+    }
+
+    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        register_native_env(it->second);
+    }
+
+    create_cross_envs();
+    return true;
 }
 
 int Daemon::working_loop()
@@ -2217,10 +3662,350 @@ int Daemon::working_loop()
             clear_children();
             break;
         }
+
+        if (upgrade_requested) {
+            maybe_upgrade();
+        }
     }
     return 0;
 }
 
+/* Clients waiting for the compile child are passed on as they are, the child
+   talks to them. These are too if they have no message in flight, the new
+   daemon couldn't continue reading or writing it. */
+static bool hand_over_if_quiet(const Client *client)
+{
+    switch (client->status) {
+    case Client::UNKNOWN:
+    case Client::GOTNATIVE:
+    case Client::PENDING_USE_CS:
+    case Client::JOBDONE:
+    case Client::LINKJOB:
+    case Client::WAITFORCS:
+    case Client::CLIENTWORK:
+    case Client::RELEASED:
+        return true;
+    case Client::WAITCOMPILE:
+        // the environment upload isn't passed on
+        return client->pending_upload.empty();
+    default:
+        return false;
+    }
+}
+
+static bool can_hand_over(const Client *client)
+{
+    return client->status == Client::WAITFORCHILD
+           || (hand_over_if_quiet(client) && client->channel->is_quiet());
+}
+
+bool Daemon::ready_to_hand_over() const
+{
+    if (scheduler && !scheduler->is_quiet()) {
+        return false;
+    }
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (hand_over_if_quiet(it->second) && !it->second->channel->is_quiet()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Daemon::maybe_upgrade()
+{
+    time_t now = time(0);
+
+    if (!upgrade_started) {
+        log_info() << "upgrading, executing " << execPath << endl;
+        upgrade_started = now;
+    }
+
+    if (!ready_to_hand_over() && now - upgrade_started < upgrade_quiet_timeout) {
+        return;
+    }
+
+    hand_over();
+    // still here, keep running as we are
+    log_error() << "upgrade failed" << endl;
+    upgrade_requested = 0;
+    upgrade_started = 0;
+}
+
+/* Executes the daemon's binary again in this process, which keeps the compile
+   children ours, and passes on the listening sockets, the scheduler
+   connection and the clients. Builds only notice if their job was waiting
+   for a slot, it is released to other hosts, or if a message to or from this
+   daemon was in flight for too long. The installed environments are kept,
+   the native ones are created again when needed. Only returns on failure. */
+bool Daemon::hand_over()
+{
+    if (!keep_capabilities_across_exec()) {
+        log_error() << "the capabilities wouldn't survive the upgrade" << endl;
+        return false;
+    }
+
+    list<Client *> busy;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (!can_hand_over(it->second)) {
+            busy.push_back(it->second);
+        }
+    }
+
+    for (list<Client *>::const_iterator it = busy.begin(); it != busy.end(); ++it) {
+        Client *client = *it;
+
+        // the job would have to wait for its data to be read anyway
+        if (client->status == Client::TOCOMPILE && IS_PROTOCOL_54(client->channel)) {
+            if (!release_job(client) || client->channel->is_quiet()) {
+                continue; // gone, or passed on as released
+            }
+        }
+
+        handle_end(client, 145);
+    }
+
+    end_env_lookups();
+
+    if (scheduler && !scheduler->is_quiet()) {
+        // the jobs keep running and are reported as orphaned to the next one
+        log_warning() << "not passing on the scheduler connection, it is busy" << endl;
+        close_scheduler();
+    }
+
+    list<HandoffRecord> records;
+    vector<int> fds;
+
+    records.push_back(HandoffRecord("daemon") << logfile << scheduler_cache_file << scratchdir
+                      << new_client_id << cache_size << max_scheduler_pong << max_scheduler_ping);
+    records.push_back(HandoffRecord("listen") << tcp_listen_fd << tcp_listen_local_fd
+                      << unix_listen_fd);
+    fds.push_back(tcp_listen_fd);
+    fds.push_back(tcp_listen_local_fd);
+    fds.push_back(unix_listen_fd);
+
+    if (scheduler) {
+        records.push_back(HandoffRecord("scheduler") << scheduler->fd << scheduler->protocol
+                          << scheduler->maximum_remote_protocol << remote_name);
+        fds.push_back(scheduler->fd);
+    }
+
+    for (map<string, time_t>::const_iterator it = envs_last_use.begin();
+            it != envs_last_use.end(); ++it) {
+        map<string, unsigned int>::const_iterator count = envs_job_count.find(it->first);
+        records.push_back(HandoffRecord("env") << it->first << it->second
+                          << (count != envs_job_count.end() ? count->second : 0));
+    }
+
+    for (map<unsigned int, time_t>::const_iterator it = released_jobs.begin();
+            it != released_jobs.end(); ++it) {
+        records.push_back(HandoffRecord("released") << it->first << it->second);
+    }
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        const Client *client = it->second;
+        const MsgChannel *c = client->channel;
+
+        records.push_back(HandoffRecord("client") << c->fd << c->protocol
+                          << c->maximum_remote_protocol << client->client_id
+                          << Client::status_str(client->status) << client->job_id
+                          << client->orphaned << client->peer_placed << client->target
+                          << client->outfile);
+        fds.push_back(c->fd);
+
+        if (client->usecsmsg) {
+            const UseCSMsg *m = client->usecsmsg;
+            records.push_back(HandoffRecord("usecs") << m->host_platform << m->hostname << m->port
+                              << m->job_id << m->got_env << m->client_id << m->matched_job_id
+                              << m->host_protocol);
+        }
+
+        if (client->status == Client::WAITFORCHILD) {
+            const CompileJob *job = client->job;
+            HandoffRecord child("child");
+            child << client->child_pid << client->pipe_from_child << client->core
+                  << client->mem_granted << client->cold_start << job->jobID()
+                  << job->language() << job->targetPlatform() << job->environmentVersion()
+                  << job->workingDirectory() << job->inputFile();
+
+            // what the memory budget learns the job's peak by
+            list<string> flags = job->allFlags();
+
+            for (list<string>::const_iterator flag = flags.begin(); flag != flags.end(); ++flag) {
+                child << *flag;
+            }
+
+            records.push_back(child);
+            fds.push_back(client->pipe_from_child);
+        }
+    }
+
+    int state_fd = write_handoff(records);
+
+    if (state_fd < 0) {
+        return false;
+    }
+
+    bool ok = true;
+
+    for (vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        ok = keep_across_exec(*it) && ok;
+    }
+
+    if (ok) {
+        log_info() << "passing on " << clients.size() << " clients and " << current_kids
+                   << " jobs" << endl;
+        flush_debug();
+        setenv("ICECC_HANDOFF_FD", toString(state_fd).c_str(), 1);
+        unlock_env(); // the next binary locks it again
+        execvp(execPath.c_str(), execArgv);
+        log_perror("execvp()") << "\t" << execPath << endl;
+        unsetenv("ICECC_HANDOFF_FD");
+    }
+
+    for (vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        keep_across_exec(*it, false);
+    }
+
+    close(state_fd);
+    return false;
+}
+
+/* Continues where the daemon that executed us stopped, see hand_over(). */
+void Daemon::take_over(const list<HandoffRecord> &records)
+{
+    Client *client = 0;
+
+    for (list<HandoffRecord>::const_iterator it = records.begin(); it != records.end(); ++it) {
+        const HandoffRecord &r = *it;
+
+        if (r.kind() == "daemon") {
+            scratchdir = r.str(3);
+            new_client_id = r.num(4);
+            cache_size = r.num(5);
+            max_scheduler_pong = r.num(6);
+            max_scheduler_ping = r.num(7);
+        } else if (r.kind() == "listen") {
+            tcp_listen_fd = r.num(1);
+            tcp_listen_local_fd = r.num(2);
+            unix_listen_fd = r.num(3);
+            keep_across_exec(tcp_listen_fd, false);
+            keep_across_exec(tcp_listen_local_fd, false);
+            keep_across_exec(unix_listen_fd, false);
+        } else if (r.kind() == "scheduler") {
+            scheduler = Service::adoptChannel(r.num(1), r.num(2), r.num(3));
+
+            if (!scheduler) {
+                close(r.num(1));
+                continue;
+            }
+
+            remote_name = r.str(4);
+            log_info() << "kept the connection to the scheduler (I am known as " << remote_name
+                       << ")" << endl;
+        } else if (r.kind() == "env") {
+            envs_last_use[r.str(1)] = r.num(2);
+
+            if (r.num(3)) {
+                envs_job_count[r.str(1)] = r.num(3);
+            }
+        } else if (r.kind() == "released") {
+            released_jobs[r.num(1)] = r.num(2);
+        } else if (r.kind() == "client") {
+            Client::Status status = Client::status_from_str(r.str(5));
+            MsgChannel *c = 0;
+
+            if (status <= Client::LASTSTATE) {
+                c = Service::adoptChannel(r.num(1), r.num(2), r.num(3));
+            }
+
+            client = 0;
+
+            if (!c) {
+                close(r.num(1));
+                continue;
+            }
+
+            client = new Client;
+            client->channel = c;
+            client->client_id = r.num(4);
+            client->status = status;
+            client->job_id = r.num(6);
+            client->orphaned = r.num(7);
+            client->peer_placed = r.num(8);
+            client->target = r.str(9);
+            client->outfile = r.str(10);
+            clients[c] = client;
+            fd2chan[c->fd] = c;
+
+            if (status == Client::CLIENTWORK) {
+                clients.active_processes++;
+            }
+        } else if (r.kind() == "usecs" && client) {
+            client->usecsmsg = new UseCSMsg(r.str(1), r.str(2), r.num(3), r.num(4), r.num(5),
+                                            r.num(6), r.num(7));
+            client->usecsmsg->host_protocol = r.num(8);
+        } else if (r.kind() == "child") {
+            int pipe = r.num(2);
+
+            if (!client || client->status != Client::WAITFORCHILD) {
+                // the child is reaped without its result
+                close(pipe);
+                continue;
+            }
+
+            keep_across_exec(pipe, false);
+            client->child_pid = r.num(1);
+            client->pipe_from_child = pipe;
+            client->core = r.num(3);
+            client->mem_granted = r.num(4);
+            client->cold_start = r.num(5);
+            topology.claim(client->core);
+            memory.grant(client->mem_granted);
+            current_kids++;
+
+            CompileJob *job = new CompileJob;
+            job->setJobID(r.num(6));
+            job->setLanguage(CompileJob::Language(r.num(7)));
+            job->setTargetPlatform(r.str(8));
+            job->setEnvironmentVersion(r.str(9));
+            job->setWorkingDirectory(r.str(10));
+            job->setInputFile(r.str(11));
+
+            ArgumentsList flags;
+
+            for (size_t i = 12; i < r.size(); ++i) {
+                flags.append(r.str(i), Arg_Rest);
+            }
+
+            job->setFlags(flags);
+            client->job = job;
+        }
+    }
+
+    // the children's time before counted in the old daemon's load already
+    struct rusage ru;
+
+    if (!getrusage(RUSAGE_CHILDREN, &ru)) {
+        icecream_usage = ru.ru_utime;
+    }
+
+    gettimeofday(&last_stat, 0);
+    drop_ambient_capabilities();
+
+    log_info() << "took over " << clients.size() << " clients and " << current_kids << " jobs"
+               << endl;
+
+    // this binary may support other features or be configured differently,
+    // if sending fails the scheduler connection is closed and made anew
+    if (scheduler && !send_login()) {
+        log_warning() << "logging in again over the kept scheduler connection failed" << endl;
+    }
+}
+
 int main(int argc, char **argv)
 {
     int max_processes = -1;
@@ -2248,6 +4033,13 @@ int main(int argc, char **argv)
             { "user-uid", 1, NULL, 'u'},
             { "cache-limit", 1, NULL, 0},
             { "no-remote", 0, NULL, 0},
+            { "mlock-limit", 1, NULL, 0},
+            { "scratch-size", 1, NULL, 0},
+            { "driver-bypass", 0, NULL, 0},
+            { "cpu-pinning", 0, NULL, 0},
+            { "cross-compiler", 1, NULL, 0},
+            { "env-upload-limit", 1, NULL, 0},
+            { "auto-slots", 1, NULL, 0},
             { "interface", 1, NULL, 'i'},
             { "port", 1, NULL, 'p'},
             { 0, 0, 0, 0 }
@@ -2293,6 +4085,61 @@ int main(int argc, char **argv)
                 }
             } else if (optname == "no-remote") {
                 d.noremote = true;
+            } else if (optname == "mlock-limit") {
+                if (optarg && *optarg) {
+                    errno = 0;
+                    int mb = atoi(optarg);
+
+                    if (!errno && mb >= 0) {
+                        mlock_limit = size_t(mb) * 1024 * 1024;
+                    }
+                } else {
+                    usage("Error: --mlock-limit requires argument");
+                }
+            } else if (optname == "scratch-size") {
+                if (optarg && *optarg) {
+                    errno = 0;
+                    int mb = atoi(optarg);
+
+                    if (!errno && mb >= 0) {
+                        scratch_size_limit = size_t(mb) * 1024 * 1024;
+                    }
+                } else {
+                    usage("Error: --scratch-size requires argument");
+                }
+            } else if (optname == "driver-bypass") {
+                driver_bypass = true;
+            } else if (optname == "cpu-pinning") {
+                cpu_pinning = true;
+            } else if (optname == "cross-compiler") {
+                if (optarg && *optarg) {
+                    cross_compilers.push_back(optarg);
+                } else {
+                    usage("Error: --cross-compiler requires argument");
+                }
+            } else if (optname == "env-upload-limit") {
+                if (optarg && *optarg) {
+                    char *end;
+                    errno = 0;
+                    long kbps = strtol(optarg, &end, 10);
+
+                    if (errno || *end || kbps < 0 || static_cast<unsigned long>(kbps) > UINT_MAX) {
+                        usage("Error: --env-upload-limit requires a number of KB/s");
+                    }
+
+                    env_upload_limit = kbps;
+                } else {
+                    usage("Error: --env-upload-limit requires argument");
+                }
+            } else if (optname == "auto-slots") {
+                unsigned int min_slots, max_slots;
+
+                if (optarg && sscanf(optarg, "%u:%u", &min_slots, &max_slots) == 2
+                        && min_slots > 0 && min_slots <= max_slots) {
+                    d.slots.set_bounds(min_slots, max_slots);
+                } else {
+                    usage("Error: --auto-slots requires <min>:<max>");
+                }
             }
 
         }
@@ -2426,6 +4273,35 @@ int main(int argc, char **argv)
         log_errno("No icecc user on system. Falling back to nobody.", d.warn_icecc_user_errno);
     }
 
+    // for executing the binary again when upgrading
+    execArgv = argv;
+    execPath = argv[0];
+
+    if (execPath.find('/') != string::npos) {
+        if (char *path = realpath(argv[0], NULL)) {
+            execPath = path;
+            free(path);
+        }
+    }
+
+    // executed by the daemon that is upgraded, see Daemon::hand_over()
+    list<HandoffRecord> handoff;
+    bool handed_over = false;
+    bool handoff_read = false;
+
+    if (const char *handoff_fd = getenv("ICECC_HANDOFF_FD")) {
+        handed_over = true;
+        handoff_read = read_handoff(atoi(handoff_fd), handoff);
+        unsetenv("ICECC_HANDOFF_FD");
+
+        for (list<HandoffRecord>::const_iterator it = handoff.begin(); it != handoff.end(); ++it) {
+            if (it->kind() == "daemon") {
+                logfile = it->str(1);
+                d.scheduler_cache_file = it->str(2);
+            }
+        }
+    }
+
     umask(022);
 
     bool remote_disabled = false;
@@ -2441,9 +4317,23 @@ int main(int argc, char **argv)
         chmod("/var/run/icecc", S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
         ignore_result(chown("/var/run/icecc", d.user_uid, d.user_gid));
 
+        // unlike /var/run, this survives reboots
+        mkdir("/var/cache/icecc", S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+        chmod("/var/cache/icecc", S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+        ignore_result(chown("/var/cache/icecc", d.user_uid, d.user_gid));
+        d.scheduler_cache_file = "/var/cache/icecc/scheduler";
+
 #ifdef HAVE_LIBCAP_NG
+        // the bounding set keeps them, so that they can be passed on when upgrading
+        const capng_type_t caps = (capng_type_t)(CAPNG_EFFECTIVE | CAPNG_PERMITTED | CAPNG_BOUNDING_SET);
         capng_clear(CAPNG_SELECT_BOTH);
-        capng_update(CAPNG_ADD, (capng_type_t)(CAPNG_EFFECTIVE | CAPNG_PERMITTED), CAP_SYS_CHROOT);
+        capng_update(CAPNG_ADD, caps, CAP_SYS_CHROOT);
+        if (mlock_limit) {
+            capng_update(CAPNG_ADD, caps, CAP_IPC_LOCK);
+        }
+        if (scratch_size_limit) { // for mounting the scratch dir
+            capng_update(CAPNG_ADD, caps, CAP_SYS_ADMIN);
+        }
         int r = capng_change_id(d.user_uid, d.user_gid,
                                 (capng_flags_t)(CAPNG_DROP_SUPP_GRP | CAPNG_CLEAR_BOUNDING));
         if (r) {
@@ -2463,10 +4353,16 @@ int main(int argc, char **argv)
         }
     }
 
+    d.logfile = logfile;
     setup_debug(debug_level, logfile);
 
     log_info() << "ICECREAM daemon " VERSION " starting up (nice level "
                << nice_level << ") " << endl;
+
+    if (handed_over && !handoff_read) {
+        log_error() << "cannot take over from the upgraded daemon" << endl;
+        exit(EXIT_DISTCC_FAILED);
+    }
     if (remote_disabled)
         log_warning() << "Cannot use chroot, no remote jobs accepted." << endl;
     if (d.noremote)
@@ -2480,7 +4376,7 @@ int main(int argc, char **argv)
         exit(EXIT_DISTCC_FAILED);
     }
 
-    if (detach)
+    if (detach && !handed_over)
         if (daemon(0, 0)) {
             log_perror("Failed to run as a daemon.");
             exit(EXIT_DISTCC_FAILED);
@@ -2490,12 +4386,19 @@ int main(int argc, char **argv)
         log_info() << d.num_cpus << " CPU(s) online on this server" << endl;
     }
 
+    if (d.topology.discover()) {
+        log_info() << d.topology.cores() << " physical core(s) with " << d.topology.threads()
+                   << " thread(s) on " << d.topology.nodes() << " NUMA node(s)" << endl;
+    }
+
     if (max_processes < 0) {
         max_kids = d.num_cpus;
     } else {
         max_kids = max_processes;
     }
 
+    max_kids = d.slots.clamp(max_kids);
+
     log_info() << "allowing up to " << max_kids << " active jobs" << endl;
 
     d.determine_supported_features();
@@ -2535,18 +4438,39 @@ int main(int argc, char **argv)
     pidFile << dcc_master_pid << endl;
     pidFile.close();
 
-    if (!cleanup_cache(d.envbasedir, d.user_uid, d.user_gid)) {
-        return 1;
+    // the upgraded daemon set up all of this already
+    if (!handed_over) {
+        if (!cleanup_cache(d.envbasedir, d.user_uid, d.user_gid)) {
+            return 1;
+        }
+
+        expire_partial_environments(d.envbasedir, partial_env_max_age, cache_size_limit,
+                                    set<string>());
     }
 
-    list<string> nl = get_netnames(200, d.scheduler_port);
-    trace() << "Netnames:" << endl;
+    if (scratch_size_limit && !d.noremote && !handed_over) {
+        if (setup_scratch_dir(d.envbasedir, scratch_size_limit, d.user_uid, d.user_gid)) {
+            d.scratchdir = d.envbasedir + "/scratch";
+            log_info() << "using " << scratch_size_limit / 1024 / 1024
+                       << "MiB scratch dir " << d.scratchdir << endl;
+        } else {
+            log_warning() << "no scratch dir, compile output is written to disk" << endl;
+        }
+    }
+
+    // This only logs, don't delay startup by it otherwise.
+    if (debug_level >= Debug) {
+        list<string> nl = get_netnames(200, d.scheduler_port);
+        trace() << "Netnames:" << endl;
 
-    for (list<string>::const_iterator it = nl.begin(); it != nl.end(); ++it) {
-        trace() << *it << endl;
+        for (list<string>::const_iterator it = nl.begin(); it != nl.end(); ++it) {
+            trace() << *it << endl;
+        }
     }
 
-    if (!d.setup_listen_fds()) { // error
+    if (handed_over) {
+        d.take_over(handoff);
+    } else if (!d.setup_listen_fds()) { // error
         return 1;
     }
 
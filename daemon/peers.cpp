@@ -0,0 +1,185 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "peers.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "logging.h"
+
+using namespace std;
+
+// forget about peers nobody has heard of for this long
+static const time_t peer_max_age = 15 * 60;
+
+static string peer_key(const string &host, unsigned int port)
+{
+    return host + ":" + toString(port);
+}
+
+void Peers::update(const PeerListMsg &msg, const string &self, unsigned int self_port)
+{
+    time_t now = time(0);
+
+    for (list<PeerListMsg::Peer>::const_iterator it = msg.peers.begin(); it != msg.peers.end(); ++it) {
+        if (it->hostname.empty() || (it->hostname == self && it->port == self_port)
+                || it->age >= peer_max_age) {
+            continue;
+        }
+
+        string key = peer_key(it->hostname, it->port);
+        time_t seen = now - it->age;
+        map<string, Peer>::iterator known = peers.find(key);
+
+        if (known != peers.end() && known->second.seen >= seen) {
+            continue;
+        }
+
+        Peer peer;
+        static_cast<PeerListMsg::Peer &>(peer) = *it;
+        peer.seen = seen;
+        peer.assigned = 0; // the load is newer than our own placements
+        peers[key] = peer;
+    }
+}
+
+void Peers::expire()
+{
+    time_t now = time(0);
+
+    for (map<string, Peer>::iterator it = peers.begin(); it != peers.end();) {
+        if (now - it->second.seen >= peer_max_age) {
+            trace() << "forgetting peer " << it->first << endl;
+            peers.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Peers::fill(PeerListMsg &msg, size_t max) const
+{
+    vector<const Peer *> all;
+
+    for (map<string, Peer>::const_iterator it = peers.begin(); it != peers.end(); ++it) {
+        all.push_back(&it->second);
+    }
+
+    time_t now = time(0);
+
+    for (size_t i = 0; i < all.size() && i < max; ++i) {
+        swap(all[i], all[i + random() % (all.size() - i)]);
+        PeerListMsg::Peer entry = *all[i];
+        entry.age = now - all[i]->seen;
+        msg.peers.push_back(entry);
+    }
+}
+
+const Peers::Peer *Peers::random_peer() const
+{
+    if (peers.empty()) {
+        return 0;
+    }
+
+    map<string, Peer>::const_iterator it = peers.begin();
+    advance(it, random() % peers.size());
+    return &it->second;
+}
+
+const Peers::Peer *Peers::place(const GetCSMsg &request, string &platform, bool &got_env)
+{
+    vector<Peer *> candidates;
+
+    for (map<string, Peer>::iterator it = peers.begin(); it != peers.end(); ++it) {
+        Peer &peer = it->second;
+
+        if (peer.max_jobs == 0 || int(peer.protocol) < request.minimal_host_version
+                || (peer.features & request.required_features) != request.required_features
+                || request.avoids(peer.hostname, peer.port)) {
+            continue;
+        }
+
+        for (Environments::const_iterator env = request.versions.begin();
+                env != request.versions.end(); ++env) {
+            if (env->first == peer.host_platform) {
+                candidates.push_back(&peer);
+                break;
+            }
+        }
+    }
+
+    if (candidates.empty()) {
+        return 0;
+    }
+
+    Peer *best = 0;
+    float best_usage = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        Peer *peer = candidates[random() % candidates.size()];
+        float usage = peer->load / 1000.0 + float(peer->assigned) / peer->max_jobs;
+
+        if (!best || usage < best_usage) {
+            best = peer;
+            best_usage = usage;
+        }
+    }
+
+    if (best_usage >= 1) {
+        return 0;
+    }
+
+    best->assigned++;
+    platform = best->host_platform;
+    got_env = false;
+
+    for (Environments::const_iterator env = request.versions.begin();
+            env != request.versions.end(); ++env) {
+        if (env->first != platform) {
+            continue;
+        }
+
+        for (Environments::const_iterator have = best->envs.begin(); have != best->envs.end(); ++have) {
+            if (*have == *env) {
+                got_env = true;
+            }
+        }
+    }
+
+    return best;
+}
+
+void Peers::release(const string &host, unsigned int port)
+{
+    map<string, Peer>::iterator it = peers.find(peer_key(host, port));
+
+    if (it != peers.end() && it->second.assigned > 0) {
+        it->second.assigned--;
+    }
+}
+
+int Peers::protocol(const string &host, unsigned int port) const
+{
+    map<string, Peer>::const_iterator it = peers.find(peer_key(host, port));
+    return it != peers.end() ? it->second.protocol : 0;
+}
@@ -0,0 +1,58 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_PEERS_H
+#define ICECREAM_PEERS_H
+
+#include <comm.h>
+#include <map>
+#include <string>
+
+/* The compile servers a daemon knows about, learned from the scheduler and
+   from exchanging lists with other daemons. Used to place jobs while no
+   scheduler is reachable. */
+class Peers
+{
+public:
+    struct Peer : public PeerListMsg::Peer {
+        time_t seen;
+        unsigned int assigned; // jobs we placed there since last hearing about it
+    };
+
+    // merge the entries of msg, skipping ourselves (as known to others)
+    void update(const PeerListMsg &msg, const std::string &self, unsigned int self_port);
+    void expire();
+    // add up to max random entries to msg
+    void fill(PeerListMsg &msg, size_t max) const;
+    const Peer *random_peer() const;
+    // power of two choices among the peers able to take the job, 0 if none has a free slot
+    const Peer *place(const GetCSMsg &request, std::string &platform, bool &got_env);
+    void release(const std::string &host, unsigned int port);
+    // the protocol the peer speaks, 0 if unknown
+    int protocol(const std::string &host, unsigned int port) const;
+    size_t size() const {
+        return peers.size();
+    }
+
+private:
+    std::map<std::string, Peer> peers; // by host:port
+};
+
+#endif
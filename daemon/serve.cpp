@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <cassert>
+#include <vector>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -53,8 +54,11 @@
 #include "serve.h"
 #include "util.h"
 #include "file_util.h"
+#include "topology.h"
+#include "command.h"
 
 #include <sys/time.h>
+#include <sys/statvfs.h>
 
 #ifdef __FreeBSD__
 #include <sys/socket.h>
@@ -69,8 +73,78 @@
 #define _PATH_TMP "/tmp"
 #endif
 
+#ifndef _PATH_VARTMP
+#define _PATH_VARTMP "/var/tmp"
+#endif
+
 using namespace std;
 
+// Below this much free space in a scratch /tmp the output goes to disk instead.
+static const unsigned long min_scratch_space = 25 * 1024 * 1024;
+
+// Whether /tmp is a scratch tmpfs separate from the disk-backed /var/tmp.
+static bool can_spill_to_disk()
+{
+    struct stat tmp_st, spill_st;
+
+    return stat(_PATH_TMP, &tmp_st) == 0 && stat(_PATH_VARTMP, &spill_st) == 0
+           && tmp_st.st_dev != spill_st.st_dev && access(_PATH_VARTMP, W_OK) == 0;
+}
+
+/**
+ * Returns the directory to put compile output in. Normally that's /tmp, but if
+ * /tmp is a scratch tmpfs and is (almost) full, spill to disk rather than failing
+ * the job. A job that fills it up while running is compiled again on disk.
+ **/
+static const char *output_tmp_dir()
+{
+    struct statvfs tmp_fs;
+
+    if (can_spill_to_disk() && statvfs(_PATH_TMP, &tmp_fs) == 0
+            && (unsigned long long)tmp_fs.f_bavail * tmp_fs.f_frsize < min_scratch_space) {
+        trace() << "scratch " << _PATH_TMP << " is full, spilling output to " << _PATH_VARTMP << endl;
+        return _PATH_VARTMP;
+    }
+
+    return _PATH_TMP;
+}
+
+/**
+ * Opens an unlinked file on disk for the preprocessed source of a job, it
+ * mostly stays in the page cache for the short time it is needed.
+ **/
+static int open_kept_input()
+{
+    char name[] = _PATH_VARTMP "/icecc-input-XXXXXX";
+    int fd = mkstemp(name);
+
+    if (fd < 0) {
+        log_perror("mkstemp failed") << "\t" << name << endl;
+        return -1;
+    }
+
+    unlink(name);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static void remove_output(const string &obj_file, const string &dwo_file, const string &tmp_path)
+{
+    if (!obj_file.empty()) {
+        if (-1 == unlink(obj_file.c_str()) && errno != ENOENT){
+            log_perror("unlink failure") << "\t" << obj_file << endl;
+        }
+    }
+    if (!dwo_file.empty()) {
+        if (-1 == unlink(dwo_file.c_str()) && errno != ENOENT){
+            log_perror("unlink failure") << "\t" << dwo_file << endl;
+        }
+    }
+    if (!tmp_path.empty()) {
+        rmpath(tmp_path.c_str());
+    }
+}
+
 int nice_level = 5;
 
 static void
@@ -93,10 +167,17 @@ static void write_output_file( const string& file, MsgChannel* client )
             throw myexception(EXIT_DISTCC_FAILED);
         }
 
-        unsigned char buffer[100000];
+        // the chunk size grows as the connection gets up to speed
+        vector<unsigned char> buffer;
 
         do {
-            ssize_t bytes = read(obj_fd, buffer, sizeof(buffer));
+            size_t chunk_size = client->bulkChunkSize();
+
+            if (chunk_size > buffer.size()) {
+                buffer.resize(chunk_size);
+            }
+
+            ssize_t bytes = read(obj_fd, &buffer[0], chunk_size);
 
             if (bytes < 0) {
                 if (errno == EINTR) {
@@ -114,7 +195,7 @@ static void write_output_file( const string& file, MsgChannel* client )
                 break;
             }
 
-            FileChunkMsg fcmsg(buffer, bytes);
+            FileChunkMsg fcmsg(&buffer[0], bytes);
 
             if (!client->send_msg(fcmsg)) {
                 log_info() << "write of obj chunk failed " << bytes << endl;
@@ -136,7 +217,9 @@ static void write_output_file( const string& file, MsgChannel* client )
  **/
 int handle_connection(const string &basedir, CompileJob *job,
                       MsgChannel *client, int &out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid)
+                      unsigned int mem_limit, unsigned int mem_granted,
+                      uid_t user_uid, gid_t user_gid,
+                      const vector<int> &cpus)
 {
     int socket[2];
 
@@ -167,6 +250,8 @@ int handle_connection(const string &basedir, CompileJob *job,
     /* internal communication channel, don't inherit to gcc */
     fcntl(out_fd, F_SETFD, FD_CLOEXEC);
 
+    pin_to_cpus(cpus);
+
     int niceval = nice(nice_level);
     if (niceval == -1) {
         log_warning() << "failed to set nice value: " << strerror(errno)
@@ -201,7 +286,7 @@ int handle_connection(const string &basedir, CompileJob *job,
         }
 
         int ret;
-        unsigned int job_stat[8];
+        unsigned int job_stat[9];
         CompileResultMsg rmsg;
         unsigned int job_id = job->jobID();
 
@@ -210,67 +295,110 @@ int handle_connection(const string &basedir, CompileJob *job,
         char *tmp_output = 0;
         char prefix_output[32]; // 20 for 2^64 + 6 for "icecc-" + 1 for trailing NULL
         sprintf(prefix_output, "icecc-%u", job_id);
+        const char *tmp_dir = output_tmp_dir();
 
-        if (job->dwarfFissionEnabled() && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
-            tmp_path = tmp_output;
-            free(tmp_output);
-
-            // dwo information is embedded in the final object file, but the compiler
-            // hard codes the path to the dwo file based on the given path to the
-            // object output file. In every case, we must recreate the directory structure of
-            // the client system inside our tmp directory, including both the working
-            // directory the compiler will be run from as well as the relative path from
-            // that directory to the specified output file.
-            //
-            // the work_it() function will rewrite the tmp build directory as root, effectively
-            // letting us set up a "chroot"ed environment inside the build folder and letting
-            // us set up the paths to mimic the client system
-
-            string job_output_file = job->outputFile();
-            string job_working_dir = job->workingDirectory();
-
-            size_t slash_index = job_output_file.rfind('/');
-            string file_dir, file_name;
-            if (slash_index != string::npos) {
-                file_dir = job_output_file.substr(0, slash_index);
-                file_name = job_output_file.substr(slash_index+1);
-            }
-            else {
-                file_name = job_output_file;
-            }
+        // while the output goes to the scratch tmpfs, keep the input to compile it
+        // again on disk if the tmpfs runs full meanwhile
+        KeptInput kept_input;
+        KeptInput *keep_input = 0;
 
-            string output_dir, relative_file_path;
-            if (!file_dir.empty() && file_dir[0] == '/') { // output dir is absolute, convert to relative
-                relative_file_path = get_relative_path(get_canonicalized_path(job_output_file), get_canonicalized_path(job_working_dir));
-                output_dir = tmp_path + get_canonicalized_path(file_dir);
-            }
-            else { // output file is already relative, canonicalize in relation to working dir
-                string canonicalized_dir = get_canonicalized_path(job_working_dir + '/' + file_dir);
-                relative_file_path = get_relative_path(canonicalized_dir + '/' + file_name, get_canonicalized_path(job_working_dir));
-                output_dir = tmp_path + canonicalized_dir;
+        if (strcmp(tmp_dir, _PATH_TMP) == 0 && can_spill_to_disk()) {
+            kept_input.fd = open_kept_input();
+            keep_input = kept_input.fd >= 0 ? &kept_input : 0;
+        }
+
+        for (;;) {
+            if (job->language() == CompileJob::Lang_Custom) {
+                // a command from icerun, run in a directory holding its input files
+                if ((ret = dcc_make_tmpdir_in(tmp_dir, &tmp_output)) == 0) {
+                    tmp_path = tmp_output;
+                    free(tmp_output);
+                    ret = run_command(*job, job_stat, client, rmsg, tmp_path, mem_limit);
+                }
             }
+            else if (job->dwarfFissionEnabled() && (ret = dcc_make_tmpdir_in(tmp_dir, &tmp_output)) == 0) {
+                tmp_path = tmp_output;
+                free(tmp_output);
+
+                // dwo information is embedded in the final object file, but the compiler
+                // hard codes the path to the dwo file based on the given path to the
+                // object output file. In every case, we must recreate the directory structure of
+                // the client system inside our tmp directory, including both the working
+                // directory the compiler will be run from as well as the relative path from
+                // that directory to the specified output file.
+                //
+                // the work_it() function will rewrite the tmp build directory as root, effectively
+                // letting us set up a "chroot"ed environment inside the build folder and letting
+                // us set up the paths to mimic the client system
+
+                string job_output_file = job->outputFile();
+                string job_working_dir = job->workingDirectory();
+
+                size_t slash_index = job_output_file.rfind('/');
+                string file_dir, file_name;
+                if (slash_index != string::npos) {
+                    file_dir = job_output_file.substr(0, slash_index);
+                    file_name = job_output_file.substr(slash_index+1);
+                }
+                else {
+                    file_name = job_output_file;
+                }
+
+                string output_dir, relative_file_path;
+                if (!file_dir.empty() && file_dir[0] == '/') { // output dir is absolute, convert to relative
+                    relative_file_path = get_relative_path(get_canonicalized_path(job_output_file), get_canonicalized_path(job_working_dir));
+                    output_dir = tmp_path + get_canonicalized_path(file_dir);
+                }
+                else { // output file is already relative, canonicalize in relation to working dir
+                    string canonicalized_dir = get_canonicalized_path(job_working_dir + '/' + file_dir);
+                    relative_file_path = get_relative_path(canonicalized_dir + '/' + file_name, get_canonicalized_path(job_working_dir));
+                    output_dir = tmp_path + canonicalized_dir;
+                }
+
+                if (!mkpath(output_dir)) {
+                    error_client(client, "could not create object file location in tmp directory");
+                    throw myexception(EXIT_IO_ERROR);
+                }
+                if (!mkpath(tmp_path + job_working_dir))  {
+                    error_client(client, "could not create compiler working directory in tmp directory");
+                    throw myexception(EXIT_IO_ERROR);
+                }
+
+                obj_file = output_dir + '/' + file_name;
+                dwo_file = obj_file.substr(0, obj_file.rfind('.')) + ".dwo";
 
-            if (!mkpath(output_dir)) {
-                error_client(client, "could not create object file location in tmp directory");
-                throw myexception(EXIT_IO_ERROR);
+                ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path,
+                              mem_limit, mem_granted, client->fd, keep_input);
             }
-            if (!mkpath(tmp_path + job_working_dir))  {
-                error_client(client, "could not create compiler working directory in tmp directory");
-                throw myexception(EXIT_IO_ERROR);
+            else if (!job->dwarfFissionEnabled() && (ret = dcc_make_tmpnam_in(tmp_dir, prefix_output, ".o", &tmp_output)) == 0) {
+                obj_file = tmp_output;
+                free(tmp_output);
+                string build_path = obj_file.substr(0, obj_file.rfind('/'));
+                string file_name = obj_file.substr(obj_file.rfind('/')+1);
+
+                ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit,
+                              mem_granted, client->fd, keep_input);
             }
 
-            obj_file = output_dir + '/' + file_name;
-            dwo_file = obj_file.substr(0, obj_file.rfind('.')) + ".dwo";
+            if (ret != EXIT_IO_ERROR || !keep_input || !kept_input.complete
+                    || strcmp(tmp_dir, _PATH_VARTMP) == 0) {
+                break;
+            }
 
-            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd);
+            log_warning() << "scratch " << _PATH_TMP << " ran out of space, compiling job "
+                          << job_id << " again in " << _PATH_VARTMP << endl;
+            remove_output(obj_file, dwo_file, tmp_path);
+            obj_file.clear();
+            dwo_file.clear();
+            tmp_path.clear();
+            rmsg.out.clear();
+            rmsg.err.clear();
+            rmsg.status = 0;
+            tmp_dir = _PATH_VARTMP;
         }
-        else if (!job->dwarfFissionEnabled() && (ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
-            obj_file = tmp_output;
-            free(tmp_output);
-            string build_path = obj_file.substr(0, obj_file.rfind('/'));
-            string file_name = obj_file.substr(obj_file.rfind('/')+1);
 
-            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd);
+        if (kept_input.fd >= 0) {
+            close(kept_input.fd);
         }
 
         if (ret) {
@@ -308,7 +436,13 @@ int handle_connection(const string &basedir, CompileJob *job,
             log_perror("close failed");
         }
 
-        if (rmsg.status == 0) {
+        if (rmsg.status == 0 && job->language() == CompileJob::Lang_Custom) {
+            const list<string> outputs = job->commandOutputs();
+
+            for (list<string>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+                write_output_file(tmp_path + "/" + *it, client);
+            }
+        } else if (rmsg.status == 0) {
             write_output_file(obj_file, client);
             if (rmsg.have_dwo_file) {
                 write_output_file(dwo_file, client);
@@ -321,19 +455,7 @@ int handle_connection(const string &basedir, CompileJob *job,
         delete client;
         client = 0;
 
-        if (!obj_file.empty()) {
-            if (-1 == unlink(obj_file.c_str()) && errno != ENOENT){
-                log_perror("unlink failure") << "\t" << obj_file << endl;
-            }
-        }
-        if (!dwo_file.empty()) {
-            if (-1 == unlink(dwo_file.c_str()) && errno != ENOENT){
-                log_perror("unlink failure") << "\t" << dwo_file << endl;
-            }
-        }
-        if (!tmp_path.empty()) {
-            rmpath(tmp_path.c_str());
-        }
+        remove_output(obj_file, dwo_file, tmp_path);
 
         delete job;
 
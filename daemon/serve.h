@@ -25,6 +25,7 @@
 #define ICECREAM_SERVE_H
 
 #include <string>
+#include <vector>
 
 class CompileJob;
 class MsgChannel;
@@ -33,6 +34,8 @@ extern int nice_level;
 
 int handle_connection(const std::string &basedir, CompileJob *job,
                       MsgChannel *serv, int & out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid);
+                      unsigned int mem_limit, unsigned int mem_granted,
+                      uid_t user_uid, gid_t user_gid,
+                      const std::vector<int> &cpus);
 
 #endif
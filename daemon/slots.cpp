@@ -0,0 +1,166 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "slots.h"
+
+#include <algorithm>
+
+#include "logging.h"
+
+using namespace std;
+
+// a window lasts at least this long and takes at least that many jobs
+static const unsigned long min_window_msec = 60 * 1000;
+static const unsigned int min_window_jobs = 8;
+// a window without enough jobs for that long is started anew
+static const unsigned long max_window_msec = 10 * min_window_msec;
+// measurements older than that many windows are tried again
+static const unsigned int max_score_age = 20;
+// a neighbouring count has to be that much better (in percent) to move there
+static const unsigned int margin = 5;
+
+unsigned int SlotTuner::clamp(unsigned int slots) const
+{
+    if (!enabled()) {
+        return slots;
+    }
+
+    return max(min_slots, min(max_slots, slots));
+}
+
+void SlotTuner::job_started(unsigned int waited_msec)
+{
+    waited++;
+    wait_msec += waited_msec;
+}
+
+void SlotTuner::job_done(unsigned int out, unsigned int user_msec)
+{
+    jobs++;
+    out_bytes += out;
+    cpu_msec += user_msec;
+}
+
+void SlotTuner::reset()
+{
+    window_msec = full_msec = 0;
+    out_bytes = cpu_msec = 0;
+    jobs = waited = 0;
+    wait_msec = 0;
+}
+
+bool SlotTuner::measured(unsigned int slots) const
+{
+    map<unsigned int, Score>::const_iterator it = scores.find(slots);
+    return it != scores.end() && windows - it->second.window <= max_score_age;
+}
+
+unsigned int SlotTuner::update(unsigned int slots, unsigned int elapsed, bool full)
+{
+    if (!enabled()) {
+        return slots;
+    }
+
+    window_msec += elapsed;
+
+    if (full) {
+        full_msec += elapsed;
+    }
+
+    if (window_msec < min_window_msec || jobs < min_window_jobs) {
+        if (window_msec >= max_window_msec) {
+            reset();
+        }
+
+        return slots;
+    }
+
+    last_speed = cpu_msec ? out_bytes * 1000 / cpu_msec : 0;
+    last_throughput = out_bytes * 1000 / window_msec;
+    last_delay = waited ? wait_msec / waited : 0;
+
+    // with slots to spare, the throughput is what was asked for
+    bool saturated = full_msec * 4 >= window_msec * 3 || last_delay >= 1000;
+    bool use = !settling && saturated && out_bytes;
+
+    reset();
+    settling = false;
+    windows++;
+
+    if (!use) {
+        return slots;
+    }
+
+    Score &score = scores[slots];
+
+    if (measured(slots)) {
+        score.throughput = (score.throughput + last_throughput) / 2;
+    } else {
+        score.throughput = last_throughput;
+    }
+
+    score.window = windows;
+
+    unsigned int next = slots;
+
+    if (slots < max_slots && !measured(slots + 1)) {
+        next = slots + 1;
+    } else if (slots > min_slots && !measured(slots - 1)) {
+        next = slots - 1;
+    } else {
+        double best = score.throughput * (100 + margin) / 100;
+
+        if (slots < max_slots && scores[slots + 1].throughput > best) {
+            next = slots + 1;
+            best = scores[slots + 1].throughput;
+        }
+
+        if (slots > min_slots && scores[slots - 1].throughput > best) {
+            next = slots - 1;
+        }
+    }
+
+    trace() << "slot tuning: " << slots << " slots did " << last_throughput << " bytes/s ("
+            << last_speed << " bytes per CPU second, " << last_delay << " ms queue delay), next "
+            << next << endl;
+
+    settling = next != slots;
+    return next;
+}
+
+string SlotTuner::dump() const
+{
+    if (!enabled()) {
+        return string();
+    }
+
+    string result = "  Slot tuning between " + toString(min_slots) + " and " + toString(max_slots)
+                    + ": " + toString(last_speed) + " bytes per CPU second, "
+                    + toString(last_throughput) + " bytes/s, " + toString(last_delay)
+                    + " ms queue delay\n";
+
+    for (map<unsigned int, Score>::const_iterator it = scores.begin(); it != scores.end(); ++it) {
+        result += "    " + toString(it->first) + " slots: " + toString(long(it->second.throughput))
+                  + " bytes/s (" + toString(windows - it->second.window) + " windows ago)\n";
+    }
+
+    return result;
+}
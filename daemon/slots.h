@@ -0,0 +1,111 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_SLOTS_H
+#define ICECREAM_SLOTS_H
+
+#include <map>
+#include <string>
+
+/* Looks for the number of concurrent compile jobs with the best throughput,
+   within the configured bounds. Each window of enough jobs measures the
+   output bytes of the finished jobs per second of the window. Only windows
+   in which the slots were all taken or jobs had to wait for one say
+   something about the slot count, the others are dropped. The tuner climbs
+   to whichever neighbouring count did better, trying counts it has no
+   recent measurement for first. */
+class SlotTuner
+{
+public:
+    SlotTuner()
+        : min_slots(0)
+        , max_slots(0)
+        , windows(0)
+        , window_msec(0)
+        , full_msec(0)
+        , out_bytes(0)
+        , cpu_msec(0)
+        , jobs(0)
+        , waited(0)
+        , wait_msec(0)
+        , settling(true)
+        , last_speed(0)
+        , last_throughput(0)
+        , last_delay(0) {}
+
+    void set_bounds(unsigned int min, unsigned int max) {
+        min_slots = min;
+        max_slots = max;
+    }
+    bool enabled() const {
+        return max_slots > 0;
+    }
+    unsigned int clamp(unsigned int slots) const;
+
+    // a job waited that long for a slot before it was started
+    void job_started(unsigned int waited_msec);
+    // a job finished successfully
+    void job_done(unsigned int out, unsigned int user_msec);
+
+    /* Accounts the last elapsed milliseconds, in which all slots were taken
+       or not, and returns the slot count to use from now on. */
+    unsigned int update(unsigned int slots, unsigned int elapsed, bool full);
+
+    // measurements of the last complete window
+    unsigned int speed() const { // output bytes per CPU second
+        return last_speed;
+    }
+    unsigned int throughput() const { // output bytes per second
+        return last_throughput;
+    }
+    unsigned int queue_delay() const { // average milliseconds a job waited for a slot
+        return last_delay;
+    }
+
+    std::string dump() const;
+
+private:
+    void reset();
+    bool measured(unsigned int slots) const;
+
+    struct Score {
+        double throughput;
+        unsigned int window; // when it was last measured
+    };
+
+    unsigned int min_slots;
+    unsigned int max_slots; // 0 if disabled
+    unsigned int windows;
+    // the current window
+    unsigned long window_msec;
+    unsigned long full_msec; // elapsed time in which all slots were taken
+    unsigned long out_bytes;
+    unsigned long cpu_msec;
+    unsigned int jobs;
+    unsigned int waited; // jobs started in the window
+    unsigned long wait_msec;
+    bool settling; // the slot count just changed, the window is not representative
+    std::map<unsigned int, Score> scores;
+    unsigned int last_speed;
+    unsigned int last_throughput;
+    unsigned int last_delay;
+};
+
+#endif
@@ -0,0 +1,232 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "topology.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <map>
+#include <utility>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "logging.h"
+
+using namespace std;
+
+#ifdef __linux__
+static bool read_id(const string &file, int &id)
+{
+    ifstream in(file.c_str());
+    return bool(in >> id);
+}
+
+// the N of the nodeN entry in the directory of the cpu, 0 without NUMA
+static int cpu_node(const string &cpudir)
+{
+    DIR *dir = opendir(cpudir.c_str());
+    int node = 0;
+
+    if (!dir) {
+        return 0;
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+#endif
+
+bool CpuTopology::discover()
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        log_perror("sched_getaffinity");
+        return false;
+    }
+
+    // (package, core id) -> index in all
+    map<pair<int, int>, size_t> by_id;
+    map<int, size_t> node_index;
+    all.clear();
+    node_cores.clear();
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+
+        string dir = "/sys/devices/system/cpu/cpu" + toString(cpu);
+        int package, core_id;
+
+        if (!read_id(dir + "/topology/physical_package_id", package)
+                || !read_id(dir + "/topology/core_id", core_id)) {
+            trace() << "no topology for cpu " << cpu << endl;
+            all.clear();
+            node_cores.clear();
+            return false;
+        }
+
+        map<pair<int, int>, size_t>::iterator it = by_id.find(make_pair(package, core_id));
+
+        if (it == by_id.end()) {
+            int node = cpu_node(dir);
+
+            if (node_index.find(node) == node_index.end()) {
+                size_t index = node_cores.size();
+                node_index[node] = index;
+                node_cores.push_back(0);
+            }
+
+            Core core;
+            core.node = node_index[node];
+            core.jobs = 0;
+            node_cores[core.node]++;
+            it = by_id.insert(make_pair(make_pair(package, core_id), all.size())).first;
+            all.push_back(core);
+        }
+
+        all[it->second].cpus.push_back(cpu);
+    }
+
+    node_jobs.assign(node_cores.size(), 0);
+    return !all.empty();
+#else
+    return false;
+#endif
+}
+
+size_t CpuTopology::threads() const
+{
+    size_t count = 0;
+
+    for (vector<Core>::const_iterator it = all.begin(); it != all.end(); ++it) {
+        count += it->cpus.size();
+    }
+
+    return count;
+}
+
+int CpuTopology::acquire()
+{
+    int best = -1;
+
+    for (size_t i = 0; i < all.size(); ++i) {
+        if (best < 0 || all[i].jobs < all[best].jobs) {
+            best = i;
+            continue;
+        }
+
+        // the same number of jobs on the core, prefer the less busy node
+        const Core &core = all[i];
+        const Core &other = all[best];
+
+        if (core.jobs == other.jobs
+                && node_jobs[core.node] * node_cores[other.node]
+                   < node_jobs[other.node] * node_cores[core.node]) {
+            best = i;
+        }
+    }
+
+    if (best >= 0) {
+        all[best].jobs++;
+        node_jobs[all[best].node]++;
+    }
+
+    return best;
+}
+
+void CpuTopology::release(int core)
+{
+    if (core < 0 || size_t(core) >= all.size() || all[core].jobs == 0) {
+        return;
+    }
+
+    all[core].jobs--;
+    node_jobs[all[core].node]--;
+}
+
+void CpuTopology::claim(int core)
+{
+    if (core < 0 || size_t(core) >= all.size()) {
+        return;
+    }
+
+    all[core].jobs++;
+    node_jobs[all[core].node]++;
+}
+
+const vector<int> &CpuTopology::cpus(int core) const
+{
+    static const vector<int> none;
+
+    if (core < 0 || size_t(core) >= all.size()) {
+        return none;
+    }
+
+    return all[core].cpus;
+}
+
+string CpuTopology::dump() const
+{
+    string result;
+
+    for (size_t node = 0; node < node_cores.size(); ++node) {
+        result += "  Node " + toString(node) + ": " + toString(node_cores[node]) + " cores, "
+                  + toString(node_jobs[node]) + " jobs\n";
+    }
+
+    return result;
+}
+
+void pin_to_cpus(const vector<int> &cpus)
+{
+#ifdef __linux__
+    if (cpus.empty()) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (vector<int>::const_iterator it = cpus.begin(); it != cpus.end(); ++it) {
+        CPU_SET(*it, &set);
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        log_perror("sched_setaffinity");
+    }
+#else
+    (void) cpus;
+#endif
+}
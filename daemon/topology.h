@@ -0,0 +1,70 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_TOPOLOGY_H
+#define ICECREAM_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+/* The physical cores this daemon may run on, each with its hardware threads
+   and NUMA node. Compile children are pinned to a core, so that they neither
+   wander between sockets nor share a core while others are idle, and their
+   memory is allocated on the node they run on. */
+class CpuTopology
+{
+public:
+    // false if the topology cannot be read (only supported on Linux)
+    bool discover();
+
+    size_t cores() const {
+        return all.size();
+    }
+    size_t threads() const;
+    size_t nodes() const {
+        return node_cores.size();
+    }
+
+    // Picks the core for a new job: one without jobs if there is any, on the
+    // node with the fewest jobs. Returns -1 if the topology is not known.
+    int acquire();
+    void release(int core);
+    // counts a job that was started on the core before, e.g. by the daemon that was upgraded
+    void claim(int core);
+    const std::vector<int> &cpus(int core) const;
+
+    std::string dump() const;
+
+private:
+    struct Core {
+        int node;
+        std::vector<int> cpus;
+        unsigned int jobs;
+    };
+
+    std::vector<Core> all;
+    std::vector<unsigned int> node_jobs;
+    std::vector<unsigned int> node_cores;
+};
+
+// restricts the calling process (and the compilers it starts) to the given CPUs
+extern void pin_to_cpus(const std::vector<int> &cpus);
+
+#endif
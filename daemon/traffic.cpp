@@ -0,0 +1,91 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+#include "traffic.h"
+
+#include <algorithm>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+
+Traffic *Traffic::create_shared()
+{
+    void *mem = mmap(0, sizeof(Traffic), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED) {
+        log_perror("mmap");
+        return 0;
+    }
+
+    memset(mem, 0, sizeof(Traffic));
+    return static_cast<Traffic *>(mem);
+}
+
+BulkBucket::BulkBucket(unsigned int kbps, Traffic *_traffic)
+    : TokenBucket(kbps)
+    , limit(kbps)
+    , traffic(_traffic)
+    , measured(0)
+    , window_start(seconds_now())
+    , window_bytes(0)
+    , window_shared(false)
+{
+}
+
+unsigned int BulkBucket::rate() const
+{
+    unsigned int full = limit ? limit : measured;
+
+    if (traffic && full && __atomic_load_n(&traffic->active_jobs, __ATOMIC_RELAXED)) {
+        return std::max(full / 4, 1U);
+    }
+
+    return limit;
+}
+
+void BulkBucket::consume(size_t len)
+{
+    if (traffic) {
+        traffic->add(traffic->bulk_out, len);
+
+        if (__atomic_load_n(&traffic->active_jobs, __ATOMIC_RELAXED)) {
+            window_shared = true;
+        }
+    }
+
+    window_bytes += len;
+    double now = seconds_now();
+
+    // only a window the transfer had the network to itself shows what the link can do
+    if (now - window_start >= 1) {
+        if (!window_shared) {
+            measured = std::max(1U, (unsigned int)(window_bytes / 1024 / (now - window_start)));
+        }
+
+        window_start = now;
+        window_bytes = 0;
+        window_shared = false;
+    }
+
+    TokenBucket::consume(len);
+}
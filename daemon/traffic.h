@@ -0,0 +1,66 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_TRAFFIC_H
+#define ICECREAM_TRAFFIC_H
+
+#include "envtransfer.h"
+#include <stdint.h>
+
+/* Bytes transferred per traffic class, and how many jobs move data right now.
+   Lives in memory shared with the children uploading environments, which
+   count their bytes there and slow down while there is job traffic. */
+struct Traffic {
+    uint32_t active_jobs; // only written by the daemon
+    uint64_t job_in;
+    uint64_t job_out;
+    uint64_t bulk_in;
+    uint64_t bulk_out;
+
+    // 0 if the memory cannot be mapped
+    static Traffic *create_shared();
+
+    void add(uint64_t &counter, uint64_t bytes) {
+        __sync_fetch_and_add(&counter, bytes);
+    }
+};
+
+// Sends environments at the configured rate, or a quarter of it while jobs
+// need the network, and counts them as bulk traffic. Without a configured
+// rate, the rate measured while no jobs needed the network is used.
+class BulkBucket : public TokenBucket
+{
+public:
+    BulkBucket(unsigned int kbps, Traffic *traffic);
+
+    virtual unsigned int rate() const;
+    virtual void consume(size_t len);
+
+private:
+    unsigned int limit;
+    Traffic *traffic;
+    unsigned int measured; // KB/s, 0 until a second without jobs was measured
+    double window_start;
+    size_t window_bytes;
+    bool window_shared; // jobs needed the network during the window
+};
+
+#endif
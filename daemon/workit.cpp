@@ -27,6 +27,8 @@
 #include "assert.h"
 #include "exitcode.h"
 #include "logging.h"
+#include "driver.h"
+#include "file_util.h"
 #include <sys/select.h>
 #include <algorithm>
 
@@ -72,6 +74,8 @@ using namespace std;
 
 static int death_pipe[2];
 
+bool driver_bypass = false;
+
 extern "C" {
 
     static void theSigCHLDHandler(int)
@@ -98,7 +102,8 @@ error_client(MsgChannel *client, string error)
 
 int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileResultMsg &rmsg,
             const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-            unsigned long int mem_limit, int client_fd)
+            unsigned long int mem_limit, unsigned int mem_granted, int client_fd,
+            KeptInput *kept_input)
 {
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
@@ -160,6 +165,14 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         return EXIT_DISTCC_FAILED;
     }
 
+    // compiling a kept source again
+    bool replay = kept_input && kept_input->complete;
+
+    if (replay && lseek(kept_input->fd, 0, SEEK_SET) < 0) {
+        log_perror("lseek failed");
+        return EXIT_DISTCC_FAILED;
+    }
+
     /* Testing */
     struct sigaction act;
     sigemptyset(&act.sa_mask);
@@ -224,6 +237,13 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 #endif
 #endif
 
+        // HACK: If in / , Clang records DW_AT_name with / prepended .
+        if (chdir((tmp_root + build_path).c_str()) != 0) {
+            error_client(client, "/tmp dir missing?");
+        }
+
+        DriverExpansion expansion(j.inputFile(), file_name, tmp_root);
+
         int argc = list.size();
         argc++; // the program
         argc += 6; // -x c - -o file.o -fpreprocessed
@@ -268,7 +288,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                 argv[i++] = strdup("-Xclang");
                 argv[i++] = strdup("-main-file-name");
                 argv[i++] = strdup("-Xclang");
-                argv[i++] = strdup(j.inputFile().c_str());
+                argv[i++] = strdup(expansion.input().c_str());
             }
             if( !j.workingDirectory().empty()) {
                 argv[i++] = strdup("-Xclang");
@@ -278,11 +298,6 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             }
         }
 
-        // HACK: If in / , Clang records DW_AT_name with / prepended .
-        if (chdir((tmp_root + build_path).c_str()) != 0) {
-            error_client(client, "/tmp dir missing?");
-        }
-
         for (std::list<string>::const_iterator it = list.begin();
                 it != list.end(); ++it) {
             argv[i++] = strdup(it->c_str());
@@ -294,14 +309,16 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 
         argv[i++] = strdup("-");
         argv[i++] = strdup("-o");
-        argv[i++] = strdup(file_name.c_str());
+        argv[i++] = strdup(expansion.output().c_str());
 
         if (!clang) {
+            // collect garbage according to what the job was granted of the memory budget,
+            // the driver expansion keeps these values out of its cache key (see driver.cpp)
             argv[i++] = strdup("--param");
-            sprintf(buffer, "ggc-min-expand=%d", ggc_min_expand_heuristic(mem_limit));
+            sprintf(buffer, "ggc-min-expand=%d", ggc_min_expand_heuristic(mem_granted));
             argv[i++] = strdup(buffer);
             argv[i++] = strdup("--param");
-            sprintf(buffer, "ggc-min-heapsize=%d", ggc_min_heapsize_heuristic(mem_limit));
+            sprintf(buffer, "ggc-min-heapsize=%d", ggc_min_heapsize_heuristic(mem_granted));
             argv[i++] = strdup(buffer);
         }
 
@@ -310,7 +327,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         }
 
         if (!clang && j.dwarfFissionEnabled()) {
-            sprintf(buffer, "-fdebug-prefix-map=%s/=/", tmp_root.c_str());
+            sprintf(buffer, "-fdebug-prefix-map=%s/=/", expansion.root().c_str());
             argv[i++] = strdup(buffer);
         }
 
@@ -318,6 +335,19 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         argv[i] = 0;
         assert(i <= argc);
 
+        // Run the frontend (and assembler) the driver would run for these arguments directly.
+        // The driver's -### run below must not look like the compiler exiting to the parent.
+        signal(SIGCHLD, SIG_DFL);
+        vector<Command> commands;
+
+        if (driver_bypass) {
+            expansion.expand(vector<string>(argv, argv + i), commands);
+        }
+
+        for (int pos = 0; pos < i; ++pos) {
+            argv[pos] = strdup(expansion.resolve(argv[pos]).c_str());
+        }
+
         argstxt.clear();
         for (int pos = 1;
              pos < i;
@@ -327,6 +357,17 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         }
         trace() << "final arguments:" << argstxt << endl;
 
+        for (vector<Command>::const_iterator it = commands.begin(); it != commands.end(); ++it) {
+            argstxt.clear();
+
+            for (Command::const_iterator arg = it->begin(); arg != it->end(); ++arg) {
+                argstxt += ' ';
+                argstxt += *arg;
+            }
+
+            trace() << "running directly:" << argstxt << endl;
+        }
+
         close_debug();
 
         if ((-1 == close(sock_out[0])) && (errno != EBADF)){
@@ -357,7 +398,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             log_perror("close failed");
         }
 
-        if (-1 == dup2(sock_in[0], STDIN_FILENO)){
+        if (-1 == dup2(replay ? kept_input->fd : sock_in[0], STDIN_FILENO)){
             log_perror("dup2 failed");
         }
 
@@ -387,6 +428,10 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 
 #endif
 
+        if (!commands.empty()) {
+            exec_commands(commands, main_sock[1]);
+        }
+
         execv(argv[0], const_cast<char * const*>(argv));    // no return
         perror("ICECC: execv");
 
@@ -446,6 +491,15 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
     FileChunkMsg *fcmsg = 0;
     size_t off = 0;
 
+    if (replay) {
+        // the compiler reads the kept source itself
+        if (-1 == close(sock_in[1])){
+            log_perror("close failed");
+        }
+        sock_in[1] = -1;
+        input_complete = true;
+    }
+
     log_block parent_wait("parent, waiting");
 
     for (;;) {
@@ -463,6 +517,10 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     if (msg->type == M_END) {
                         input_complete = true;
 
+                        if (kept_input && kept_input->fd >= 0) {
+                            kept_input->complete = true;
+                        }
+
                         if (!fcmsg && sock_in[1] != -1) {
                             if (-1 == close(sock_in[1])){
                                 log_perror("close failed");
@@ -475,6 +533,13 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                         fcmsg = static_cast<FileChunkMsg*>(msg);
                         off = 0;
 
+                        if (kept_input && kept_input->fd >= 0
+                                && !write_all(kept_input->fd, fcmsg->buffer, fcmsg->len)) {
+                            log_perror("cannot keep the preprocessed source");
+                            close(kept_input->fd);
+                            kept_input->fd = -1;
+                        }
+
                         job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
                         job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
                     } else {
@@ -661,6 +726,12 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     return EXIT_DISTCC_FAILED;
                 }
 
+#ifdef __APPLE__
+                job_stat[JobStatistics::peak_rss] = ru.ru_maxrss / 1024;
+#else
+                job_stat[JobStatistics::peak_rss] = ru.ru_maxrss; // kilobytes
+#endif
+
                 if (shell_exit_status(status) != 0) {
                     if( !rmsg.out.empty())
                         trace() << "compiler produced stdout output:\n" << rmsg.out;
@@ -685,7 +756,8 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 
 #ifdef HAVE_SYS_VFS_H
                     struct statfs buf;
-                    int ret = statfs( "/", &buf);
+                    // where the output goes, the scratch tmpfs or the disk
+                    int ret = statfs(tmp_root.c_str(), &buf);
                     // If there's less than 10MiB of disk space free, we're probably running out of disk space.
                     if ((ret == 0 && long(buf.f_bavail) < ((10 * 1024 * 1024) / buf.f_bsize))
                             || rmsg.err.find("o space left on device") != string::npos) {
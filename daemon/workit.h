@@ -47,12 +47,25 @@ public:
 namespace JobStatistics
 {
 enum job_stat_fields { in_compressed, in_uncompressed, out_uncompressed, exit_code,
-                       real_msec, user_msec, sys_msec, sys_pfaults
+                       real_msec, user_msec, sys_msec, sys_pfaults, peak_rss
                      };
 }
 
+// execute the compiler frontend directly instead of the driver when possible
+extern bool driver_bypass;
+
+// The preprocessed source of a job, kept in an unlinked file for compiling it again.
+struct KeptInput {
+    KeptInput() : fd(-1), complete(false) {}
+    int fd;
+    bool complete; // all of it arrived, it is not read from the client again
+};
+
+// With kept_input, the source is written there while it is read from the client, or
+// the compiler reads it from there if it is complete already.
 extern int work_it(CompileJob &j, unsigned int job_stats[], MsgChannel *client, CompileResultMsg &msg,
                    const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-                   unsigned long int mem_limit, int client_fd);
+                   unsigned long int mem_limit, unsigned int mem_granted, int client_fd,
+                   KeptInput *kept_input = 0);
 
 #endif
@@ -32,6 +32,7 @@
 #include "../services/logging.h"
 #include "../services/job.h"
 
+#include "iothreads.h"
 #include "job.h"
 #include "scheduler.h"
 
@@ -44,11 +45,14 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_hostId(0)
     , m_nodeName()
     , m_busyInstalling(0)
+    , m_installingJob(0)
     , m_hostPlatform()
     , m_load(1000)
     , m_maxJobs(0)
+    , m_physicalJobs(0)
     , m_noRemote(false)
     , m_jobList()
+    , m_orphanedJobs(0)
     , m_state(CONNECTED)
     , m_type(UNKNOWN)
     , m_chrootPossible(false)
@@ -68,6 +72,8 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_nextConnTime(0)
     , m_lastConnStartTime(0)
     , m_acceptingInConnection(true)
+    , m_ioThread(0)
+    , m_ioClosed(0)
 {
 }
 
@@ -173,16 +179,20 @@ bool CompileServer::is_eligible_ever(const Job *job) const
     // But here we are asked about the daemon's protocol version, so check that.
     bool version_okay = job->minimalHostVersion() <= maximum_remote_protocol;
     bool features_okay = featuresSupported(job->requiredFeatures());
+    // the job failed here before and is retried elsewhere
+    bool avoided = job->avoids(name, m_remotePort);
     bool eligible = jobs_okay
                     && (m_chrootPossible || job->submitter() == this)
                     && version_okay
                     && features_okay
+                    && !avoided
                     && m_acceptingInConnection
                     && can_install(job, true).size()
                     && check_remote(job);
 #if DEBUG_SCHEDULER > 2
     trace() << nodeName() << " is_eligible_ever: " << eligible << " (jobs_okay " << jobs_okay
         << ", version_okay " << version_okay << ", features_okay " << features_okay
+        << ", avoided " << avoided
         << ", chroot_or_local " << (m_chrootPossible || job->submitter() == this)
         << ", accepting " << m_acceptingInConnection << ", can_install " << (can_install(job).size() != 0)
         << ", check_remote " << check_remote(job) << ")" << endl;
@@ -194,8 +204,8 @@ bool CompileServer::is_eligible_now(const Job *job) const
 {
     if(!is_eligible_ever(job))
         return false;
-    bool jobs_okay = int(m_jobList.size()) < m_maxJobs;
-    if( m_maxJobs > 0 && int(m_jobList.size()) < m_maxJobs + maxPreloadCount())
+    bool jobs_okay = activeJobCount() < m_maxJobs;
+    if( m_maxJobs > 0 && activeJobCount() < m_maxJobs + maxPreloadCount())
         jobs_okay = true; // allow a job for preloading
     bool load_okay = m_load < 1000;
     bool eligible = jobs_okay
@@ -248,9 +258,17 @@ time_t CompileServer::busyInstalling() const
     return m_busyInstalling;
 }
 
-void CompileServer::setBusyInstalling(time_t time)
+void CompileServer::setBusyInstalling(time_t time, unsigned int job_id)
 {
     m_busyInstalling = time;
+    m_installingJob = job_id;
+}
+
+void CompileServer::clearBusyInstalling(unsigned int job_id)
+{
+    if (m_busyInstalling && m_installingJob == job_id) {
+        setBusyInstalling(0);
+    }
 }
 
 string CompileServer::hostPlatform() const
@@ -283,6 +301,16 @@ void CompileServer::setMaxJobs(int jobs)
     m_maxJobs = jobs;
 }
 
+int CompileServer::physicalJobs() const
+{
+    return m_physicalJobs;
+}
+
+void CompileServer::setPhysicalJobs(int jobs)
+{
+    m_physicalJobs = jobs;
+}
+
 bool CompileServer::noRemote() const
 {
     return m_noRemote;
@@ -309,6 +337,53 @@ void CompileServer::removeJob(Job *job)
     m_jobList.remove(job);
 }
 
+int CompileServer::orphanedJobs() const
+{
+    return m_orphanedJobs;
+}
+
+void CompileServer::setOrphanedJobs(int jobs)
+{
+    m_orphanedJobs = jobs;
+}
+
+int CompileServer::activeJobCount() const
+{
+    return m_jobList.size() + m_orphanedJobs;
+}
+
+/* Gradually throttle with the number of assigned jobs. This takes care of
+   the fact that not all slots are equally fast on CPUs with SMT and dynamic
+   clock ramping.  */
+float CompileServer::slotSpeed() const
+{
+    int active = activeJobCount();
+
+    if (m_physicalJobs > 0 && m_physicalJobs < m_maxJobs) {
+        // The daemon told us which slots are SMT siblings. The cores themselves only
+        // slow down by clock ramping, a job beyond them shares a core with another
+        // one, so the speed drops faster from there on.
+        if (active <= m_physicalJobs) {
+            return 1.0f - 0.25f * active / m_physicalJobs;
+        }
+
+        return 0.75f - 0.45f * (active - m_physicalJobs) / (m_maxJobs - m_physicalJobs);
+    }
+
+    return 1.0f - 0.5f * active / m_maxJobs;
+}
+
+/* Goes by the output the server produced per millisecond in its last jobs,
+   with as many jobs running as it had then.  */
+unsigned long CompileServer::expectedJobTime(unsigned long output, unsigned long fallback) const
+{
+    if (m_cumCompiled.outputSize() == 0 || m_cumCompiled.compileTimeReal() == 0) {
+        return fallback;
+    }
+
+    return (unsigned long)((double)output * m_cumCompiled.compileTimeReal() / m_cumCompiled.outputSize());
+}
+
 unsigned int CompileServer::lastPickedId()
 {
     return m_lastPickId;
@@ -615,3 +690,37 @@ time_t CompileServer::getNextTimeout()
     time_t until_connect = m_nextConnTime - time(0);
     return (until_connect > 0) ? until_connect : 0;
 }
+
+IOThread *CompileServer::ioThread() const
+{
+    return m_ioThread;
+}
+
+void CompileServer::setIOThread(IOThread *thread)
+{
+    m_ioThread = thread;
+}
+
+bool CompileServer::ioClosed() const
+{
+    return __atomic_load_n(&m_ioClosed, __ATOMIC_ACQUIRE);
+}
+
+void CompileServer::setIOClosed()
+{
+    __atomic_store_n(&m_ioClosed, 1, __ATOMIC_RELEASE);
+}
+
+bool CompileServer::post_msg(Msg *m, int flags)
+{
+    return m_ioThread->send(this, m, flags);
+}
+
+bool CompileServer::send_msg_here(const Msg &m, int flags)
+{
+    if (m_ioThread) {
+        return m_ioThread->send(this, m, flags);
+    }
+
+    return MsgChannel::send_msg(m, flags);
+}
@@ -27,10 +27,12 @@
 #include <string>
 #include <list>
 #include <map>
+#include <typeinfo>
 
 #include "../services/comm.h"
 #include "jobstat.h"
 
+class IOThread;
 class Job;
 
 using namespace std;
@@ -73,7 +75,10 @@ public:
     bool matches(const string& nm) const;
 
     time_t busyInstalling() const;
-    void setBusyInstalling(const time_t time);
+    // job_id is the job whose environment gets installed, if any
+    void setBusyInstalling(const time_t time, const unsigned int job_id = 0);
+    // only if the installing was started for that job
+    void clearBusyInstalling(const unsigned int job_id);
 
     string hostPlatform() const;
     void setHostPlatform(const string &platform);
@@ -83,6 +88,9 @@ public:
 
     int maxJobs() const;
     void setMaxJobs(const int jobs);
+    // jobs that get a core of their own, 0 if unknown
+    int physicalJobs() const;
+    void setPhysicalJobs(const int jobs);
     int maxPreloadCount() const;
 
     bool noRemote() const;
@@ -91,6 +99,13 @@ public:
     list<Job *> jobList() const;
     void appendJob(Job *job);
     void removeJob(Job *job);
+    int orphanedJobs() const;
+    void setOrphanedJobs(int jobs);
+    int activeJobCount() const;
+    // how fast another job runs compared to one on the idle server
+    float slotSpeed() const;
+    // milliseconds for a job producing output bytes, fallback if it has compiled nothing yet
+    unsigned long expectedJobTime(unsigned long output, unsigned long fallback) const;
     unsigned int lastPickedId();
 
     State state() const;
@@ -149,7 +164,29 @@ public:
     bool isConnected();
     void updateInConnectivity(bool acceptingIn);
 
+    // the thread doing the reading and writing, 0 if the main thread does it
+    IOThread *ioThread() const;
+    void setIOThread(IOThread *thread);
+    /* Set by the I/O thread once the connection has failed, so that the messages sent
+       after that fail as well, before the main thread learns about it. */
+    bool ioClosed() const;
+    void setIOClosed();
+    /* Hides MsgChannel::send_msg(). With an I/O thread the message goes there as a copy
+       and is encoded there, unless only its base class is known here. */
+    template <class M>
+    bool send_msg(const M &m, int flags = SendBlocking)
+    {
+        if (m_ioThread && typeid(m) == typeid(M)) {
+            return post_msg(new M(m), flags);
+        }
+
+        return send_msg_here(m, flags);
+    }
+
 private:
+    bool post_msg(Msg *m, int flags);
+    bool send_msg_here(const Msg &m, int flags);
+
     bool blacklisted(const Job *job, const pair<string, string> &environment) const;
 
     /* The listener port, on which it takes compile requests.  */
@@ -157,13 +194,16 @@ private:
     unsigned int m_hostId;
     string m_nodeName;
     time_t m_busyInstalling;
+    unsigned int m_installingJob;
     string m_hostPlatform;
 
     // LOAD is load * 1000
     unsigned int m_load;
     int m_maxJobs;
+    int m_physicalJobs;
     bool m_noRemote;
     list<Job *> m_jobList;
+    int m_orphanedJobs; // jobs running since before login, not in m_jobList
     State m_state;
     Type m_type;
     bool m_chrootPossible;
@@ -188,6 +228,9 @@ private:
     time_t m_nextConnTime;
     time_t m_lastConnStartTime;
     bool m_acceptingInConnection;
+
+    IOThread *m_ioThread;
+    int m_ioClosed;
 };
 
 #endif
@@ -0,0 +1,391 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "iothreads.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../services/comm.h"
+#include "../services/logging.h"
+#include "../services/util.h"
+
+#include "compileserver.h"
+
+using namespace std;
+
+IOItem::~IOItem()
+{
+    delete msg;
+}
+
+IOQueue::IOQueue()
+    : m_head(&m_stub)
+    , m_tail(&m_stub)
+    , m_stub(IOItem::Stop)
+    , m_signaled(0)
+{
+    if (pipe(m_pipe) < 0) {
+        log_perror("pipe()");
+        m_pipe[0] = m_pipe[1] = -1;
+        return;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        fcntl(m_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(m_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+IOQueue::~IOQueue()
+{
+    while (IOItem *item = take()) {
+        delete item;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (m_pipe[i] >= 0) {
+            close(m_pipe[i]);
+        }
+    }
+}
+
+void IOQueue::push(IOItem *item)
+{
+    __atomic_store_n(&item->next, (IOItem *) 0, __ATOMIC_SEQ_CST);
+    IOItem *prev = __atomic_exchange_n(&m_head, item, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, item, __ATOMIC_SEQ_CST);
+}
+
+void IOQueue::post(IOItem *item)
+{
+    push(item);
+
+    // wake up the taking thread, unless that is already pending
+    if (!__atomic_exchange_n(&m_signaled, 1, __ATOMIC_SEQ_CST)) {
+        char c = 0;
+        ignore_result(write(m_pipe[1], &c, 1));
+    }
+}
+
+IOItem *IOQueue::take()
+{
+    IOItem *tail = m_tail;
+    IOItem *next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+
+    if (tail == &m_stub) {
+        if (!next) {
+            return 0;
+        }
+
+        m_tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_SEQ_CST);
+    }
+
+    if (next) {
+        m_tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&m_head, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+
+    // tail is the last item, put the stub behind it so that it can be taken
+    push(&m_stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+
+    if (next) {
+        m_tail = next;
+        return tail;
+    }
+
+    return 0;
+}
+
+void IOQueue::clear()
+{
+    char buf[64];
+
+    while (read(m_pipe[0], buf, sizeof(buf)) > 0) {}
+
+    __atomic_store_n(&m_signaled, 0, __ATOMIC_SEQ_CST);
+}
+
+IOThread::IOThread(IOQueue *events)
+    : m_events(events)
+    , m_running(false)
+    , m_log_null(0)
+{
+}
+
+IOThread::~IOThread()
+{
+    stop();
+}
+
+bool IOThread::start()
+{
+    // signals are for the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int ret = pthread_create(&m_thread, 0, run, this);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+
+    if (ret != 0) {
+        log_errno("pthread_create()", ret);
+        return false;
+    }
+
+    m_running = true;
+    return true;
+}
+
+void IOThread::stop()
+{
+    if (!m_running) {
+        return;
+    }
+
+    m_commands.post(new IOItem(IOItem::Stop));
+    pthread_join(m_thread, 0);
+    m_running = false;
+}
+
+void IOThread::attach(CompileServer *cs)
+{
+    m_commands.post(new IOItem(IOItem::Attach, cs));
+}
+
+bool IOThread::send(CompileServer *cs, const Msg &m, int flags)
+{
+    if (cs->ioClosed()) {
+        return false;
+    }
+
+    IOItem *item = new IOItem(IOItem::Send, cs);
+
+    if (!cs->encode_msg(m, item->data)) {
+        delete item;
+        return false;
+    }
+
+    item->flags = flags;
+    m_commands.post(item);
+    return true;
+}
+
+bool IOThread::send(CompileServer *cs, Msg *m, int flags)
+{
+    if (cs->ioClosed()) {
+        delete m;
+        return false;
+    }
+
+    IOItem *item = new IOItem(IOItem::Send, cs);
+    item->msg = m;
+    item->flags = flags;
+    m_commands.post(item);
+    return true;
+}
+
+void IOThread::detach(CompileServer *cs)
+{
+    cs->setIOThread(0);
+    m_commands.post(new IOItem(IOItem::Detach, cs));
+}
+
+void *IOThread::run(void *arg)
+{
+    static_cast<IOThread *>(arg)->loop();
+    return 0;
+}
+
+void IOThread::loop()
+{
+    set_thread_log(&m_log, &m_log_null);
+    bool stop = false;
+
+    while (!stop) {
+        vector<pollfd> pollfds;
+        pollfds.reserve(m_connections.size() + 1);
+        pollfd pfd;
+        pfd.fd = m_commands.fd();
+        pfd.events = POLLIN;
+        pollfds.push_back(pfd);
+
+        for (map<int, CompileServer *>::const_iterator it = m_connections.begin();
+                it != m_connections.end(); ++it) {
+            pfd.fd = it->first;
+            pollfds.push_back(pfd);
+        }
+
+        if (poll(pollfds.data(), pollfds.size(), -1) < 0 && errno != EINTR) {
+            log_perror("poll()");
+            flush_log();
+            sleep(1);
+            continue;
+        }
+
+        if (pollfds[0].revents) {
+            m_commands.clear();
+        }
+
+        while (IOItem *item = m_commands.take()) {
+            handle_command(item, stop);
+        }
+
+        for (size_t i = 1; i < pollfds.size(); ++i) {
+            if (!pollfds[i].revents) {
+                continue;
+            }
+
+            // a command may have detached it meanwhile
+            map<int, CompileServer *>::iterator it = m_connections.find(pollfds[i].fd);
+
+            if (it != m_connections.end()) {
+                read_messages(it->second);
+            }
+        }
+
+        flush_log();
+    }
+
+    set_thread_log(0, 0);
+}
+
+void IOThread::handle_command(IOItem *item, bool &stop)
+{
+    CompileServer *cs = item->cs;
+
+    switch (item->type) {
+    case IOItem::Attach:
+        m_connections[cs->fd] = cs;
+        break;
+    case IOItem::Send:
+        // nothing to do if it has been closed already, it is being detached then
+        if (!m_connections.count(cs->fd)) {
+            break;
+        }
+
+        // a message that cannot be encoded ends the connection, as it does without the thread
+        if ((item->msg && !cs->encode_msg(*item->msg, item->data))
+                || !cs->send_encoded(item->data, item->flags)) {
+            closed(cs);
+        }
+
+        break;
+    case IOItem::Detach:
+        m_connections.erase(cs->fd);
+        m_events->post(new IOItem(IOItem::Released, cs));
+        break;
+    case IOItem::Stop:
+        stop = true;
+        break;
+    default:
+        log_error() << "unexpected I/O thread command " << item->type << endl;
+        break;
+    }
+
+    delete item;
+}
+
+void IOThread::read_messages(CompileServer *cs)
+{
+    while (!cs->read_a_bit() || cs->has_msg()) {
+        Msg *m = cs->get_msg(0, true);
+
+        if (!m) {
+            closed(cs);
+            return;
+        }
+
+        IOItem *item = new IOItem(IOItem::Message, cs);
+        item->msg = m;
+        m_events->post(item);
+    }
+}
+
+void IOThread::closed(CompileServer *cs)
+{
+    cs->setIOClosed();
+    m_connections.erase(cs->fd);
+    m_events->post(new IOItem(IOItem::Closed, cs));
+}
+
+void IOThread::flush_log()
+{
+    string text = m_log.str();
+
+    if (!text.empty()) {
+        IOItem *item = new IOItem(IOItem::Log);
+        item->data = text;
+        m_events->post(item);
+        m_log.str(string());
+    }
+}
+
+IOThreads::IOThreads()
+    : m_next(0)
+{
+}
+
+IOThreads::~IOThreads()
+{
+    stop();
+}
+
+bool IOThreads::start(unsigned int count)
+{
+    for (unsigned int i = 0; i < count; ++i) {
+        IOThread *thread = new IOThread(&m_events);
+
+        if (!thread->start()) {
+            delete thread;
+            return false;
+        }
+
+        m_threads.push_back(thread);
+    }
+
+    return true;
+}
+
+void IOThreads::stop()
+{
+    for (vector<IOThread *>::iterator it = m_threads.begin(); it != m_threads.end(); ++it) {
+        delete *it;
+    }
+
+    m_threads.clear();
+}
+
+void IOThreads::attach(CompileServer *cs)
+{
+    IOThread *thread = m_threads[m_next++ % m_threads.size()];
+    cs->setIOThread(thread);
+    thread->attach(cs);
+}
@@ -0,0 +1,169 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef IOTHREADS_H
+#define IOTHREADS_H
+
+#include <pthread.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class CompileServer;
+class Msg;
+
+/* With --io-threads the connections are read, their messages decoded and the replies
+   written by threads of their own, while all scheduling stays in the main thread.
+   Once a connection is attached to an I/O thread, only that thread touches the channel
+   until it releases it again. The threads talk to each other only through IOQueue. */
+
+struct IOItem
+{
+    enum Type {
+        // to an I/O thread
+        Attach,   // start reading cs
+        Send,     // send data, or encode msg and send it, on cs
+        Detach,   // stop using cs and release it
+        Stop,
+        // to the main thread
+        Message,  // msg was read from cs
+        Closed,   // cs was closed by the other side, or on an error
+        Released, // cs may be deleted
+        Log       // data is log output of an I/O thread
+    };
+
+    explicit IOItem(Type t, CompileServer *c = 0)
+        : next(0)
+        , type(t)
+        , cs(c)
+        , msg(0)
+        , flags(0) {}
+    ~IOItem();
+
+    IOItem *next;
+    Type type;
+    CompileServer *cs;
+    Msg *msg;
+    std::string data;
+    int flags;
+};
+
+/* Lock-free queue of items, added from any thread and taken by one
+   (intrusive MPSC queue after Dmitry Vyukov). The taking thread polls fd()
+   and calls clear() before taking the items; a write to the pipe is needed
+   only when it might be waiting. */
+class IOQueue
+{
+public:
+    IOQueue();
+    ~IOQueue();
+
+    void post(IOItem *item);
+    // 0 if the queue is empty, or the next item is still being added (there is a wakeup then)
+    IOItem *take();
+
+    int fd() const
+    {
+        return m_pipe[0];
+    }
+    void clear();
+
+private:
+    void push(IOItem *item);
+
+    IOItem *m_head; // last added
+    IOItem *m_tail; // next to take
+    IOItem m_stub;
+    int m_signaled;
+    int m_pipe[2];
+};
+
+class IOThread
+{
+public:
+    explicit IOThread(IOQueue *events);
+    ~IOThread();
+
+    bool start();
+    void stop();
+
+    void attach(CompileServer *cs);
+    // false if the connection has failed already, the sending happens in the thread later
+    // encodes the message here
+    bool send(CompileServer *cs, const Msg &m, int flags);
+    // takes the message and encodes it in the thread
+    bool send(CompileServer *cs, Msg *m, int flags);
+    void detach(CompileServer *cs);
+
+private:
+    static void *run(void *arg);
+    void loop();
+    void handle_command(IOItem *item, bool &stop);
+    void read_messages(CompileServer *cs);
+    void closed(CompileServer *cs);
+    void flush_log();
+
+    IOQueue m_commands;
+    IOQueue *m_events;
+    std::map<int, CompileServer *> m_connections;
+    pthread_t m_thread;
+    bool m_running;
+    std::ostringstream m_log;
+    std::ostream m_log_null;
+};
+
+class IOThreads
+{
+public:
+    IOThreads();
+    ~IOThreads();
+
+    bool start(unsigned int count);
+    void stop();
+    bool enabled() const
+    {
+        return !m_threads.empty();
+    }
+
+    // hands the connection over to one of the threads
+    void attach(CompileServer *cs);
+
+    int events_fd() const
+    {
+        return m_events.fd();
+    }
+    void clear_events()
+    {
+        m_events.clear();
+    }
+    // the caller owns the item
+    IOItem *next_event()
+    {
+        return m_events.take();
+    }
+
+private:
+    IOQueue m_events;
+    std::vector<IOThread *> m_threads;
+    unsigned int m_next;
+};
+
+#endif
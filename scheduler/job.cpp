@@ -23,6 +23,8 @@
 
 #include "job.h"
 
+#include <algorithm>
+
 #include "compileserver.h"
 
 Job::Job(const unsigned int _id, CompileServer *subm)
@@ -42,6 +44,10 @@ Job::Job(const unsigned int _id, CompileServer *subm)
     , m_preferredHost()
     , m_minimalHostVersion(0)
     , m_requiredFeatures(0)
+    , m_buildSession()
+    , m_priority(0)
+    , m_releaseRequested(false)
+    , m_avoidedHosts()
 {
     m_submitter->submittedJobsIncrement();
 }
@@ -228,3 +234,44 @@ void Job::setRequiredFeatures(unsigned int features)
 {
     m_requiredFeatures = features;
 }
+
+std::string Job::buildSession() const
+{
+    return m_buildSession;
+}
+
+void Job::setBuildSession(const std::string &session)
+{
+    m_buildSession = session;
+}
+
+int Job::priority() const
+{
+    return m_priority;
+}
+
+void Job::setPriority(int priority)
+{
+    m_priority = priority;
+}
+
+bool Job::releaseRequested() const
+{
+    return m_releaseRequested;
+}
+
+void Job::setReleaseRequested(bool requested)
+{
+    m_releaseRequested = requested;
+}
+
+void Job::setAvoidedHosts(const HostPorts &hosts)
+{
+    m_avoidedHosts = hosts;
+}
+
+bool Job::avoids(const std::string &host, unsigned int port) const
+{
+    return std::find(m_avoidedHosts.begin(), m_avoidedHosts.end(),
+                     std::make_pair(host, uint32_t(port))) != m_avoidedHosts.end();
+}
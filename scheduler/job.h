@@ -96,6 +96,18 @@ public:
     unsigned int requiredFeatures() const;
     void setRequiredFeatures(unsigned int features);
 
+    std::string buildSession() const;
+    void setBuildSession(const std::string &session);
+
+    int priority() const;
+    void setPriority(int priority);
+
+    bool releaseRequested() const;
+    void setReleaseRequested(bool requested);
+
+    void setAvoidedHosts(const HostPorts &hosts);
+    bool avoids(const std::string &host, unsigned int port) const;
+
 private:
     const unsigned int m_id;
     unsigned int m_localClientId;
@@ -121,6 +133,10 @@ private:
     std::string m_preferredHost; // for debugging daemons
     int m_minimalHostVersion; // minimal version required for the the remote server
     unsigned int m_requiredFeatures; // flags the job requires on the remote server
+    std::string m_buildSession; // the build the job belongs to, if known
+    int m_priority; // hint of the client, higher goes first within the build
+    bool m_releaseRequested; // the server was asked to give it back before starting it
+    HostPorts m_avoidedHosts; // the job failed on these compile servers before
 };
 
 #endif
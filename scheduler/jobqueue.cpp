@@ -0,0 +1,142 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "jobqueue.h"
+
+#include "job.h"
+
+using namespace std;
+
+JobQueue::~JobQueue()
+{
+    for (list<Build *>::iterator it = m_builds.begin(); it != m_builds.end(); ++it) {
+        delete *it;
+    }
+}
+
+void JobQueue::enqueue(Job *job)
+{
+    for (list<Build *>::iterator it = m_builds.begin(); it != m_builds.end(); ++it) {
+        Build *build = *it;
+
+        if (build->submitter != job->submitter() || build->session != job->buildSession()) {
+            continue;
+        }
+
+        list<Job *>::iterator jit = build->jobs.end();
+
+        while (jit != build->jobs.begin()) {
+            list<Job *>::iterator prev = jit;
+
+            if ((*--prev)->priority() >= job->priority()) {
+                break;
+            }
+
+            jit = prev;
+        }
+
+        build->jobs.insert(jit, job);
+        return;
+    }
+
+    Build *build = new Build();
+    build->submitter = job->submitter();
+    build->session = job->buildSession();
+    build->jobs.push_back(job);
+    m_builds.push_back(build);
+}
+
+Job *JobQueue::front() const
+{
+    if (m_builds.empty()) {
+        return 0;
+    }
+
+    return m_builds.front()->jobs.front();
+}
+
+void JobQueue::pop_front()
+{
+    if (m_builds.empty()) {
+        return;
+    }
+
+    Build *first = m_builds.front();
+    m_builds.pop_front();
+    first->jobs.pop_front();
+
+    if (first->jobs.empty()) {
+        delete first;
+    } else {
+        m_builds.push_back(first);
+    }
+}
+
+Job *JobQueue::delay_front()
+{
+    if (m_builds.size() < 2) {
+        return 0;
+    }
+
+    m_builds.push_back(m_builds.front());
+    m_builds.pop_front();
+    return front();
+}
+
+bool JobQueue::remove(Job *job)
+{
+    for (list<Build *>::iterator it = m_builds.begin(); it != m_builds.end(); ++it) {
+        Build *build = *it;
+
+        for (list<Job *>::iterator jit = build->jobs.begin(); jit != build->jobs.end(); ++jit) {
+            if (*jit != job) {
+                continue;
+            }
+
+            build->jobs.erase(jit);
+
+            if (build->jobs.empty()) {
+                delete build;
+                m_builds.erase(it);
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+list<Job *> JobQueue::remove_submitter(const CompileServer *submitter)
+{
+    list<Job *> removed;
+
+    for (list<Build *>::iterator it = m_builds.begin(); it != m_builds.end();) {
+        if ((*it)->submitter == submitter) {
+            removed.splice(removed.end(), (*it)->jobs);
+            delete *it;
+            it = m_builds.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    return removed;
+}
@@ -0,0 +1,66 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <list>
+#include <string>
+
+class CompileServer;
+class Job;
+
+/* The job requests waiting for a compile server. There is one list per build
+   (session) of a submitter, and the lists take turns, so that concurrent builds
+   get their share of the farm. Within a list, jobs with a higher priority go
+   first, the same ones in the order they came in.  */
+class JobQueue
+{
+public:
+    ~JobQueue();
+
+    void enqueue(Job *job);
+    // the job to place next, 0 if there is none
+    Job *front() const;
+    // removes front(), then the next build has its turn
+    void pop_front();
+    // gives the next build its turn, returns its job or 0 if there is no other build
+    Job *delay_front();
+    // searches for job and removes it, returns true if it was there
+    bool remove(Job *job);
+    // removes the jobs of submitter and returns them
+    std::list<Job *> remove_submitter(const CompileServer *submitter);
+
+    bool empty() const
+    {
+        return m_builds.empty();
+    }
+
+private:
+    struct Build {
+        std::list<Job *> jobs;
+        CompileServer *submitter;
+        std::string session;
+    };
+
+    std::list<Build *> m_builds;
+};
+
+#endif
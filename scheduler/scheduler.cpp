@@ -43,6 +43,7 @@
 #include <list>
 #include <map>
 #include <queue>
+#include <vector>
 #include <algorithm>
 #include <cassert>
 #include <fstream>
@@ -57,7 +58,9 @@
 #include "config.h"
 
 #include "compileserver.h"
+#include "iothreads.h"
 #include "job.h"
+#include "jobqueue.h"
 #include "scheduler.h"
 
 /* TODO:
@@ -99,6 +102,10 @@ static volatile sig_atomic_t exit_main_loop = false;
 
 time_t starttime;
 time_t last_announce;
+time_t last_peer_lists;
+// How many compile servers a daemon is told about at once, they pick
+// from them if they lose the connection to us.
+static const size_t max_peer_list = 32;
 static string scheduler_interface = "";
 static unsigned int scheduler_port = 8765;
 
@@ -109,36 +116,33 @@ static list<CompileServer *> controls;
 static list<string> block_css;
 static unsigned int new_job_id;
 static map<unsigned int, Job *> jobs;
-
-/* XXX Uah.  Don't use a queue for the job requests.  It's a hell
-   to delete anything out of them (for clean up).  */
-struct UnansweredList {
-    list<Job *> l;
-    CompileServer *submitter;
-    bool remove_job(Job *);
+// a compile slot has become free, preloaded jobs may move to it
+static bool check_preloaded = false;
+
+// the job requests not answered yet
+static JobQueue toanswer;
+
+/* Native environments by toolchain fingerprint, so that daemons with the same
+   compiler fetch an existing one from a daemon holding its tarball instead of
+   creating their own.  */
+struct EnvRegistration {
+    string platform;
+    string name;
+    list<CompileServer *> holders;
 };
-static list<UnansweredList *> toanswer;
+static map<string, EnvRegistration> env_registry;
+
+/* With I/O threads the connections are read by those, so a daemon's answer to
+   "internals" arrives as a message of its own.  These are the daemons still
+   to answer, along with the control connection that asked.  */
+static IOThreads io_threads;
+static list<pair<CompileServer *, CompileServer *> > internals_requests;
 
 static list<JobStat> all_job_stats;
 static JobStat cum_job_stats;
 
 static float server_speed(CompileServer *cs, Job *job = 0, bool blockDebug = false);
 
-/* Searches the queue for JOB and removes it.
-   Returns true if something was deleted.  */
-bool UnansweredList::remove_job(Job *job)
-{
-    list<Job *>::iterator it;
-
-    for (it = l.begin(); it != l.end(); ++it)
-        if (*it == job) {
-            l.erase(it);
-            return true;
-        }
-
-    return false;
-}
-
 static void add_job_stats(Job *job, JobDoneMsg *msg)
 {
     JobStat st;
@@ -228,7 +232,8 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
 
 static bool handle_end(CompileServer *cs, Msg *);
 
-static void notify_monitors(Msg *m)
+template <class M>
+static void notify_monitors(const M &m)
 {
     list<CompileServer *>::iterator it;
     list<CompileServer *>::iterator it_old;
@@ -237,13 +242,11 @@ static void notify_monitors(Msg *m)
         it_old = it++;
 
         /* If we can't send it, don't be clever, simply close this monitor.  */
-        if (!(*it_old)->send_msg(*m, MsgChannel::SendNonBlocking /*| MsgChannel::SendBulkOnly*/)) {
+        if (!(*it_old)->send_msg(m, MsgChannel::SendNonBlocking /*| MsgChannel::SendBulkOnly*/)) {
             trace() << "monitor is blocking... removing" << endl;
             handle_end(*it_old, 0);
         }
     }
-
-    delete m;
 }
 
 static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
@@ -306,11 +309,7 @@ static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
                 f *= float(1000 - cs->load()) / 1000;
             }
 
-            /* Gradually throttle with the number of assigned jobs. This
-             * takes care of the fact that not all slots are equally fast on
-             * CPUs with SMT and dynamic clock ramping.
-             */
-            f *= (1.0f - (0.5f * cs->jobList().size() / cs->maxJobs()));
+            f *= cs->slotSpeed();
         }
 
         // below we add a pessimism factor - assuming the first job a computer got is not representative
@@ -358,12 +357,43 @@ static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = 0)
         msg += buffer;
         sprintf(buffer, "FreeMem:%u\n", m->freeMem);
         msg += buffer;
+
+        if (m->max_kids) {
+            sprintf(buffer, "JobSpeed:%u\n", m->job_speed);
+            msg += buffer;
+            sprintf(buffer, "Throughput:%u\n", m->throughput);
+            msg += buffer;
+            sprintf(buffer, "QueueDelay:%u\n", m->queue_delay);
+            msg += buffer;
+        }
+
+        if (m->cold_jobs || m->warm_jobs) {
+            sprintf(buffer, "ColdJobs:%u\n", m->cold_jobs);
+            msg += buffer;
+            sprintf(buffer, "ColdJobTime:%u\n", m->cold_job_msec);
+            msg += buffer;
+            sprintf(buffer, "WarmJobs:%u\n", m->warm_jobs);
+            msg += buffer;
+            sprintf(buffer, "WarmJobTime:%u\n", m->warm_job_msec);
+            msg += buffer;
+        }
+
+        if (m->job_in || m->job_out || m->bulk_in || m->bulk_out) {
+            sprintf(buffer, "JobTrafficIn:%u\n", m->job_in);
+            msg += buffer;
+            sprintf(buffer, "JobTrafficOut:%u\n", m->job_out);
+            msg += buffer;
+            sprintf(buffer, "BulkTrafficIn:%u\n", m->bulk_in);
+            msg += buffer;
+            sprintf(buffer, "BulkTrafficOut:%u\n", m->bulk_out);
+            msg += buffer;
+        }
     } else {
         sprintf(buffer, "Load:%u\n", cs->load());
         msg += buffer;
     }
 
-    notify_monitors(new MonStatsMsg(cs->hostId(), msg));
+    notify_monitors(MonStatsMsg(cs->hostId(), msg));
 }
 
 static Job *create_new_job(CompileServer *submitter)
@@ -376,47 +406,6 @@ static Job *create_new_job(CompileServer *submitter)
     return job;
 }
 
-static void enqueue_job_request(Job *job)
-{
-    if (!toanswer.empty() && toanswer.back()->submitter == job->submitter()) {
-        toanswer.back()->l.push_back(job);
-    } else {
-        UnansweredList *newone = new UnansweredList();
-        newone->submitter = job->submitter();
-        newone->l.push_back(job);
-        toanswer.push_back(newone);
-    }
-}
-
-static Job *get_job_request(void)
-{
-    if (toanswer.empty()) {
-        return 0;
-    }
-
-    UnansweredList *first = toanswer.front();
-    assert(!first->l.empty());
-    return first->l.front();
-}
-
-/* Removes the first job request (the one returned by get_job_request()) */
-static void remove_job_request(void)
-{
-    if (toanswer.empty()) {
-        return;
-    }
-
-    UnansweredList *first = toanswer.front();
-    toanswer.pop_front();
-    first->l.pop_front();
-
-    if (first->l.empty()) {
-        delete first;
-    } else {
-        toanswer.push_back(first);
-    }
-}
-
 static string dump_job(Job *job);
 
 static bool handle_cs_request(MsgChannel *cs, Msg *_m)
@@ -463,7 +452,10 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
         job->setPreferredHost(m->preferred_host);
         job->setMinimalHostVersion(m->minimal_host_version);
         job->setRequiredFeatures(m->required_features);
-        enqueue_job_request(job);
+        job->setBuildSession(m->build_session);
+        job->setPriority(m->priority);
+        job->setAvoidedHosts(m->avoided_hosts);
+        toanswer.enqueue(job);
         std::ostream &dbg = log_info();
         dbg << "NEW " << job->id() << " client="
             << submitter->nodeName() << " versions=[";
@@ -479,8 +471,24 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
             }
         }
 
-        dbg << "] " << m->filename << " " << job->language() << endl;
-        notify_monitors(new MonGetCSMsg(job->id(), submitter->hostId(), m));
+        dbg << "] " << m->filename << " " << job->language();
+
+        if (!m->build_session.empty()) {
+            dbg << " session=" << m->build_session;
+        }
+
+        if (m->priority) {
+            dbg << " priority=" << m->priority;
+        }
+
+        for (HostPorts::const_iterator it = m->avoided_hosts.begin();
+                it != m->avoided_hosts.end(); ++it) {
+            dbg << (it == m->avoided_hosts.begin() ? " avoiding=" : ",")
+                << it->first << ":" << it->second;
+        }
+
+        dbg << endl;
+        notify_monitors(MonGetCSMsg(job->id(), submitter->hostId(), m));
 
         if (!master_job) {
             master_job = job;
@@ -503,7 +511,7 @@ static bool handle_local_job(CompileServer *cs, Msg *_m)
     ++new_job_id;
     trace() << "handle_local_job " << m->outfile << " " << m->id << endl;
     cs->insertClientJobId(m->id, new_job_id);
-    notify_monitors(new MonLocalJobBeginMsg(new_job_id, m->outfile, m->stime, cs->hostId()));
+    notify_monitors(MonLocalJobBeginMsg(new_job_id, m->outfile, m->stime, cs->hostId()));
     return true;
 }
 
@@ -516,7 +524,7 @@ static bool handle_local_job_done(CompileServer *cs, Msg *_m)
     }
 
     trace() << "handle_local_job_done " << m->job_id << endl;
-    notify_monitors(new JobLocalDoneMsg(cs->getClientJobId(m->job_id)));
+    notify_monitors(JobLocalDoneMsg(cs->getClientJobId(m->job_id)));
     cs->eraseClientJobId(m->job_id);
     return true;
 }
@@ -607,9 +615,22 @@ static CompileServer *pick_server(Job *job)
     if (!all_job_stats.size ()) {
         CompileServer *selected = NULL;
         int eligible_count = 0;
+        // a server with a free slot is better than preloading a busy one
+        bool selected_idle = false;
 
         for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
             if ((*it)->is_eligible_now( job )) {
+                bool idle = (*it)->activeJobCount() < (*it)->maxJobs();
+
+                if (selected_idle && !idle) {
+                    continue;
+                }
+
+                if (idle && !selected_idle) {
+                    selected_idle = true;
+                    eligible_count = 0;
+                }
+
                 ++eligible_count;
                 // Do not select the first one (which could be broken and so we might never get job stats),
                 // but rather select randomly.
@@ -640,8 +661,8 @@ static CompileServer *pick_server(Job *job)
         // Ignore ineligible servers
         if (!cs->is_eligible_now(job)) {
 #if DEBUG_SCHEDULER > 1
-            if ((int(cs->jobList().size()) >= cs->maxJobs() + c->maxPreloadJobs()) || (cs->load() >= 1000)) {
-                trace() << "overloaded " << cs->nodeName() << " " << cs->jobList().size() << "/"
+            if ((cs->activeJobCount() >= cs->maxJobs() + c->maxPreloadJobs()) || (cs->load() >= 1000)) {
+                trace() << "overloaded " << cs->nodeName() << " " << cs->activeJobCount() << "/"
                         <<  cs->maxJobs() << " jobs, load:" << cs->load() << endl;
             else
                 trace() << cs->nodeName() << " not eligible" << endl;
@@ -677,7 +698,7 @@ static CompileServer *pick_server(Job *job)
                 " client count: " << cs->clientCount() << endl;
 #endif
 
-        if ((cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0) && cs->maxJobs()) {
+        if ((cs->lastCompiledJobs().size() == 0) && (cs->activeJobCount() == 0) && cs->maxJobs()) {
             /* Make all servers compile a job at least once, so we'll get an
                idea about their speed.  */
             if (!envs_match(cs, job).empty()) {
@@ -709,7 +730,7 @@ static CompileServer *pick_server(Job *job)
                the job.  (XXX currently this is equivalent to the fastest one)  */
             else if ((best->lastCompiledJobs().size() != 0)
                      && (server_speed(best, job) < server_speed(cs, job))) {
-                if (int(cs->jobList().size()) < cs->maxJobs()) {
+                if (cs->activeJobCount() < cs->maxJobs()) {
                     best = cs;
                 } else {
                     bestpre = cs;
@@ -725,7 +746,7 @@ static CompileServer *pick_server(Job *job)
                the job.  (XXX currently this is equivalent to the fastest one)  */
             else if ((bestui->lastCompiledJobs().size() != 0)
                      && (server_speed(bestui, job) < server_speed(cs, job))) {
-                if (int(cs->jobList().size()) < cs->maxJobs()) {
+                if (cs->activeJobCount() < cs->maxJobs()) {
                     bestui = cs;
                 } else {
                     bestpre = cs;
@@ -843,23 +864,59 @@ static time_t prune_servers()
     return min_time;
 }
 
-static Job *delay_current_job()
+/* Expected milliseconds for a typical job of the farm on CS, 0 if there
+   are no job statistics yet.  */
+static unsigned long expected_job_time(CompileServer *cs)
 {
-    assert(!toanswer.empty());
-
-    if (toanswer.size() == 1) {
+    if (all_job_stats.empty()) {
         return 0;
     }
 
-    UnansweredList *first = toanswer.front();
-    toanswer.pop_front();
-    toanswer.push_back(first);
-    return get_job_request();
+    return cs->expectedJobTime(cum_job_stats.outputSize() / all_job_stats.size(),
+                               cum_job_stats.compileTimeReal() / all_job_stats.size());
+}
+
+/* Expected milliseconds until a slot of CS is free for another job, from
+   when its running jobs should end and the jobs already waiting for a slot.  */
+static unsigned long expected_slot_wait(CompileServer *cs)
+{
+    unsigned long duration = expected_job_time(cs);
+    time_t now = time(0);
+    vector<unsigned long> slots; // from now, when each slot is done
+    unsigned int waiting = 0;
+    list<Job *> jobList = cs->jobList();
+
+    for (list<Job *>::const_iterator it = jobList.begin(); it != jobList.end(); ++it) {
+        if ((*it)->state() == Job::COMPILING) {
+            // one that already took longer than usual is a big one, likely taking as long again
+            unsigned long running = (now - (*it)->startOnScheduler()) * 1000;
+            slots.push_back(running < duration ? duration - running : running);
+        } else {
+            ++waiting;
+        }
+    }
+
+    slots.resize(max(slots.size(), size_t(max(cs->maxJobs(), 1))), 0);
+
+    for (; waiting > 0; --waiting) {
+        *min_element(slots.begin(), slots.end()) += duration;
+    }
+
+    return *min_element(slots.begin(), slots.end());
+}
+
+// the submitter can compile the job itself right away
+static bool submitter_has_slot(Job *job)
+{
+    CompileServer *cs = job->submitter();
+    return cs->activeJobCount() < cs->maxJobs()
+           && job->preferredHost().empty()
+           && cs->can_install(job).size();
 }
 
 static bool empty_queue()
 {
-    Job *job = get_job_request();
+    Job *job = toanswer.front();
 
     if (!job) {
         return false;
@@ -881,11 +938,8 @@ static bool empty_queue()
            be found.  We only obey to its max job number.  */
         cs = job->submitter();
 
-        if (!((int(cs->jobList().size()) < cs->maxJobs())
-                && job->preferredHost().empty()
-                /* This should be trivially true.  */
-                && cs->can_install(job).size())) {
-            job = delay_current_job();
+        if (!submitter_has_slot(job)) {
+            job = toanswer.delay_front();
 
             if ((job == first_job) || !job) { // no job found in the whole toanswer list
                 job = first_job;
@@ -908,7 +962,25 @@ static bool empty_queue()
         }
     }
 
-    remove_job_request();
+    /* A host picked for preloading may be busy with its other jobs for a
+       while, then the submitter building the job itself finishes sooner
+       if it has a slot free.  */
+    unsigned long eta = 0;
+
+    if (cs != job->submitter() && cs->activeJobCount() >= cs->maxJobs()) {
+        eta = expected_slot_wait(cs);
+        unsigned long remote = eta + expected_job_time(cs);
+        unsigned long local = expected_job_time(job->submitter());
+
+        if (local && local < remote && submitter_has_slot(job)) {
+            trace() << "building " << job->id() << " locally, " << local << "ms instead of "
+                    << remote << "ms on " << cs->nodeName() << endl;
+            cs = job->submitter();
+            eta = 0;
+        }
+    }
+
+    toanswer.pop_front();
 
     job->setState(Job::WAITINGFORCS);
     job->setServer(cs);
@@ -959,6 +1031,7 @@ static bool empty_queue()
     {
         UseCSMsg m2(host_platform, cs->name, cs->remotePort(), job->id(),
                 gotit, job->localClientId(), matched_job_id);
+        m2.host_protocol = cs->maximum_remote_protocol;
         if (!job->submitter()->send_msg(m2)) {
             trace() << "failed to deliver job " << job->id() << endl;
             handle_end(job->submitter(), 0);   // will care for the rest
@@ -970,6 +1043,9 @@ static bool empty_queue()
 #if DEBUG_SCHEDULER >= 0
     if (!gotit) {
         trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << " (will install now)" << endl;
+    } else if (eta) {
+        trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << " (starts in about "
+                << eta << "ms)" << endl;
     } else {
         trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << endl;
     }
@@ -978,7 +1054,7 @@ static bool empty_queue()
 
     /* if it doesn't have the environment, it will get it. */
     if (!gotit) {
-        cs->setBusyInstalling(time(0));
+        cs->setBusyInstalling(time(0), job->id());
     }
 
     string env;
@@ -1005,6 +1081,106 @@ static bool empty_queue()
     return true;
 }
 
+/* Jobs preloaded on a host whose slots are all busy wait there even after
+   other hosts have become idle. Ask the busy host to give such jobs back, as
+   many as there are idle slots they could go to, oldest first. Their clients
+   then ask for a compile server again.  */
+static void release_preloaded_jobs()
+{
+    // idle slots already waiting for a job to be given back
+    int releasing = 0;
+    map<const CompileServer *, int> compiling;
+    list<Job *> preloaded; // could be given back, if their host is busy
+
+    for (map<unsigned int, Job *>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        Job *job = it->second;
+        CompileServer *server = job->server();
+
+        if (job->state() == Job::COMPILING) {
+            ++compiling[server];
+        } else if (job->releaseRequested()) {
+            ++releasing;
+        } else if (server && server != job->submitter() && job->state() == Job::WAITINGFORCS
+                   && job->preferredHost().empty() && job->masterJobFor().empty()
+                   && IS_PROTOCOL_54(server)) {
+            preloaded.push_back(job);
+        }
+    }
+
+    for (list<CompileServer *>::iterator cit = css.begin(); cit != css.end(); ++cit) {
+        CompileServer *cs = *cit;
+        int idle = cs->maxJobs() - cs->activeJobCount();
+
+        if (idle <= 0 || cs->load() >= 1000) {
+            continue;
+        }
+
+        int taken = min(idle, releasing);
+        idle -= taken;
+        releasing -= taken;
+
+        for (list<Job *>::iterator it = preloaded.begin(); idle > 0 && it != preloaded.end();) {
+            Job *job = *it;
+            CompileServer *server = job->server();
+
+            if (server == cs || compiling[server] < server->maxJobs()
+                    || !cs->is_eligible_ever(job) || !cs->can_install(job).size()) {
+                ++it;
+                continue;
+            }
+
+            it = preloaded.erase(it);
+            trace() << "RELEASE " << job->id() << " from " << server->nodeName()
+                    << " for " << cs->nodeName() << endl;
+
+            if (!server->send_msg(JobReleaseMsg(job->id()))) {
+                continue;
+            }
+
+            job->setReleaseRequested(true);
+            --idle;
+        }
+    }
+}
+
+/* Tells a daemon about a random sample of the other compile servers, so that
+   it can place jobs on them itself while it has no scheduler.  */
+static void send_peer_list(CompileServer *to)
+{
+    if (!IS_PROTOCOL_45(to)) {
+        return;
+    }
+
+    vector<CompileServer *> candidates;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *cs = *it;
+
+        if (cs != to && cs->maxJobs() > 0 && !cs->noRemote() && cs->chrootPossible()) {
+            candidates.push_back(cs);
+        }
+    }
+
+    PeerListMsg msg;
+
+    for (size_t i = 0; i < candidates.size() && i < max_peer_list; ++i) {
+        swap(candidates[i], candidates[i + random() % (candidates.size() - i)]);
+        CompileServer *cs = candidates[i];
+        PeerListMsg::Peer peer;
+        peer.hostname = cs->name;
+        peer.port = cs->remotePort();
+        peer.host_platform = cs->hostPlatform();
+        peer.max_jobs = cs->maxJobs();
+        peer.load = cs->load();
+        peer.protocol = cs->maximum_remote_protocol;
+        peer.features = cs->supportedFeatures();
+        peer.envs = cs->compilerVersions();
+        msg.peers.push_back(peer);
+    }
+
+    to->send_msg(msg);
+}
+
 static bool handle_login(CompileServer *cs, Msg *_m)
 {
     LoginMsg *m = dynamic_cast<LoginMsg *>(_m);
@@ -1018,6 +1194,7 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     cs->setRemotePort(m->port);
     cs->setCompilerVersions(m->envs);
     cs->setMaxJobs(m->max_kids);
+    cs->setPhysicalJobs(m->physical_kids);
     cs->setNoRemote(m->noremote);
 
     if (m->nodename.length()) {
@@ -1029,6 +1206,7 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     cs->setHostPlatform(m->host_platform);
     cs->setChrootPossible(m->chroot_possible);
     cs->setSupportedFeatures(m->supported_features);
+    cs->setOrphanedJobs(m->orphaned_jobs);
     cs->pick_new_id();
 
     for (list<string>::const_iterator it = block_css.begin(); it != block_css.end(); ++it)
@@ -1038,6 +1216,7 @@ static bool handle_login(CompileServer *cs, Msg *_m)
 
     dbg << "login " << m->nodename << " protocol version: " << cs->protocol
         << " features: " << supported_features_to_string(m->supported_features)
+        << " orphaned jobs: " << m->orphaned_jobs
         << " [";
     for (Environments::const_iterator it = m->envs.begin(); it != m->envs.end(); ++it) {
         dbg << it->second << "(" << it->first << "), ";
@@ -1059,12 +1238,14 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     }
 
     css.push_back(cs);
+    check_preloaded = true;
 
     /* Configure the daemon */
     if (IS_PROTOCOL_24(cs)) {
         cs->send_msg(ConfCSMsg());
     }
 
+    send_peer_list(cs);
     return true;
 }
 
@@ -1080,6 +1261,20 @@ static bool handle_relogin(MsgChannel *mc, Msg *_m)
     cs->setCompilerVersions(m->envs);
     cs->setBusyInstalling(0);
 
+    // a daemon upgraded in place logs in again in full, reannouncing the
+    // environments leaves out the platform
+    if (!m->host_platform.empty()) {
+        cs->setRemotePort(m->port);
+        cs->setMaxJobs(m->max_kids);
+        cs->setPhysicalJobs(m->physical_kids);
+        cs->setNoRemote(m->noremote);
+        cs->setHostPlatform(m->host_platform);
+        cs->setChrootPossible(m->chroot_possible);
+        cs->setSupportedFeatures(m->supported_features);
+        cs->setOrphanedJobs(m->orphaned_jobs);
+        check_preloaded = true;
+    }
+
     std::ostream &dbg = trace();
     dbg << "RELOGIN " << cs->nodeName() << "(" << cs->hostPlatform() << "): [";
 
@@ -1087,7 +1282,13 @@ static bool handle_relogin(MsgChannel *mc, Msg *_m)
         dbg << it->second << "(" << it->first << "), ";
     }
 
-    dbg << "]" << endl;
+    dbg << "]";
+
+    if (!m->host_platform.empty()) {
+        dbg << " features: " << supported_features_to_string(m->supported_features);
+    }
+
+    dbg << endl;
 
     /* Configure the daemon */
     if (IS_PROTOCOL_24(cs)) {
@@ -1142,7 +1343,7 @@ static bool handle_job_begin(CompileServer *cs, Msg *_m)
     job->setState(Job::COMPILING);
     job->setStartTime(m->stime);
     job->setStartOnScheduler(time(0));
-    notify_monitors(new MonJobBeginMsg(m->job_id, m->stime, cs->hostId()));
+    notify_monitors(MonJobBeginMsg(m->job_id, m->stime, cs->hostId()));
 #if DEBUG_SCHEDULER >= 0
     trace() << "BEGIN: " << m->job_id << " client=" << job->submitter()->nodeName()
             << "(" << job->targetPlatform() << ")" << " server="
@@ -1162,6 +1363,19 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
         return false;
     }
 
+    if (m->flags & JobDoneMsg::Orphaned) {
+        // A compile that kept running while the daemon had no scheduler connection,
+        // we only know about it from the count in the login.
+        trace() << "END orphaned job on " << cs->nodeName() << " status=" << m->exitcode << endl;
+        cs->setClientCount(m->client_count);
+
+        if (cs->orphanedJobs() > 0) {
+            cs->setOrphanedJobs(cs->orphanedJobs() - 1);
+        }
+
+        return true;
+    }
+
     Job *j = 0;
 
     if (uint32_t clientId = m->unknown_job_client_id()) {
@@ -1180,27 +1394,7 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
                 j = job;
                 m->set_job_id( j->id()); // Now we know the job's id.
 
-                /* Unfortunately the toanswer queues are also tagged based on the daemon,
-                so we need to clean them up also.  */
-                list<UnansweredList *>::iterator it;
-
-                for (it = toanswer.begin(); it != toanswer.end(); ++it)
-                    if ((*it)->submitter == cs) {
-                        UnansweredList *l = *it;
-                        list<Job *>::iterator jit;
-
-                        for (jit = l->l.begin(); jit != l->l.end(); ++jit) {
-                            if (*jit == j) {
-                                l->l.erase(jit);
-                                break;
-                            }
-                        }
-
-                        if (l->l.empty()) {
-                            it = toanswer.erase(it);
-                            break;
-                        }
-                    }
+                toanswer.remove(j);
             }
         }
     } else if (jobs.find(m->job_id) != jobs.end()) {
@@ -1263,17 +1457,49 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
     }
 
     if (j->server()) {
+        // a job that never started won't install its environment there anymore,
+        // e.g. when it was retried elsewhere
+        if (j->state() != Job::COMPILING) {
+            j->server()->clearBusyInstalling(j->id());
+        }
+
         j->server()->removeJob(j);
+        check_preloaded = true;
     }
 
     add_job_stats(j, m);
-    notify_monitors(new MonJobDoneMsg(*m));
+    notify_monitors(MonJobDoneMsg(*m));
     jobs.erase(m->job_id);
     delete j;
 
     return true;
 }
 
+static bool handle_job_release(CompileServer *cs, Msg *_m)
+{
+    JobReleaseMsg *m = dynamic_cast<JobReleaseMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    map<unsigned int, Job *>::iterator it = jobs.find(m->job_id);
+
+    if (it == jobs.end() || it->second->server() != cs) {
+        trace() << "released job " << m->job_id << " isn't handled by " << cs->nodeName() << endl;
+        return true;
+    }
+
+    // the client asks for a new compile server, that is a new job
+    Job *job = it->second;
+    trace() << "RELEASED " << job->id() << " by " << cs->nodeName() << endl;
+    cs->removeJob(job);
+    notify_monitors(MonJobDoneMsg(JobDoneMsg(job->id())));
+    jobs.erase(it);
+    delete job;
+    return true;
+}
+
 static bool handle_ping(CompileServer *cs, Msg * /*_m*/)
 {
     cs->last_talk = time(0);
@@ -1303,8 +1529,22 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
         }
     }
 
+    if (IS_PROTOCOL_55(cs) && m->max_kids && int(m->max_kids) != cs->maxJobs()) {
+        trace() << cs->nodeName() << " tuned its slots from " << cs->maxJobs() << " to "
+                << m->max_kids << endl;
+        check_preloaded = check_preloaded || int(m->max_kids) > cs->maxJobs();
+        cs->setMaxJobs(m->max_kids);
+    }
+
+    // jobs placed on it by peers while they had no scheduler are only known from here
+    if (IS_PROTOCOL_56(cs)) {
+        cs->setOrphanedJobs(m->orphaned_jobs);
+    }
+
     for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it)
         if (*it == cs) {
+            // until the first stats a host counts as fully loaded
+            check_preloaded = check_preloaded || ((*it)->load() >= 1000 && m->load < 1000);
             (*it)->setLoad(m->load);
             (*it)->setClientCount(m->client_count);
             handle_monitor_stats(*it, m);
@@ -1332,6 +1572,105 @@ static bool handle_blacklist_host_env(CompileServer *cs, Msg *_m)
     return true;
 }
 
+static bool handle_env_fingerprint(CompileServer *cs, Msg *_m)
+{
+    EnvFingerprintMsg *m = dynamic_cast<EnvFingerprintMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    map<string, EnvRegistration>::iterator it = env_registry.find(m->fingerprint);
+
+    if (m->name.empty() && m->fingerprint.compare(0, 10, "toolchain:") == 0) {
+        // the same toolchain registered as "<fingerprint>@<platform>" for other platforms
+        string prefix = m->fingerprint + "@";
+
+        for (it = env_registry.lower_bound(prefix);
+                it != env_registry.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            if (it->second.platform == m->platform) {
+                continue;
+            }
+
+            vector<CompileServer *> holders;
+
+            for (list<CompileServer *>::const_iterator h = it->second.holders.begin();
+                    h != it->second.holders.end(); ++h) {
+                if (*h != cs) {
+                    holders.push_back(*h);
+                }
+            }
+
+            if (holders.empty()) {
+                continue;
+            }
+
+            CompileServer *holder = holders[random() % holders.size()];
+            EnvFingerprintMsg answer(it->first, it->second.platform, it->second.name);
+            answer.host = holder->name;
+            answer.port = holder->remotePort();
+            trace() << "cross environment for " << cs->nodeName() << ": " << answer.name << " ("
+                    << answer.platform << ") on " << answer.host << endl;
+
+            if (!cs->send_msg(answer)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    if (m->name.empty()) {
+        EnvFingerprintMsg answer(m->fingerprint, m->platform, "");
+
+        if (it != env_registry.end() && it->second.platform == m->platform) {
+            vector<CompileServer *> holders;
+
+            for (list<CompileServer *>::const_iterator h = it->second.holders.begin();
+                    h != it->second.holders.end(); ++h) {
+                if (*h != cs) {
+                    holders.push_back(*h);
+                }
+            }
+
+            if (!holders.empty()) {
+                CompileServer *holder = holders[random() % holders.size()];
+                answer.name = it->second.name;
+                answer.host = holder->name;
+                answer.port = holder->remotePort();
+            }
+        }
+
+        trace() << "environment lookup from " << cs->nodeName() << " for " << m->fingerprint << ": "
+                << (answer.name.empty() ? string("unknown") : answer.name + " on " + answer.host)
+                << endl;
+        return cs->send_msg(answer);
+    }
+
+    // only daemons accepting connections can hand out their tarballs
+    if (cs->noRemote() || !cs->remotePort()) {
+        return true;
+    }
+
+    if (it == env_registry.end()) {
+        EnvRegistration &reg = env_registry[m->fingerprint];
+        reg.platform = m->platform;
+        reg.name = m->name;
+        it = env_registry.find(m->fingerprint);
+    } else if (it->second.name != m->name || it->second.platform != m->platform) {
+        // created at the same time as the registered one, which the others use already
+        return true;
+    }
+
+    if (find(it->second.holders.begin(), it->second.holders.end(), cs) == it->second.holders.end()) {
+        log_info() << "environment " << m->name << " (" << m->fingerprint << ") available from "
+                   << cs->nodeName() << endl;
+        it->second.holders.push_back(cs);
+    }
+
+    return true;
+}
+
 static string dump_job(Job *job)
 {
     char buffer[1000];
@@ -1436,7 +1775,7 @@ static bool handle_line(CompileServer *cs, Msg *_m)
             line = " " + (*it)->nodeName() + buffer;
             line += "[" + (*it)->hostPlatform() + "] speed=";
             sprintf(buffer, "%.2f jobs=%d/%d load=%d", server_speed(*it),
-                    (int)(*it)->jobList().size(), (*it)->maxJobs(), (*it)->load());
+                    (*it)->activeJobCount(), (*it)->maxJobs(), (*it)->load());
             line += buffer;
 
             if ((*it)->busyInstalling()) {
@@ -1521,7 +1860,12 @@ static bool handle_line(CompileServer *cs, Msg *_m)
                 }
             }
 
-            if ((*it)->send_msg(GetInternalStatus())) {
+            if (io_threads.enabled()) {
+                if ((*it)->send_msg(GetInternalStatus())) {
+                    internals_requests.push_back(make_pair(*it, cs));
+                    continue;
+                }
+            } else if ((*it)->send_msg(GetInternalStatus())) {
                 msg = (*it)->get_msg();
             }
 
@@ -1537,6 +1881,14 @@ static bool handle_line(CompileServer *cs, Msg *_m)
 
             delete msg;
         }
+
+        // handle_status_text() finishes it once all have answered
+        for (list<pair<CompileServer *, CompileServer *> >::const_iterator it = internals_requests.begin();
+                it != internals_requests.end(); ++it) {
+            if (it->second == cs) {
+                return true;
+            }
+        }
     } else if (cmd == "help") {
         if (!cs->send_msg(TextMsg(
                              "listcs\nlistblocks\nlistjobs\nremovecs\nblockcs\nunblockcs\ninternals\nhelp\nquit"))) {
@@ -1555,6 +1907,36 @@ static bool handle_line(CompileServer *cs, Msg *_m)
     return cs->send_msg(TextMsg(string("200 done")));
 }
 
+/* Passes the answer of a daemon to "internals" on to the control connection
+   that asked, TEXT is 0 if the daemon went away.  Returns false if nobody asked.  */
+static bool handle_status_text(CompileServer *daemon, const string *text)
+{
+    list<pair<CompileServer *, CompileServer *> >::iterator it;
+
+    for (it = internals_requests.begin(); it != internals_requests.end(); ++it) {
+        if (it->first == daemon) {
+            break;
+        }
+    }
+
+    if (it == internals_requests.end()) {
+        return false;
+    }
+
+    CompileServer *control = it->second;
+    internals_requests.erase(it);
+    control->send_msg(TextMsg(text ? *text : daemon->nodeName() + " not reporting\n"));
+
+    for (it = internals_requests.begin(); it != internals_requests.end(); ++it) {
+        if (it->second == control) {
+            return true;
+        }
+    }
+
+    control->send_msg(TextMsg(string("200 done")));
+    return true;
+}
+
 // return false if some error occurred, leaves C open.  */
 static bool try_login(CompileServer *cs, Msg *m)
 {
@@ -1604,7 +1986,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
     case CompileServer::DAEMON:
         log_info() << "remove daemon " << toremove->nodeName() << endl;
 
-        notify_monitors(new MonStatsMsg(toremove->hostId(), "State:Offline\n"));
+        notify_monitors(MonStatsMsg(toremove->hostId(), "State:Offline\n"));
 
         /* A daemon disconnected.  We must remove it from the css list,
            and we have to delete all jobs scheduled on that daemon.
@@ -1615,28 +1997,19 @@ static bool handle_end(CompileServer *toremove, Msg *m)
 
         /* Unfortunately the toanswer queues are also tagged based on the daemon,
            so we need to clean them up also.  */
+        {
+            list<Job *> unanswered = toanswer.remove_submitter(toremove);
 
-        for (list<UnansweredList *>::iterator it = toanswer.begin(); it != toanswer.end();) {
-            if ((*it)->submitter == toremove) {
-                UnansweredList *l = *it;
-                list<Job *>::iterator jit;
-
-                for (jit = l->l.begin(); jit != l->l.end(); ++jit) {
-                    trace() << "STOP (DAEMON) FOR " << (*jit)->id() << endl;
-                    notify_monitors(new MonJobDoneMsg(JobDoneMsg((*jit)->id(),  255)));
-
-                    if ((*jit)->server()) {
-                        (*jit)->server()->setBusyInstalling(0);
-                    }
+            for (list<Job *>::iterator jit = unanswered.begin(); jit != unanswered.end(); ++jit) {
+                trace() << "STOP (DAEMON) FOR " << (*jit)->id() << endl;
+                notify_monitors(MonJobDoneMsg(JobDoneMsg((*jit)->id(),  255)));
 
-                    jobs.erase((*jit)->id());
-                    delete(*jit);
+                if ((*jit)->server()) {
+                    (*jit)->server()->clearBusyInstalling((*jit)->id());
                 }
 
-                delete l;
-                it = toanswer.erase(it);
-            } else {
-                ++it;
+                jobs.erase((*jit)->id());
+                delete(*jit);
             }
         }
 
@@ -1645,7 +2018,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
 
             if (job->server() == toremove || job->submitter() == toremove) {
                 trace() << "STOP (DAEMON2) FOR " << mit->first << endl;
-                notify_monitors(new MonJobDoneMsg(JobDoneMsg(job->id(),  255)));
+                notify_monitors(MonJobDoneMsg(JobDoneMsg(job->id(),  255)));
 
                 /* If this job is removed because the submitter is removed
                 also remove the job from the servers joblist.  */
@@ -1654,7 +2027,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
                 }
 
                 if (job->server()) {
-                    job->server()->setBusyInstalling(0);
+                    job->server()->clearBusyInstalling(job->id());
                 }
 
                 jobs.erase(mit++);
@@ -1668,11 +2041,33 @@ static bool handle_end(CompileServer *toremove, Msg *m)
             (*itr)->eraseCSFromBlacklist(toremove);
         }
 
+        for (map<string, EnvRegistration>::iterator rit = env_registry.begin();
+                rit != env_registry.end();) {
+            rit->second.holders.remove(toremove);
+
+            if (rit->second.holders.empty()) {
+                env_registry.erase(rit++);
+            } else {
+                ++rit;
+            }
+        }
+
+        while (handle_status_text(toremove, 0)) {}
+
         break;
     case CompileServer::LINE:
         toremove->send_msg(TextMsg("200 Good Bye!"));
         controls.remove(toremove);
 
+        for (list<pair<CompileServer *, CompileServer *> >::iterator it = internals_requests.begin();
+                it != internals_requests.end();) {
+            if (it->second == toremove) {
+                it = internals_requests.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
         break;
     default:
         trace() << "remote end had UNKNOWN type?" << endl;
@@ -1680,21 +2075,21 @@ static bool handle_end(CompileServer *toremove, Msg *m)
     }
 
     fd2cs.erase(toremove->fd);
-    delete toremove;
+
+    // the I/O thread may still be using it, it is deleted once released
+    if (toremove->ioThread()) {
+        toremove->ioThread()->detach(toremove);
+    } else {
+        delete toremove;
+    }
+
     return true;
 }
 
-/* Returns TRUE if C was not closed.  */
-static bool handle_activity(CompileServer *cs)
+/* Takes ownership of M.  Returns TRUE if C was not closed.  */
+static bool handle_msg(CompileServer *cs, Msg *m)
 {
-    Msg *m;
     bool ret = true;
-    m = cs->get_msg(0, true);
-
-    if (!m) {
-        handle_end(cs, m);
-        return false;
-    }
 
     /* First we need to login.  */
     if (cs->state() == CompileServer::CONNECTED) {
@@ -1708,6 +2103,9 @@ static bool handle_activity(CompileServer *cs)
     case M_JOB_DONE:
         ret = handle_job_done(cs, m);
         break;
+    case M_JOB_RELEASE:
+        ret = handle_job_release(cs, m);
+        break;
     case M_PING:
         ret = handle_ping(cs, m);
         break;
@@ -1736,6 +2134,15 @@ static bool handle_activity(CompileServer *cs)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(cs, m);
         break;
+    case M_ENV_FINGERPRINT:
+        ret = handle_env_fingerprint(cs, m);
+        break;
+    case M_STATUS_TEXT:
+        if (handle_status_text(cs, &static_cast<StatusTextMsg *>(m)->text)) {
+            break;
+        }
+
+        /* FALLTHROUGH */
     default:
         log_info() << "Invalid message type arrived " << (char)m->type << endl;
         handle_end(cs, m);
@@ -1747,6 +2154,58 @@ static bool handle_activity(CompileServer *cs)
     return ret;
 }
 
+/* Returns TRUE if C was not closed.  */
+static bool handle_activity(CompileServer *cs)
+{
+    Msg *m = cs->get_msg(0, true);
+
+    if (!m) {
+        handle_end(cs, m);
+        return false;
+    }
+
+    return handle_msg(cs, m);
+}
+
+/* Handles what the I/O threads have passed on.  */
+static void handle_io_events()
+{
+    io_threads.clear_events();
+
+    while (IOItem *item = io_threads.next_event()) {
+        CompileServer *cs = item->cs;
+
+        switch (item->type) {
+        case IOItem::Message:
+            // dropped if the connection has been ended meanwhile
+            if (cs->ioThread()) {
+                Msg *m = item->msg;
+                item->msg = 0;
+                handle_msg(cs, m);
+            }
+
+            break;
+        case IOItem::Closed:
+            if (cs->ioThread()) {
+                handle_end(cs, 0);
+            }
+
+            break;
+        case IOItem::Released:
+            delete cs;
+            break;
+        case IOItem::Log:
+            *logfile_error << item->data << flush;
+            break;
+        default:
+            log_error() << "unexpected I/O thread event " << item->type << endl;
+            break;
+        }
+
+        delete item;
+    }
+}
+
 static int open_broad_listener(int port, const string &interface)
 {
     int listen_fd;
@@ -1836,6 +2295,7 @@ static void usage(const char *reason = 0)
          << "  -u, --user-uid\n"
          << "  -v[v[v]]]\n"
          << "  -r, --persistent-client-connection\n"
+         << "  -t, --io-threads <count>\n"
          << endl;
 
     exit(1);
@@ -1908,6 +2368,7 @@ int main(int argc, char *argv[])
     uid_t user_uid;
     gid_t user_gid;
     int warn_icecc_user_errno = 0;
+    int io_thread_count = 0;
 
     if (getuid() == 0) {
         struct passwd *pw = getpwnam("icecc");
@@ -1936,10 +2397,11 @@ int main(int argc, char *argv[])
             { "daemonize", 0, NULL, 'd'},
             { "log-file", 1, NULL, 'l'},
             { "user-uid", 1, NULL, 'u'},
+            { "io-threads", 1, NULL, 't'},
             { 0, 0, 0, 0 }
         };
 
-        const int c = getopt_long(argc, argv, "n:i:p:hl:vdru:", long_options, &option_index);
+        const int c = getopt_long(argc, argv, "n:i:p:hl:vdru:t:", long_options, &option_index);
 
         if (c == -1) {
             break;    // eoo
@@ -2026,6 +2488,19 @@ int main(int argc, char *argv[])
                 usage("Error: -u requires a valid username");
             }
 
+            break;
+        case 't':
+
+            if (optarg && *optarg) {
+                io_thread_count = atoi(optarg);
+
+                if (io_thread_count < 0) {
+                    usage("Error: Invalid number of I/O threads specified");
+                }
+            } else {
+                usage("Error: -t requires argument");
+            }
+
             break;
 
         default:
@@ -2120,6 +2595,14 @@ int main(int argc, char *argv[])
     signal(SIGINT, trigger_exit);
     signal(SIGALRM, trigger_exit);
 
+    if (io_thread_count > 0) {
+        if (!io_threads.start(io_thread_count)) {
+            return 1;
+        }
+
+        log_info() << "using " << io_thread_count << " I/O threads" << endl;
+    }
+
     log_info() << "scheduler ready" << endl;
 
     time_t next_listen = 0;
@@ -2134,6 +2617,11 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        if (check_preloaded) {
+            check_preloaded = false;
+            release_preloaded_jobs();
+        }
+
         /* Announce ourselves from time to time, to make other possible schedulers disconnect
            their daemons if we are the preferred scheduler (daemons with version new enough
            should automatically select the best scheduler, but old daemons connect randomly). */
@@ -2142,6 +2630,14 @@ int main(int argc, char *argv[])
             last_announce = time(NULL);
         }
 
+        if (last_peer_lists + 60 < time(NULL)) {
+            for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+                send_peer_list(*it);
+            }
+
+            last_peer_lists = time(NULL);
+        }
+
         vector< pollfd > pollfds;
         pollfds.reserve( fd2cs.size() + css.size() + 5 );
         pollfd pfd; // tmp variable
@@ -2160,7 +2656,14 @@ int main(int argc, char *argv[])
         pfd.events = POLLIN;
         pollfds.push_back( pfd );
 
-        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin(); it != fd2cs.end();) {
+        if (io_threads.enabled()) {
+            pfd.fd = io_threads.events_fd();
+            pfd.events = POLLIN;
+            pollfds.push_back( pfd );
+        }
+
+        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin();
+                !io_threads.enabled() && it != fd2cs.end();) {
             int i = it->first;
             CompileServer *cs = it->second;
             bool ok = true;
@@ -2242,6 +2745,11 @@ int main(int argc, char *argv[])
 
                     fd2cs[cs->fd] = cs;
 
+                    if (io_threads.enabled()) {
+                        io_threads.attach(cs);
+                        continue;
+                    }
+
                     while (!cs->read_a_bit() || cs->has_msg()) {
                         if (! handle_activity(cs)) {
                             break;
@@ -2270,11 +2778,19 @@ int main(int argc, char *argv[])
                 CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, true);
                 fd2cs[cs->fd] = cs;
 
+                if (io_threads.enabled()) {
+                    io_threads.attach(cs);
+                }
+
                 if (!handle_control_login(cs)) {
                     handle_end(cs, 0);
                     continue;
                 }
 
+                if (io_threads.enabled()) {
+                    continue;
+                }
+
                 while (!cs->read_a_bit() || cs->has_msg())
                     if (!handle_activity(cs)) {
                         break;
@@ -2324,8 +2840,14 @@ int main(int argc, char *argv[])
             }
         }
 
+        if (active_fds && io_threads.enabled()
+                && pollfd_is_set(pollfds, io_threads.events_fd(), POLLIN)) {
+            active_fds--;
+            handle_io_events();
+        }
+
         for (map<int, CompileServer *>::const_iterator it = fd2cs.begin();
-                active_fds > 0 && it != fd2cs.end();) {
+                active_fds > 0 && !io_threads.enabled() && it != fd2cs.end();) {
             int i = it->first;
             CompileServer *cs = it->second;
             /* handle_activity can delete the channel from the fd2cs list,
@@ -2369,6 +2891,18 @@ int main(int argc, char *argv[])
         handle_end(css.front(), NULL);
     while (!monitors.empty())
         handle_end(monitors.front(), NULL);
+    if (io_threads.enabled()) {
+        io_threads.stop();
+
+        // only their last log output is of interest now
+        while (IOItem *item = io_threads.next_event()) {
+            if (item->type == IOItem::Log) {
+                *logfile_error << item->data << flush;
+            }
+
+            delete item;
+        }
+    }
     if ((-1 == close(broad_fd)) && (errno != EBADF)){
         log_perror("close failed");
     }
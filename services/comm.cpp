@@ -42,12 +42,16 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <algorithm>
 #include <string>
 #include <iostream>
+#include <fstream>
 #include <assert.h>
 #include <lzo/lzo1x.h>
 #include <zstd.h>
 #include <stdio.h>
+#include <sys/time.h>
+#include <vector>
 #ifdef HAVE_LIBCAP_NG
 #include <cap-ng.h>
 #endif
@@ -92,6 +96,20 @@ static int zstd_compression()
 
 #define MAX_MSG_SIZE 1 * 1024 * 1024
 
+/*
+ * Since protocol 43 file chunks adapt to the speed of the network, so allow
+ * larger messages with it.
+ */
+#define MAX_MSG_SIZE_43 16 * 1024 * 1024
+
+/*
+ * The size of file chunks when the other side is too old for larger ones,
+ * and the limits for the adaptive chunk size and socket buffer otherwise.
+ */
+#define DEFAULT_CHUNK_SIZE 100000
+#define MAX_CHUNK_SIZE 4 * 1024 * 1024
+#define MAX_SOCKET_BUFFER 16 * 1024 * 1024
+
 /*
  * On a slow and congested network it's possible for a send call to get starved.
  * This will happen especially when trying to send a huge number of bytes over at
@@ -162,7 +180,7 @@ bool MsgChannel::read_a_bit()
         // Daemons sometimes successfully do accept() but then the connection
         // gets ECONNRESET. Probably a spurious result from accept(), so
         // just be silent about it in this case.
-        set_error( instate == NEED_PROTO );
+        set_error( instate == NEED_PROTO || instate == VERIFY_PROTO );
         return false;
     }
     return true;
@@ -238,6 +256,43 @@ bool MsgChannel::update_state(void)
 
         /* FALLTHROUGH if the protocol setup was complete (instate was changed
         to NEED_LEN then).  */
+        if (instate != NEED_LEN) {
+            break;
+        }
+        // fallthrough
+    case VERIFY_PROTO:
+
+        /* We offered only the protocol we assumed and answered with it right
+           away, so the remote has to send something at least as new and agree.  */
+        while (instate == VERIFY_PROTO && inofs - intogo >= 4) {
+            uint32_t remote_prot = 0;
+            unsigned char vers[4];
+            memcpy(vers, inbuf + intogo, 4);
+            intogo += 4;
+
+            for (int i = 0; i < 4; ++i) {
+                remote_prot |= vers[i] << (i * 8);
+            }
+
+            if (maximum_remote_protocol == -1) {
+                if ((int)remote_prot < protocol || remote_prot > (1 << 20)) {
+                    trace() << "remote protocol " << remote_prot << " is older than assumed "
+                            << protocol << endl;
+                    assumed_protocol_wrong = true;
+                    set_error();
+                    return false;
+                }
+
+                maximum_remote_protocol = remote_prot;
+            } else if ((int)remote_prot != protocol) {
+                assumed_protocol_wrong = true;
+                set_error();
+                return false;
+            } else {
+                instate = NEED_LEN;
+            }
+        }
+
         if (instate != NEED_LEN) {
             break;
         }
@@ -262,7 +317,7 @@ bool MsgChannel::update_state(void)
         } else if (inofs - intogo >= 4) {
             (*this) >> inmsglen;
 
-            if (inmsglen > MAX_MSG_SIZE) {
+            if (inmsglen > maxMessageSize()) {
                 log_error() << "received a too large message (size " << inmsglen << "), ignoring" << endl;
                 set_error();
                 return false;
@@ -344,7 +399,7 @@ static size_t get_max_write_size()
     if( const char* icecc_slow_network = getenv( "ICECC_SLOW_NETWORK" ))
         if( icecc_slow_network[ 0 ] == '1' )
             return MAX_SLOW_WRITE_SIZE;
-    return MAX_MSG_SIZE;
+    return MAX_MSG_SIZE_43;
 }
 
 bool MsgChannel::flush_writebuf(bool blocking)
@@ -559,7 +614,7 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
     /* If there was some input, but nothing compressed,
        or lengths are bigger than the whole chunk message
        or we don't have everything to uncompress, there was an error.  */
-    if (uncompressed_len > MAX_MSG_SIZE
+    if (uncompressed_len > maxMessageSize()
             || compressed_len > (inofs - intogo)
             || (uncompressed_len && !compressed_len)
             || inofs < intogo + compressed_len) {
@@ -663,7 +718,7 @@ void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, si
     }
 
     uint32_t _olen = htonl(out_len);
-    if(out_len > MAX_MSG_SIZE) {
+    if(out_len > maxMessageSize()) {
         log_error() << "internal error - size of compressed message to write exceeds max size:" << out_len << endl;
     }
     memcpy(msgbuf + msgtogo_old, &_olen, 4);
@@ -815,7 +870,8 @@ static bool connect_async(int remote_fd, struct sockaddr *remote_addr, size_t re
     return true;
 }
 
-MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int timeout)
+MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int timeout,
+                                   int remote_protocol)
 {
     int remote_fd;
     struct sockaddr_in remote_addr;
@@ -824,6 +880,15 @@ MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int
         return 0;
     }
 
+#ifdef TCP_FASTOPEN_CONNECT
+    if (remote_protocol) {
+        // connect() returns at once and the first write goes out with the SYN,
+        // the kernel falls back to a normal connect if it cannot do that
+        int i = 1;
+        setsockopt(remote_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &i, sizeof(i));
+    }
+#endif
+
     if (timeout) {
         if (!connect_async(remote_fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr), timeout)) {
             return 0;    // remote_fd is already closed
@@ -843,7 +908,8 @@ MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int
     }
 
     trace() << "connected to " << hostname << endl;
-    return createChannel(remote_fd, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
+    return createChannel(remote_fd, (struct sockaddr *)&remote_addr, sizeof(remote_addr),
+                         remote_protocol);
 }
 
 MsgChannel *Service::createChannel(const string &socket_path)
@@ -898,9 +964,9 @@ bool MsgChannel::eq_ip(const MsgChannel &s) const
             && memcmp(&s1->sin_addr, &s2->sin_addr, sizeof(s1->sin_addr)) == 0);
 }
 
-MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l)
+MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l, int remote_protocol)
 {
-    MsgChannel *c = new MsgChannel(fd, _a, _l, false);
+    MsgChannel *c = new MsgChannel(fd, _a, _l, false, remote_protocol);
 
     if (!c->wait_for_protocol()) {
         delete c;
@@ -910,7 +976,25 @@ MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l)
     return c;
 }
 
-MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
+MsgChannel *Service::adoptChannel(int fd, int protocol, int maximum_remote_protocol)
+{
+    struct sockaddr_storage remote_addr;
+    socklen_t remote_len = sizeof(remote_addr);
+
+    if (getpeername(fd, (struct sockaddr *)&remote_addr, &remote_len) < 0) {
+        log_perror("getpeername()");
+        return 0;
+    }
+
+    // a text channel skips the protocol setup, which was done already
+    MsgChannel *c = new MsgChannel(fd, (struct sockaddr *)&remote_addr, remote_len, true);
+    c->text_based = false;
+    c->protocol = protocol;
+    c->maximum_remote_protocol = maximum_remote_protocol;
+    return c;
+}
+
+MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text, int remote_protocol)
     : fd(_fd)
 {
     addr_len = (sizeof(struct sockaddr) > _l) ? sizeof(struct sockaddr) : _l;
@@ -943,6 +1027,7 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     eof = false;
     text_based = text;
     set_error_recursion = false;
+    assumed_protocol_wrong = false;
     maximum_remote_protocol = -1;
 
     int on = 1;
@@ -988,6 +1073,20 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     if (text_based) {
         instate = NEED_LEN;
         protocol = PROTOCOL_VERSION;
+    } else if (remote_protocol >= MIN_PROTOCOL_VERSION) {
+        /* Offer just the protocol both sides support and confirm it without
+           waiting, the remote then agrees to it like in the normal setup.
+           Both are sent together with the first message.  */
+        instate = VERIFY_PROTO;
+        protocol = min(remote_protocol, PROTOCOL_VERSION);
+        unsigned char vers[4];
+
+        for (int i = 0; i < 4; ++i) {
+            vers[i] = protocol >> (i * 8);
+        }
+
+        writefull(vers, 4);
+        writefull(vers, 4);
     } else {
         instate = NEED_PROTO;
         protocol = -1;
@@ -1004,6 +1103,30 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     last_talk = time(0);
 }
 
+MsgChannel::MsgChannel(int _protocol, bool text)
+    : fd(-1)
+    , protocol(_protocol)
+    , maximum_remote_protocol(_protocol)
+    , last_talk(0)
+    , msgbuf((char *) malloc(128))
+    , msgbuflen(128)
+    , msgofs(0)
+    , msgtogo(0)
+    , inbuf(0)
+    , inbuflen(0)
+    , inofs(0)
+    , intogo(0)
+    , instate(NEED_LEN)
+    , inmsglen(0)
+    , eof(false)
+    , text_based(text)
+    , addr(0)
+    , addr_len(0)
+    , set_error_recursion(false)
+    , assumed_protocol_wrong(false)
+{
+}
+
 MsgChannel::~MsgChannel()
 {
     if (fd >= 0) {
@@ -1089,6 +1212,73 @@ void MsgChannel::setBulkTransfer()
     setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &i, sizeof(i));
 }
 
+void MsgChannel::setTrafficClass(TrafficClass traffic)
+{
+    if (fd < 0 || !addr || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
+        return;
+    }
+
+    // CS1 ("lower effort") for bulk data, AF21 (low latency data) for jobs
+    int tos = traffic == BulkTraffic ? 0x20 : 0x48;
+
+    if (addr->sa_family == AF_INET6) {
+#ifdef IPV6_TCLASS
+        setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+#endif
+    } else {
+        setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    }
+
+#ifdef SO_PRIORITY
+    // TC_PRIO_BULK and TC_PRIO_INTERACTIVE, the highest one allowed without privileges
+    int priority = traffic == BulkTraffic ? 2 : 6;
+    setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority));
+#endif
+}
+
+size_t MsgChannel::maxMessageSize() const
+{
+    return IS_PROTOCOL_43(this) ? MAX_MSG_SIZE_43 : MAX_MSG_SIZE;
+}
+
+size_t MsgChannel::bulkChunkSize()
+{
+    static bool slow_network = get_max_write_size() == MAX_SLOW_WRITE_SIZE;
+
+    if (!IS_PROTOCOL_43(this) || slow_network || fd < 0) {
+        return DEFAULT_CHUNK_SIZE;
+    }
+
+    size_t chunk_size = DEFAULT_CHUNK_SIZE;
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0 && info.tcpi_snd_mss > 0) {
+        // The congestion window is what the connection can have in flight,
+        // i.e. an estimate of the bandwidth-delay product.
+        size_t bdp = size_t(info.tcpi_snd_cwnd) * info.tcpi_snd_mss;
+        chunk_size = max(chunk_size, min(bdp, size_t(MAX_CHUNK_SIZE)));
+
+        // Keep twice that queued, so that the socket doesn't run empty while we're
+        // reading and compressing the next chunk. The kernel's own autotuning is
+        // limited by sysctls, so only override it if we're privileged to do so.
+#ifdef SO_SNDBUFFORCE
+        int sndbuf = 0;
+        socklen_t sndbuf_len = sizeof(sndbuf);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuf_len) == 0
+                && size_t(sndbuf) < 2 * bdp && sndbuf < MAX_SOCKET_BUFFER) {
+            sndbuf = min(2 * bdp, size_t(MAX_SOCKET_BUFFER));
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf));
+        }
+#endif
+    }
+#endif
+
+    return chunk_size;
+}
+
 /* This waits indefinitely (well, TIMEOUT seconds) for a complete
    message to arrive.  Returns false if there was some error.  */
 bool MsgChannel::wait_for_msg(int timeout)
@@ -1101,6 +1291,12 @@ bool MsgChannel::wait_for_msg(int timeout)
         return true;
     }
 
+    // the remote waits for our part of the protocol setup
+    if (instate == VERIFY_PROTO && msgtogo && !flush_writebuf(true)) {
+        set_error();
+        return false;
+    }
+
     if (!read_a_bit()) {
         trace() << "!read_a_bit\n";
         set_error();
@@ -1193,6 +1389,24 @@ Msg *MsgChannel::get_msg(int timeout, bool eofAllowed)
     case M_NO_CS:
         m = new NoCSMsg;
         break;
+    case M_PEER_LIST:
+        m = new PeerListMsg;
+        break;
+    case M_ENV_FINGERPRINT:
+        m = new EnvFingerprintMsg;
+        break;
+    case M_ENV_UPLOAD:
+        m = new EnvUploadMsg;
+        break;
+    case M_ENV_TRANSFER_STATE:
+        m = new EnvTransferStateMsg;
+        break;
+    case M_ENV_HASH:
+        m = new EnvHashMsg;
+        break;
+    case M_JOB_RELEASE:
+        m = new JobReleaseMsg;
+        break;
     case M_COMPILE_FILE:
         m = new CompileFileMsg(new CompileJob, true);
         break;
@@ -1296,15 +1510,9 @@ Msg *MsgChannel::get_msg(int timeout, bool eofAllowed)
     return m;
 }
 
-bool MsgChannel::send_msg(const Msg &m, int flags)
+// adds the message to the data waiting to be sent
+bool MsgChannel::append_msg(const Msg &m)
 {
-    if (instate == ERROR) {
-        return false;
-    }
-    if (instate == NEED_PROTO && !wait_for_protocol()) {
-        return false;
-    }
-
     chop_output();
     size_t msgtogo_old = msgtogo;
 
@@ -1314,15 +1522,59 @@ bool MsgChannel::send_msg(const Msg &m, int flags)
         *this << (uint32_t) 0;
         m.send_to_channel(this);
         uint32_t out_len = msgtogo - msgtogo_old - 4;
-        if(out_len > MAX_MSG_SIZE) {
+        if(out_len > maxMessageSize()) {
             log_error() << "internal error - size of message to write exceeds max size:" << out_len << endl;
-            set_error();
             return false;
         }
         uint32_t len = htonl(out_len);
         memcpy(msgbuf + msgtogo_old, &len, 4);
     }
 
+    return true;
+}
+
+bool MsgChannel::send_msg(const Msg &m, int flags)
+{
+    if (instate == ERROR) {
+        return false;
+    }
+    if (instate == NEED_PROTO && !wait_for_protocol()) {
+        return false;
+    }
+
+    if (!append_msg(m)) {
+        set_error();
+        return false;
+    }
+
+    if ((flags & SendBulkOnly) && msgtogo < 4096) {
+        return true;
+    }
+
+    return flush_writebuf((flags & SendBlocking));
+}
+
+bool MsgChannel::encode_msg(const Msg &m, string &data) const
+{
+    MsgChannel encoder(protocol, text_based);
+
+    if (!encoder.append_msg(m)) {
+        return false;
+    }
+
+    data.assign(encoder.msgbuf, encoder.msgtogo);
+    return true;
+}
+
+bool MsgChannel::send_encoded(const string &data, int flags)
+{
+    if (instate == ERROR) {
+        return false;
+    }
+
+    chop_output();
+    writefull(data.data(), data.size());
+
     if ((flags & SendBulkOnly) && msgtogo < 4096) {
         return true;
     }
@@ -1529,7 +1781,8 @@ void Broadcasts::broadcastData(int port, const char* buf, int len)
 }
 
 DiscoverSched::DiscoverSched(const std::string &_netname, int _timeout,
-                             const std::string &_schedname, int port)
+                             const std::string &_schedname, int port,
+                             const std::string &_cachefile)
     : netname(_netname)
     , schedname(_schedname)
     , timeout(_timeout)
@@ -1540,6 +1793,12 @@ DiscoverSched::DiscoverSched(const std::string &_netname, int _timeout,
     , best_start_time(0)
     , best_port(0)
     , multiple(false)
+    , cachefile(_cachefile)
+    , cache_fd(-1)
+    , cache_connected(false)
+    , cache_port(0)
+    , cache_version(0)
+    , cache_start_time(0)
 {
     time0 = time(0);
 
@@ -1572,11 +1831,20 @@ DiscoverSched::DiscoverSched(const std::string &_netname, int _timeout,
         attempt_scheduler_connect();
     } else {
         sendSchedulerDiscovery( PROTOCOL_VERSION );
+
+        if (!cachefile.empty()) {
+            attempt_cached_scheduler_connect();
+        }
     }
 }
 
 DiscoverSched::~DiscoverSched()
 {
+    if (cache_fd >= 0) {
+        if ((-1 == close(cache_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+    }
     if (ask_fd >= 0) {
         if ((-1 == close(ask_fd)) && (errno != EBADF)){
             log_perror("close failed");
@@ -1604,6 +1872,125 @@ void DiscoverSched::attempt_scheduler_connect()
     }
 }
 
+void DiscoverSched::attempt_cached_scheduler_connect()
+{
+    ifstream file(cachefile.c_str());
+    string name;
+    unsigned long long start_time;
+
+    if (!(file >> cache_schedname >> cache_port >> cache_version >> start_time >> name)
+            || strcasecmp(name.c_str(), netname.c_str()) != 0) {
+        return;
+    }
+
+    cache_start_time = start_time;
+
+    if ((cache_fd = prepare_connect(cache_schedname, cache_port, cache_addr)) < 0) {
+        return;
+    }
+
+    fcntl(cache_fd, F_SETFL, O_NONBLOCK);
+
+    if (connect(cache_fd, (struct sockaddr *) &cache_addr, sizeof(cache_addr)) < 0
+            && errno != EINPROGRESS) {
+        log_perror_trace("connect to cached scheduler");
+        if ((-1 == close(cache_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+        cache_fd = -1;
+        return;
+    }
+
+    log_info() << "trying cached scheduler " << cache_schedname << ":" << cache_port
+               << " (version: " << cache_version << ")" << endl;
+}
+
+void DiscoverSched::check_cached_scheduler_connect()
+{
+    if (cache_fd < 0 || cache_connected) {
+        return;
+    }
+
+    pollfd pfd;
+    pfd.fd = cache_fd;
+    pfd.events = POLLOUT;
+
+    if (poll(&pfd, 1, 0) <= 0) {
+        return; // still connecting
+    }
+
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+
+    if (getsockopt(cache_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+        log_info() << "cached scheduler " << cache_schedname << ":" << cache_port
+                   << " is not reachable: " << strerror(error) << endl;
+        if ((-1 == close(cache_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+        cache_fd = -1;
+        return;
+    }
+
+    cache_connected = true;
+}
+
+/* Once broadcasting is over, the cached scheduler is used if none answered, or if
+   it is the best of those that did. The start time in the cache may be stale, so
+   a scheduler only known from there wins over the answers only by a newer version.  */
+MsgChannel *DiscoverSched::try_cached_scheduler()
+{
+    check_cached_scheduler_connect();
+
+    if (cache_fd < 0) {
+        return 0;
+    }
+
+    bool same_as_best = best_schedname == cache_schedname && best_port == cache_port;
+
+    if (!cache_connected || (best_version != 0 && !same_as_best && best_version >= cache_version)) {
+        log_info() << "cached scheduler " << cache_schedname << ":" << cache_port
+                   << (cache_connected ? " is not the best one anymore" : " did not answer") << endl;
+        if ((-1 == close(cache_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+        cache_fd = -1;
+        cache_connected = false;
+        return 0;
+    }
+
+    int fd = cache_fd;
+    cache_fd = -1;
+    schedname = cache_schedname;
+    sport = cache_port;
+    MsgChannel *c = Service::createChannel(fd, (struct sockaddr *) &cache_addr, sizeof(cache_addr));
+
+    if (c) {
+        save_cache(cache_version, cache_start_time);
+    }
+
+    return c;
+}
+
+void DiscoverSched::save_cache(int version, time_t start_time) const
+{
+    // without the netname, the entry could never be read back
+    if (cachefile.empty() || netname.empty()) {
+        return;
+    }
+
+    string tmpfile = cachefile + ".tmp";
+    ofstream file(tmpfile.c_str());
+    file << schedname << " " << sport << " " << version << " "
+         << (unsigned long long) start_time << " " << netname << endl;
+    file.close();
+
+    if (!file || rename(tmpfile.c_str(), cachefile.c_str()) != 0) {
+        log_perror("failed to save scheduler cache") << "\t" << cachefile << endl;
+        unlink(tmpfile.c_str());
+    }
+}
+
 void DiscoverSched::sendSchedulerDiscovery( int version )
 {
         assert( version < 128 );
@@ -1765,6 +2152,12 @@ MsgChannel *DiscoverSched::try_get_scheduler()
                     log_info() << "Suitable scheduler found at " << inet_ntoa(remote_addr.sin_addr)
                         << ":" << ntohs(remote_addr.sin_port) << " (version: " << version << ")" << endl;
                 }
+                if (cache_fd >= 0 && remote_addr.sin_addr.s_addr == cache_addr.sin_addr.s_addr
+                        && remote_addr.sin_port == cache_addr.sin_port) {
+                    // fresh data for the cached scheduler
+                    cache_version = version;
+                    cache_start_time = start_time;
+                }
                 if (best_version != 0)
                     multiple = true;
                 if (best_version < version || (best_version == version && best_start_time > start_time)) {
@@ -1780,7 +2173,13 @@ MsgChannel *DiscoverSched::try_get_scheduler()
             }
         }
 
+        check_cached_scheduler_connect();
+
         if (timed_out()) {
+            if (MsgChannel *c = try_cached_scheduler()) {
+                return c;
+            }
+
             if (best_version == 0) {
                 return 0;
             }
@@ -1809,8 +2208,14 @@ MsgChannel *DiscoverSched::try_get_scheduler()
                 if (status == 0 || (status < 0 && (errno == EISCONN || errno == EINPROGRESS))) {
                     int fd = ask_fd;
                     ask_fd = -1;
-                    return Service::createChannel(fd,
+                    MsgChannel *c = Service::createChannel(fd,
                                                   (struct sockaddr *) &remote_addr, sizeof(remote_addr));
+
+                    if (c) {
+                        save_cache(best_version, best_start_time);
+                    }
+
+                    return c;
                 }
             }
         }
@@ -1940,6 +2345,7 @@ GetCSMsg::GetCSMsg(const Environments &envs, const std::string &f,
     , minimal_host_version(_minimal_host_version)
     , required_features(_required_features)
     , client_count(_client_count)
+    , priority(0)
 {
     // These have been introduced in protocol version 42.
     if( required_features & ( NODE_FEATURE_ENV_XZ | NODE_FEATURE_ENV_ZSTD ))
@@ -1987,6 +2393,29 @@ void GetCSMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_42(c)) {
         *c >> required_features;
     }
+
+    build_session = string();
+    priority = 0;
+    if (IS_PROTOCOL_53(c)) {
+        uint32_t _priority;
+        *c >> build_session;
+        *c >> _priority;
+        priority = _priority;
+    }
+
+    avoided_hosts.clear();
+    if (IS_PROTOCOL_56(c)) {
+        uint32_t count;
+        *c >> count;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            string host;
+            uint32_t port;
+            *c >> host;
+            *c >> port;
+            avoided_hosts.push_back(make_pair(host, port));
+        }
+    }
 }
 
 void GetCSMsg::send_to_channel(MsgChannel *c) const
@@ -2017,6 +2446,24 @@ void GetCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_42(c)) {
         *c << required_features;
     }
+    if (IS_PROTOCOL_53(c)) {
+        *c << build_session;
+        *c << (uint32_t) priority;
+    }
+    if (IS_PROTOCOL_56(c)) {
+        *c << (uint32_t) avoided_hosts.size();
+
+        for (HostPorts::const_iterator it = avoided_hosts.begin(); it != avoided_hosts.end(); ++it) {
+            *c << it->first;
+            *c << it->second;
+        }
+    }
+}
+
+bool GetCSMsg::avoids(const string &host, unsigned int port) const
+{
+    return find(avoided_hosts.begin(), avoided_hosts.end(), make_pair(host, uint32_t(port)))
+           != avoided_hosts.end();
 }
 
 void UseCSMsg::fill_from_channel(MsgChannel *c)
@@ -2034,6 +2481,12 @@ void UseCSMsg::fill_from_channel(MsgChannel *c)
     } else {
         matched_job_id = 0;
     }
+
+    if (IS_PROTOCOL_49(c)) {
+        *c >> host_protocol;
+    } else {
+        host_protocol = 0;
+    }
 }
 
 void UseCSMsg::send_to_channel(MsgChannel *c) const
@@ -2049,6 +2502,10 @@ void UseCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_28(c)) {
         *c << matched_job_id;
     }
+
+    if (IS_PROTOCOL_49(c)) {
+        *c << host_protocol;
+    }
 }
 
 void NoCSMsg::fill_from_channel(MsgChannel *c)
@@ -2122,6 +2579,13 @@ void CompileFileMsg::fill_from_channel(MsgChannel *c)
         job->setOutputFile(outputFile);
         job->setDwarfFissionEnabled(dwarfFissionEnabled);
     }
+    if (IS_PROTOCOL_52(c)) {
+        list<string> inputs, outputs;
+        *c >> inputs;
+        *c >> outputs;
+        job->setCommandInputs(inputs);
+        job->setCommandOutputs(outputs);
+    }
 }
 
 void CompileFileMsg::send_to_channel(MsgChannel *c) const
@@ -2165,14 +2629,23 @@ void CompileFileMsg::send_to_channel(MsgChannel *c) const
         *c << job->outputFile();
         *c << (uint32_t) job->dwarfFissionEnabled();
     }
+    if (IS_PROTOCOL_52(c)) {
+        *c << job->commandInputs();
+        *c << job->commandOutputs();
+    }
 }
 
 // Environments created by icecc-create-env always use the same binary name
 // for compilers, so even if local name was e.g. c++, remote needs to
 // be g++ (before protocol version 30 remote CS even had /usr/bin/{gcc|g++}
 // hardcoded).  For clang, the binary is just clang for both C/C++.
+// Remote commands are added to the environment with their absolute path.
 string CompileFileMsg::remote_compiler_name() const
 {
+    if (job->language() == CompileJob::Lang_Custom) {
+        return job->compilerName();
+    }
+
     if (job->compilerName().find("clang") != string::npos) {
         return "clang";
     }
@@ -2387,6 +2860,8 @@ LoginMsg::LoginMsg(unsigned int myport, const std::string &_nodename, const std:
     , nodename(_nodename)
     , host_platform(_host_platform)
     , supported_features(myfeatures)
+    , orphaned_jobs(0)
+    , physical_kids(0)
 {
 #ifdef HAVE_LIBCAP_NG
     chroot_possible = capng_have_capability(CAPNG_EFFECTIVE, CAP_SYS_CHROOT);
@@ -2419,6 +2894,16 @@ void LoginMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_42(c)) {
         *c >> supported_features;
     }
+
+    orphaned_jobs = 0;
+    if (IS_PROTOCOL_44(c)) {
+        *c >> orphaned_jobs;
+    }
+
+    physical_kids = 0;
+    if (IS_PROTOCOL_50(c)) {
+        *c >> physical_kids;
+    }
 }
 
 void LoginMsg::send_to_channel(MsgChannel *c) const
@@ -2437,6 +2922,12 @@ void LoginMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_42(c)) {
         *c << supported_features;
     }
+    if (IS_PROTOCOL_44(c)) {
+        *c << orphaned_jobs;
+    }
+    if (IS_PROTOCOL_50(c)) {
+        *c << physical_kids;
+    }
 }
 
 void ConfCSMsg::fill_from_channel(MsgChannel *c)
@@ -2465,6 +2956,25 @@ void StatsMsg::fill_from_channel(MsgChannel *c)
     *c >> loadAvg5;
     *c >> loadAvg10;
     *c >> freeMem;
+
+    if (IS_PROTOCOL_55(c)) {
+        *c >> max_kids;
+        *c >> job_speed;
+        *c >> throughput;
+        *c >> queue_delay;
+    }
+
+    if (IS_PROTOCOL_56(c)) {
+        *c >> cold_jobs;
+        *c >> cold_job_msec;
+        *c >> warm_jobs;
+        *c >> warm_job_msec;
+        *c >> orphaned_jobs;
+        *c >> job_in;
+        *c >> job_out;
+        *c >> bulk_in;
+        *c >> bulk_out;
+    }
 }
 
 void StatsMsg::send_to_channel(MsgChannel *c) const
@@ -2475,6 +2985,25 @@ void StatsMsg::send_to_channel(MsgChannel *c) const
     *c << loadAvg5;
     *c << loadAvg10;
     *c << freeMem;
+
+    if (IS_PROTOCOL_55(c)) {
+        *c << max_kids;
+        *c << job_speed;
+        *c << throughput;
+        *c << queue_delay;
+    }
+
+    if (IS_PROTOCOL_56(c)) {
+        *c << cold_jobs;
+        *c << cold_job_msec;
+        *c << warm_jobs;
+        *c << warm_job_msec;
+        *c << orphaned_jobs;
+        *c << job_in;
+        *c << job_out;
+        *c << bulk_in;
+        *c << bulk_out;
+    }
 }
 
 void GetNativeEnvMsg::fill_from_channel(MsgChannel *c)
@@ -2506,12 +3035,20 @@ void UseNativeEnvMsg::fill_from_channel(MsgChannel *c)
 {
     Msg::fill_from_channel(c);
     *c >> nativeVersion;
+
+    if (IS_PROTOCOL_51(c)) {
+        c->read_environments(cross);
+    }
 }
 
 void UseNativeEnvMsg::send_to_channel(MsgChannel *c) const
 {
     Msg::send_to_channel(c);
     *c << nativeVersion;
+
+    if (IS_PROTOCOL_51(c)) {
+        c->write_environments(cross);
+    }
 }
 
 void EnvTransferMsg::fill_from_channel(MsgChannel *c)
@@ -2672,6 +3209,130 @@ void BlacklistHostEnvMsg::send_to_channel(MsgChannel *c) const
     *c << hostname;
 }
 
+void PeerListMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t net_reply = 0;
+    *c >> net_reply;
+    reply = net_reply != 0;
+    uint32_t count = 0;
+    *c >> count;
+    peers.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Peer peer;
+        *c >> peer.hostname;
+        *c >> peer.port;
+        *c >> peer.host_platform;
+        *c >> peer.max_jobs;
+        *c >> peer.load;
+        *c >> peer.protocol;
+        *c >> peer.features;
+        *c >> peer.age;
+        c->read_environments(peer.envs);
+        peers.push_back(peer);
+    }
+}
+
+void PeerListMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << (uint32_t) reply;
+    *c << (uint32_t) peers.size();
+
+    for (list<Peer>::const_iterator it = peers.begin(); it != peers.end(); ++it) {
+        *c << it->hostname;
+        *c << it->port;
+        *c << it->host_platform;
+        *c << it->max_jobs;
+        *c << it->load;
+        *c << it->protocol;
+        *c << it->features;
+        *c << it->age;
+        c->write_environments(it->envs);
+    }
+}
+
+void EnvFingerprintMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> fingerprint;
+    *c >> platform;
+    *c >> name;
+    *c >> host;
+    *c >> port;
+}
+
+void EnvFingerprintMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << fingerprint;
+    *c << platform;
+    *c << name;
+    *c << host;
+    *c << port;
+}
+
+void EnvUploadMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> hostname;
+    *c >> port;
+    *c >> target;
+    *c >> name;
+    *c >> file;
+    *c >> result;
+}
+
+void EnvUploadMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << hostname;
+    *c << port;
+    *c << target;
+    *c << name;
+    *c << file;
+    *c << result;
+}
+
+void EnvTransferStateMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> blocks;
+}
+
+void EnvTransferStateMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << blocks;
+}
+
+void EnvHashMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> block;
+    *c >> hash;
+}
+
+void EnvHashMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << block;
+    *c << hash;
+}
+
+void JobReleaseMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> job_id;
+}
+
+void JobReleaseMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << job_id;
+}
+
 /*
 vim:cinoptions={.5s,g0,p5,t0,(0,^-0.5s,n-0.5s:tw=78:cindent:sw=4:
 */
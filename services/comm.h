@@ -36,7 +36,7 @@
 #include "job.h"
 
 // if you increase the PROTOCOL_VERSION, add a macro below and use that
-#define PROTOCOL_VERSION 42
+#define PROTOCOL_VERSION 56
 // if you increase the MIN_PROTOCOL_VERSION, comment out macros below and clean up the code
 #define MIN_PROTOCOL_VERSION 21
 
@@ -67,6 +67,31 @@
 #define IS_PROTOCOL_40(c) ((c)->protocol >= 40)
 #define IS_PROTOCOL_41(c) ((c)->protocol >= 41)
 #define IS_PROTOCOL_42(c) ((c)->protocol >= 42)
+#define IS_PROTOCOL_43(c) ((c)->protocol >= 43)
+#define IS_PROTOCOL_44(c) ((c)->protocol >= 44)
+#define IS_PROTOCOL_45(c) ((c)->protocol >= 45)
+#define IS_PROTOCOL_46(c) ((c)->protocol >= 46)
+// client asks the local daemon to upload the environment (M_ENV_UPLOAD)
+#define IS_PROTOCOL_47(c) ((c)->protocol >= 47)
+// resumable environment transfers verified by hashes
+#define IS_PROTOCOL_48(c) ((c)->protocol >= 48)
+// protocol of the compile server in M_USE_CS, for optimistic connection setup
+#define IS_PROTOCOL_49(c) ((c)->protocol >= 49)
+// number of physical cores among the job slots in M_LOGIN
+#define IS_PROTOCOL_50(c) ((c)->protocol >= 50)
+// environments of the same toolchain for other platforms in M_NATIVE_ENV
+#define IS_PROTOCOL_51(c) ((c)->protocol >= 51)
+// remote commands from icerun with their input and output files in M_COMPILE_FILE
+#define IS_PROTOCOL_52(c) ((c)->protocol >= 52)
+// build session and priority hint in M_GET_CS
+#define IS_PROTOCOL_53(c) ((c)->protocol >= 53)
+// jobs waiting for a slot can be given back to the scheduler with M_JOB_RELEASE
+#define IS_PROTOCOL_54(c) ((c)->protocol >= 54)
+// tuned slot count and its measurements in M_STATS
+#define IS_PROTOCOL_55(c) ((c)->protocol >= 55)
+// compile servers the job failed on before in M_GET_CS, cold and warm starts, orphaned jobs
+// and traffic per class in M_STATS
+#define IS_PROTOCOL_56(c) ((c)->protocol >= 56)
 
 // Terms used:
 // S  = scheduler
@@ -140,7 +165,18 @@ enum MsgType {
     // C --> CS, CS --> S (forwarded from C), to not use given host for given environment
     M_BLACKLIST_HOST_ENV,
     // S --> CS
-    M_NO_CS
+    M_NO_CS,
+    // S --> CS, CS --> CS, known compile servers for placing jobs without a scheduler
+    M_PEER_LIST,
+    // CS --> S (look up or register), S --> CS (lookup answer), CS --> CS (fetch request),
+    // environments known by toolchain fingerprint
+    M_ENV_FINGERPRINT,
+    M_ENV_UPLOAD,
+    M_ENV_TRANSFER_STATE,
+    M_ENV_HASH,
+    // S --> CS (give the job back if not started yet), CS --> S (given back),
+    // CS --> C (ask for another compile server)
+    M_JOB_RELEASE
 };
 
 enum Compression {
@@ -148,6 +184,9 @@ enum Compression {
     C_ZSTD = 1
 };
 
+// Environments are transferred in blocks of this size, each one verified by its hash.
+const size_t ENV_BLOCK_SIZE = 4 * 1024 * 1024;
+
 // The remote node is capable of unpacking environment compressed as .tar.xz .
 const int NODE_FEATURE_ENV_XZ = ( 1 << 0 );
 // The remote node is capable of unpacking environment compressed as .tar.zst .
@@ -157,6 +196,8 @@ class MsgChannel;
 
 // a list of pairs of host platform, filename
 typedef std::list<std::pair<std::string, std::string> > Environments;
+// a list of pairs of hostname, port of compile servers
+typedef std::list<std::pair<std::string, uint32_t> > HostPorts;
 
 class Msg
 {
@@ -180,9 +221,25 @@ public:
         SendBulkOnly = 1 << 2
     };
 
+    // Job data is sent as fast as possible, environments as bulk data that
+    // the network may delay in favour of jobs.
+    enum TrafficClass {
+        JobTraffic,
+        BulkTraffic
+    };
+
     virtual ~MsgChannel();
 
     void setBulkTransfer();
+    // Marks the packets of the connection for queueing on the way (DSCP) and in
+    // the local network stack (socket priority).
+    void setTrafficClass(TrafficClass traffic);
+
+    // Size of the largest message the other side accepts.
+    size_t maxMessageSize() const;
+    // Size of file data to send in one FileChunkMsg. Adapts to the bandwidth-delay
+    // product of the connection measured so far and grows the socket send buffer to match.
+    size_t bulkChunkSize();
 
     std::string dump() const;
     // NULL  <--> channel closed or timeout
@@ -192,6 +249,11 @@ public:
     // false <--> error (msg not send)
     bool send_msg(const Msg &, int SendFlags = SendBlocking);
 
+    // Encodes a message the way send_msg() would for this channel, without touching
+    // the channel, so that another thread can send it with send_encoded().
+    bool encode_msg(const Msg &, std::string &data) const;
+    bool send_encoded(const std::string &data, int SendFlags = SendBlocking);
+
     bool has_msg(void) const
     {
         return eof || instate == HAS_MSG;
@@ -205,6 +267,20 @@ public:
         return instate != HAS_MSG && eof;
     }
 
+    // The remote did not agree to the protocol assumed when connecting, a
+    // connection with the normal protocol setup may still work.
+    bool assumed_protocol_failed(void) const
+    {
+        return assumed_protocol_wrong;
+    }
+
+    // Nothing is buffered in either direction, so another process may take the
+    // connection over at a message boundary.
+    bool is_quiet(void) const
+    {
+        return instate == NEED_LEN && inofs == intogo && msgtogo == 0 && !eof;
+    }
+
     bool is_text_based(void) const
     {
         return text_based;
@@ -240,9 +316,12 @@ public:
     time_t last_talk;
 
 protected:
-    MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false);
+    MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false, int remote_protocol = 0);
+    // a channel without a connection, only for encoding messages into msgbuf
+    MsgChannel(int _protocol, bool text);
 
     bool wait_for_protocol();
+    bool append_msg(const Msg &);
     // returns false if there was an error sending something
     bool flush_writebuf(bool blocking);
     void writefull(const void *_buf, size_t count);
@@ -267,7 +346,8 @@ protected:
         NEED_LEN,
         FILL_BUF,
         HAS_MSG,
-        ERROR
+        ERROR,
+        VERIFY_PROTO // protocol assumed, remote's part of the setup not read yet
     } instate;
 
     uint32_t inmsglen;
@@ -281,15 +361,23 @@ private:
     struct sockaddr *addr;
     socklen_t addr_len;
     bool set_error_recursion;
+    bool assumed_protocol_wrong;
 };
 
 // just convenient functions to create MsgChannels
 class Service
 {
 public:
-    static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout);
+    // If the protocol the remote supports is known, the first message goes out
+    // without waiting for the protocol setup, on a TCP Fast Open connection
+    // if possible.
+    static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout,
+                                     int remote_protocol = 0);
     static MsgChannel *createChannel(const std::string &domain_socket);
-    static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t);
+    static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t,
+                                     int remote_protocol = 0);
+    // Takes over a connection whose protocol setup another process has done.
+    static MsgChannel *adoptChannel(int fd, int protocol, int maximum_remote_protocol);
 };
 
 class Broadcasts
@@ -314,11 +402,16 @@ class DiscoverSched
 public:
     /* Connect to a scheduler waiting max. TIMEOUT seconds.
        schedname can be the hostname of a box running a scheduler, to avoid
-       broadcasting, port can be specified explicitly */
+       broadcasting, port can be specified explicitly.
+       If cachefile is given, the scheduler found by broadcasting is saved there,
+       and the next time it is connected to directly in parallel to broadcasting.
+       It is only used if no scheduler answers the broadcast, or if it has a newer
+       protocol version than those that do. */
     DiscoverSched(const std::string &_netname = std::string(),
                   int _timeout = 2,
                   const std::string &_schedname = std::string(),
-                  int port = 0);
+                  int port = 0,
+                  const std::string &_cachefile = std::string());
     ~DiscoverSched();
 
     bool timed_out();
@@ -333,6 +426,13 @@ public:
         return schedname.empty() ? -1 : ask_fd;
     }
 
+    // The direct connection to the cached scheduler while it is being made,
+    // it is ready when writable.
+    int cache_connect_fd() const
+    {
+        return cache_connected ? -1 : cache_fd;
+    }
+
     // compat for icecream monitor
     int get_fd() const
     {
@@ -383,8 +483,20 @@ private:
     std::string best_schedname;
     int best_port;
     bool multiple;
+    std::string cachefile;
+    int cache_fd;
+    bool cache_connected;
+    struct sockaddr_in cache_addr;
+    std::string cache_schedname;
+    int cache_port;
+    int cache_version;
+    time_t cache_start_time;
 
     void attempt_scheduler_connect();
+    void attempt_cached_scheduler_connect();
+    void check_cached_scheduler_connect();
+    MsgChannel *try_cached_scheduler();
+    void save_cache(int version, time_t start_time) const;
     void sendSchedulerDiscovery( int version );
     static bool get_broad_answer(int ask_fd, int timeout, char *buf2, struct sockaddr_in *remote_addr,
                  socklen_t *remote_len);
@@ -418,7 +530,8 @@ public:
         , count(1)
         , arg_flags(0)
         , client_id(0)
-        , client_count(0) {}
+        , client_count(0)
+        , priority(0) {}
 
     GetCSMsg(const Environments &envs, const std::string &f,
              CompileJob::Language _lang, unsigned int _count,
@@ -441,6 +554,14 @@ public:
     int minimal_host_version;
     uint32_t required_features;
     uint32_t client_count; // number of CS -> C connections at the moment
+    // jobs of one build (e.g. one make or ninja run) share the session, empty if not known
+    std::string build_session;
+    // jobs with a higher priority are placed first among those of the same build
+    int32_t priority;
+    // the compile servers the job failed on before, empty for the first try
+    HostPorts avoided_hosts;
+
+    bool avoids(const std::string &host, unsigned int port) const;
 };
 
 class UseCSMsg : public Msg
@@ -457,7 +578,8 @@ public:
           host_platform(platform),
           got_env(gotit),
           client_id(_client_id),
-          matched_job_id(matched_host_jobs) {}
+          matched_job_id(matched_host_jobs),
+          host_protocol(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -469,6 +591,7 @@ public:
     uint32_t got_env;
     uint32_t client_id;
     uint32_t matched_job_id;
+    uint32_t host_protocol; // 0 if unknown
 };
 
 class NoCSMsg : public Msg
@@ -524,6 +647,8 @@ public:
     virtual void send_to_channel(MsgChannel *c) const;
 
     std::string nativeVersion;
+    // the same compiler built to run on other platforms, fetched from compile servers
+    Environments cross;
 };
 
 class CompileFileMsg : public Msg
@@ -636,7 +761,10 @@ public:
 
     // other flags
     enum {
-        UnknownJobId = (1 << 1)
+        UnknownJobId = (1 << 1),
+        // the job was started before the daemon logged in to this scheduler,
+        // job_id is meaningless and the job was counted in LoginMsg::orphaned_jobs
+        Orphaned = (1 << 2)
     };
 
     JobDoneMsg(int job_id = 0, int exitcode = -1, unsigned int flags = FROM_SERVER,
@@ -714,7 +842,9 @@ public:
              unsigned int my_features);
     LoginMsg()
         : Msg(M_LOGIN)
-        , port(0) {}
+        , port(0)
+        , orphaned_jobs(0)
+        , physical_kids(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -727,6 +857,9 @@ public:
     std::string nodename;
     std::string host_platform;
     uint32_t supported_features; // bitmask of various features the node supports
+    uint32_t orphaned_jobs; // compiles still running from before this login
+    // slots on cores of their own, the others share a core with them (SMT), 0 if unknown
+    uint32_t physical_kids;
 };
 
 class ConfCSMsg : public Msg
@@ -751,6 +884,19 @@ public:
         : Msg(M_STATS)
         , load(0)
         , client_count(0)
+        , max_kids(0)
+        , job_speed(0)
+        , throughput(0)
+        , queue_delay(0)
+        , cold_jobs(0)
+        , cold_job_msec(0)
+        , warm_jobs(0)
+        , warm_job_msec(0)
+        , orphaned_jobs(0)
+        , job_in(0)
+        , job_out(0)
+        , bulk_in(0)
+        , bulk_out(0)
     {
     }
 
@@ -774,6 +920,24 @@ public:
     uint32_t freeMem;
 
     uint32_t client_count; // number of CS -> C connections at the moment
+
+    uint32_t max_kids; // slot count picked by the daemon's tuning, 0 if it is not tuned
+    uint32_t job_speed; // output bytes per CPU second of the jobs measured for the tuning
+    uint32_t throughput; // output bytes per second
+    uint32_t queue_delay; // average milliseconds jobs waited for a slot
+
+    uint32_t cold_jobs; // jobs that were the first in their environment after installing or idling
+    uint32_t cold_job_msec; // and their average time
+    uint32_t warm_jobs;
+    uint32_t warm_job_msec;
+
+    uint32_t orphaned_jobs; // running jobs the scheduler has no ids for, as in the login
+
+    // KB transferred since the daemon started, by the data of jobs and of environments
+    uint32_t job_in;
+    uint32_t job_out;
+    uint32_t bulk_in;
+    uint32_t bulk_out;
 };
 
 class EnvTransferMsg : public Msg
@@ -794,6 +958,44 @@ public:
     std::string target;
 };
 
+/* The answer to M_TRANFER_ENV with protocol 48: how many blocks of the
+   environment the daemon has from an earlier, interrupted transfer. The
+   sender continues after them, following each block with M_ENV_HASH. */
+class EnvTransferStateMsg : public Msg
+{
+public:
+    EnvTransferStateMsg(uint32_t _blocks = 0)
+        : Msg(M_ENV_TRANSFER_STATE)
+        , blocks(_blocks) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t blocks;
+};
+
+class EnvHashMsg : public Msg
+{
+public:
+    // the block number of the hash of the whole archive, sent before M_END
+    static const uint32_t ARCHIVE = 0xffffffff;
+
+    EnvHashMsg()
+        : Msg(M_ENV_HASH)
+        , block(0) {}
+
+    EnvHashMsg(uint32_t _block, const std::string &_hash)
+        : Msg(M_ENV_HASH)
+        , block(_block)
+        , hash(_hash) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t block;
+    std::string hash;
+};
+
 class GetInternalStatus : public Msg
 {
 public:
@@ -1005,4 +1207,128 @@ public:
     std::string hostname;
 };
 
+class PeerListMsg : public Msg
+{
+public:
+    struct Peer {
+        Peer()
+            : port(0), max_jobs(0), load(0), protocol(0), features(0), age(0) {}
+        std::string hostname; // empty for the sending daemon itself
+        uint32_t port;
+        std::string host_platform;
+        uint32_t max_jobs;
+        uint32_t load;
+        uint32_t protocol;
+        uint32_t features;
+        uint32_t age; // seconds since the information was current
+        Environments envs;
+    };
+
+    PeerListMsg()
+        : Msg(M_PEER_LIST)
+        , reply(false) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    bool reply; // answer to a daemon's list, don't answer again
+    std::list<Peer> peers;
+};
+
+/* The cluster-wide registry of native environments. A daemon asks the scheduler
+   for the environment matching a fingerprint of the toolchain (empty name),
+   and registers the ones it created or fetched (with name). The scheduler
+   answers a lookup with the name and a daemon holding the tarball, if known.
+   The same message with a name asks that daemon for the tarball, which
+   answers with M_TRANFER_ENV, file chunks and M_END.
+   Environments are also registered as "toolchain:<identity>@<platform>",
+   the identity naming the compiler, its version and the target it generates
+   code for. A lookup of "toolchain:<identity>" is answered with one message
+   for each other platform that has an environment of that toolchain. */
+class EnvFingerprintMsg : public Msg
+{
+public:
+    EnvFingerprintMsg()
+        : Msg(M_ENV_FINGERPRINT)
+        , port(0) {}
+
+    EnvFingerprintMsg(const std::string &_fingerprint, const std::string &_platform,
+                      const std::string &_name)
+        : Msg(M_ENV_FINGERPRINT)
+        , fingerprint(_fingerprint)
+        , platform(_platform)
+        , name(_name)
+        , port(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string fingerprint;
+    std::string platform;
+    std::string name; // file name of the tarball
+    std::string host; // lookup answer: where to get it
+    uint32_t port;
+};
+
+/* A client asks its local daemon to install an environment on the compile
+   server it was given, instead of sending the tarball itself. The daemon
+   does one upload per compile server and environment no matter how many
+   clients ask, and answers each of them with the same message carrying
+   the result once it is done. */
+class EnvUploadMsg : public Msg
+{
+public:
+    enum Result {
+        Ok = 0,
+        VerifyFailed = 1, // the compile server cannot use the environment
+        TransferFailed = 2,
+        Declined = 3, // the daemon cannot read the file or the compile server is too old,
+                      // the client has to send it
+        VerifyError = 4 // the environment was sent, but the compile server didn't verify it
+    };
+
+    EnvUploadMsg()
+        : Msg(M_ENV_UPLOAD)
+        , port(0)
+        , result(Ok) {}
+
+    EnvUploadMsg(const std::string &_hostname, unsigned int _port, const std::string &_target,
+                 const std::string &_name, const std::string &_file)
+        : Msg(M_ENV_UPLOAD)
+        , hostname(_hostname)
+        , port(_port)
+        , target(_target)
+        , name(_name)
+        , file(_file)
+        , result(Ok) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string hostname;
+    uint32_t port;
+    std::string target;
+    std::string name; // environment version
+    std::string file; // absolute path of the tarball on this machine
+    uint32_t result; // only in the answer
+};
+
+/* A compile server has more jobs than slots, so the scheduler lets a job
+   that is still waiting for a slot move to a host that has become idle.
+   The scheduler asks for the job back, the compile server tells the client
+   to ask again and confirms to the scheduler, or ignores the request if the
+   job has started meanwhile. */
+class JobReleaseMsg : public Msg
+{
+public:
+    JobReleaseMsg(unsigned int id = 0)
+        : Msg(M_JOB_RELEASE)
+        , job_id(id) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t job_id;
+};
+
 #endif
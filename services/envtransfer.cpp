@@ -0,0 +1,177 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "envtransfer.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "comm.h"
+#include "logging.h"
+
+using namespace std;
+
+void EnvHash::update(const unsigned char *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        value ^= data[i];
+        value *= 1099511628211ULL;
+    }
+}
+
+string EnvHash::str() const
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) value);
+    return buf;
+}
+
+double TokenBucket::seconds_now()
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+TokenBucket::TokenBucket(unsigned int kbps)
+    : rate_kbps(kbps)
+    , tokens(0)
+    , last(seconds_now())
+{
+}
+
+void TokenBucket::consume(size_t len)
+{
+    double now = seconds_now();
+    double bytes_per_sec = rate() * 1024.0;
+
+    if (!bytes_per_sec) {
+        last = now;
+        return;
+    }
+
+    tokens = min(tokens + (now - last) * bytes_per_sec, bytes_per_sec / 10) - len;
+    last = now;
+
+    if (tokens < 0) {
+        usleep(useconds_t(-tokens / bytes_per_sec * 1000000));
+    }
+}
+
+bool send_environment(MsgChannel *c, int fd, TokenBucket *bucket)
+{
+    uint32_t first_block = 0;
+
+    if (IS_PROTOCOL_48(c)) {
+        Msg *msg = c->get_msg(60);
+
+        if (!msg || msg->type != M_ENV_TRANSFER_STATE) {
+            delete msg;
+            return false;
+        }
+
+        first_block = static_cast<EnvTransferStateMsg *>(msg)->blocks;
+        delete msg;
+
+        if (first_block) {
+            trace() << "resuming environment transfer after " << first_block << " blocks" << endl;
+        }
+    }
+
+    vector<unsigned char> buffer;
+    EnvHash archive_hash;
+    EnvHash block_hash;
+    uint32_t block = 0;
+    size_t in_block = 0;
+
+    for (;;) {
+        // the chunk size grows as the connection gets up to speed
+        size_t len = c->bulkChunkSize();
+
+        if (bucket && bucket->rate()) {
+            // about ten chunks per second, so that the rate doesn't come in bursts
+            len = max<size_t>(1024, min<size_t>(len, bucket->rate() * 1024 / 10));
+        }
+
+        if (IS_PROTOCOL_48(c)) {
+            len = min(len, ENV_BLOCK_SIZE - in_block);
+        }
+
+        if (buffer.size() < len) {
+            buffer.resize(len);
+        }
+
+        ssize_t bytes = read(fd, &buffer[0], len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            log_perror("reading environment");
+            return false;
+        }
+
+        if (bytes == 0) {
+            break;
+        }
+
+        archive_hash.update(&buffer[0], bytes);
+        in_block += bytes;
+
+        // blocks the receiver has already are only needed for the hash of the archive
+        if (block >= first_block) {
+            if (!c->send_msg(FileChunkMsg(&buffer[0], bytes))) {
+                return false;
+            }
+
+            block_hash.update(&buffer[0], bytes);
+
+            if (bucket) {
+                bucket->consume(bytes);
+            }
+        }
+
+        if (IS_PROTOCOL_48(c) && in_block == ENV_BLOCK_SIZE) {
+            if (block >= first_block && !c->send_msg(EnvHashMsg(block, block_hash.str()))) {
+                return false;
+            }
+
+            block_hash = EnvHash();
+            in_block = 0;
+            ++block;
+        }
+    }
+
+    if (IS_PROTOCOL_48(c)) {
+        if (in_block && block >= first_block && !c->send_msg(EnvHashMsg(block, block_hash.str()))) {
+            return false;
+        }
+
+        return c->send_msg(EnvHashMsg(EnvHashMsg::ARCHIVE, archive_hash.str()));
+    }
+
+    return true;
+}
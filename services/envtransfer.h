@@ -0,0 +1,76 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_ENVTRANSFER_H
+#define ICECREAM_ENVTRANSFER_H
+
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+
+class MsgChannel;
+
+// FNV-1a, for telling corrupted environment blocks from good ones. The daemon also names
+// its driver expansions and fingerprints toolchains with it, there is no other copy.
+class EnvHash
+{
+public:
+    EnvHash()
+        : value(14695981039346656037ULL) {}
+
+    void update(const unsigned char *data, size_t len);
+    void update(const std::string &data) {
+        update(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    }
+    std::string str() const;
+
+private:
+    uint64_t value;
+};
+
+/* Rate limit for bulk transfers. The tokens are bytes, refilled at the rate
+   up to a tenth of a second's worth. */
+class TokenBucket
+{
+public:
+    explicit TokenBucket(unsigned int kbps = 0);
+    virtual ~TokenBucket() {}
+
+    // 0 is unlimited
+    virtual unsigned int rate() const {
+        return rate_kbps;
+    }
+    // waits until len more bytes may be sent
+    virtual void consume(size_t len);
+
+protected:
+    static double seconds_now();
+
+private:
+    unsigned int rate_kbps;
+    double tokens;
+    double last;
+};
+
+// Sends the environment tarball read from fd after M_TRANFER_ENV, up to but
+// not including M_END, at the rate of bucket if given.
+extern bool send_environment(MsgChannel *c, int fd, TokenBucket *bucket = 0);
+
+#endif
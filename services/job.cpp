@@ -92,7 +92,7 @@ unsigned int CompileJob::argumentFlags() const
     for (ArgumentsList::const_iterator it = m_flags.begin(); it != m_flags.end(); ++it) {
         const string arg = it->first;
 
-        if (arg.at(0) == '-') {
+        if (!arg.empty() && arg.at(0) == '-') {
             if (arg.length() == 1) {
                 continue;
             }
@@ -166,6 +166,28 @@ public:
         return m_working_directory;
     }
 
+    // The files a remote command (Lang_Custom) reads and writes, relative to the
+    // working directory. They are sent along with the job and returned after it.
+    void setCommandInputs(const std::list<std::string> &files)
+    {
+        m_command_inputs = files;
+    }
+
+    std::list<std::string> commandInputs() const
+    {
+        return m_command_inputs;
+    }
+
+    void setCommandOutputs(const std::list<std::string> &files)
+    {
+        m_command_outputs = files;
+    }
+
+    std::list<std::string> commandOutputs() const
+    {
+        return m_command_outputs;
+    }
+
     void setJobID(unsigned int id)
     {
         m_id = id;
@@ -215,6 +237,7 @@ private:
     ArgumentsList m_flags;
     std::string m_input_file, m_output_file;
     std::string m_working_directory;
+    std::list<std::string> m_command_inputs, m_command_outputs;
     std::string m_target_platform;
     bool m_dwarf_fission;
     bool m_block_rewrite_includes;
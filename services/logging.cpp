@@ -44,6 +44,8 @@ volatile sig_atomic_t reset_debug_needed = 0;
 static ofstream logfile_null("/dev/null");
 static ofstream logfile_file;
 static string logfile_filename;
+static __thread ostream *thread_log = 0;
+static __thread ostream *thread_log_null = 0;
 
 static void reset_debug_signal_handler(int);
 
@@ -157,6 +159,21 @@ void setup_debug(int level, const string &filename, const string &prefix)
     signal(SIGHUP, reset_debug_signal_handler);
 }
 
+void set_thread_log(ostream *log, ostream *null)
+{
+    thread_log = log;
+    thread_log_null = null;
+}
+
+ostream *thread_log_stream(ostream *stream)
+{
+    if (!thread_log) {
+        return stream;
+    }
+
+    return stream == &logfile_null ? thread_log_null : thread_log;
+}
+
 void reset_debug()
 {
     setup_debug(debug_level, logfile_filename);
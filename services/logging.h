@@ -54,12 +54,19 @@ void reset_debug();
 void close_debug();
 void flush_debug();
 
+/* Threads other than the main one must not write to the shared log streams,
+   they log into log instead, and output of levels that are not enabled goes
+   to null. */
+void set_thread_log(std::ostream *log, std::ostream *null);
+std::ostream *thread_log_stream(std::ostream *stream);
+
 static inline std::ostream &output_date(std::ostream &os)
 {
     time_t t = time(0);
-    struct tm *tmp = localtime(&t);
+    struct tm tmp;
+    localtime_r(&t, &tmp);
     char buf[64];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %T: ", tmp);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %T: ", &tmp);
 
     if (logfile_prefix.size()) {
         os << logfile_prefix;
@@ -77,7 +84,7 @@ static inline std::ostream &log_info()
         return std::cerr;
     }
 
-    return output_date(*logfile_info);
+    return output_date(*thread_log_stream(logfile_info));
 }
 
 static inline std::ostream &log_warning()
@@ -86,7 +93,7 @@ static inline std::ostream &log_warning()
         return std::cerr;
     }
 
-    return output_date(*logfile_warning);
+    return output_date(*thread_log_stream(logfile_warning));
 }
 
 
@@ -96,7 +103,7 @@ static inline std::ostream &log_error()
         return std::cerr;
     }
 
-    return output_date(*logfile_error);
+    return output_date(*thread_log_stream(logfile_error));
 }
 
 static inline std::ostream &trace()
@@ -105,7 +112,7 @@ static inline std::ostream &trace()
         return std::cerr;
     }
 
-    return output_date(*logfile_trace);
+    return output_date(*thread_log_stream(logfile_trace));
 }
 
 static inline std::ostream & log_errno(const char *prefix, int tmp_errno)
@@ -61,13 +61,22 @@
  * that it exists with appropriately tight permissions.
  **/
 int dcc_make_tmpnam(const char *prefix, const char *suffix, char **name_ret, int relative)
+{
+    return dcc_make_tmpnam_in(relative ? _PATH_TMP + 1 : _PATH_TMP, prefix, suffix, name_ret);
+}
+
+/**
+ * Like dcc_make_tmpnam(), but inside the given directory instead of the
+ * temporary directory.
+ **/
+int dcc_make_tmpnam_in(const char *dir, const char *prefix, const char *suffix, char **name_ret)
 {
     unsigned long random_bits;
     unsigned long tries = 0;
     size_t tmpname_length;
     char *tmpname;
 
-    tmpname_length = strlen(_PATH_TMP) + 1 + strlen(prefix) + 1 + 8 + strlen(suffix) + 1;
+    tmpname_length = strlen(dir) + 1 + strlen(prefix) + 1 + 8 + strlen(suffix) + 1;
     tmpname = malloc(tmpname_length);
 
     if (!tmpname) {
@@ -89,7 +98,7 @@ int dcc_make_tmpnam(const char *prefix, const char *suffix, char **name_ret, int
 
     do {
         if (snprintf(tmpname, tmpname_length, "%s/%s_%08lx%s",
-                     (relative ? _PATH_TMP + 1 : _PATH_TMP),
+                     dir,
                      prefix,
                      random_bits & 0xffffffffUL,
                      suffix) == -1) {
@@ -144,16 +153,20 @@ int dcc_make_tmpnam(const char *prefix, const char *suffix, char **name_ret, int
 }
 
 int dcc_make_tmpdir(char **name_ret) {
+    return dcc_make_tmpdir_in(_PATH_TMP, name_ret);
+}
+
+int dcc_make_tmpdir_in(const char *dir, char **name_ret) {
     unsigned long tries = 0;
     char template[] = "icecc-XXXXXX";
-    size_t tmpname_length = strlen(_PATH_TMP) + 1 + strlen(template) + 1;
+    size_t tmpname_length = strlen(dir) + 1 + strlen(template) + 1;
     char *tmpname = malloc(tmpname_length);
 
     if (!tmpname) {
         return EXIT_OUT_OF_MEMORY;
     }
 
-    if (snprintf(tmpname, tmpname_length, "%s/%s", _PATH_TMP, template) == -1) {
+    if (snprintf(tmpname, tmpname_length, "%s/%s", dir, template) == -1) {
         free(tmpname);
         return EXIT_OUT_OF_MEMORY;
     }
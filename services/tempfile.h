@@ -30,7 +30,10 @@ extern "C" {
     int dcc_make_tmpnam(const char *prefix,
                         const char *suffix,
                         char **name_ret, int relative);
+    int dcc_make_tmpnam_in(const char *dir, const char *prefix,
+                           const char *suffix, char **name_ret);
     int dcc_make_tmpdir(char **name_ret);
+    int dcc_make_tmpdir_in(const char *dir, char **name_ret);
 
 #ifdef __cplusplus
 }
@@ -157,3 +157,26 @@ string supported_features_to_string(unsigned int features)
         ret.erase( 0, 1 ); // remove leading " "
     return ret;
 }
+
+bool is_contained_path(const string &path)
+{
+    if (path.empty() || path[0] == '/') {
+        return false;
+    }
+
+    string::size_type start = 0;
+
+    for (;;) {
+        string::size_type slash = path.find('/', start);
+
+        if (path.compare(start, slash == string::npos ? string::npos : slash - start, "..") == 0) {
+            return false;
+        }
+
+        if (slash == string::npos) {
+            return true;
+        }
+
+        start = slash + 1;
+    }
+}
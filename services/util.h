@@ -47,4 +47,7 @@ bool pollfd_is_set(const std::vector<pollfd>& pollfds, int fd, int flags, bool c
 
 std::string supported_features_to_string(unsigned int features);
 
+// True if path is relative and does not leave the directory it is relative to.
+bool is_contained_path(const std::string &path);
+
 #endif
@@ -0,0 +1,13 @@
+// takes a few seconds to compile with gcc and -fconstexpr-loop-limit/-fconstexpr-ops-limit raised
+constexpr long spin(long n)
+    {
+    long s = 0;
+    for (long i = 0; i < n; ++i)
+        s += i % 7;
+    return s;
+    }
+static_assert(spin(2000000) > 0, "spin");
+int f()
+    {
+    return 0;
+    }
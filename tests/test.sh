@@ -254,13 +254,20 @@ kill_daemon()
     eval ${pid}=
 }
 
-start_ice()
+# Arguments are passed to the scheduler.
+start_scheduler()
 {
     ICECC_TESTS=1 ICECC_TEST_SCHEDULER_PORTS=8767:8769 \
         ICECC_TEST_FLUSH_LOG_MARK="$testdir"/flush_log_mark.txt ICECC_TEST_LOG_HEADER="$testdir"/log_header.txt \
-        $valgrind "${icecc_scheduler}" -p 8767 -l "$testdir"/scheduler.log -n ${netname} -v -v -v &
+        $valgrind "${icecc_scheduler}" -p 8767 -l "$testdir"/scheduler.log -n ${netname} -v -v -v "$@" &
     scheduler_pid=$!
     echo $scheduler_pid > "$testdir"/scheduler.pid
+}
+
+# Arguments are passed to the scheduler.
+start_ice()
+{
+    start_scheduler "$@"
 
     start_iceccd localice --no-remote -m 2
     start_iceccd remoteice1 -p 10246 -m 2
@@ -471,7 +478,7 @@ compare_outputs()
 #   - keepoutput - will keep the file specified using $output (the remotely compiled version)
 #   - split_dwarf - compilation is done with -gsplit-dwarf
 #   - noresetlogs - will not use reset_logs at the start (needs to be done explicitly before calling run_ice)
-#   - remoteabort - remote compilation will abort (as a result of local processing failing and remote daemon killing the remote compiler)
+#   - cppfail - local preprocessing fails, so the job is not sent to a remote host but rebuilt locally
 #   - nostderrcheck - will not compare stderr output
 #   - unusedmacrohack - hack for Wunused-macros test
 # Rest is the command to pass to icecc.
@@ -509,9 +516,9 @@ run_ice()
         noresetlogs=1
         shift
     fi
-    remoteabort=
-    if test "$1" = "remoteabort"; then
-        remoteabort=1
+    cppfail=
+    if test "$1" = "cppfail"; then
+        cppfail=1
         shift
     fi
     nostderrcheck=
@@ -578,16 +585,24 @@ run_ice()
         flush_logs
         check_logs_for_generic_errors $localrebuildforlog
         check_everything_is_idle
-        if test "$remote_type" = "remote"; then
+        if test -n "$cppfail"; then
+            # cpp runs while waiting for the compile host, which is not used then,
+            # only gcc's -fdirectives-only is not trusted to fail for real
+            if test -n "$using_gcc"; then
+                check_log_message icecc "local cpp invocation failed"
+                check_log_message icecc "<building_local>"
+            else
+                check_log_error icecc "local cpp invocation failed"
+                check_log_error icecc "<building_local>"
+            fi
+            check_log_error icecc "Have to use host 127.0.0.1:10246"
+            check_log_error remoteice1 "Remote compilation"
+        elif test "$remote_type" = "remote"; then
             check_log_message icecc "Have to use host 127.0.0.1:10246"
             if test -z "$localrebuild"; then
                 check_log_error icecc "<building_local>"
             fi
-            if test -n "$remoteabort"; then
-                check_log_message remoteice1 "Remote compilation aborted with exit code"
-                check_log_error remoteice1 "Remote compilation completed with exit code 0"
-                check_log_error remoteice1 "Remote compilation exited with exit code"
-            elif test -n "$output"; then
+            if test -n "$output"; then
                 check_log_message remoteice1 "Remote compilation completed with exit code 0"
                 check_log_error remoteice1 "Remote compilation aborted with exit code"
                 check_log_error remoteice1 "Remote compilation exited with exit code"
@@ -934,6 +949,403 @@ icerun_nocompile_test()
     echo
 }
 
+daemon_upgrade_test()
+{
+    # the upgraded daemon would not run under valgrind anymore
+    if test -n "$chroot_disabled" -o -n "$valgrind"; then
+        skipped_tests="$skipped_tests daemon_upgrade"
+        return
+    fi
+    local slowflags="-std=c++14 -fconstexpr-loop-limit=2000000000 -fconstexpr-ops-limit=4000000000"
+    if test -z "$using_gcc" || ! echo | $TESTCXX $slowflags -fsyntax-only -x c++ - 2>/dev/null; then
+        skipped_tests="$skipped_tests daemon_upgrade"
+        return
+    fi
+    # SIGUSR2 makes the daemon execute its binary again, the job running on it must not notice
+    reset_logs "remote" "daemon upgrade test"
+    echo "Running daemon upgrade test."
+    rm -f "$testdir"/slowcompile.o
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 \
+        ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        $valgrind "${icecc}" $TESTCXX $slowflags -c slowcompile.cpp -o "$testdir"/slowcompile.o &
+    local compile_pid=$!
+    wait_for_log_message remoteice1 "remote compile for file .*slowcompile.cpp"
+    kill -USR2 $(cat "$testdir"/remoteice1.pid)
+    wait $compile_pid
+    if test $? -ne 0 -o ! -f "$testdir"/slowcompile.o; then
+        echo Error, the job running during the daemon upgrade failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors
+    check_everything_is_idle
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_error icecc "<building_local>"
+    check_log_message remoteice1 "passing on .* clients and 1 jobs"
+    check_log_message remoteice1 "took over .* clients and 1 jobs"
+    check_log_error remoteice1 "upgrade failed"
+    check_log_error remoteice1 "logging in again over the kept scheduler connection failed"
+    check_log_message scheduler "RELOGIN remoteice1.*features:"
+    rm -f "$testdir"/slowcompile.o
+    # the upgraded daemon takes new jobs
+    run_ice "$testdir/plain.o" "remote" 0 $TESTCXX -Wall -Werror -c plain.cpp -o "$testdir/"plain.o
+    echo "Daemon upgrade test successful."
+    echo
+}
+
+scratch_retry_test()
+{
+    if test -n "$chroot_disabled"; then
+        skipped_tests="$skipped_tests scratch_retry"
+        return
+    fi
+    # a job whose output doesn't fit into the scratch tmpfs is compiled again on disk
+    kill_daemon remoteice1
+    start_iceccd remoteice1 -p 10246 -m 2 --scratch-size 30
+    wait_for_ice_startup_complete remoteice1
+    if ! grep -q "using 30MiB scratch dir" "$testdir"/remoteice1.log; then
+        skipped_tests="$skipped_tests scratch_retry"
+    else
+        reset_logs "remote" "scratch retry test"
+        echo "Running scratch retry test."
+        # about 40MiB of initialized data
+        echo "char big[40 * 1024 * 1024] = { 1 };" > "$testdir"/bigdata.c
+        rm -f "$testdir"/bigdata.o
+        ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 \
+            ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+            $valgrind "${icecc}" $TESTCC -c "$testdir"/bigdata.c -o "$testdir"/bigdata.o
+        if test $? -ne 0 -o $(stat -c %s "$testdir"/bigdata.o 2>/dev/null || echo 0) -lt 41943040; then
+            echo Error, the job that filled the scratch dir failed.
+            stop_ice 0
+            abort_tests
+        fi
+        flush_logs
+        check_logs_for_generic_errors
+        check_everything_is_idle
+        check_log_message icecc "Have to use host 127.0.0.1:10246"
+        check_log_error icecc "<building_local>"
+        check_log_message remoteice1 "ran out of space, compiling job .* again in /var/tmp"
+        check_log_message remoteice1 "Remote compilation completed with exit code 0"
+        rm -f "$testdir"/bigdata.c "$testdir"/bigdata.o
+        echo "Scratch retry test successful."
+        echo
+    fi
+    kill_daemon remoteice1
+    start_iceccd remoteice1 -p 10246 -m 2
+    wait_for_ice_startup_complete remoteice1
+}
+
+scheduler_restart_test()
+{
+    if test -n "$chroot_disabled"; then
+        skipped_tests="$skipped_tests scheduler_restart"
+        return
+    fi
+    local slowflags="-std=c++14 -fconstexpr-loop-limit=2000000000 -fconstexpr-ops-limit=4000000000"
+    if test -z "$using_gcc" || ! echo | $TESTCXX $slowflags -fsyntax-only -x c++ - 2>/dev/null; then
+        skipped_tests="$skipped_tests scheduler_restart"
+        return
+    fi
+    # a job running while the scheduler restarts finishes, and the new scheduler learns about it
+    reset_logs "remote" "scheduler restart test"
+    echo "Running scheduler restart test."
+    # a few times slowcompile.cpp, so that it outlasts the daemons reconnecting
+    sed 's/spin(2000000)/spin(8000000)/' slowcompile.cpp > "$testdir"/slowercompile.cpp
+    rm -f "$testdir"/slowercompile.o
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 \
+        ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        $valgrind "${icecc}" $TESTCXX $slowflags -c "$testdir"/slowercompile.cpp -o "$testdir"/slowercompile.o &
+    local compile_pid=$!
+    wait_for_log_message remoteice1 "remote compile for file .*slowercompile.cpp"
+    kill $scheduler_pid
+    wait $scheduler_pid
+    start_scheduler
+    wait_for_ice_startup_complete scheduler localice remoteice1 remoteice2
+    wait $compile_pid
+    if test $? -ne 0 -o ! -f "$testdir"/slowercompile.o; then
+        echo Error, the job running during the scheduler restart failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    # not check_logs_for_generic_errors, the daemons do see the scheduler go away
+    for log in scheduler icecc localice remoteice1 remoteice2; do
+        check_log_error $log "internal error"
+    done
+    check_everything_is_idle
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_error icecc "<building_local>"
+    check_log_message remoteice1 "scheduler closed connection"
+    check_log_message remoteice1 "keeping 1 jobs running without scheduler"
+    check_log_message remoteice1 "Remote compilation completed with exit code 0"
+    check_log_message scheduler "login remoteice1 protocol version: .* orphaned jobs: 1"
+    check_log_message scheduler "END orphaned job on remoteice1"
+    rm -f "$testdir"/slowercompile.cpp "$testdir"/slowercompile.o
+    echo "Scheduler restart test successful."
+    echo
+}
+
+peer_placement_test()
+{
+    if test -n "$chroot_disabled"; then
+        skipped_tests="$skipped_tests peer_placement"
+        return
+    fi
+    local slowflags="-std=c++14 -fconstexpr-loop-limit=2000000000 -fconstexpr-ops-limit=4000000000"
+    if test -z "$using_gcc" || ! echo | $TESTCXX $slowflags -fsyntax-only -x c++ - 2>/dev/null; then
+        skipped_tests="$skipped_tests peer_placement"
+        return
+    fi
+    # without a scheduler the job is placed on a peer, which tells the next scheduler about it
+    reset_logs "remote" "peer placement test"
+    echo "Running peer placement test."
+    # localice learns about the compile servers from the peer list it gets on login
+    kill_daemon localice
+    start_iceccd localice --no-remote -m 2
+    wait_for_ice_startup_complete localice
+    kill $scheduler_pid
+    wait $scheduler_pid
+    sed 's/spin(2000000)/spin(8000000)/' slowcompile.cpp > "$testdir"/slowercompile.cpp
+    rm -f "$testdir"/slowercompile.o
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 \
+        ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        $valgrind "${icecc}" $TESTCXX $slowflags -c "$testdir"/slowercompile.cpp -o "$testdir"/slowercompile.o &
+    local compile_pid=$!
+    wait_for_log_message icecc "Have to use host 127.0.0.1:1024[67]"
+    local server=remoteice1
+    cat_log_last_mark icecc | grep -q "Have to use host 127.0.0.1:10247" && server=remoteice2
+    wait_for_log_message $server "remote compile for file .*slowercompile.cpp"
+    start_scheduler
+    wait_for_ice_startup_complete scheduler localice remoteice1 remoteice2
+    wait $compile_pid
+    if test $? -ne 0 -o ! -f "$testdir"/slowercompile.o; then
+        echo Error, the job placed on a peer failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    # not check_logs_for_generic_errors, the daemons do see the scheduler go away
+    for log in scheduler icecc localice remoteice1 remoteice2; do
+        check_log_error $log "internal error"
+    done
+    check_everything_is_idle
+    check_log_error icecc "<building_local>"
+    check_log_message localice "no scheduler, placing jobs on 2 known peers"
+    check_log_message localice "resuming central placement, 1 jobs were placed on peers"
+    check_log_message $server "Remote compilation completed with exit code 0"
+    check_log_message scheduler "login $server protocol version: .* orphaned jobs: 1"
+    check_log_message scheduler "END orphaned job on $server"
+    rm -f "$testdir"/slowercompile.cpp "$testdir"/slowercompile.o
+    echo "Peer placement test successful."
+    echo
+}
+
+preload_release_test()
+{
+    if test -n "$chroot_disabled"; then
+        skipped_tests="$skipped_tests preload_release"
+        return
+    fi
+    local slowflags="-std=c++14 -fconstexpr-loop-limit=2000000000 -fconstexpr-ops-limit=4000000000"
+    if test -z "$using_gcc" || ! echo | $TESTCXX $slowflags -fsyntax-only -x c++ - 2>/dev/null; then
+        skipped_tests="$skipped_tests preload_release"
+        return
+    fi
+    # a job preloaded on a host with its only slot busy moves to a host that becomes idle
+    reset_logs "remote" "preload release test"
+    echo "Running preload release test."
+    # without local slots remoteice1 is the only host for the jobs
+    kill_daemon localice
+    kill_daemon remoteice1
+    kill_daemon remoteice2
+    start_iceccd localice --no-remote -m 0
+    start_iceccd remoteice1 -p 10246 -m 1
+    wait_for_ice_startup_complete localice remoteice1
+    sed 's/spin(2000000)/spin(8000000)/' slowcompile.cpp > "$testdir"/slowercompile.cpp
+    rm -f "$testdir"/slowercompile.o "$testdir"/slowcompile.o
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 \
+        ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        $valgrind "${icecc}" $TESTCXX $slowflags -c "$testdir"/slowercompile.cpp -o "$testdir"/slowercompile.o &
+    local slower_pid=$!
+    wait_for_log_message remoteice1 "remote compile for file .*slowercompile.cpp"
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 \
+        ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        $valgrind "${icecc}" $TESTCXX $slowflags -c slowcompile.cpp -o "$testdir"/slowcompile.o &
+    local slow_pid=$!
+    # the logs cannot be marked while remoteice1 compiles, wait for the second job to be preloaded
+    for ((i=0; i<200; i++)); do
+        if test $(cat_log_last_mark icecc | grep -c "Have to use host 127.0.0.1:10246") -ge 2; then
+            break
+        fi
+        sleep 0.1
+    done
+    check_log_message_count icecc 2 "Have to use host 127.0.0.1:10246"
+    start_iceccd remoteice2 -p 10247 -m 1
+    wait_for_ice_startup_complete remoteice2
+    wait $slow_pid
+    if test $? -ne 0 -o ! -f "$testdir"/slowcompile.o; then
+        echo Error, the released job failed.
+        stop_ice 0
+        abort_tests
+    fi
+    wait $slower_pid
+    if test $? -ne 0 -o ! -f "$testdir"/slowercompile.o; then
+        echo Error, the job keeping the slot busy failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors
+    check_everything_is_idle
+    check_log_error icecc "<building_local>"
+    check_section_log_message scheduler "RELEASE .* from remoteice1 for remoteice2"
+    check_log_message icecc "job released by .*, asking for another host"
+    check_log_message remoteice2 "remote compile for file .*slowcompile.cpp"
+    check_log_error remoteice1 "remote compile for file .*slowcompile.cpp"
+    reset_logs "remote" "preload release test end"
+    kill_daemon localice
+    kill_daemon remoteice1
+    kill_daemon remoteice2
+    start_iceccd localice --no-remote -m 2
+    start_iceccd remoteice1 -p 10246 -m 2
+    start_iceccd remoteice2 -p 10247 -m 2
+    wait_for_ice_startup_complete localice remoteice1 remoteice2
+    rm -f "$testdir"/slowercompile.cpp "$testdir"/slowercompile.o "$testdir"/slowcompile.o
+    echo "Preload release test successful."
+    echo
+}
+
+driver_bypass_test()
+{
+    if test -n "$chroot_disabled"; then
+        skipped_tests="$skipped_tests driver_bypass"
+        return
+    fi
+    # the frontend and assembler run without the driver must give the same output as with it
+    reset_logs "remote" "driver bypass test"
+    echo "Running driver bypass test."
+    kill_daemon remoteice1
+    start_iceccd remoteice1 -p 10246 -m 2 --driver-bypass
+    wait_for_ice_startup_complete remoteice1
+    run_ice "$testdir/plain.o" "remote" 0 $TESTCC -Wall -Werror -c plain.c -o "$testdir/"plain.o
+    check_section_log_message remoteice1 "running directly:"
+    run_ice "$testdir/plain.o" "remote" 0 $TESTCXX -Wall -Werror -c plain.cpp -o "$testdir/"plain.o
+    check_section_log_message remoteice1 "running directly:"
+    run_ice "$testdir/plain.o" "remote" 0 $TESTCXX -Wall -Werror -g -O2 -c plain.cpp -o "$testdir/"plain.o
+    check_section_log_message remoteice1 "running directly:"
+    # a gcc frontend is only run without the driver when the assembler follows it
+    run_ice "$testdir/plain.s" "remote" 0 $TESTCC -Wall -Werror -S plain.c -o "$testdir"/plain.s
+    reset_logs "remote" "driver bypass test end"
+    kill_daemon remoteice1
+    start_iceccd remoteice1 -p 10246 -m 2
+    wait_for_ice_startup_complete remoteice1
+    echo "Driver bypass test successful."
+    echo
+}
+
+cpu_pinning_test()
+{
+    # jobs are only pinned to cores when asked for
+    reset_logs "remote" "cpu pinning test"
+    echo "Running cpu pinning test."
+    run_ice "$testdir/plain.o" "remote" 0 $TESTCXX -Wall -Werror -c plain.cpp -o "$testdir/"plain.o
+    check_section_log_error remoteice1 "pinned to core"
+    kill_daemon remoteice1
+    start_iceccd remoteice1 -p 10246 -m 2 --cpu-pinning
+    wait_for_ice_startup_complete remoteice1
+    run_ice "$testdir/plain.o" "remote" 0 $TESTCXX -Wall -Werror -c plain.cpp -o "$testdir/"plain.o
+    check_section_log_message remoteice1 "pinned to core"
+    reset_logs "remote" "cpu pinning test end"
+    kill_daemon remoteice1
+    start_iceccd remoteice1 -p 10246 -m 2
+    wait_for_ice_startup_complete remoteice1
+    echo "Cpu pinning test successful."
+    echo
+}
+
+native_env_sharing_test()
+{
+    if test -n "$chroot_disabled"; then
+        skipped_tests="$skipped_tests native_env_sharing"
+        return
+    fi
+    # a daemon gets the native environment from another one with the same compiler,
+    # only daemons taking remote jobs serve theirs, so the clients use the remote ones
+    reset_logs "remote" "native environment sharing test"
+    echo "Running native environment sharing test."
+    rm -f "$testdir"/plain.o
+    ICECC_TEST_SOCKET="$testdir"/socket-remoteice1 ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice2 \
+        ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        $valgrind "${icecc}" $TESTCXX -Wall -Werror -c plain.cpp -o "$testdir"/plain.o
+    if test $? -ne 0 -o ! -f "$testdir"/plain.o; then
+        echo Error, building with remoteice1 as the local daemon failed.
+        stop_ice 0
+        abort_tests
+    fi
+    mark_logs "remote" "native environment sharing test, second daemon"
+    rm -f "$testdir"/plain.o
+    ICECC_TEST_SOCKET="$testdir"/socket-remoteice2 ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 \
+        ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        $valgrind "${icecc}" $TESTCXX -Wall -Werror -c plain.cpp -o "$testdir"/plain.o
+    if test $? -ne 0 -o ! -f "$testdir"/plain.o; then
+        echo Error, building with remoteice2 as the local daemon failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors
+    check_everything_is_idle
+    check_log_message remoteice2 "fetching native environment .* from 127.0.0.1:10246"
+    check_log_message remoteice1 "sending native environment"
+    check_section_log_message remoteice1 "looking up cross environments"
+    check_log_error remoteice2 "does not match its name"
+    check_log_error remoteice2 "failed, creating it"
+    check_log_error remoteice2 "start_create_env"
+    rm -f "$testdir"/plain.o
+    echo "Native environment sharing test successful."
+    echo
+}
+
+icerun_remote_test()
+{
+    if test -n "$chroot_disabled"; then
+        skipped_tests="$skipped_tests icerun_remote"
+        return
+    fi
+    # a command declaring its input and output files is run on a compile server
+    reset_logs "remote" "icerun remote test"
+    echo "Running icerun remote test."
+    rm -rf -- "$testdir"/icerunremote
+    mkdir -p "$testdir"/icerunremote
+    printf 'b\nc\na\n' > "$testdir"/icerunremote/input.txt
+    (cd "$testdir"/icerunremote && \
+        ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 \
+        ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        $valgrind "${icerun}" --input input.txt --output output.txt sort -o output.txt input.txt)
+    if test $? -ne 0; then
+        echo Error, icerun remote command failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors
+    check_everything_is_idle
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_error icecc "<building_local>"
+    check_log_message remoteice1 "Remote command completed with exit code 0"
+    # the command is not in the environments of other platforms
+    check_log_error localice "looking up cross environments"
+    if test "$(cat "$testdir"/icerunremote/output.txt 2>/dev/null)" != "$(printf 'a\nb\nc')"; then
+        echo Error, icerun remote command did not return its output file.
+        stop_ice 0
+        abort_tests
+    fi
+    rm -rf -- "$testdir"/icerunremote
+    echo "Icerun remote test successful."
+    echo
+}
+
 symlink_wrapper_test()
 {
     cxxwrapper="$wrapperdir/$(basename $TESTCXX)"
@@ -1010,9 +1422,38 @@ unhandled_environment_test()
     check_log_message icecc "<building_local>"
     check_log_error icecc "Have to use host 127.0.0.1:10247"
     check_log_error icecc "building myself, but telling localhost"
-    check_log_message icecc "<Transfer Environment>"
+    # the local daemon uploads the environment for the client
+    check_log_message icecc "<Wait for environment upload>"
     check_log_message icecc "got exception Error 25 - other error verifying environment on remote"
 
+    # Without a preferred host the job is retried on the other remote, then on none of them.
+    # The local daemon gets no job slots, so that the remotes are the only choice.
+    kill_daemon localice
+    start_iceccd localice --no-remote -m 0
+    wait_for_ice_startup_complete localice
+    mark_logs "retried" "unhandled environment test"
+    ICECC_VERSION=brokenenvfile.tar.gz \
+        ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        PATH=$(dirname $TESTCXX):$PATH $valgrind "${icecc}" $TESTCXX -Wall -c plain.cpp
+    if test $? -ne 0; then
+        echo Error, unhandled environment test failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors "ignoreexception25" "ignorenosuitablehost"
+    check_everything_is_idle
+    check_log_message_count icecc 1 "Have to use host 127.0.0.1:10246"
+    check_log_message_count icecc 1 "Have to use host 127.0.0.1:10247"
+    check_log_message_count icecc 2 "retrying on another host: Error 25"
+    check_log_message scheduler "avoiding=127.0.0.1:1024[67],127.0.0.1:1024[67]"
+    check_log_message scheduler "No suitable host found, assigning submitter"
+    check_log_message icecc "building myself, but telling localhost"
+    check_log_error icecc "<building_local>"
+    kill_daemon localice
+    start_iceccd localice --no-remote -m 2
+    wait_for_ice_startup_complete localice
+
     local compression=
     if grep -q "supported features:.* env_zstd" "$testdir"/remoteice1.log && command -v zstd >/dev/null; then
         compression=zstd
@@ -1039,7 +1480,7 @@ unhandled_environment_test()
         check_log_error icecc "<building_local>"
         check_log_error icecc "Have to use host 127.0.0.1:10247"
         check_log_error icecc "building myself, but telling localhost"
-        check_log_message icecc "<Transfer Environment>"
+        check_log_message icecc "<Wait for environment upload>"
 
         mark_logs "unsupported" "unhandled environment test"
         ICECC_ENV_COMPRESSION="$compression" ICECC_EXTRAFILES="$extrafile" \
@@ -1057,7 +1498,7 @@ unhandled_environment_test()
         check_log_error icecc "Have to use host 127.0.0.1:10246"
         check_log_error icecc "Have to use host 127.0.0.1:10247"
         check_log_message scheduler "No suitable host found, assigning submitter"
-        check_log_error icecc "<Transfer Environment>"
+        check_log_error icecc "<Wait for environment upload>"
         rm -f "$extrafile"
     else
         skipped_tests="$skipped_tests unhandled_environment_type"
@@ -1830,6 +2271,21 @@ check_log_message()
     fi
 }
 
+# Like check_log_message, but for something that is going to happen in the next 20 seconds.
+wait_for_log_message()
+{
+    log="$1"
+    for ((i=0; i<200; i++)); do
+        if cat_log_last_mark ${log} | grep -q "$2"; then
+            return
+        fi
+        sleep 0.1
+    done
+    echo "Error, $log log does not contain: $2"
+    stop_ice 0
+    abort_tests
+}
+
 check_section_log_message()
 {
     log="$1"
@@ -1976,7 +2432,7 @@ fi
 run_ice "$testdir/testdefine.o" "remote" 0 $TESTCXX -Wall -Werror -DICECREAM_TEST_DEFINE=test -c testdefine.cpp -o "$testdir/"testdefine.o
 run_ice "$testdir/testdefine.o" "remote" 0 $TESTCXX -Wall -Werror -D ICECREAM_TEST_DEFINE=test -c testdefine.cpp -o "$testdir/"testdefine.o
 
-run_ice "" "remote" 300 "localrebuild" "remoteabort" "nostderrcheck" $TESTCXX -c nonexistent.cpp
+run_ice "" "remote" 300 "localrebuild" "cppfail" "nostderrcheck" $TESTCXX -c nonexistent.cpp
 
 if test -e /bin/true; then
     run_ice "" "local" 0 /bin/true
@@ -1993,9 +2449,9 @@ run_ice "$testdir/unusedmacro.o" "remote" 0 "unusedmacrohack" $TESTCXX -Wall -Wu
 
 if test -n "$using_gcc"; then
     # These all break because of -fdirectives-only bugs, check we manage to build them somehow.
-    run_ice "$testdir/countermacro.o" "remote" 0 "localrebuild" "remoteabort" "nostderrcheck" $TESTCC -Wall -Werror -c countermacro.c -o "$testdir"/countermacro.o
+    run_ice "$testdir/countermacro.o" "remote" 0 "localrebuild" "cppfail" "nostderrcheck" $TESTCC -Wall -Werror -c countermacro.c -o "$testdir"/countermacro.o
     if $TESTCXX -std=c++11 -fsyntax-only -Werror -c rawliterals.cpp 2>/dev/null; then
-        run_ice "$testdir/rawliterals.o" "remote" 0 "localrebuild" "remoteabort" "nostderrcheck" $TESTCXX -std=c++11 -Wall -Werror -c rawliterals.cpp -o "$testdir"/rawliterals.o
+        run_ice "$testdir/rawliterals.o" "remote" 0 "localrebuild" "cppfail" "nostderrcheck" $TESTCXX -std=c++11 -Wall -Werror -c rawliterals.cpp -o "$testdir"/rawliterals.o
     fi
 fi
 
@@ -2039,7 +2495,7 @@ if test -z "$debug_fission_disabled"; then
     run_ice "$testdir/plain.o" "remote" 0 "split_dwarf" $TESTCXX -Wall -Werror -gsplit-dwarf -g -c plain.cpp -o "$testdir/"plain.o
     run_ice "$testdir/plain.o" "remote" 0 "split_dwarf" $TESTCC -Wall -Werror -gsplit-dwarf -c plain.c -o "$testdir/"plain.o
     run_ice "$testdir/plain.o" "remote" 0 "split_dwarf" $TESTCC -Wall -Werror -gsplit-dwarf -c plain.c -o "../../../../../../../..$testdir/plain.o"
-    run_ice "" "remote" 300 "localrebuild" "split_dwarf" "remoteabort" "nostderrcheck" $TESTCXX -gsplit-dwarf -c nonexistent.cpp
+    run_ice "" "remote" 300 "localrebuild" "split_dwarf" "cppfail" "nostderrcheck" $TESTCXX -gsplit-dwarf -c nonexistent.cpp
 fi
 
 if test -z "$chroot_disabled"; then
@@ -2171,6 +2627,16 @@ differentcompilerversiontest
 icerun_serialize_test
 icerun_nopath_test
 icerun_nocompile_test
+icerun_remote_test
+
+daemon_upgrade_test
+scratch_retry_test
+scheduler_restart_test
+peer_placement_test
+preload_release_test
+driver_bypass_test
+cpu_pinning_test
+native_env_sharing_test
 
 recursive_test
 
@@ -2249,6 +2715,17 @@ if test -z "$chroot_disabled"; then
     check_log_message remoteice2 "Connected to scheduler"
     echo Reconnect test successful.
     echo
+
+    echo Testing scheduler I/O threads.
+    reset_logs remote "Scheduler I/O threads"
+    stop_ice 1
+    start_ice --io-threads 2
+    check_log_message scheduler "using 2 I/O threads"
+    run_ice "$testdir/plain.o" "remote" 0 $TESTCXX -Wall -Werror -c plain.cpp -o "$testdir/"plain.o
+    run_ice "$testdir/plain.o" "remote" 0 $TESTCC -Wall -Werror -c plain.c -o "$testdir/"plain.o
+    icerun_serialize_test
+    echo Scheduler I/O threads test successful.
+    echo
 else
     skipped_tests="$skipped_tests scheduler_multiple"
 fi
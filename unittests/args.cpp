@@ -38,6 +38,11 @@ static void test_3() {
    test_run("3", argv, false, "local:0 language:C++ compiler:clang local:'-D, TEST1=1, -I.' remote:'-c' rest:'-target, x86_64-unknown-linux-gnu'");
 }
 
+static void test_4() {
+   const char * argv[] = { "gcc", "-MD", "-MF", "bazel-out/main.d", "-c", "pkg/main.cpp", "-o", "bazel-out/main.o", 0 };
+   test_run("4", argv, false, "local:0 language:C++ compiler:gcc local:'-MD, -MF, bazel-out/main.d, -MQ, bazel-out/main.o' remote:'-c' rest:''");
+}
+
 int main() {
     unsetenv( "ICECC_COLOR_DIAGNOSTICS" );
     unsetenv( "ICECC" );
@@ -57,5 +62,6 @@ int main() {
     test_1();
     test_2();
     test_3();
+    test_4();
     return 0;
 }
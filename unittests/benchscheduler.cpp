@@ -0,0 +1,258 @@
+/*
+    Load generator for the scheduler, printing how many job requests it
+    places per second. A fleet of fake daemons logs in, and each of them
+    keeps asking for a compile server and reporting the job done at once.
+    Not run as part of the tests, use
+    "make benchscheduler && ./benchscheduler host port [daemons] [seconds] [processes]"
+    against a scheduler started with "-p port".
+*/
+
+#include "config.h"
+#include <comm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+using namespace std;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// The port the fake daemons claim to take compile requests on, the scheduler checks it.
+static int listen_loopback(unsigned short &port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0
+            || getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+struct FakeDaemon {
+    MsgChannel *c;
+    double asked; // when the pending request was sent
+};
+
+static Environments fake_envs()
+{
+    Environments envs;
+    envs.push_back(make_pair(string("x86_64"), string("benchscheduler.tar.gz")));
+    return envs;
+}
+
+static bool ask(FakeDaemon &d)
+{
+    d.asked = now();
+    return d.c->send_msg(GetCSMsg(fake_envs(), "bench.cpp", CompileJob::Lang_CXX, 1, "x86_64", 0,
+                                  "", 0, 0));
+}
+
+static FakeDaemon login(const string &host, unsigned short port, const string &name,
+                        unsigned short listen_port)
+{
+    FakeDaemon d;
+    // don't wait for the protocol setup, the scheduler accepts connections in bursts
+    d.c = Service::createChannel(host, port, 10, PROTOCOL_VERSION);
+
+    if (!d.c) {
+        cerr << "can't connect to " << host << ":" << port << endl;
+        exit(1);
+    }
+
+    LoginMsg lmsg(listen_port, name, "x86_64", 0);
+    lmsg.envs = fake_envs();
+    lmsg.max_kids = 8;
+    lmsg.noremote = false;
+    lmsg.chroot_possible = true;
+    StatsMsg smsg;
+    smsg.loadAvg1 = smsg.loadAvg5 = smsg.loadAvg10 = 0;
+    smsg.freeMem = 1024 * 1024;
+
+    if (!d.c->send_msg(lmsg) || !d.c->send_msg(smsg)) {
+        cerr << "login of " << name << " failed" << endl;
+        exit(1);
+    }
+
+    return d;
+}
+
+// Runs COUNT fake daemons until END, writing "requests latency_sum" to OUT.
+static void fleet(const string &host, unsigned short port, int first, int count,
+                  unsigned short listen_port, double end, int out)
+{
+    vector<FakeDaemon> daemons;
+    char name[64];
+
+    for (int i = first; i < first + count; ++i) {
+        snprintf(name, sizeof(name), "fake%d", i);
+        daemons.push_back(login(host, port, name, listen_port));
+    }
+
+    for (size_t i = 0; i < daemons.size(); ++i) {
+        ask(daemons[i]);
+    }
+
+    long requests = 0;
+    double latency = 0;
+
+    while (now() < end) {
+        vector<pollfd> pollfds(daemons.size());
+
+        for (size_t i = 0; i < daemons.size(); ++i) {
+            pollfds[i].fd = daemons[i].c->fd;
+            pollfds[i].events = POLLIN;
+        }
+
+        if (poll(pollfds.data(), pollfds.size(), 100) <= 0) {
+            continue;
+        }
+
+        for (size_t i = 0; i < daemons.size(); ++i) {
+            if (!pollfds[i].revents) {
+                continue;
+            }
+
+            FakeDaemon &d = daemons[i];
+
+            while (!d.c->read_a_bit() || d.c->has_msg()) {
+                Msg *m = d.c->get_msg(0, true);
+
+                if (!m) {
+                    cerr << "scheduler closed the connection" << endl;
+                    _exit(1);
+                }
+
+                // a daemon picked for its own job is told to compile it locally
+                if (m->type == M_USE_CS || m->type == M_NO_CS) {
+                    unsigned int job_id = m->type == M_USE_CS ? static_cast<UseCSMsg *>(m)->job_id
+                                          : static_cast<NoCSMsg *>(m)->job_id;
+                    ++requests;
+                    latency += now() - d.asked;
+                    d.c->send_msg(JobDoneMsg(job_id, 0, JobDoneMsg::FROM_SUBMITTER));
+                    ask(d);
+                } else if (m->type == M_PING) {
+                    d.c->send_msg(PingMsg());
+                }
+
+                delete m;
+            }
+        }
+    }
+
+    char result[64];
+    int len = snprintf(result, sizeof(result), "%ld %f\n", requests, latency);
+    _exit(write(out, result, len) == len ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        cerr << "usage: benchscheduler host port [daemons] [seconds] [processes]" << endl;
+        return 1;
+    }
+
+    string host = argv[1];
+    unsigned short port = atoi(argv[2]);
+    int count = argc > 3 ? atoi(argv[3]) : 200;
+    int seconds = argc > 4 ? atoi(argv[4]) : 10;
+    int processes = argc > 5 ? atoi(argv[5]) : 4;
+    unsigned short listen_port;
+    int listen_fd = listen_loopback(listen_port);
+    int results[2];
+
+    if (count < processes || processes < 1 || pipe(results) < 0) {
+        return 1;
+    }
+
+    double end = now() + seconds;
+
+    for (int p = 0; p < processes; ++p) {
+        int first = count * p / processes;
+
+        if (fork() == 0) {
+            close(listen_fd);
+            close(results[0]);
+            fleet(host, port, first, count * (p + 1) / processes - first, listen_port, end,
+                  results[1]);
+        }
+    }
+
+    close(results[1]);
+    long requests = 0;
+    double latency = 0;
+    string text;
+
+    // the scheduler checks that the daemons accept connections, take those until all are done
+    for (;;) {
+        pollfd pfds[2];
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = results[0];
+        pfds[1].events = POLLIN;
+        poll(pfds, 2, -1);
+
+        if (pfds[0].revents) {
+            int fd = accept(listen_fd, 0, 0);
+
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        if (pfds[1].revents) {
+            char buf[256];
+            ssize_t len = read(results[0], buf, sizeof(buf));
+
+            if (len <= 0) {
+                break;
+            }
+
+            text.append(buf, len);
+        }
+    }
+
+    while (wait(0) > 0) {}
+
+    for (size_t pos = 0; pos < text.size();) {
+        size_t nl = text.find('\n', pos);
+        long r;
+        double l;
+
+        if (nl == string::npos || sscanf(text.c_str() + pos, "%ld %lf", &r, &l) != 2) {
+            break;
+        }
+
+        requests += r;
+        latency += l;
+        pos = nl + 1;
+    }
+
+    printf("%d daemons, %d s: %ld requests, %.0f/s, %.2f ms average latency\n", count, seconds,
+           requests, requests / double(seconds), requests ? latency / requests * 1000 : 0.0);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+    Loopback benchmark of file chunk transfers, printing throughput for
+    different chunk sizes. Not run as part of the tests, use
+    "make benchtransfer && ./benchtransfer [MB]".
+*/
+
+#include "config.h"
+#include <comm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <iostream>
+
+using namespace std;
+
+static int listen_loopback(unsigned short &port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0
+            || getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// Receives rounds of chunks, acknowledging each round's EndMsg.
+static void receiver(int listen_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = accept(listen_fd, (struct sockaddr *) &addr, &len);
+
+    if (fd < 0) {
+        perror("accept");
+        _exit(1);
+    }
+
+    MsgChannel *c = Service::createChannel(fd, (struct sockaddr *) &addr, len);
+
+    if (!c) {
+        _exit(1);
+    }
+
+    while (Msg *msg = c->get_msg(60, true)) {
+        if (msg->type == M_END) {
+            c->send_msg(EndMsg());
+        }
+
+        delete msg;
+    }
+
+    delete c;
+    _exit(0);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Sends total bytes in chunks of chunk_size, or adaptive ones if that is 0.
+static double send_round(MsgChannel *c, const vector<unsigned char> &data, size_t chunk_size,
+                         size_t total)
+{
+    double start = now();
+
+    for (size_t sent = 0; sent < total;) {
+        size_t len = chunk_size ? chunk_size : c->bulkChunkSize();
+        len = min(len, min(data.size(), total - sent));
+        FileChunkMsg fcmsg(const_cast<unsigned char *>(&data[0]), len);
+
+        if (!c->send_msg(fcmsg)) {
+            cerr << "sending chunk failed" << endl;
+            exit(1);
+        }
+
+        sent += len;
+    }
+
+    c->send_msg(EndMsg());
+    Msg *ack = c->get_msg(60);
+
+    if (!ack || ack->type != M_END) {
+        cerr << "no reply from receiver" << endl;
+        exit(1);
+    }
+
+    delete ack;
+    return total / (now() - start) / 1024 / 1024;
+}
+
+int main(int argc, char **argv)
+{
+    size_t total = (argc > 1 ? atoi(argv[1]) : 256) * size_t(1024 * 1024);
+    unsigned short port;
+    int listen_fd = listen_loopback(port);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        receiver(listen_fd);
+    }
+
+    close(listen_fd);
+    MsgChannel *c = Service::createChannel("127.0.0.1", port, 10);
+
+    if (!c) {
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    // Object files compress somewhat, so don't send just random data or just zeros.
+    vector<unsigned char> data(4 * 1024 * 1024);
+    srand(1);
+
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (i % 7) ? 0 : rand();
+    }
+
+    const size_t chunk_sizes[] = { 10 * 1024, 100000, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 0 };
+
+    printf("protocol %d, %zu MiB per chunk size\n", c->protocol, total / 1024 / 1024);
+
+    for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++i) {
+        if (chunk_sizes[i] > c->maxMessageSize() / 2) {
+            continue;
+        }
+
+        double mbs = send_round(c, data, chunk_sizes[i], total);
+
+        if (chunk_sizes[i]) {
+            printf("%10zu bytes: %8.1f MB/s\n", chunk_sizes[i], mbs);
+        } else {
+            printf("  adaptive (%zu): %8.1f MB/s\n", c->bulkChunkSize(), mbs);
+        }
+    }
+
+    delete c;
+    waitpid(pid, 0, 0);
+    return 0;
+}
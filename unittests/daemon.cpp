@@ -0,0 +1,114 @@
+#include "daemon/budget.h"
+#include "daemon/slots.h"
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+static void check_admit(const string &prefix, const MemoryBudget &budget, unsigned int need, bool expected) {
+  if (budget.admit(need) != expected) {
+    cerr << prefix << " failed for " << need << " MB\n";
+    cerr << "     got: " << !expected << "\nexpected: " << expected << "\n";
+    exit(1);
+  }
+}
+
+static void test_budget() {
+  MemoryBudget budget;
+  // unknown budget
+  check_admit("unknown", budget, 100000, true);
+  budget.set_available(1000, 0);
+  // a single job is always admitted
+  check_admit("single", budget, 2000, true);
+
+  budget.grant(600);
+  budget.set_available(400, 0);
+  check_admit("all used", budget, 400, true);
+  check_admit("all used", budget, 401, false);
+
+  // the job just started, the free memory still counts its reservation
+  budget.set_available(1000, 600);
+  check_admit("nothing used", budget, 400, true);
+  check_admit("nothing used", budget, 401, false);
+
+  budget.set_available(700, 300);
+  check_admit("half used", budget, 400, true);
+  check_admit("half used", budget, 401, false);
+
+  budget.release(600);
+  check_admit("released", budget, 100000, true);
+}
+
+// Runs one window of 8 jobs in a minute with all slots taken.
+static void check_window(const string &prefix, SlotTuner &tuner, unsigned int slots,
+                         unsigned int job_out, unsigned int expected) {
+  for (int i = 0; i < 8; ++i) {
+    tuner.job_done(job_out, 30000);
+  }
+  unsigned int next = tuner.update(slots, 60000, true);
+  if (next != expected) {
+    cerr << prefix << " failed at " << slots << " slots\n";
+    cerr << "     got: " << next << "\nexpected: " << expected << "\n";
+    exit(1);
+  }
+}
+
+static void check_throughput(const string &prefix, const SlotTuner &tuner, unsigned int expected) {
+  if (tuner.throughput() != expected) {
+    cerr << prefix << " failed\n";
+    cerr << "     got: " << tuner.throughput() << "\nexpected: " << expected << "\n";
+    exit(1);
+  }
+}
+
+// The throughput is the output per time of the window, not per CPU time of the jobs.
+static void test_slot_tuner() {
+  SlotTuner tuner;
+  tuner.set_bounds(2, 4);
+  // a window that is not complete yet
+  tuner.job_done(60000, 30000);
+  if (tuner.update(2, 30000, true) != 2 || tuner.throughput() != 0) {
+    cerr << "short window failed\n";
+    exit(1);
+  }
+  // the rest of the window, the first one only settles
+  for (int i = 0; i < 7; ++i) {
+    tuner.job_done(60000, 30000);
+  }
+  if (tuner.update(2, 30000, true) != 2) {
+    cerr << "settling window failed\n";
+    exit(1);
+  }
+  check_throughput("settling window", tuner, 8000);
+
+  check_window("first count", tuner, 2, 60000, 3);
+  check_throughput("first count", tuner, 8000);
+  if (tuner.speed() != 2000) {
+    cerr << "speed failed\n";
+    cerr << "     got: " << tuner.speed() << "\nexpected: 2000\n";
+    exit(1);
+  }
+  check_window("settling after change", tuner, 3, 120000, 3);
+  check_window("more slots", tuner, 3, 120000, 4);
+  check_throughput("more slots", tuner, 16000);
+  check_window("settling after change", tuner, 4, 90000, 4);
+  // 4 slots did worse than 3
+  check_window("back to the best", tuner, 4, 90000, 3);
+  check_throughput("back to the best", tuner, 12000);
+
+  // with slots to spare, the window says nothing about the count
+  check_window("settling after change", tuner, 3, 120000, 3);
+  for (int i = 0; i < 8; ++i) {
+    tuner.job_done(10000, 30000);
+  }
+  if (tuner.update(3, 60000, false) != 3) {
+    cerr << "window with free slots failed\n";
+    exit(1);
+  }
+}
+
+int main() {
+    test_budget();
+    test_slot_tuner();
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "comm.h"
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+static void check(const string &prefix, bool ok, const string &what) {
+  if (!ok) {
+    cerr << prefix << " failed: " << what << "\n";
+    exit(1);
+  }
+}
+
+static MsgChannel *channel(int fd, int remote_protocol) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  return Service::createChannel(fd, (struct sockaddr *)&addr, sizeof(addr), remote_protocol);
+}
+
+static void write_version(int fd, uint32_t version) {
+  unsigned char vers[4];
+  for (int i = 0; i < 4; ++i) {
+    vers[i] = version >> (i * 8);
+  }
+  if (write(fd, vers, 4) != 4) {
+    exit(1);
+  }
+}
+
+// The channel assuming the protocol sends its first message before hearing from the
+// remote, which runs the normal setup and has to end up with the same protocol.
+static void test_agree(const string &prefix, int assumed, int expected) {
+  int fds[2];
+  check(prefix, socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair");
+  MsgChannel *client = channel(fds[0], assumed);
+  check(prefix, client && client->send_msg(EndMsg()), "sending before the setup");
+  MsgChannel *server = channel(fds[1], 0);
+  check(prefix, server && server->protocol == expected, "server protocol");
+  Msg *msg = server->get_msg(2);
+  check(prefix, msg && msg->type == M_END, "first message");
+  delete msg;
+  check(prefix, server->send_msg(EndMsg()), "answer");
+  msg = client->get_msg(2);
+  check(prefix, msg && msg->type == M_END, "reading the answer");
+  delete msg;
+  check(prefix, client->protocol == expected, "client protocol");
+  check(prefix, !client->assumed_protocol_failed(), "client agreed");
+  delete client;
+  delete server;
+}
+
+// A remote older than assumed, or one confirming another protocol, fails the
+// channel in a way that tells its user to try the normal setup.
+static void test_disagree(const string &prefix, uint32_t remote_version, uint32_t remote_confirm) {
+  int fds[2];
+  check(prefix, socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair");
+  MsgChannel *client = channel(fds[0], PROTOCOL_VERSION);
+  check(prefix, client && client->send_msg(EndMsg()), "sending before the setup");
+  unsigned char sent[8];
+  check(prefix, read(fds[1], sent, 8) == 8, "reading the setup");
+  check(prefix, sent[0] == PROTOCOL_VERSION && sent[4] == PROTOCOL_VERSION, "offer and confirmation");
+  write_version(fds[1], remote_version);
+  write_version(fds[1], remote_confirm);
+  Msg *msg = client->get_msg(2);
+  check(prefix, !msg, "channel failed");
+  check(prefix, client->assumed_protocol_failed(), "setup reported as failed");
+  delete client;
+  close(fds[1]);
+}
+
+int main() {
+    test_agree("agree", PROTOCOL_VERSION, PROTOCOL_VERSION);
+    test_agree("agree older", PROTOCOL_VERSION - 1, PROTOCOL_VERSION - 1);
+    test_agree("agree newer", PROTOCOL_VERSION + 1, PROTOCOL_VERSION);
+    test_disagree("remote older", PROTOCOL_VERSION - 1, PROTOCOL_VERSION - 1);
+    test_disagree("remote confirms other", PROTOCOL_VERSION, PROTOCOL_VERSION - 1);
+    return 0;
+}
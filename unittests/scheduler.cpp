@@ -0,0 +1,220 @@
+#include "scheduler/compileserver.h"
+#include "scheduler/iothreads.h"
+#include "scheduler/job.h"
+#include "scheduler/jobqueue.h"
+#include "scheduler/jobstat.h"
+#include <iostream>
+#include <math.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+static void check_speed(const string &prefix, CompileServer &cs, int active, float expected) {
+  cs.setOrphanedJobs(active);
+  float speed = cs.slotSpeed();
+  if (fabs(speed - expected) > 0.001) {
+    cerr << prefix << " failed with " << active << " jobs\n";
+    cerr << "     got: " << speed << "\nexpected: " << expected << "\n";
+    exit(1);
+  }
+}
+
+// The speed drops with every job, without a jump where the jobs start to share cores.
+static void test_slot_speed_smt() {
+  CompileServer cs(socket(AF_UNIX, SOCK_STREAM, 0), 0, 0, true);
+  cs.setMaxJobs(8);
+  cs.setPhysicalJobs(4);
+  check_speed("smt", cs, 0, 1.0);
+  check_speed("smt", cs, 2, 0.875);
+  check_speed("smt", cs, 4, 0.75);
+  check_speed("smt", cs, 6, 0.525);
+  check_speed("smt", cs, 8, 0.3);
+
+  float previous = 1;
+  for (int active = 1; active <= 8; ++active) {
+    cs.setOrphanedJobs(active);
+    float speed = cs.slotSpeed();
+    if (speed >= previous || previous - speed > 0.15) {
+      cerr << "smt failed, speed " << previous << " to " << speed << " at " << active << " jobs\n";
+      exit(1);
+    }
+    previous = speed;
+  }
+}
+
+static void test_slot_speed_plain() {
+  CompileServer cs(socket(AF_UNIX, SOCK_STREAM, 0), 0, 0, true);
+  cs.setMaxJobs(4);
+  check_speed("plain", cs, 0, 1.0);
+  check_speed("plain", cs, 2, 0.75);
+  check_speed("plain", cs, 4, 0.5);
+  // all slots are physical cores
+  cs.setPhysicalJobs(4);
+  check_speed("physical", cs, 2, 0.75);
+}
+
+// The expected time of a job goes by the output the server produced per time.
+static void test_expected_job_time() {
+  CompileServer cs(socket(AF_UNIX, SOCK_STREAM, 0), 0, 0, true);
+  if (cs.expectedJobTime(1000, 77) != 77) {
+    cerr << "expected job time failed without stats\n";
+    exit(1);
+  }
+  JobStat stats;
+  stats.setOutputSize(20000);
+  stats.setCompileTimeReal(4000);
+  stats.setCompileTimeUser(1000); // not what the wall clock time depends on
+  cs.setCumCompiled(stats);
+  if (cs.expectedJobTime(1000, 77) != 200 || cs.expectedJobTime(50000, 77) != 10000) {
+    cerr << "expected job time failed\n";
+    cerr << "     got: " << cs.expectedJobTime(1000, 77) << "\nexpected: 200\n";
+    exit(1);
+  }
+}
+
+// Only the job the environment gets installed for ends the installing.
+static void test_busy_installing() {
+  CompileServer cs(socket(AF_UNIX, SOCK_STREAM, 0), 0, 0, true);
+  cs.setBusyInstalling(100, 7);
+  cs.clearBusyInstalling(8);
+  if (cs.busyInstalling() != 100) {
+    cerr << "busy installing failed, cleared by another job\n";
+    exit(1);
+  }
+  cs.clearBusyInstalling(7);
+  if (cs.busyInstalling() != 0) {
+    cerr << "busy installing failed, not cleared by its job\n";
+    exit(1);
+  }
+}
+
+// Sending through an I/O thread fails once the thread has seen the connection fail.
+static void test_io_thread_closed() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    cerr << "socketpair failed\n";
+    exit(1);
+  }
+  CompileServer *cs = new CompileServer(fds[0], 0, 0, true);
+  IOThreads threads;
+  if (!threads.start(1)) {
+    cerr << "starting the I/O thread failed\n";
+    exit(1);
+  }
+  threads.attach(cs);
+  if (!cs->send_msg(TextMsg("open"))) {
+    cerr << "io thread failed, sending on the open connection\n";
+    exit(1);
+  }
+  close(fds[1]);
+
+  bool closed = false;
+  while (!closed) {
+    pollfd pfd;
+    pfd.fd = threads.events_fd();
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 5000) != 1) {
+      cerr << "io thread failed, the closing was not reported\n";
+      exit(1);
+    }
+    threads.clear_events();
+    while (IOItem *item = threads.next_event()) {
+      closed = closed || item->type == IOItem::Closed;
+      delete item;
+    }
+  }
+
+  if (cs->send_msg(TextMsg("closed"))) {
+    cerr << "io thread failed, sending on the closed connection succeeded\n";
+    exit(1);
+  }
+  threads.stop();
+  delete cs;
+}
+
+static Job *queued_job(unsigned int id, CompileServer *submitter, const string &session, int priority) {
+  Job *job = new Job(id, submitter);
+  job->setBuildSession(session);
+  job->setPriority(priority);
+  return job;
+}
+
+static void check_front(const string &prefix, const JobQueue &queue, unsigned int expected) {
+  Job *job = queue.front();
+  if ((job ? job->id() : 0) != expected) {
+    cerr << prefix << " failed\n";
+    cerr << "     got: " << (job ? job->id() : 0) << "\nexpected: " << expected << "\n";
+    exit(1);
+  }
+}
+
+// The builds take turns, within a build higher priorities go first, the same
+// ones in the order they came in.
+static void test_job_queue() {
+  CompileServer submitter(socket(AF_UNIX, SOCK_STREAM, 0), 0, 0, true);
+  CompileServer other(socket(AF_UNIX, SOCK_STREAM, 0), 0, 0, true);
+  Job *jobs[] = {
+    queued_job(1, &submitter, "a", 0),
+    queued_job(2, &submitter, "a", 0),
+    queued_job(3, &submitter, "b", 0),
+    queued_job(4, &submitter, "a", 5),
+    queued_job(5, &other, "a", 0),
+    queued_job(6, &submitter, "b", 0),
+  };
+  JobQueue queue;
+  for (size_t i = 0; i < sizeof(jobs) / sizeof(jobs[0]); ++i) {
+    queue.enqueue(jobs[i]);
+  }
+
+  check_front("priority", queue, 4);
+  queue.pop_front();
+  check_front("second build", queue, 3);
+  queue.pop_front();
+  check_front("other submitter", queue, 5);
+  if (queue.delay_front() != jobs[0]) {
+    cerr << "delaying failed\n";
+    exit(1);
+  }
+  check_front("delayed", queue, 1);
+  queue.pop_front();
+  check_front("turn after delay", queue, 6);
+  if (!queue.remove(jobs[5]) || queue.remove(jobs[5])) {
+    cerr << "removing failed\n";
+    exit(1);
+  }
+  check_front("after removing", queue, 5);
+
+  list<Job *> removed = queue.remove_submitter(&submitter);
+  if (removed.size() != 1 || removed.front() != jobs[1]) {
+    cerr << "removing the submitter failed\n";
+    exit(1);
+  }
+  check_front("only other submitter", queue, 5);
+  if (queue.delay_front()) {
+    cerr << "delaying the only build failed\n";
+    exit(1);
+  }
+  queue.pop_front();
+  check_front("empty", queue, 0);
+  if (!queue.empty()) {
+    cerr << "queue not empty\n";
+    exit(1);
+  }
+
+  for (size_t i = 0; i < sizeof(jobs) / sizeof(jobs[0]); ++i) {
+    delete jobs[i];
+  }
+}
+
+int main() {
+    test_slot_speed_smt();
+    test_slot_speed_plain();
+    test_expected_job_time();
+    test_busy_installing();
+    test_io_thread_closed();
+    test_job_queue();
+    return 0;
+}